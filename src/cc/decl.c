@@ -157,9 +157,11 @@ func_t *func_declaration()
   current_scope = scope_global;
   
   func->local_size = scope_local->size;
+  func->locals = scope_local->decls;
   
   map_flush(scope_local->map);
   scope_local->size = 0;
+  scope_local->decls = NULL;
   
   return func;
 }
@@ -313,6 +315,9 @@ decl_t *insert_decl(scope_t *scope, spec_t *spec, dcltr_t *dcltr, expr_t *init,
   scope->size += type_size(spec, dcltr);
   map_put(scope->map, name, decl);
   
+  decl->next_in_scope = scope->decls;
+  scope->decls = decl;
+  
   return decl;
 }
 
@@ -460,6 +465,7 @@ scope_t *make_scope(taddr_t taddr)
   scope->map = make_map();
   scope->taddr = taddr;
   scope->size = 0;
+  scope->decls = NULL;
   return scope;
 }
 
@@ -488,6 +494,8 @@ decl_t *make_decl(spec_t *spec, dcltr_t *dcltr, expr_t *init, int offset)
   decl->offset = offset;
   decl->init = init;
   decl->next = NULL;
+  decl->next_in_scope = NULL;
+  decl->slot = -1;
   return decl;
 }
 
@@ -509,7 +517,9 @@ func_t *make_func(hash_t name, type_t *type, param_t *params, stmt_t *body, int
   func->type.dcltr = type->dcltr;
   func->params = params;
   func->body = body;
+  func->locals = NULL;
   func->local_size = local_size;
+  func->num_slot = 0;
   func->next = NULL;
   return func;
 }
@@ -11,7 +11,12 @@ enum order_e {
   ORDER_ASSIGNMENT,
   ORDER_OR,
   ORDER_AND,
+  ORDER_BIT_OR,
+  ORDER_BIT_XOR,
+  ORDER_BIT_AND,
   ORDER_EQUALATIVE,
+  ORDER_RELATIONAL,
+  ORDER_SHIFT,
   ORDER_ADDITIVE,
   ORDER_MULTIPLICATIVE
 };
@@ -24,8 +29,12 @@ opset_t opset_dict[] = {
   { '=', TK_ADD_ASSIGN, TK_SUB_ASSIGN, TK_MUL_ASSIGN, TK_DIV_ASSIGN },
   { TK_OR_OP },
   { TK_AND_OP },
+  { '|' },
+  { '^' },
+  { '&' },
   { TK_EQ_OP, TK_NE_OP },
   { '<', '>', TK_LE_OP, TK_GE_OP },
+  { TK_LEFT_OP, TK_RIGHT_OP },
   { '+', '-' },
   { '*', '/', '%' }
 };
@@ -53,6 +62,21 @@ int read_assign_op(operator_t *op)
   case TK_MOD_ASSIGN:
     *op = OPERATOR_MOD;
     break;
+  case TK_LEFT_ASSIGN:
+    *op = OPERATOR_SHL;
+    break;
+  case TK_RIGHT_ASSIGN:
+    *op = OPERATOR_SHR;
+    break;
+  case TK_AND_ASSIGN:
+    *op = OPERATOR_BIT_AND;
+    break;
+  case TK_OR_ASSIGN:
+    *op = OPERATOR_BIT_OR;
+    break;
+  case TK_XOR_ASSIGN:
+    *op = OPERATOR_BIT_XOR;
+    break;
   default:
     return 0;
   }
@@ -105,6 +129,21 @@ int read_expr_op(operator_t *op, int level)
       case TK_GE_OP:
         *op = OPERATOR_GE;
         break;
+      case TK_LEFT_OP:
+        *op = OPERATOR_SHL;
+        break;
+      case TK_RIGHT_OP:
+        *op = OPERATOR_SHR;
+        break;
+      case '&':
+        *op = OPERATOR_BIT_AND;
+        break;
+      case '|':
+        *op = OPERATOR_BIT_OR;
+        break;
+      case '^':
+        *op = OPERATOR_BIT_XOR;
+        break;
       default:
         return 0;
       }
@@ -340,6 +379,9 @@ expr_t *unary()
   } if (lex.token == '-') {
     match('-');
     return make_binop(cast(), OPERATOR_MUL, make_const(-1));
+  } else if (lex.token == '~') {
+    match('~');
+    return make_binop(cast(), OPERATOR_BIT_XOR, make_const(-1));
   } else if (lex.token == '+') {
     match('+');
     return cast();
@@ -514,23 +556,9 @@ expr_t *make_arg(expr_t *base)
 
 expr_t *make_binop(expr_t *lhs, operator_t op, expr_t *rhs)
 {
-  if (lhs->texpr == EXPR_CONST && rhs->texpr == EXPR_CONST) {
-    switch (op) {
-    case OPERATOR_ADD:
-      return make_const(lhs->num + rhs->num);
-    case OPERATOR_SUB:
-      return make_const(lhs->num - rhs->num);
-    case OPERATOR_MUL:
-      return make_const(lhs->num * rhs->num);
-    case OPERATOR_DIV:
-      return make_const(lhs->num / rhs->num);
-    case OPERATOR_MOD:
-      return make_const(lhs->num % rhs->num);
-    default:
-      error("unknown operator");
-      break;
-    }
-  }
+  int num;
+  if (lhs->texpr == EXPR_CONST && rhs->texpr == EXPR_CONST && fold_const(op, lhs->num, rhs->num, &num))
+    return make_const(num);
   
   expr_t *expr = make_expr();
   expr->texpr = EXPR_BINOP;
@@ -0,0 +1,454 @@
+#include "p_local.h"
+
+#include <stdio.h>
+#include <limits.h>
+
+//
+// constant folding
+//
+// runs over the whole unit once it is parsed. children are folded first,
+// so a node only ever sees constants that are already as far out as they
+// go:
+//
+//   c1 op c2           ->  c
+//   c + x, c * x       ->  x + c, x * c, and so for &, | and ^
+//   x - c              ->  x + -c
+//   (x + c1) + c2      ->  x + (c1 + c2)
+//   (x + c) + y        ->  (x + y) + c
+//   (x * c1) * c2      ->  x * (c1 * c2)
+//   (x + c1) * c2      ->  x * c2 + c1 * c2
+//   x + 0, x * 1, x / 1  ->  x
+//   x * 0, x % 1       ->  0, if x has no side effects
+//   x | 0, x ^ 0, x & -1, x << 0, x >> 0  ->  x
+//   x & 0, x | -1      ->  0, -1, if x has no side effects
+//   (type) c           ->  c
+//
+// so a member or constant index off a pointer ends up as one constant
+// added at the end, which fuse turns into a single addi, and fold_split
+// can take any address apart into the pieces ldx and ldo want. arithmetic wraps
+// and casts truncate exactly as the vm does, division by zero is left for
+// run time.
+//
+
+static int num_fold;
+
+static expr_t *fold_expr(expr_t *expr);
+static expr_t *fold_binop(expr_t *expr);
+static expr_t *fold_add(expr_t *expr);
+static expr_t *fold_mul(expr_t *expr);
+static expr_t *fold_bit(expr_t *expr);
+static expr_t *fold_cast(expr_t *expr);
+static void fold_stmt(stmt_t *stmt);
+
+static int is_const(expr_t *expr)
+{
+  return expr->texpr == EXPR_CONST;
+}
+
+static int is_binop(expr_t *expr, operator_t op)
+{
+  return expr->texpr == EXPR_BINOP && expr->binop.op == op;
+}
+
+static int is_i8(type_t *type)
+{
+  return type->spec && type->spec->tspec == TY_I8 && !type->dcltr;
+}
+
+// nothing gets written or called on the way to the value
+static int is_pure(expr_t *expr)
+{
+  switch (expr->texpr) {
+  case EXPR_CALL:
+    return 0;
+  case EXPR_ADDR:
+  case EXPR_LOAD:
+    return is_pure(expr->addr.base);
+  case EXPR_CAST:
+    return is_pure(expr->unary.base);
+  case EXPR_BINOP:
+    return expr->binop.op != OPERATOR_ASSIGN && is_pure(expr->binop.lhs) && is_pure(expr->binop.rhs);
+  default:
+    return 1;
+  }
+}
+
+// a constant standing in for expr, keeping its type
+static expr_t *fold_to(expr_t *expr, int num)
+{
+  expr_t *folded = make_const(num);
+  folded->type = expr->type;
+  num_fold++;
+  return folded;
+}
+
+// expr with an operand dropped, only if it does not change the width
+static expr_t *fold_to_operand(expr_t *expr, expr_t *operand)
+{
+  if (is_i8(&expr->type) != is_i8(&operand->type))
+    return expr;
+  
+  num_fold++;
+  return operand;
+}
+
+int fold_const(operator_t op, int lhs, int rhs, int *num)
+{
+  unsigned a = lhs, b = rhs;
+  
+  switch (op) {
+  case OPERATOR_ADD:
+    *num = a + b;
+    break;
+  case OPERATOR_SUB:
+    *num = a - b;
+    break;
+  case OPERATOR_MUL:
+    *num = a * b;
+    break;
+  case OPERATOR_DIV:
+  case OPERATOR_MOD:
+    if (rhs == 0 || (lhs == INT_MIN && rhs == -1))
+      return 0;
+    *num = op == OPERATOR_DIV ? lhs / rhs : lhs % rhs;
+    break;
+  case OPERATOR_OR:
+    *num = lhs || rhs;
+    break;
+  case OPERATOR_AND:
+    *num = lhs && rhs;
+    break;
+  case OPERATOR_EQ:
+    *num = lhs == rhs;
+    break;
+  case OPERATOR_NE:
+    *num = lhs != rhs;
+    break;
+  // the vm orders by the sign of the wrapped difference, not by value,
+  // and the folded result has to be what it would have worked out
+  case OPERATOR_LSS:
+    *num = (int) (a - b) < 0;
+    break;
+  case OPERATOR_GTR:
+    *num = (int) (a - b) > 0;
+    break;
+  case OPERATOR_LE:
+    *num = (int) (a - b) <= 0;
+    break;
+  case OPERATOR_GE:
+    *num = (int) (a - b) >= 0;
+    break;
+  case OPERATOR_SHL:
+    *num = a << (b & 31);
+    break;
+  case OPERATOR_SHR:
+    *num = lhs >> (b & 31);
+    break;
+  case OPERATOR_BIT_AND:
+    *num = a & b;
+    break;
+  case OPERATOR_BIT_OR:
+    *num = a | b;
+    break;
+  case OPERATOR_BIT_XOR:
+    *num = a ^ b;
+    break;
+  default:
+    return 0;
+  }
+  
+  return 1;
+}
+
+void fold(unit_t *unit, int report)
+{
+  num_fold = 0;
+  
+  fold_stmt(unit->stmt);
+  
+  for (func_t *func = unit->func; func; func = func->next)
+    fold_stmt(func->body);
+  
+  if (report)
+    fprintf(stderr, "fold: %i expressions simplified\n", num_fold);
+}
+
+static void fold_stmt(stmt_t *stmt)
+{
+  while (stmt) {
+    switch (stmt->tstmt) {
+    case STMT_EXPR:
+      stmt->expr = fold_expr(stmt->expr);
+      break;
+    case STMT_IF:
+      for (stmt_t *next_if = stmt; next_if; next_if = next_if->if_stmt.next_if) {
+        next_if->if_stmt.cond = fold_expr(next_if->if_stmt.cond);
+        fold_stmt(next_if->if_stmt.body);
+        fold_stmt(next_if->if_stmt.else_body);
+      }
+      break;
+    case STMT_WHILE:
+      stmt->while_stmt.cond = fold_expr(stmt->while_stmt.cond);
+      fold_stmt(stmt->while_stmt.body);
+      break;
+    case STMT_RETURN:
+      stmt->ret_stmt.value = fold_expr(stmt->ret_stmt.value);
+      break;
+    default:
+      break;
+    }
+    
+    stmt = stmt->next;
+  }
+}
+
+// loads are lvalues that may be shared with a compound assignment, so
+// they are only ever folded in place, never replaced
+static expr_t *fold_expr(expr_t *expr)
+{
+  if (!expr)
+    return NULL;
+  
+  expr_t *next = expr->next;
+  
+  switch (expr->texpr) {
+  case EXPR_ADDR:
+  case EXPR_LOAD:
+    expr->addr.base = fold_expr(expr->addr.base);
+    break;
+  case EXPR_BINOP:
+    expr = fold_binop(expr);
+    break;
+  case EXPR_CAST:
+    expr = fold_cast(expr);
+    break;
+  case EXPR_CALL:
+    for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next)
+      arg->arg.base = fold_expr(arg->arg.base);
+    break;
+  default:
+    break;
+  }
+  
+  expr->next = fold_expr(next);
+  
+  return expr;
+}
+
+static expr_t *fold_binop(expr_t *expr)
+{
+  expr->binop.lhs = fold_expr(expr->binop.lhs);
+  expr->binop.rhs = fold_expr(expr->binop.rhs);
+  
+  expr_t *lhs = expr->binop.lhs;
+  expr_t *rhs = expr->binop.rhs;
+  int num;
+  
+  if (is_const(lhs) && is_const(rhs) && fold_const(expr->binop.op, lhs->num, rhs->num, &num))
+    return fold_to(expr, num);
+  
+  switch (expr->binop.op) {
+  case OPERATOR_SUB:
+    if (!is_const(rhs))
+      break;
+    
+    expr->binop.op = OPERATOR_ADD;
+    expr->binop.rhs = make_const(-(unsigned) rhs->num);
+    num_fold++;
+    return fold_add(expr);
+  case OPERATOR_ADD:
+    return fold_add(expr);
+  case OPERATOR_MUL:
+    return fold_mul(expr);
+  case OPERATOR_DIV:
+    if (is_const(rhs) && rhs->num == 1)
+      return fold_to_operand(expr, lhs);
+    break;
+  case OPERATOR_MOD:
+    if (is_const(rhs) && rhs->num == 1 && is_pure(lhs))
+      return fold_to(expr, 0);
+    break;
+  case OPERATOR_SHL:
+  case OPERATOR_SHR:
+    if (is_const(rhs) && (rhs->num & 31) == 0)
+      return fold_to_operand(expr, lhs);
+    break;
+  case OPERATOR_BIT_AND:
+  case OPERATOR_BIT_OR:
+  case OPERATOR_BIT_XOR:
+    return fold_bit(expr);
+  default:
+    break;
+  }
+  
+  return expr;
+}
+
+static expr_t *fold_add(expr_t *expr)
+{
+  if (is_const(expr->binop.lhs)) {
+    expr_t *lhs = expr->binop.lhs;
+    expr->binop.lhs = expr->binop.rhs;
+    expr->binop.rhs = lhs;
+  }
+  
+  expr_t *lhs = expr->binop.lhs;
+  expr_t *rhs = expr->binop.rhs;
+  
+  // x + (y + c)  ->  (x + y) + c
+  if (rhs->texpr == EXPR_BINOP && rhs->binop.op == OPERATOR_ADD && is_const(rhs->binop.rhs)) {
+    expr->binop.lhs = lhs = make_binop(lhs, OPERATOR_ADD, rhs->binop.lhs);
+    expr->binop.rhs = rhs = rhs->binop.rhs;
+    num_fold++;
+  }
+  
+  if (lhs->texpr == EXPR_BINOP && lhs->binop.op == OPERATOR_ADD && is_const(lhs->binop.rhs)) {
+    if (is_const(rhs)) {
+      expr->binop.lhs = lhs->binop.lhs;
+      expr->binop.rhs = make_const((unsigned) lhs->binop.rhs->num + rhs->num);
+    } else {
+      expr->binop.rhs = lhs->binop.rhs;
+      lhs->binop.rhs = rhs;
+    }
+    
+    num_fold++;
+  }
+  
+  if (is_const(expr->binop.rhs) && expr->binop.rhs->num == 0)
+    return fold_to_operand(expr, expr->binop.lhs);
+  
+  return expr;
+}
+
+static expr_t *fold_mul(expr_t *expr)
+{
+  if (is_const(expr->binop.lhs)) {
+    expr_t *lhs = expr->binop.lhs;
+    expr->binop.lhs = expr->binop.rhs;
+    expr->binop.rhs = lhs;
+  }
+  
+  expr_t *lhs = expr->binop.lhs;
+  expr_t *rhs = expr->binop.rhs;
+  
+  if (!is_const(rhs))
+    return expr;
+  
+  if (lhs->texpr == EXPR_BINOP && is_const(lhs->binop.rhs)) {
+    unsigned c = lhs->binop.rhs->num;
+    
+    switch (lhs->binop.op) {
+    case OPERATOR_MUL:
+      expr->binop.lhs = lhs->binop.lhs;
+      expr->binop.rhs = rhs = make_const(c * rhs->num);
+      num_fold++;
+      break;
+    case OPERATOR_ADD:
+      // the product comes out as x * c2 + c, which fold_add can merge
+      // with whatever constant is added to it next
+      expr->binop.op = OPERATOR_ADD;
+      expr->binop.lhs = fold_mul(make_binop(lhs->binop.lhs, OPERATOR_MUL, rhs));
+      expr->binop.rhs = make_const(c * rhs->num);
+      num_fold++;
+      return fold_add(expr);
+    default:
+      break;
+    }
+  }
+  
+  if (rhs->num == 1)
+    return fold_to_operand(expr, expr->binop.lhs);
+  
+  if (rhs->num == 0 && is_pure(expr->binop.lhs))
+    return fold_to(expr, 0);
+  
+  return expr;
+}
+
+static expr_t *fold_bit(expr_t *expr)
+{
+  if (is_const(expr->binop.lhs)) {
+    expr_t *lhs = expr->binop.lhs;
+    expr->binop.lhs = expr->binop.rhs;
+    expr->binop.rhs = lhs;
+  }
+  
+  expr_t *lhs = expr->binop.lhs;
+  expr_t *rhs = expr->binop.rhs;
+  
+  if (!is_const(rhs))
+    return expr;
+  
+  // the operand that leaves x as it is, and the one that swamps it
+  int same = expr->binop.op == OPERATOR_BIT_AND ? -1 : 0;
+  int full = expr->binop.op == OPERATOR_BIT_AND ? 0 : -1;
+  
+  if (rhs->num == same)
+    return fold_to_operand(expr, lhs);
+  
+  if (rhs->num == full && expr->binop.op != OPERATOR_BIT_XOR && is_pure(lhs))
+    return fold_to(expr, full);
+  
+  return expr;
+}
+
+// the same bit twiddling as sx32_8 and sx8_32 in the vm
+static expr_t *fold_cast(expr_t *expr)
+{
+  expr->unary.base = fold_expr(expr->unary.base);
+  
+  expr_t *base = expr->unary.base;
+  if (!is_const(base))
+    return expr;
+  
+  if (is_i8(&expr->type) == is_i8(&base->type))
+    return fold_to(expr, base->num);
+  
+  return fold_to(expr, fold_sx(base->num, is_i8(&expr->type)));
+}
+
+int fold_sx(int num, int to_i8)
+{
+  unsigned n = num;
+  
+  if (to_i8)
+    return ((n & 0x80000000) >> 24) | (n & 0x7f);
+  
+  unsigned is_sign = n & 0x80;
+  return (is_sign << 24) | (is_sign ? (n | ~0x7f) : (n & 0x7f));
+}
+
+// takes an address as fold leaves it apart into base + index * scale + ofs:
+// the constant is added last, and an index is the rhs of the add under it,
+// scaled by a mul or, once reduce has been over it, a shl. returns the base,
+// or NULL when there is nothing left of it
+expr_t *fold_split(expr_t *addr, expr_t **index, int *scale, int *ofs)
+{
+  *index = NULL;
+  *scale = 0;
+  *ofs = 0;
+  
+  if (is_binop(addr, OPERATOR_ADD) && is_const(addr->binop.rhs)) {
+    *ofs = addr->binop.rhs->num;
+    addr = addr->binop.lhs;
+  }
+  
+  expr_t *mul = is_binop(addr, OPERATOR_ADD) ? addr->binop.rhs : addr;
+  
+  if (is_binop(mul, OPERATOR_MUL) && is_const(mul->binop.rhs)) {
+    *index = mul->binop.lhs;
+    *scale = mul->binop.rhs->num;
+    addr = mul == addr ? NULL : addr->binop.lhs;
+  } else if (is_binop(mul, OPERATOR_SHL) && is_const(mul->binop.rhs) && mul->binop.rhs->num > 0 && mul->binop.rhs->num < 31) {
+    *index = mul->binop.lhs;
+    *scale = 1 << mul->binop.rhs->num;
+    addr = mul == addr ? NULL : addr->binop.lhs;
+  }
+  
+  if (addr && is_const(addr)) {
+    *ofs = (unsigned) *ofs + addr->num;
+    addr = NULL;
+  }
+  
+  return addr;
+}
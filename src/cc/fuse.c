@@ -0,0 +1,286 @@
+#include "gen.h"
+
+#include "../common/error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// superinstruction fusion over generated bytecode
+//
+// gen_addr/gen_load emit the same handful of idioms for every local access,
+// member, array element, constant offset and condition. each is rewritten
+// into a single fused op:
+//
+//   lbp push k add ldr   ->  ldl k
+//   lbp push k add str   ->  stl k
+//   lbp push k add       ->  leal k
+//   push s mul add ldr   ->  ldx s
+//   push s mul add str   ->  stx s
+//   push k add ldr       ->  ldo k
+//   push k add str       ->  sto k
+//   push k add           ->  addi k
+//   push k sub           ->  addi -k
+//   push k div           ->  divi k
+//   push k mod           ->  modi k
+//   cmp jcc t            ->  cjcc t
+//
+// a sub is taken as an add of -k in the same way wherever add is.
+//
+// nothing is fused across a jump target, and cmp/jcc is left alone when the
+// flags are read again afterwards since the fused branch does not set them.
+//
+
+static int is_branch(instr_t instr);
+static int is_flag_read(instr_t instr);
+static int fuse_match(instr_t *instr, int num_instr, char *is_target, int ip, instr_t *op, int *i32);
+static void fuse_report(bin_t *bin, int *pos, int num_instr);
+
+void fuse(bin_t *bin, int report)
+{
+  instr_t *instr = bin->instr;
+  int num_instr = bin->num_instr;
+  
+  char *is_target = calloc(num_instr + 1, 1);
+  
+  int ip = 0;
+  while (ip < num_instr) {
+    if (is_branch(instr[ip]) && ip + 1 < num_instr) {
+      int target = instr[ip + 1];
+      if (target >= 0 && target <= num_instr)
+        is_target[target] = 1;
+    }
+    
+    ip += instr_len(instr[ip]);
+  }
+  
+  for (int i = 0; i < bin->num_sym; i++)
+    is_target[bin->sym[i].pos] = 1;
+  
+  int *pos = malloc((num_instr + 1) * sizeof(int));
+  instr_t *out = malloc(num_instr * sizeof(instr_t));
+  int num_out = 0;
+  
+  ip = 0;
+  while (ip < num_instr) {
+    instr_t op;
+    int i32;
+    int len = fuse_match(instr, num_instr, is_target, ip, &op, &i32);
+    
+    for (int i = 0; i < len; i++)
+      pos[ip + i] = num_out;
+    
+    if (len > 0) {
+      out[num_out++] = op;
+      out[num_out++] = i32;
+      ip += len;
+    } else {
+      len = instr_len(instr[ip]);
+      for (int i = 0; i < len && ip < num_instr; i++) {
+        pos[ip] = num_out;
+        out[num_out++] = instr[ip++];
+      }
+    }
+  }
+  
+  pos[num_instr] = num_out;
+  
+  ip = 0;
+  while (ip < num_out) {
+    if (is_branch(out[ip]) && ip + 1 < num_out) {
+      int target = out[ip + 1];
+      if (target >= 0 && target <= num_instr)
+        out[ip + 1] = pos[target];
+    }
+    
+    ip += instr_len(out[ip]);
+  }
+  
+  if (report)
+    fuse_report(bin, pos, num_instr);
+  
+  for (int i = 0; i < bin->num_sym; i++)
+    bin->sym[i].pos = pos[bin->sym[i].pos];
+  
+  free(bin->instr);
+  bin->instr = out;
+  bin->num_instr = num_out;
+  
+  free(is_target);
+  free(pos);
+}
+
+static int is_branch(instr_t instr)
+{
+  switch (instr) {
+  case CALL:
+  case JMP:
+  case JE:
+  case JNE:
+  case JL:
+  case JG:
+  case JLE:
+  case JGE:
+  case CJE:
+  case CJNE:
+  case CJL:
+  case CJG:
+  case CJLE:
+  case CJGE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int is_flag_read(instr_t instr)
+{
+  switch (instr) {
+  case JE:
+  case JNE:
+  case JL:
+  case JG:
+  case JLE:
+  case JGE:
+  case SETE:
+  case SETNE:
+  case SETL:
+  case SETG:
+  case SETLE:
+  case SETGE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// returns the number of cells replaced by op i32, or 0 if nothing matched
+static int fuse_match(instr_t *instr, int num_instr, char *is_target, int ip, instr_t *op, int *i32)
+{
+  int n = num_instr - ip;
+  instr_t *c = &instr[ip];
+  
+  for (int i = 1; i < 5 && i < n; i++) {
+    if (is_target[ip + i]) {
+      n = i;
+      break;
+    }
+  }
+  
+  if (n >= 4 && c[0] == LBP && c[1] == PUSH && c[3] == ADD) {
+    *i32 = c[2];
+    
+    if (n >= 5 && c[4] == LDR) {
+      *op = LDL;
+      return 5;
+    }
+    
+    if (n >= 5 && c[4] == STR) {
+      *op = STL;
+      return 5;
+    }
+    
+    *op = LEAL;
+    return 4;
+  }
+  
+  if (n >= 5 && c[0] == PUSH && c[2] == MUL && c[3] == ADD && (c[4] == LDR || c[4] == STR)) {
+    *op = c[4] == LDR ? LDX : STX;
+    *i32 = c[1];
+    return 5;
+  }
+  
+  if (n >= 3 && c[0] == PUSH && (c[2] == ADD || c[2] == SUB)) {
+    *i32 = c[2] == ADD ? c[1] : (int) (0u - (unsigned) c[1]);
+    
+    if (n >= 4 && c[3] == LDR) {
+      *op = LDO;
+      return 4;
+    }
+    
+    if (n >= 4 && c[3] == STR) {
+      *op = STO;
+      return 4;
+    }
+    
+    *op = ADDI;
+    return 3;
+  }
+  
+  if (n >= 3 && c[0] == PUSH && (c[2] == DIV || c[2] == MOD)) {
+    *op = c[2] == DIV ? DIVI : MODI;
+    *i32 = c[1];
+    return 3;
+  }
+  
+  if (n >= 3 && c[0] == CMP && (ip + 3 >= num_instr || !is_flag_read(c[3]))) {
+    *i32 = c[2];
+    
+    switch (c[1]) {
+    case JE:
+      *op = CJE;
+      return 3;
+    case JNE:
+      *op = CJNE;
+      return 3;
+    case JL:
+      *op = CJL;
+      return 3;
+    case JG:
+      *op = CJG;
+      return 3;
+    case JLE:
+      *op = CJLE;
+      return 3;
+    case JGE:
+      *op = CJGE;
+      return 3;
+    default:
+      break;
+    }
+  }
+  
+  return 0;
+}
+
+static int count_ops(instr_t *instr, int start, int end)
+{
+  int n = 0;
+  
+  int ip = start;
+  while (ip < end) {
+    ip += instr_len(instr[ip]);
+    n++;
+  }
+  
+  return n;
+}
+
+static void fuse_report(bin_t *bin, int *pos, int num_instr)
+{
+  int total_before = 0;
+  int total_after = 0;
+  
+  for (int i = 0; i < bin->num_sym; i++) {
+    int start = bin->sym[i].pos;
+    int end = i + 1 < bin->num_sym ? bin->sym[i + 1].pos : num_instr;
+    
+    int before = count_ops(bin->instr, start, end);
+    
+    // the fused stream is not installed yet, recount it from the remap
+    int after = 0;
+    int ip = start;
+    while (ip < end) {
+      if (ip == start || pos[ip] != pos[ip - 1])
+        after++;
+      ip += instr_len(bin->instr[ip]);
+    }
+    
+    fprintf(stderr, "fuse: %-16s %5i -> %5i (-%i)\n", hash_get(bin->sym[i].name), before, after, before - after);
+    
+    total_before += before;
+    total_after += after;
+  }
+  
+  fprintf(stderr, "fuse: %-16s %5i -> %5i (-%i)\n", "total", total_before, total_after, total_before - total_after);
+}
@@ -1,4 +1,5 @@
 #include "gen.h"
+#include "ir.h"
 
 #include "../common/hash.h"
 #include "../common/map.h"
@@ -38,23 +39,43 @@ static instr_t *instr_buf;
 static int num_instr, max_instr;
 static int num_lbl;
 
+static sym_t *sym_buf;
+static int num_sym;
+
 static int func_active;
 static hash_t ret_lbl;
+static hash_t entry_lbl;
+static stmt_t *ret_tail;
+
+static int inline_size, inline_depth;
+static int num_inline, inline_active;
+static int top_frame;
+static int local_ofs;
+static int frame_top, frame_max;
+static func_t *slot_func;
+static int slot_ofs, slot_top;
+static int opt_level;
+static int opt_before, opt_after;
+static int report_opt;
 
 static map_t map_replace;
 static label_t *label_list;
 
-int emit(instr_t instr);
 void emit_jmp_hash(hash_t lbl);
-void emit_label(instr_t instr, hash_t lbl);
-void emit_frame_enter(int size);
+int emit_frame_enter(int size);
 void emit_frame_leave();
 data_t *emit_data_str(hash_t str_hash);
+void emit_sym(hash_t name);
 
 void gen_func(func_t *func);
 void gen_param(param_t *param);
+int gen_opt(func_t *func, stmt_t *body, hash_t end);
+int local_slot(expr_t *expr);
+int can_inline(func_t *func);
+void gen_inline(func_t *func);
 
 void gen_stmt(stmt_t *stmt);
+stmt_t *stmt_tail(stmt_t *stmt);
 void gen_if(stmt_t *stmt);
 void gen_while(stmt_t *stmt);
 void gen_ret(stmt_t *stmt);
@@ -62,8 +83,12 @@ void gen_asm(stmt_t *stmt);
 void gen_decl(stmt_t *stmt);
 
 void gen_expr(expr_t *expr);
+void gen_discard(expr_t *expr);
+expr_t *expr_last(expr_t *expr);
 void gen_const(expr_t *expr);
 void gen_addr(expr_t *expr);
+int gen_base(expr_t *expr, expr_t *base, int ofs);
+void gen_access(expr_t *expr, instr_t op);
 void gen_call(expr_t *expr);
 void gen_load(expr_t *expr);
 void gen_cast(expr_t *expr);
@@ -78,20 +103,19 @@ void gen_condition(expr_t *expr, hash_t end);
 
 label_t *make_label(hash_t name, int pos);
 replace_t *make_replace(int pos);
-hash_t tmp_label();
-void set_label(hash_t name);
 void set_replace(hash_t name, int pos);
 void replace_all();
 tspec_t simplify_type_spec(type_t *type);
 int sub_str_match_lhs(char *lhs, char *rhs);
 void *collapse_data(int *data_len);
 
-bin_t *gen(unit_t *unit)
+bin_t *gen(unit_t *unit, int max_size, int max_depth, int opt, int report)
 {
   max_instr = 1024;
   num_lbl = 0;
   num_instr = 0;
-  bss_size = unit->scope.size;
+  bss_size = (unit->scope.size + 3) & (~3);
+  data_size = 0;
   
   instr_buf = malloc(max_instr * sizeof(instr_t));
   data_list = NULL;
@@ -100,18 +124,67 @@ bin_t *gen(unit_t *unit)
   map_replace = make_map();
   map_data = make_map();
   
-  gen_stmt(unit->stmt);
+  num_sym = 1;
+  for (func_t *func = unit->func; func; func = func->next)
+    num_sym++;
+  
+  sym_buf = malloc(num_sym * sizeof(sym_t));
+  num_sym = 0;
+  emit_sym(hash_value("(top)"));
+  
+  inline_size = max_depth > 0 ? max_size : 0;
+  inline_depth = max_depth;
+  num_inline = 0;
+  inline_active = 0;
+  local_ofs = 0;
+  frame_top = 0;
+  frame_max = 0;
+  slot_func = NULL;
+  slot_ofs = 0;
+  slot_top = 0;
+  opt_level = opt;
+  opt_before = 0;
+  opt_after = 0;
+  report_opt = report;
+  
+  // top level code has no frame of its own, one is only entered when
+  // something gets inlined into it or the optimiser needs slots
+  top_frame = opt_level > 0 || (inline_size > 0 && inline_any(unit->stmt, inline_size));
+  
+  int frame_pos = -1;
+  if (top_frame)
+    frame_pos = emit_frame_enter(0);
+  
+  hash_t top_end = tmp_label();
+  if (!gen_opt(NULL, unit->stmt, top_end))
+    gen_stmt(unit->stmt);
+  
+  set_label(top_end);
   emit(INT);
   emit(SYS_EXIT);
   
+  if (top_frame)
+    instr_buf[frame_pos] = (frame_max + 3) & (~3);
+  
+  top_frame = 0;
   gen_func(unit->func);
   
+  if (report) {
+    fprintf(stderr, "inline: %i call sites\n", num_inline);
+    if (opt_level > 0)
+      fprintf(stderr, "opt: %-16s %5i -> %5i (-%i)\n", "total", opt_before, opt_after, opt_before - opt_after);
+  }
+  
   replace_all();
   
   int data_size;
   void *data = collapse_data(&data_size);
   
-  return make_bin(instr_buf, num_instr, data, data_size, (bss_size + 3) & (~3));
+  bin_t *bin = make_bin(instr_buf, num_instr, data, data_size, bss_size);
+  bin->sym = sym_buf;
+  bin->num_sym = num_sym;
+  
+  return bin;
 }
 
 void gen_func(func_t *func)
@@ -120,13 +193,30 @@ void gen_func(func_t *func)
   
   while (func) {
     ret_lbl = tmp_label();
+    ret_tail = stmt_tail(func->body);
     
     set_label(func->name);
+    emit_sym(func->name);
+    
+    frame_top = func->local_size;
+    frame_max = frame_top;
+    slot_func = func;
+    slot_ofs = 0;
+    slot_top = 0;
+    
+    int frame_pos = emit_frame_enter(func->local_size);
     
-    emit_frame_enter(func->local_size);
+    entry_lbl = tmp_label();
+    set_label(entry_lbl);
     
-    gen_param(func->params);
-    gen_stmt(func->body);
+    if (!gen_opt(func, func->body, ret_lbl)) {
+      slot_top = func->num_slot;
+      gen_param(func->params);
+      gen_stmt(func->body);
+    }
+    
+    // grown by whatever was inlined
+    instr_buf[frame_pos] = (frame_max + 3) & (~3);
     
     set_label(ret_lbl);
     emit_frame_leave();
@@ -145,16 +235,160 @@ void gen_param(param_t *param)
   if (param->next)
     gen_param(param->next);
   
+  int slot = local_slot(param->addr);
+  if (slot >= 0) {
+    emit(STS);
+    emit(slot);
+    return;
+  }
+  
   gen_addr(param->addr);
   emit(STR);
 }
 
+//
+// optimising
+//
+// a body goes through ssa when it can, see ir.h, and is generated
+// straight from the ast when it cannot. end is where the body leaves.
+//
+
+int gen_opt(func_t *func, stmt_t *body, hash_t end)
+{
+  if (opt_level < 1)
+    return 0;
+  
+  ir_func_t *ir = ir_build(func, body);
+  if (!ir)
+    return 0;
+  
+  int before = ir_count(ir);
+  ir_opt(ir);
+  int after = ir_count(ir);
+  
+  if (report_opt)
+    fprintf(stderr, "opt: %-16s %5i -> %5i (-%i)\n", func ? hash_get(func->name) : "(top)", before, after, before - after);
+  
+  opt_before += before;
+  opt_after += after;
+  
+  ir_lower(ir, end);
+  
+  return 1;
+}
+
+int frame_reserve(int size)
+{
+  int ofs = (frame_top + 3) & (~3);
+  
+  frame_top = ofs + size;
+  if (frame_top > frame_max)
+    frame_max = frame_top;
+  
+  return ofs;
+}
+
+//
+// frame slots
+//
+// locals slot.c found a slot for are read and written with lds and sts
+// instead of going through memory. an inlined callee's slots go past the
+// ones in use, like its locals do, and whatever does not fit in the vm's
+// MAX_SLOT stays in memory.
+//
+
+int local_slot(expr_t *expr)
+{
+  if (!slot_func || expr->addr.taddr != ADDR_LOCAL || expr->addr.base->texpr != EXPR_CONST)
+    return -1;
+  
+  for (decl_t *decl = slot_func->locals; decl; decl = decl->next_in_scope) {
+    if (decl->slot >= 0 && decl->offset == expr->addr.base->num)
+      return slot_ofs + decl->slot < MAX_SLOT ? slot_ofs + decl->slot : -1;
+  }
+  
+  return -1;
+}
+
+// num slots past the ones in use, -1 if there are not that many left
+int slot_reserve(int num)
+{
+  if (slot_top + num > MAX_SLOT)
+    return -1;
+  
+  int slot = slot_top;
+  slot_top += num;
+  
+  return slot;
+}
+
+//
+// inlining
+//
+// a small callee is generated in place of its CALL. its locals, params
+// included, get their own slots past everything the caller has in use,
+// growing the caller's frame, and a return jumps to the end of the body
+// instead of leaving. the args are already on the stack in the order
+// gen_param wants them.
+//
+
+int can_inline(func_t *func)
+{
+  return inline_active < inline_depth
+    && (func_active || top_frame)
+    && inline_ok(func, inline_size);
+}
+
+void gen_inline(func_t *func)
+{
+  int old_active = func_active;
+  int old_ofs = local_ofs;
+  int old_top = frame_top;
+  hash_t old_ret = ret_lbl;
+  stmt_t *old_tail = ret_tail;
+  func_t *old_slot_func = slot_func;
+  int old_slot_ofs = slot_ofs;
+  int old_slot_top = slot_top;
+  
+  func_active = 1;
+  local_ofs = (frame_top + 3) & (~3);
+  frame_top = local_ofs + func->local_size;
+  slot_func = func;
+  slot_ofs = slot_top;
+  slot_top += func->num_slot;
+  ret_lbl = tmp_label();
+  ret_tail = stmt_tail(func->body);
+  
+  if (frame_top > frame_max)
+    frame_max = frame_top;
+  
+  inline_active++;
+  num_inline++;
+  
+  gen_param(func->params);
+  gen_stmt(func->body);
+  
+  set_label(ret_lbl);
+  
+  inline_active--;
+  
+  func_active = old_active;
+  local_ofs = old_ofs;
+  frame_top = old_top;
+  ret_lbl = old_ret;
+  ret_tail = old_tail;
+  slot_func = old_slot_func;
+  slot_ofs = old_slot_ofs;
+  slot_top = old_slot_top;
+}
+
 void gen_stmt(stmt_t *stmt)
 {
   while (stmt) {
     switch (stmt->tstmt) {
     case STMT_EXPR:
       gen_expr(stmt->expr);
+      gen_discard(expr_last(stmt->expr));
       break;
     case STMT_IF:
       gen_if(stmt);
@@ -177,47 +411,76 @@ void gen_stmt(stmt_t *stmt)
   }
 }
 
+stmt_t *stmt_tail(stmt_t *stmt)
+{
+  while (stmt && stmt->next)
+    stmt = stmt->next;
+  
+  return stmt;
+}
+
+int asm_next(char **code, int *word)
+{
+  char *c = *code;
+  
+  while (*c == ' ' || *c == '\n')
+    c++;
+  
+  if (!*c) {
+    *code = c;
+    return ASM_END;
+  }
+  
+  if (isdigit(*c) || *c == '-') {
+    int signedness = 1;
+    
+    if (*c == '-') {
+      signedness = -1;
+      c++;
+    }
+    
+    int sum = 0;
+    while (isdigit(*c)) {
+      sum = sum * 10 + *c - '0';
+      c++;
+    }
+    
+    *word = sum;
+    *code = c;
+    return ASM_NUM;
+  }
+  
+  int match_keyword = -1;
+  int match_len = 0;
+  for (int i = 0; i < num_instr_tbl; i++) {
+    int len = strlen(instr_tbl[i]);
+    if (len > match_len && sub_str_match_lhs(instr_tbl[i], c)) {
+      match_keyword = i;
+      match_len = len;
+    }
+  }
+  
+  if (match_keyword < 0)
+    error("unknown character or keyword");
+  
+  *word = match_keyword;
+  *code = c + match_len;
+  return ASM_OP;
+}
+
 void gen_asm(stmt_t *stmt)
 {
   char *c = stmt->inline_asm_stmt.code;
+  int word, kind;
   
-  while (*c) {
-    switch (*c) {
-    case ' ':
-    case '\n':
-      *c++;
-      break;
-    default:
-      if (isdigit(*c) || *c == '-') {
-        int signedness = 1;
-        
-        if (*c == '-') {
-          signedness = -1;
-          c++;
-        }
-        
-        int sum = 0;
-        while (isdigit(*c)) {
-          sum = sum * 10 + *c - '0';
-          c++;
-        }
-        
-        emit(sum);
-      } else {
-        int match_keyword = 0;
-        for (int i = 0; i < num_instr_tbl; i++) {
-          if (sub_str_match_lhs(instr_tbl[i], c)) {
-            match_keyword = 1;
-            emit(i);
-            c += strlen(instr_tbl[i]);
-            break;
-          }
-        }
-        
-        if (!match_keyword)
-          error("unknown character or keyword");
-      }
-      break;
+  while ((kind = asm_next(&c, &word)) != ASM_END) {
+    emit(word);
+    
+    // inlined, the frame the asm expects starts further up
+    if (kind == ASM_OP && word == LBP && local_ofs) {
+      emit(PUSH);
+      emit(local_ofs);
+      emit(ADD);
     }
   }
 }
@@ -227,9 +490,20 @@ void gen_ret(stmt_t *stmt)
   if (!func_active)
     error("ret_label while func inactive");
   
+  func_t *tail = tail_callee(stmt);
+  if (tail) {
+    for (expr_t *arg = stmt->ret_stmt.value->post.post; arg; arg = arg->arg.next)
+      gen_expr(arg->arg.base);
+    
+    emit_tail(tail);
+    return;
+  }
+  
   gen_expr(stmt->ret_stmt.value);
   
-  emit_label(JMP, ret_lbl);
+  // the last statement of a body falls through to ret_lbl anyway
+  if (stmt != ret_tail)
+    emit_label(JMP, ret_lbl);
 }
 
 void gen_if(stmt_t *stmt)
@@ -303,17 +577,54 @@ void gen_expr(expr_t *expr)
       break;
     }
     
+    // a comma keeps only the last value
+    if (expr->next)
+      gen_discard(expr);
+    
     expr = expr->next;
   }
 }
 
+// drops the value expr left on the stack if it left one. nothing pops on
+// its own, so it is compared against 0: the flags it sets are dead, every
+// jump has its own cmp or is fused with it
+void gen_discard(expr_t *expr)
+{
+  if (!expr)
+    return;
+  
+  if (expr->texpr == EXPR_BINOP && expr->binop.op == OPERATOR_ASSIGN)
+    return;
+  
+  // a call to a function declared without a return type has no spec
+  if (!expr->type.spec || simplify_type_spec(&expr->type) == TY_U0)
+    return;
+  
+  emit(PUSH);
+  emit(0);
+  emit(CMP);
+}
+
+expr_t *expr_last(expr_t *expr)
+{
+  while (expr && expr->next)
+    expr = expr->next;
+  
+  return expr;
+}
+
 void gen_str(expr_t *expr)
 {
-  data_t *data = map_get(map_data, expr->str_hash);
+  emit_str(expr->str_hash);
+}
+
+void emit_str(hash_t str_hash)
+{
+  data_t *data = map_get(map_data, str_hash);
   
   if (!data) {
-    data = emit_data_str(expr->str_hash);
-    map_put(map_data, expr->str_hash, data);
+    data = emit_data_str(str_hash);
+    map_put(map_data, str_hash, data);
   }
   
   emit(PUSH);
@@ -365,12 +676,56 @@ void gen_call(expr_t *expr)
     arg = arg->arg.next;
   }
   
+  emit_call(func);
+}
+
+void emit_call(func_t *func)
+{
+  if (can_inline(func)) {
+    gen_inline(func);
+    return;
+  }
+  
   emit(CALL);
   int pos = emit(0);
   
   set_replace(func->name, pos);
 }
 
+//
+// tail calls
+//
+// find_tails marks the returns that can leave the frame before their call.
+// one inlined into another body returns to the end of it instead, and a
+// callee that can be inlined is better off inlined.
+//
+
+func_t *tail_callee(stmt_t *stmt)
+{
+  if (!stmt->ret_stmt.tail || inline_active)
+    return NULL;
+  
+  func_t *func = stmt->ret_stmt.value->post.base->func.func;
+  if (can_inline(func))
+    return NULL;
+  
+  return func;
+}
+
+// the args are on the stack the way the callee's entry takes them. a call
+// to itself keeps the frame and starts the body over, anything else leaves
+// it and enters its own, since the callee's frame can be a different size
+void emit_tail(func_t *func)
+{
+  if (func == slot_func) {
+    emit_label(JMP, entry_lbl);
+    return;
+  }
+  
+  emit(LEAVE);
+  emit_label(JMP, func->name);
+}
+
 void gen_const(expr_t *expr)
 {
   emit(PUSH);
@@ -385,7 +740,17 @@ void gen_addr(expr_t *expr)
     break;
   case ADDR_LOCAL:
     emit(LBP);
-    gen_expr(expr->addr.base);
+    if (expr->addr.base->texpr == EXPR_CONST) {
+      emit(PUSH);
+      emit(expr->addr.base->num + local_ofs);
+    } else {
+      gen_expr(expr->addr.base);
+      if (local_ofs) {
+        emit(ADD);
+        emit(PUSH);
+        emit(local_ofs);
+      }
+    }
     emit(ADD);
     break;
   default:
@@ -395,16 +760,79 @@ void gen_addr(expr_t *expr)
   
 }
 
+// pushes the base of an access, returns the offset still to be added to it
+int gen_base(expr_t *expr, expr_t *base, int ofs)
+{
+  if (expr->addr.taddr == ADDR_LOCAL) {
+    emit(LBP);
+    if (base) {
+      gen_expr(base);
+      emit(ADD);
+    }
+    return ofs + local_ofs;
+  }
+  
+  if (!base) {
+    emit(PUSH);
+    emit(ofs);
+    return 0;
+  }
+  
+  gen_expr(base);
+  return ofs;
+}
+
+// an i32 array element is read or written with ldx off the array and a
+// member with ldo off the struct, op being LDR or STR. anything else goes
+// through gen_addr.
+void gen_access(expr_t *expr, instr_t op)
+{
+  expr_t *index;
+  int scale, ofs;
+  expr_t *base = fold_split(expr->addr.base, &index, &scale, &ofs);
+  
+  if (index) {
+    ofs = gen_base(expr, base, ofs);
+    if (ofs) {
+      emit(PUSH);
+      emit(ofs);
+      emit(ADD);
+    }
+    
+    gen_expr(index);
+    emit(op == LDR ? LDX : STX);
+    emit(scale);
+  } else if (base) {
+    ofs = gen_base(expr, base, ofs);
+    if (ofs) {
+      emit(op == LDR ? LDO : STO);
+      emit(ofs);
+    } else {
+      emit(op);
+    }
+  } else {
+    gen_addr(expr);
+    emit(op);
+  }
+}
+
 void gen_load(expr_t *expr)
 {
-  gen_addr(expr);
+  int slot = local_slot(expr);
+  if (slot >= 0) {
+    emit(LDS);
+    emit(slot);
+    return;
+  }
+  
   tspec_t tspec = simplify_type_spec(&expr->type);
   switch (tspec) {
   case TY_I8:
+    gen_addr(expr);
     emit(LDR8);
     break;
   case TY_I32:
-    emit(LDR);
+    gen_access(expr, LDR);
     break;
   default:
     error("assign: unknown operator");
@@ -446,26 +874,25 @@ void gen_condition(expr_t *expr, hash_t end)
     case OPERATOR_GTR:
       gen_expr(expr->binop.lhs);
       gen_expr(expr->binop.rhs);
-      emit(CMP);
       
       switch (expr->binop.op) {
       case OPERATOR_EQ:
-        emit_label(JNE, end);
+        emit_label(CJNE, end);
         break;
       case OPERATOR_NE:
-        emit_label(JE, end);
+        emit_label(CJE, end);
         break;
       case OPERATOR_LE:
-        emit_label(JG, end);
+        emit_label(CJG, end);
         break;
       case OPERATOR_GE:
-        emit_label(JL, end);
+        emit_label(CJL, end);
         break;
       case OPERATOR_LSS:
-        emit_label(JGE, end);
+        emit_label(CJGE, end);
         break;
       case OPERATOR_GTR:
-        emit_label(JLE, end);
+        emit_label(CJLE, end);
         break;
       }
       
@@ -474,13 +901,17 @@ void gen_condition(expr_t *expr, hash_t end)
       goto expr_cond;
     }
     break;
+  case EXPR_CONST:
+    // folded, the branch is either always or never taken
+    if (!expr->num)
+      emit_label(JMP, end);
+    break;
   expr_cond:
   default:
     gen_expr(expr);
     emit(PUSH);
     emit(0);
-    emit(CMP);
-    emit_label(JE, end);
+    emit_label(CJE, end);
     break;
   }
 }
@@ -504,15 +935,22 @@ void gen_binop(expr_t *expr)
 void gen_binop_assign(expr_t *expr)
 {
   gen_expr(expr->binop.rhs);
-  gen_addr(expr->binop.lhs);
+  
+  int slot = local_slot(expr->binop.lhs);
+  if (slot >= 0) {
+    emit(STS);
+    emit(slot);
+    return;
+  }
   
   tspec_t tspec = simplify_type_spec(&expr->type);
   switch (tspec) {
   case TY_I8:
+    gen_addr(expr->binop.lhs);
     emit(STR8);
     break;
   case TY_I32:
-    emit(STR);
+    gen_access(expr->binop.lhs, STR);
     break;
   default:
     error("assign: unknown operator");
@@ -566,29 +1004,38 @@ void gen_binop_math(expr_t *expr)
     case OPERATOR_MOD:
       emit(MOD);
       break;
+    case OPERATOR_SHL:
+      emit(SHL);
+      break;
+    case OPERATOR_SHR:
+      emit(SHR);
+      break;
+    case OPERATOR_BIT_AND:
+      emit(AND);
+      break;
+    case OPERATOR_BIT_OR:
+      emit(OR);
+      break;
+    case OPERATOR_BIT_XOR:
+      emit(XOR);
+      break;
     case OPERATOR_EQ:
-      emit(CMP);
-      emit(SETE);
+      emit(SEQ);
       break;
     case OPERATOR_NE:
-      emit(CMP);
-      emit(SETNE);
+      emit(SNE);
       break;
     case OPERATOR_LSS:
-      emit(CMP);
-      emit(SETL);
+      emit(SLT);
       break;
     case OPERATOR_GTR:
-      emit(CMP);
-      emit(SETG);
+      emit(SGT);
       break;
     case OPERATOR_LE:
-      emit(CMP);
-      emit(SETLE);
+      emit(SLE);
       break;
     case OPERATOR_GE:
-      emit(CMP);
-      emit(SETGE);
+      emit(SGE);
       break;
     default:
       error("unknown case: op: '%i'", expr->binop.op);
@@ -736,7 +1183,7 @@ int emit(instr_t instr)
 {
   if (num_instr >= max_instr) {
     max_instr += 1024;
-    instr_buf = realloc(instr_buf, max_instr);
+    instr_buf = realloc(instr_buf, max_instr * sizeof(instr_t));
   }
   
   int cache_pos = num_instr;
@@ -745,10 +1192,10 @@ int emit(instr_t instr)
   return cache_pos;
 }
 
-void emit_frame_enter(int size)
+int emit_frame_enter(int size)
 {
   emit(ENTER);
-  emit((size + 3) & (~3));
+  return emit((size + 3) & (~3));
 }
 
 void emit_frame_leave()
@@ -781,3 +1228,10 @@ data_t *emit_data_str(hash_t str_hash)
   
   return data;
 }
+
+void emit_sym(hash_t name)
+{
+  sym_buf[num_sym].name = name;
+  sym_buf[num_sym].pos = num_instr;
+  num_sym++;
+}
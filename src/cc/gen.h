@@ -4,6 +4,27 @@
 #include "parse.h"
 #include "../vm/bin.h"
 
-bin_t *gen(unit_t *unit);
+#define INLINE_SIZE 40
+#define INLINE_DEPTH 4
+#define OPT_LEVEL 1
+
+#define ASM_END 0
+#define ASM_NUM 1
+#define ASM_OP 2
+
+bin_t *gen(unit_t *unit, int max_size, int max_depth, int opt, int report);
+int asm_next(char **code, int *word);
+tspec_t simplify_type_spec(type_t *type);
+int sub_str_match_lhs(char *lhs, char *rhs);
+
+void gen_x86(unit_t *unit, FILE *out, unsigned mem_size);
+int gen_x86_exe(unit_t *unit, char *out_name, unsigned mem_size);
+
+void gen_c(unit_t *unit, FILE *out, unsigned mem_size);
+
+void fuse(bin_t *bin, int report);
+
+int inline_ok(func_t *func, int max_size);
+int inline_any(stmt_t *stmt, int max_size);
 
 #endif
@@ -0,0 +1,831 @@
+#include "gen.h"
+
+#include "../common/hash.h"
+#include "../common/map.h"
+#include "../common/error.h"
+#include "../vm/vm.h"
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+
+//
+// portable c backend
+//
+// guest memory is one int32_t array with the same layout as the vm: globals,
+// string data, then frames growing down from the top. addresses stay 32-bit
+// guest addresses and every access goes through the same ALIGN_32 rule, so
+// type_size/type_align layouts behave exactly as they do in the vm. the
+// array is sized by -m like the vm's memory and allocated at startup, so a
+// large one costs nothing until it is touched.
+//
+
+typedef struct c_str_s c_str_t;
+
+struct c_str_s {
+  int pos;
+  hash_t str_hash;
+  c_str_t *next;
+};
+
+static FILE *c_out;
+static int c_num_tmp;
+static int c_max_tmp;
+static int c_use_ret;
+
+static map_t c_map_str;
+static c_str_t *c_str_list, *c_str_head;
+static int c_data_base;
+static int c_data_size;
+static unsigned c_mem_size;
+
+void c_prelude();
+void c_func_decl(func_t *func);
+void c_func(func_t *func);
+void c_body(stmt_t *body, int depth);
+
+void c_stmt(stmt_t *stmt, int depth);
+void c_if(stmt_t *stmt, int depth);
+void c_while(stmt_t *stmt, int depth);
+void c_ret(stmt_t *stmt, int depth);
+void c_asm(stmt_t *stmt, int depth);
+
+void c_expr(expr_t *expr);
+void c_value(expr_t *expr);
+void c_addr(expr_t *expr);
+void c_load(expr_t *expr);
+void c_call(expr_t *expr);
+void c_cast(expr_t *expr);
+void c_str(expr_t *expr);
+void c_binop(expr_t *expr);
+void c_binop_assign(expr_t *expr);
+void c_binop_math(expr_t *expr);
+void c_pair(const char *fmt, expr_t *lhs, expr_t *rhs);
+
+int c_has_side(expr_t *expr);
+int c_is_pure(expr_t *expr);
+int c_is_ordered(expr_t *a, expr_t *b);
+void c_indent(int depth);
+void c_string_literal(char *str);
+
+void gen_c(unit_t *unit, FILE *out, unsigned mem_size)
+{
+  c_mem_size = (mem_size + 4095) & ~4095u;
+  c_str_list = NULL;
+  c_str_head = NULL;
+  c_map_str = make_map();
+  c_data_base = (unit->scope.size + 3) & ~3;
+  c_data_size = 0;
+  
+  char *text;
+  size_t text_size;
+  c_out = open_memstream(&text, &text_size);
+  
+  for (func_t *func = unit->func; func; func = func->next)
+    c_func_decl(func);
+  
+  fprintf(c_out, "\n");
+  
+  for (func_t *func = unit->func; func; func = func->next)
+    c_func(func);
+  
+  fprintf(c_out, "int main(void)\n{\n");
+  fprintf(c_out, "  mem = calloc(MEM_SIZE / 4, 4);\n");
+  fprintf(c_out, "  if (!mem) {\n");
+  fprintf(c_out, "    fputs(\"could not allocate guest memory\\n\", stderr);\n");
+  fprintf(c_out, "    return 1;\n");
+  fprintf(c_out, "  }\n");
+  fprintf(c_out, "  memcpy(m_i8 + DATA_BASE, data, sizeof(data));\n");
+  c_body(unit->stmt, 1);
+  fprintf(c_out, "  sys_exit();\n");
+  fprintf(c_out, "  return 0;\n");
+  fprintf(c_out, "}\n");
+  
+  fclose(c_out);
+  
+  if ((unsigned) c_data_base + c_data_size > c_mem_size)
+    error("c: program data does not fit in %u bytes of memory", c_mem_size);
+  
+  c_out = out;
+  c_prelude();
+  fwrite(text, 1, text_size, out);
+  free(text);
+}
+
+void c_prelude()
+{
+  fprintf(c_out, "/* generated by 9c */\n");
+  fprintf(c_out, "#include <stdint.h>\n");
+  fprintf(c_out, "#include <stdio.h>\n");
+  fprintf(c_out, "#include <stdlib.h>\n");
+  fprintf(c_out, "#include <string.h>\n\n");
+  
+  fprintf(c_out, "#define MEM_SIZE %uu\n", c_mem_size);
+  fprintf(c_out, "#define DATA_BASE %i\n\n", c_data_base);
+  
+  fprintf(c_out, "static int32_t *mem;\n");
+  fprintf(c_out, "static int32_t bp = (int32_t) MEM_SIZE;\n");
+  fprintf(c_out, "#define m_i8 ((int8_t *) mem)\n\n");
+  
+  fprintf(c_out, "static const char data[] =");
+  if (!c_str_list)
+    fprintf(c_out, " \"\"");
+  for (c_str_t *str = c_str_list; str; str = str->next) {
+    fprintf(c_out, "\n  ");
+    c_string_literal(hash_get(str->str_hash));
+  }
+  fprintf(c_out, ";\n\n");
+  
+  fprintf(c_out,
+    "static inline int32_t ld32(int32_t a) { return mem[(uint32_t) a / 4]; }\n"
+    "static inline int32_t ld8(int32_t a) { return m_i8[(uint32_t) a]; }\n"
+    "static inline int32_t st32(int32_t a, int32_t v) { return mem[(uint32_t) a / 4] = v; }\n"
+    "static inline int32_t st8(int32_t a, int32_t v) { return m_i8[(uint32_t) a] = (int8_t) v; }\n"
+    "static inline int32_t add32(int32_t a, int32_t b) { return (int32_t) ((uint32_t) a + (uint32_t) b); }\n"
+    "static inline int32_t sub32(int32_t a, int32_t b) { return (int32_t) ((uint32_t) a - (uint32_t) b); }\n"
+    "static inline int32_t mul32(int32_t a, int32_t b) { return (int32_t) ((uint32_t) a * (uint32_t) b); }\n"
+    "static inline int32_t shl32(int32_t a, int32_t b) { return (int32_t) ((uint32_t) a << (b & 31)); }\n"
+    "static inline int32_t shr32(int32_t a, int32_t b) { return a >> (b & 31); }\n"
+    "static inline int32_t sx8_32(int32_t v) { return (int8_t) v; }\n"
+    "static inline int32_t sx32_8(int32_t v) { return (int32_t) (((uint32_t) v & 0x80000000u) >> 24) | (v & 0x7f); }\n"
+    "static inline void sys_exit(void) { fflush(stdout); exit(0); }\n"
+    "static inline void sys_print(int32_t v) { printf(\"%%i\\n\", v); }\n"
+    "static inline void sys_write(int32_t a) { fputs((char *) m_i8 + (uint32_t) a, stdout); }\n\n");
+}
+
+void c_func_decl(func_t *func)
+{
+  fprintf(c_out, "static int32_t f_%s(", hash_get(func->name));
+  
+  int i = 0;
+  for (param_t *param = func->params; param; param = param->next, i++)
+    fprintf(c_out, "%sint32_t p%i", i ? ", " : "", i);
+  
+  fprintf(c_out, "%s);\n", i ? "" : "void");
+}
+
+void c_func(func_t *func)
+{
+  int frame = (func->local_size + 3) & ~3;
+  
+  fprintf(c_out, "static int32_t f_%s(", hash_get(func->name));
+  
+  int i = 0;
+  for (param_t *param = func->params; param; param = param->next, i++)
+    fprintf(c_out, "%sint32_t p%i", i ? ", " : "", i);
+  
+  fprintf(c_out, "%s)\n{\n", i ? "" : "void");
+  fprintf(c_out, "  int32_t fbp = bp -= %i;\n", frame);
+  fprintf(c_out, "  int32_t ret = 0;\n");
+  
+  c_use_ret = 0;
+  
+  i = 0;
+  for (param_t *param = func->params; param; param = param->next)
+    fprintf(c_out, "  st32(fbp + %i, p%i);\n", param->addr->addr.base->num, i++);
+  
+  c_body(func->body, 1);
+  
+  if (c_use_ret)
+    fprintf(c_out, "ret:\n");
+  fprintf(c_out, "  bp = fbp + %i;\n", frame);
+  fprintf(c_out, "  return ret;\n");
+  fprintf(c_out, "}\n\n");
+}
+
+// temporaries are only known once the body is written, so buffer it
+void c_body(stmt_t *body, int depth)
+{
+  FILE *out = c_out;
+  
+  char *text;
+  size_t text_size;
+  c_out = open_memstream(&text, &text_size);
+  
+  c_num_tmp = 0;
+  c_max_tmp = 0;
+  c_stmt(body, depth);
+  
+  fclose(c_out);
+  c_out = out;
+  
+  if (c_max_tmp) {
+    c_indent(depth);
+    fprintf(c_out, "int32_t t0");
+    for (int i = 1; i < c_max_tmp; i++)
+      fprintf(c_out, ", t%i", i);
+    fprintf(c_out, ";\n");
+  }
+  
+  fwrite(text, 1, text_size, c_out);
+  free(text);
+}
+
+void c_stmt(stmt_t *stmt, int depth)
+{
+  while (stmt) {
+    switch (stmt->tstmt) {
+    case STMT_EXPR:
+      for (expr_t *expr = stmt->expr; expr; expr = expr->next) {
+        c_indent(depth);
+        c_value(expr);
+        fprintf(c_out, ";\n");
+      }
+      break;
+    case STMT_IF:
+      c_indent(depth);
+      c_if(stmt, depth);
+      break;
+    case STMT_WHILE:
+      c_while(stmt, depth);
+      break;
+    case STMT_RETURN:
+      c_ret(stmt, depth);
+      break;
+    case STMT_INLINE_ASM:
+      c_asm(stmt, depth);
+      break;
+    default:
+      error("unknown case");
+      break;
+    }
+    
+    stmt = stmt->next;
+  }
+}
+
+void c_if(stmt_t *stmt, int depth)
+{
+  fprintf(c_out, "if (");
+  c_expr(stmt->if_stmt.cond);
+  fprintf(c_out, ") {\n");
+  c_stmt(stmt->if_stmt.body, depth + 1);
+  c_indent(depth);
+  fprintf(c_out, "}");
+  
+  if (stmt->if_stmt.next_if) {
+    fprintf(c_out, " else ");
+    c_if(stmt->if_stmt.next_if, depth);
+    return;
+  }
+  
+  if (stmt->if_stmt.else_body) {
+    fprintf(c_out, " else {\n");
+    c_stmt(stmt->if_stmt.else_body, depth + 1);
+    c_indent(depth);
+    fprintf(c_out, "}");
+  }
+  
+  fprintf(c_out, "\n");
+}
+
+void c_while(stmt_t *stmt, int depth)
+{
+  c_indent(depth);
+  fprintf(c_out, "while (");
+  c_expr(stmt->while_stmt.cond);
+  fprintf(c_out, ") {\n");
+  c_stmt(stmt->while_stmt.body, depth + 1);
+  c_indent(depth);
+  fprintf(c_out, "}\n");
+}
+
+void c_ret(stmt_t *stmt, int depth)
+{
+  c_indent(depth);
+  
+  if (stmt->ret_stmt.value) {
+    fprintf(c_out, "ret = ");
+    c_expr(stmt->ret_stmt.value);
+    fprintf(c_out, ";\n");
+    c_indent(depth);
+  }
+  
+  fprintf(c_out, "goto ret;\n");
+  c_use_ret = 1;
+}
+
+void c_asm(stmt_t *stmt, int depth)
+{
+  char *c = stmt->inline_asm_stmt.code;
+  int n = 0;
+  
+  c_indent(depth);
+  fprintf(c_out, "{ /* asm */\n");
+  c_indent(depth + 1);
+  fprintf(c_out, "int32_t s[16];\n");
+  
+  while (*c) {
+    if (isspace(*c)) {
+      c++;
+      continue;
+    }
+    
+    int instr = -1, len = 0;
+    for (int i = 0; i < num_instr_tbl; i++) {
+      int l = strlen(instr_tbl[i]);
+      if (l > len && sub_str_match_lhs(instr_tbl[i], c) && !isalnum(c[l])) {
+        instr = i;
+        len = l;
+      }
+    }
+    
+    if (instr < 0)
+      error("unknown character or keyword");
+    
+    c += len;
+    
+    int i32 = 0;
+    if (instr_len(instr) == 2) {
+      while (isspace(*c))
+        c++;
+      i32 = strtol(c, &c, 10);
+    }
+    
+    c_indent(depth + 1);
+    
+    switch (instr) {
+    case PUSH:
+      fprintf(c_out, "s[%i] = %i;\n", n++, i32);
+      break;
+    case LBP:
+      fprintf(c_out, "s[%i] = fbp;\n", n++);
+      break;
+    case LDR:
+      fprintf(c_out, "s[%i] = ld32(s[%i]);\n", n - 1, n - 1);
+      break;
+    case LDR8:
+      fprintf(c_out, "s[%i] = ld8(s[%i]);\n", n - 1, n - 1);
+      break;
+    case STR:
+      fprintf(c_out, "st32(s[%i], s[%i]);\n", n - 1, n - 2);
+      n -= 2;
+      break;
+    case STR8:
+      fprintf(c_out, "st8(s[%i], s[%i]);\n", n - 1, n - 2);
+      n -= 2;
+      break;
+    case ADD:
+      fprintf(c_out, "s[%i] = add32(s[%i], s[%i]);\n", n - 2, n - 2, n - 1);
+      n--;
+      break;
+    case SUB:
+      fprintf(c_out, "s[%i] = sub32(s[%i], s[%i]);\n", n - 2, n - 2, n - 1);
+      n--;
+      break;
+    case MUL:
+      fprintf(c_out, "s[%i] = mul32(s[%i], s[%i]);\n", n - 2, n - 2, n - 1);
+      n--;
+      break;
+    case DIV:
+      fprintf(c_out, "s[%i] = s[%i] / s[%i];\n", n - 2, n - 2, n - 1);
+      n--;
+      break;
+    case MOD:
+      fprintf(c_out, "s[%i] = s[%i] %% s[%i];\n", n - 2, n - 2, n - 1);
+      n--;
+      break;
+    case SX8_32:
+      fprintf(c_out, "s[%i] = sx8_32(s[%i]);\n", n - 1, n - 1);
+      break;
+    case SX32_8:
+      fprintf(c_out, "s[%i] = sx32_8(s[%i]);\n", n - 1, n - 1);
+      break;
+    case INT:
+      switch (i32) {
+      case SYS_EXIT:
+        fprintf(c_out, "sys_exit();\n");
+        break;
+      case SYS_PRINT:
+        fprintf(c_out, "sys_print(s[%i]);\n", --n);
+        break;
+      case SYS_WRITE:
+        fprintf(c_out, "sys_write(s[%i]);\n", --n);
+        break;
+      default:
+        error("asm: unknown interrupt '%i'", i32);
+        break;
+      }
+      break;
+    default:
+      error("asm: '%s' is not supported by the c backend", instr_tbl[instr]);
+      break;
+    }
+    
+    if (n < 0 || n >= 16)
+      error("asm: eval stack out of range");
+  }
+  
+  if (n > 0) {
+    c_indent(depth + 1);
+    fprintf(c_out, "ret = s[%i];\n", n - 1);
+  }
+  
+  c_indent(depth);
+  fprintf(c_out, "}\n");
+}
+
+// comma-separated chain, as written in the source
+void c_expr(expr_t *expr)
+{
+  if (expr->next) {
+    fprintf(c_out, "(");
+    while (expr) {
+      c_value(expr);
+      if (expr->next)
+        fprintf(c_out, ", ");
+      expr = expr->next;
+    }
+    fprintf(c_out, ")");
+  } else {
+    c_value(expr);
+  }
+}
+
+void c_value(expr_t *expr)
+{
+  switch (expr->texpr) {
+  case EXPR_CONST:
+    fprintf(c_out, "%i", expr->num);
+    break;
+  case EXPR_ADDR:
+    c_addr(expr);
+    break;
+  case EXPR_LOAD:
+    c_load(expr);
+    break;
+  case EXPR_BINOP:
+    c_binop(expr);
+    break;
+  case EXPR_CALL:
+    c_call(expr);
+    break;
+  case EXPR_CAST:
+    c_cast(expr);
+    break;
+  case EXPR_STR:
+    c_str(expr);
+    break;
+  default:
+    error("unknown case");
+    break;
+  }
+}
+
+void c_addr(expr_t *expr)
+{
+  switch (expr->addr.taddr) {
+  case ADDR_GLOBAL:
+    c_expr(expr->addr.base);
+    break;
+  case ADDR_LOCAL:
+    fprintf(c_out, "(fbp + ");
+    c_expr(expr->addr.base);
+    fprintf(c_out, ")");
+    break;
+  default:
+    error("unknown case");
+    break;
+  }
+}
+
+void c_load(expr_t *expr)
+{
+  switch (simplify_type_spec(&expr->type)) {
+  case TY_I8:
+    fprintf(c_out, "ld8(");
+    break;
+  case TY_I32:
+    fprintf(c_out, "ld32(");
+    break;
+  default:
+    error("load: unknown type");
+    break;
+  }
+  
+  c_addr(expr);
+  fprintf(c_out, ")");
+}
+
+void c_call(expr_t *expr)
+{
+  func_t *func = expr->post.base->func.func;
+  
+  int num_side = 0;
+  int num_impure = 0;
+  for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next) {
+    num_side += c_has_side(arg->arg.base);
+    num_impure += !c_is_pure(arg->arg.base);
+  }
+  
+  // arguments are evaluated left to right in the vm, which matters as soon
+  // as one of them has side effects another could see
+  int spill = num_side > 0 && num_impure > 1;
+  
+  int tmp = c_num_tmp;
+  if (spill) {
+    fprintf(c_out, "(");
+    for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next) {
+      fprintf(c_out, "t%i = ", c_num_tmp++);
+      c_expr(arg->arg.base);
+      fprintf(c_out, ", ");
+    }
+    
+    if (c_num_tmp > c_max_tmp)
+      c_max_tmp = c_num_tmp;
+  }
+  
+  fprintf(c_out, "f_%s(", hash_get(func->name));
+  
+  int i = tmp;
+  for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next) {
+    if (arg != expr->post.post)
+      fprintf(c_out, ", ");
+    
+    if (spill)
+      fprintf(c_out, "t%i", i++);
+    else
+      c_expr(arg->arg.base);
+  }
+  
+  fprintf(c_out, ")");
+  
+  if (spill) {
+    fprintf(c_out, ")");
+    c_num_tmp = tmp;
+  }
+}
+
+void c_cast(expr_t *expr)
+{
+  tspec_t type_a = simplify_type_spec(&expr->type);
+  tspec_t type_b = simplify_type_spec(&expr->unary.base->type);
+  
+  if (type_a == TY_I8 && type_b == TY_I32) {
+    fprintf(c_out, "sx32_8(");
+    c_expr(expr->unary.base);
+    fprintf(c_out, ")");
+  } else if (type_a == TY_I32 && type_b == TY_I8) {
+    fprintf(c_out, "sx8_32(");
+    c_expr(expr->unary.base);
+    fprintf(c_out, ")");
+  } else {
+    c_expr(expr->unary.base);
+  }
+}
+
+void c_str(expr_t *expr)
+{
+  c_str_t *str = map_get(c_map_str, expr->str_hash);
+  
+  if (!str) {
+    str = malloc(sizeof(c_str_t));
+    str->pos = c_data_base + c_data_size;
+    str->str_hash = expr->str_hash;
+    str->next = NULL;
+    
+    if (c_str_list)
+      c_str_head = c_str_head->next = str;
+    else
+      c_str_list = c_str_head = str;
+    
+    c_data_size += strlen(hash_get(expr->str_hash)) + 1;
+    map_put(c_map_str, expr->str_hash, str);
+  }
+  
+  fprintf(c_out, "%i", str->pos);
+}
+
+void c_binop(expr_t *expr)
+{
+  switch (expr->binop.op) {
+  case OPERATOR_ASSIGN:
+    c_binop_assign(expr);
+    break;
+  case OPERATOR_OR:
+    c_pair("(%s || %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_AND:
+    c_pair("(%s && %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  default:
+    c_binop_math(expr);
+    break;
+  }
+}
+
+// the vm evaluates the value before the address it is stored to
+void c_binop_assign(expr_t *expr)
+{
+  expr_t *lhs = expr->binop.lhs;
+  int side = c_is_ordered(expr->binop.rhs, lhs->addr.base);
+  
+  const char *st;
+  switch (simplify_type_spec(&expr->type)) {
+  case TY_I8:
+    st = "st8";
+    break;
+  case TY_I32:
+    st = "st32";
+    break;
+  default:
+    error("assign: unknown operator");
+    break;
+  }
+  
+  if (side) {
+    int tmp = c_num_tmp++;
+    if (c_num_tmp > c_max_tmp)
+      c_max_tmp = c_num_tmp;
+    
+    fprintf(c_out, "(t%i = ", tmp);
+    c_expr(expr->binop.rhs);
+    fprintf(c_out, ", %s(", st);
+    c_addr(lhs);
+    fprintf(c_out, ", t%i))", tmp);
+    
+    c_num_tmp = tmp;
+  } else {
+    fprintf(c_out, "%s(", st);
+    c_addr(lhs);
+    fprintf(c_out, ", ");
+    c_expr(expr->binop.rhs);
+    fprintf(c_out, ")");
+  }
+}
+
+void c_binop_math(expr_t *expr)
+{
+  switch (expr->binop.op) {
+  case OPERATOR_ADD:
+    c_pair("add32(%s, %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_SUB:
+    c_pair("sub32(%s, %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_MUL:
+    c_pair("mul32(%s, %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_DIV:
+    c_pair("(%s / %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_MOD:
+    c_pair("(%s %% %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_SHL:
+    c_pair("shl32(%s, %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_SHR:
+    c_pair("shr32(%s, %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_BIT_AND:
+    c_pair("(%s & %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_BIT_OR:
+    c_pair("(%s | %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_BIT_XOR:
+    c_pair("(%s ^ %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_EQ:
+    c_pair("(%s == %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_NE:
+    c_pair("(%s != %s)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_LSS:
+    c_pair("(sub32(%s, %s) < 0)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_GTR:
+    c_pair("(sub32(%s, %s) > 0)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_LE:
+    c_pair("(sub32(%s, %s) <= 0)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  case OPERATOR_GE:
+    c_pair("(sub32(%s, %s) >= 0)", expr->binop.lhs, expr->binop.rhs);
+    break;
+  default:
+    error("unknown case: op: '%i'", expr->binop.op);
+    break;
+  }
+}
+
+// fmt takes the two operands as '%s'; if their order matters the lhs is
+// evaluated into a temporary first to keep the vm's left to right order
+void c_pair(const char *fmt, expr_t *lhs, expr_t *rhs)
+{
+  int side = c_is_ordered(lhs, rhs);
+  int tmp = c_num_tmp;
+  
+  if (side) {
+    c_num_tmp++;
+    if (c_num_tmp > c_max_tmp)
+      c_max_tmp = c_num_tmp;
+    
+    fprintf(c_out, "(t%i = ", tmp);
+    c_expr(lhs);
+    fprintf(c_out, ", ");
+  }
+  
+  const char *c = fmt;
+  int operand = 0;
+  while (*c) {
+    if (c[0] == '%' && c[1] == 's') {
+      if (operand++ == 0) {
+        if (side)
+          fprintf(c_out, "t%i", tmp);
+        else
+          c_expr(lhs);
+      } else {
+        c_expr(rhs);
+      }
+      c += 2;
+    } else if (c[0] == '%' && c[1] == '%') {
+      fputc('%', c_out);
+      c += 2;
+    } else {
+      fputc(*c++, c_out);
+    }
+  }
+  
+  if (side) {
+    fprintf(c_out, ")");
+    c_num_tmp = tmp;
+  }
+}
+
+int c_has_side(expr_t *expr)
+{
+  if (!expr)
+    return 0;
+  
+  switch (expr->texpr) {
+  case EXPR_CALL:
+    return 1;
+  case EXPR_BINOP:
+    return expr->binop.op == OPERATOR_ASSIGN
+      || c_has_side(expr->binop.lhs)
+      || c_has_side(expr->binop.rhs)
+      || c_has_side(expr->next);
+  case EXPR_ADDR:
+  case EXPR_LOAD:
+    return c_has_side(expr->addr.base) || c_has_side(expr->next);
+  case EXPR_CAST:
+    return c_has_side(expr->unary.base) || c_has_side(expr->next);
+  default:
+    return c_has_side(expr->next);
+  }
+}
+
+// no side effects and nothing read from memory, so it comes out the same
+// whenever it is evaluated
+int c_is_pure(expr_t *expr)
+{
+  if (!expr)
+    return 1;
+  
+  switch (expr->texpr) {
+  case EXPR_CALL:
+  case EXPR_LOAD:
+    return 0;
+  case EXPR_BINOP:
+    return expr->binop.op != OPERATOR_ASSIGN
+      && c_is_pure(expr->binop.lhs)
+      && c_is_pure(expr->binop.rhs)
+      && c_is_pure(expr->next);
+  case EXPR_ADDR:
+    return c_is_pure(expr->addr.base) && c_is_pure(expr->next);
+  case EXPR_CAST:
+    return c_is_pure(expr->unary.base) && c_is_pure(expr->next);
+  default:
+    return c_is_pure(expr->next);
+  }
+}
+
+// whether a has to be evaluated before b: one has side effects that the
+// other could change or see, and c leaves the order of operands to the
+// compiler
+int c_is_ordered(expr_t *a, expr_t *b)
+{
+  return (c_has_side(a) && !c_is_pure(b)) || (c_has_side(b) && !c_is_pure(a));
+}
+
+void c_indent(int depth)
+{
+  for (int i = 0; i < depth; i++)
+    fprintf(c_out, "  ");
+}
+
+void c_string_literal(char *str)
+{
+  fputc('"', c_out);
+  for (char *c = str; *c; c++) {
+    if (*c == '"' || *c == '\\')
+      fprintf(c_out, "\\%c", *c);
+    else if (isprint((unsigned char) *c))
+      fputc(*c, c_out);
+    else
+      fprintf(c_out, "\\%03o", (unsigned char) *c);
+  }
+  fprintf(c_out, "\\0\"");
+}
@@ -0,0 +1,1022 @@
+#include "gen.h"
+
+#include "../common/hash.h"
+#include "../common/map.h"
+#include "../common/error.h"
+#include "../common/magic.h"
+#include "../vm/vm.h"
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+//
+// ahead-of-time x86-64 backend
+//
+// the guest address space is a single image in .bss addressed from %r15,
+// laid out as in the vm: globals, then string data, then the machine stack
+// growing down from the top. functions get a real frame on that stack, so
+// locals are %rbp-relative while pointers stay 32-bit guest addresses. the
+// image is sized by -m and sits last in .bss, so the runtime's own buffers
+// stay in rip-relative reach however large it is. every function checks
+// that its frame, and a little for what it pushes, stays above the program
+// data, and stops the way the vm does when it would not.
+//
+
+#define X86_STACK_SLACK KB(2)
+
+typedef struct x86_str_s x86_str_t;
+
+struct x86_str_s {
+  int pos;
+  hash_t str_hash;
+  x86_str_t *next;
+};
+
+static FILE *x86_out;
+static int x86_num_lbl;
+static int x86_frame;
+static int x86_ret_lbl;
+
+static map_t x86_map_str;
+static x86_str_t *x86_str_list, *x86_str_head;
+static int x86_data_base;
+static int x86_data_size;
+static unsigned x86_mem_size;
+
+void x86_func(func_t *func);
+
+void x86_stmt(stmt_t *stmt);
+void x86_if(stmt_t *stmt);
+void x86_while(stmt_t *stmt);
+void x86_ret(stmt_t *stmt);
+void x86_asm(stmt_t *stmt);
+
+void x86_expr(expr_t *expr);
+void x86_host_addr(expr_t *expr);
+void x86_addr(expr_t *expr);
+void x86_load(expr_t *expr);
+void x86_call(expr_t *expr);
+void x86_cast(expr_t *expr);
+void x86_sx32_8();
+void x86_str(expr_t *expr);
+void x86_binop(expr_t *expr);
+void x86_binop_assign(expr_t *expr);
+void x86_binop_cond(expr_t *expr);
+void x86_binop_math(expr_t *expr);
+void x86_divi(int d, int mod);
+void x86_condition(expr_t *expr, int end);
+void x86_operands(expr_t *expr);
+
+int x86_is_local_const(expr_t *expr);
+int x86_tmp_label();
+void x86_runtime(int data_size);
+void x86_emit(const char *fmt, ...);
+
+void x86_emit(const char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  fprintf(x86_out, "  ");
+  vfprintf(x86_out, fmt, args);
+  fprintf(x86_out, "\n");
+  va_end(args);
+}
+
+void gen_x86(unit_t *unit, FILE *out, unsigned mem_size)
+{
+  x86_out = out;
+  x86_mem_size = (mem_size + 4095) & ~4095u;
+  x86_num_lbl = 0;
+  x86_frame = 0;
+  x86_str_list = NULL;
+  x86_str_head = NULL;
+  x86_map_str = make_map();
+  x86_data_base = (unit->scope.size + 3) & ~3;
+  x86_data_size = 0;
+  
+  fprintf(out, "  .text\n");
+  fprintf(out, "  .globl _start\n");
+  fprintf(out, "_start:\n");
+  x86_emit("leaq mem(%%rip), %%r15");
+  x86_emit("movl $%u, %%eax", x86_mem_size);
+  x86_emit("leaq (%%r15,%%rax), %%rsp");
+  x86_emit("leaq data(%%rip), %%rsi");
+  x86_emit("leaq %i(%%r15), %%rdi", x86_data_base);
+  x86_emit("movl $data_size, %%ecx");
+  x86_emit("rep movsb");
+  x86_emit("movq %%rsp, %%rbp");
+  
+  x86_stmt(unit->stmt);
+  x86_emit("call rt_exit");
+  
+  x86_func(unit->func);
+  
+  if ((unsigned) x86_data_base + x86_data_size > x86_mem_size)
+    error("x86: program data does not fit in %u bytes of memory", x86_mem_size);
+  
+  x86_runtime(x86_data_size);
+}
+
+void x86_func(func_t *func)
+{
+  while (func) {
+    x86_ret_lbl = x86_tmp_label();
+    x86_frame = (func->local_size + 3) & ~3;
+    
+    fprintf(x86_out, "f_%s:\n", hash_get(func->name));
+    x86_emit("pushq %%rbp");
+    x86_emit("movq %%rsp, %%rbp");
+    x86_emit("subq $%i, %%rsp", x86_frame);
+    x86_emit("leaq stack_end(%%r15), %%rax");
+    x86_emit("cmpq %%rax, %%rsp");
+    x86_emit("jb rt_overflow");
+    
+    int num_param = 0;
+    for (param_t *param = func->params; param; param = param->next)
+      num_param++;
+    
+    int i = 0;
+    for (param_t *param = func->params; param; param = param->next) {
+      x86_emit("movl %i(%%rbp), %%eax", 16 + 8 * (num_param - 1 - i));
+      x86_emit("movl %%eax, %i(%%rbp)", param->addr->addr.base->num - x86_frame);
+      i++;
+    }
+    
+    x86_stmt(func->body);
+    
+    fprintf(x86_out, ".L%i:\n", x86_ret_lbl);
+    x86_emit("leave");
+    x86_emit("ret");
+    
+    func = func->next;
+  }
+}
+
+void x86_stmt(stmt_t *stmt)
+{
+  while (stmt) {
+    switch (stmt->tstmt) {
+    case STMT_EXPR:
+      x86_expr(stmt->expr);
+      break;
+    case STMT_IF:
+      x86_if(stmt);
+      break;
+    case STMT_WHILE:
+      x86_while(stmt);
+      break;
+    case STMT_RETURN:
+      x86_ret(stmt);
+      break;
+    case STMT_INLINE_ASM:
+      x86_asm(stmt);
+      break;
+    default:
+      error("unknown case");
+      break;
+    }
+    
+    stmt = stmt->next;
+  }
+}
+
+void x86_if(stmt_t *stmt)
+{
+  int end_lbl = x86_tmp_label();
+  
+  while (stmt) {
+    int cond_end_lbl = x86_tmp_label();
+    
+    x86_condition(stmt->if_stmt.cond, cond_end_lbl);
+    x86_stmt(stmt->if_stmt.body);
+    x86_emit("jmp .L%i", end_lbl);
+    
+    fprintf(x86_out, ".L%i:\n", cond_end_lbl);
+    
+    if (stmt->if_stmt.else_body)
+      x86_stmt(stmt->if_stmt.else_body);
+    
+    stmt = stmt->if_stmt.next_if;
+  }
+  
+  fprintf(x86_out, ".L%i:\n", end_lbl);
+}
+
+void x86_while(stmt_t *stmt)
+{
+  int end_lbl = x86_tmp_label();
+  int cond_lbl = x86_tmp_label();
+  
+  fprintf(x86_out, ".L%i:\n", cond_lbl);
+  x86_condition(stmt->while_stmt.cond, end_lbl);
+  x86_stmt(stmt->while_stmt.body);
+  
+  x86_emit("jmp .L%i", cond_lbl);
+  fprintf(x86_out, ".L%i:\n", end_lbl);
+}
+
+void x86_ret(stmt_t *stmt)
+{
+  x86_expr(stmt->ret_stmt.value);
+  x86_emit("jmp .L%i", x86_ret_lbl);
+}
+
+void x86_asm(stmt_t *stmt)
+{
+  char *c = stmt->inline_asm_stmt.code;
+  int depth = 0;
+  
+  while (*c) {
+    if (isspace(*c)) {
+      c++;
+      continue;
+    }
+    
+    int instr = -1, len = 0;
+    for (int i = 0; i < num_instr_tbl; i++) {
+      int n = strlen(instr_tbl[i]);
+      if (n > len && sub_str_match_lhs(instr_tbl[i], c) && !isalnum(c[n])) {
+        instr = i;
+        len = n;
+      }
+    }
+    
+    if (instr < 0)
+      error("unknown character or keyword");
+    
+    c += len;
+    
+    int i32 = 0;
+    if (instr_len(instr) == 2) {
+      while (isspace(*c))
+        c++;
+      i32 = strtol(c, &c, 10);
+    }
+    
+    switch (instr) {
+    case PUSH:
+      x86_emit("pushq $%i", i32);
+      depth++;
+      break;
+    case LBP:
+      x86_emit("leaq %i(%%rbp), %%rax", -x86_frame);
+      x86_emit("subq %%r15, %%rax");
+      x86_emit("pushq %%rax");
+      depth++;
+      break;
+    case LDR:
+      x86_emit("popq %%rax");
+      x86_emit("andl $-4, %%eax");
+      x86_emit("movl (%%r15,%%rax), %%eax");
+      x86_emit("pushq %%rax");
+      break;
+    case LDR8:
+      x86_emit("popq %%rax");
+      x86_emit("movsbl (%%r15,%%rax), %%eax");
+      x86_emit("pushq %%rax");
+      break;
+    case STR:
+    case STR8:
+      x86_emit("popq %%rax");
+      x86_emit("popq %%rcx");
+      if (instr == STR) {
+        x86_emit("andl $-4, %%eax");
+        x86_emit("movl %%ecx, (%%r15,%%rax)");
+      } else {
+        x86_emit("movb %%cl, (%%r15,%%rax)");
+      }
+      depth -= 2;
+      break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOD:
+      x86_emit("popq %%rcx");
+      x86_emit("popq %%rax");
+      switch (instr) {
+      case ADD:
+        x86_emit("addl %%ecx, %%eax");
+        break;
+      case SUB:
+        x86_emit("subl %%ecx, %%eax");
+        break;
+      case MUL:
+        x86_emit("imull %%ecx, %%eax");
+        break;
+      case DIV:
+        x86_emit("cltd");
+        x86_emit("idivl %%ecx");
+        break;
+      case MOD:
+        x86_emit("cltd");
+        x86_emit("idivl %%ecx");
+        x86_emit("movl %%edx, %%eax");
+        break;
+      }
+      x86_emit("pushq %%rax");
+      depth--;
+      break;
+    case SX8_32:
+      x86_emit("popq %%rax");
+      x86_emit("movsbl %%al, %%eax");
+      x86_emit("pushq %%rax");
+      break;
+    case SX32_8:
+      x86_emit("popq %%rax");
+      x86_sx32_8();
+      x86_emit("pushq %%rax");
+      break;
+    case INT:
+      switch (i32) {
+      case SYS_EXIT:
+        x86_emit("call rt_exit");
+        break;
+      case SYS_PRINT:
+        x86_emit("popq %%rax");
+        x86_emit("call rt_print");
+        depth--;
+        break;
+      case SYS_WRITE:
+        x86_emit("popq %%rax");
+        x86_emit("call rt_write");
+        depth--;
+        break;
+      default:
+        error("asm: unknown interrupt '%i'", i32);
+        break;
+      }
+      break;
+    default:
+      error("asm: '%s' is not supported by the x86-64 backend", instr_tbl[instr]);
+      break;
+    }
+    
+    if (depth < 0)
+      error("asm: pops values it did not push");
+  }
+  
+  if (depth > 0) {
+    x86_emit("popq %%rax");
+    x86_emit("addq $%i, %%rsp", (depth - 1) * 8);
+  }
+}
+
+void x86_expr(expr_t *expr)
+{
+  while (expr) {
+    switch (expr->texpr) {
+    case EXPR_CONST:
+      x86_emit("movl $%i, %%eax", expr->num);
+      break;
+    case EXPR_ADDR:
+      x86_addr(expr);
+      break;
+    case EXPR_LOAD:
+      x86_load(expr);
+      break;
+    case EXPR_BINOP:
+      x86_binop(expr);
+      break;
+    case EXPR_CALL:
+      x86_call(expr);
+      break;
+    case EXPR_CAST:
+      x86_cast(expr);
+      break;
+    case EXPR_STR:
+      x86_str(expr);
+      break;
+    default:
+      error("unknown case");
+      break;
+    }
+    
+    expr = expr->next;
+  }
+}
+
+int x86_is_local_const(expr_t *expr)
+{
+  return expr->addr.taddr == ADDR_LOCAL && expr->addr.base->texpr == EXPR_CONST;
+}
+
+// guest address of an lvalue in %eax, or a host address in %rax for locals
+void x86_host_addr(expr_t *expr)
+{
+  x86_expr(expr->addr.base);
+  
+  switch (expr->addr.taddr) {
+  case ADDR_GLOBAL:
+    x86_emit("addq %%r15, %%rax");
+    break;
+  case ADDR_LOCAL:
+    x86_emit("movslq %%eax, %%rax");
+    x86_emit("leaq %i(%%rbp,%%rax), %%rax", -x86_frame);
+    break;
+  default:
+    error("unknown case");
+    break;
+  }
+}
+
+void x86_addr(expr_t *expr)
+{
+  switch (expr->addr.taddr) {
+  case ADDR_GLOBAL:
+    x86_expr(expr->addr.base);
+    break;
+  case ADDR_LOCAL:
+    x86_host_addr(expr);
+    x86_emit("subq %%r15, %%rax");
+    break;
+  default:
+    error("unknown case");
+    break;
+  }
+}
+
+void x86_load(expr_t *expr)
+{
+  tspec_t tspec = simplify_type_spec(&expr->type);
+  
+  if (x86_is_local_const(expr)) {
+    int ofs = expr->addr.base->num - x86_frame;
+    switch (tspec) {
+    case TY_I8:
+      x86_emit("movsbl %i(%%rbp), %%eax", ofs);
+      break;
+    case TY_I32:
+      x86_emit("movl %i(%%rbp), %%eax", ofs);
+      break;
+    default:
+      error("load: unknown type");
+      break;
+    }
+    return;
+  }
+  
+  x86_expr(expr->addr.base);
+  
+  if (expr->addr.taddr == ADDR_LOCAL) {
+    x86_emit("leaq %i(%%rbp), %%rcx", -x86_frame);
+    x86_emit("subq %%r15, %%rcx");
+    x86_emit("addl %%ecx, %%eax");
+  }
+  
+  switch (tspec) {
+  case TY_I8:
+    x86_emit("movsbl (%%r15,%%rax), %%eax");
+    break;
+  case TY_I32:
+    x86_emit("andl $-4, %%eax");
+    x86_emit("movl (%%r15,%%rax), %%eax");
+    break;
+  default:
+    error("load: unknown type");
+    break;
+  }
+}
+
+void x86_call(expr_t *expr)
+{
+  func_t *func = expr->post.base->func.func;
+  
+  int num_arg = 0;
+  expr_t *arg = expr->post.post;
+  while (arg) {
+    x86_expr(arg->arg.base);
+    x86_emit("pushq %%rax");
+    num_arg++;
+    arg = arg->arg.next;
+  }
+  
+  x86_emit("call f_%s", hash_get(func->name));
+  
+  if (num_arg)
+    x86_emit("addq $%i, %%rsp", num_arg * 8);
+}
+
+void x86_cast(expr_t *expr)
+{
+  x86_expr(expr->unary.base);
+  
+  tspec_t type_a = simplify_type_spec(&expr->type);
+  tspec_t type_b = simplify_type_spec(&expr->unary.base->type);
+  
+  if (type_a == TY_I8 && type_b == TY_I32)
+    x86_sx32_8();
+  else if (type_a == TY_I32 && type_b == TY_I8)
+    x86_emit("movsbl %%al, %%eax");
+}
+
+void x86_sx32_8()
+{
+  x86_emit("movl %%eax, %%edx");
+  x86_emit("shrl $24, %%edx");
+  x86_emit("andl $0x80, %%edx");
+  x86_emit("andl $0x7f, %%eax");
+  x86_emit("orl %%edx, %%eax");
+}
+
+void x86_str(expr_t *expr)
+{
+  x86_str_t *str = map_get(x86_map_str, expr->str_hash);
+  
+  if (!str) {
+    str = malloc(sizeof(x86_str_t));
+    str->pos = x86_data_base + x86_data_size;
+    str->str_hash = expr->str_hash;
+    str->next = NULL;
+    
+    if (x86_str_list)
+      x86_str_head = x86_str_head->next = str;
+    else
+      x86_str_list = x86_str_head = str;
+    
+    x86_data_size += strlen(hash_get(expr->str_hash)) + 1;
+    map_put(x86_map_str, expr->str_hash, str);
+  }
+  
+  x86_emit("movl $%i, %%eax", str->pos);
+}
+
+void x86_condition(expr_t *expr, int end)
+{
+  int next_cond, yes_cond;
+  
+  if (expr->texpr == EXPR_BINOP) {
+    switch (expr->binop.op) {
+    case OPERATOR_AND:
+      x86_condition(expr->binop.lhs, end);
+      x86_condition(expr->binop.rhs, end);
+      return;
+    case OPERATOR_OR:
+      next_cond = x86_tmp_label();
+      yes_cond = x86_tmp_label();
+      
+      x86_condition(expr->binop.lhs, next_cond);
+      x86_emit("jmp .L%i", yes_cond);
+      
+      fprintf(x86_out, ".L%i:\n", next_cond);
+      x86_condition(expr->binop.rhs, end);
+      
+      fprintf(x86_out, ".L%i:\n", yes_cond);
+      return;
+    case OPERATOR_EQ:
+    case OPERATOR_NE:
+    case OPERATOR_LE:
+    case OPERATOR_GE:
+    case OPERATOR_LSS:
+    case OPERATOR_GTR:
+      x86_operands(expr);
+      x86_emit("subl %%ecx, %%eax");
+      
+      switch (expr->binop.op) {
+      case OPERATOR_EQ:
+        x86_emit("jne .L%i", end);
+        break;
+      case OPERATOR_NE:
+        x86_emit("je .L%i", end);
+        break;
+      case OPERATOR_LE:
+        x86_emit("testl %%eax, %%eax");
+        x86_emit("jg .L%i", end);
+        break;
+      case OPERATOR_GE:
+        x86_emit("testl %%eax, %%eax");
+        x86_emit("jl .L%i", end);
+        break;
+      case OPERATOR_LSS:
+        x86_emit("testl %%eax, %%eax");
+        x86_emit("jge .L%i", end);
+        break;
+      case OPERATOR_GTR:
+        x86_emit("testl %%eax, %%eax");
+        x86_emit("jle .L%i", end);
+        break;
+      }
+      return;
+    default:
+      break;
+    }
+  }
+  
+  x86_expr(expr);
+  x86_emit("testl %%eax, %%eax");
+  x86_emit("je .L%i", end);
+}
+
+void x86_binop(expr_t *expr)
+{
+  switch (expr->binop.op) {
+  case OPERATOR_ASSIGN:
+    x86_binop_assign(expr);
+    break;
+  case OPERATOR_OR:
+  case OPERATOR_AND:
+    x86_binop_cond(expr);
+    break;
+  default:
+    x86_binop_math(expr);
+    break;
+  }
+}
+
+void x86_binop_assign(expr_t *expr)
+{
+  expr_t *lhs = expr->binop.lhs;
+  tspec_t tspec = simplify_type_spec(&expr->type);
+  
+  x86_expr(expr->binop.rhs);
+  
+  if (x86_is_local_const(lhs)) {
+    int ofs = lhs->addr.base->num - x86_frame;
+    switch (tspec) {
+    case TY_I8:
+      x86_emit("movb %%al, %i(%%rbp)", ofs);
+      break;
+    case TY_I32:
+      x86_emit("movl %%eax, %i(%%rbp)", ofs);
+      break;
+    default:
+      error("assign: unknown operator");
+      break;
+    }
+    return;
+  }
+  
+  x86_emit("pushq %%rax");
+  x86_addr(lhs);
+  x86_emit("popq %%rcx");
+  
+  switch (tspec) {
+  case TY_I8:
+    x86_emit("movb %%cl, (%%r15,%%rax)");
+    break;
+  case TY_I32:
+    x86_emit("andl $-4, %%eax");
+    x86_emit("movl %%ecx, (%%r15,%%rax)");
+    break;
+  default:
+    error("assign: unknown operator");
+    break;
+  }
+}
+
+void x86_binop_cond(expr_t *expr)
+{
+  int cond_end = x86_tmp_label();
+  int body_end = x86_tmp_label();
+  
+  x86_condition(expr, cond_end);
+  x86_emit("movl $1, %%eax");
+  x86_emit("jmp .L%i", body_end);
+  fprintf(x86_out, ".L%i:\n", cond_end);
+  x86_emit("xorl %%eax, %%eax");
+  fprintf(x86_out, ".L%i:\n", body_end);
+}
+
+// lhs in %eax, rhs in %ecx
+void x86_operands(expr_t *expr)
+{
+  if (expr->binop.rhs->texpr == EXPR_CONST) {
+    x86_expr(expr->binop.lhs);
+    x86_emit("movl $%i, %%ecx", expr->binop.rhs->num);
+  } else {
+    x86_expr(expr->binop.lhs);
+    x86_emit("pushq %%rax");
+    x86_expr(expr->binop.rhs);
+    x86_emit("movl %%eax, %%ecx");
+    x86_emit("popq %%rax");
+  }
+}
+
+// %eax divided by a constant without idiv, as the jit does it: a power of
+// two shifts with the quotient rounded towards zero, anything else multiplies
+// by div_magic's reciprocal. d is neither 0 nor INT_MIN, those go to idiv
+void x86_divi(int d, int mod)
+{
+  unsigned ud = d < 0 ? -(unsigned) d : d;
+  int k = log2_exact(ud);
+  
+  if (ud == 1) {
+    if (mod)
+      x86_emit("xorl %%eax, %%eax");
+    else if (d < 0)
+      x86_emit("negl %%eax");
+    return;
+  }
+  
+  if (k > 0) {
+    x86_emit("movl %%eax, %%edx");
+    x86_emit("sarl $31, %%edx");
+    x86_emit("shrl $%i, %%edx", 32 - k);
+    x86_emit("addl %%eax, %%edx");
+    x86_emit("sarl $%i, %%edx", k);
+  } else {
+    unsigned mul;
+    int shift;
+    div_magic(ud, &mul, &shift);
+    
+    x86_emit("movslq %%eax, %%rdx");
+    x86_emit("movl $%u, %%ecx", mul);
+    x86_emit("imulq %%rcx, %%rdx");
+    x86_emit("sarq $%i, %%rdx", shift);
+    x86_emit("movl %%eax, %%ecx");
+    x86_emit("sarl $31, %%ecx");
+    x86_emit("subl %%ecx, %%edx");
+  }
+  
+  if (mod) {
+    x86_emit("imull $%u, %%edx, %%edx", ud);
+    x86_emit("subl %%edx, %%eax");
+  } else {
+    x86_emit("movl %%edx, %%eax");
+    if (d < 0)
+      x86_emit("negl %%eax");
+  }
+}
+
+void x86_binop_math(expr_t *expr)
+{
+  expr_t *rhs = expr->binop.rhs;
+  operator_t op = expr->binop.op;
+  
+  if ((op == OPERATOR_DIV || op == OPERATOR_MOD) && rhs->texpr == EXPR_CONST && rhs->num != 0 && rhs->num != INT_MIN) {
+    x86_expr(expr->binop.lhs);
+    x86_divi(rhs->num, op == OPERATOR_MOD);
+    return;
+  }
+  
+  x86_operands(expr);
+  
+  const char *setcc = NULL;
+  
+  switch (expr->binop.op) {
+  case OPERATOR_ADD:
+    x86_emit("addl %%ecx, %%eax");
+    break;
+  case OPERATOR_SUB:
+    x86_emit("subl %%ecx, %%eax");
+    break;
+  case OPERATOR_MUL:
+    x86_emit("imull %%ecx, %%eax");
+    break;
+  case OPERATOR_DIV:
+    x86_emit("cltd");
+    x86_emit("idivl %%ecx");
+    break;
+  case OPERATOR_MOD:
+    x86_emit("cltd");
+    x86_emit("idivl %%ecx");
+    x86_emit("movl %%edx, %%eax");
+    break;
+  case OPERATOR_SHL:
+    x86_emit("sall %%cl, %%eax");
+    break;
+  case OPERATOR_SHR:
+    x86_emit("sarl %%cl, %%eax");
+    break;
+  case OPERATOR_BIT_AND:
+    x86_emit("andl %%ecx, %%eax");
+    break;
+  case OPERATOR_BIT_OR:
+    x86_emit("orl %%ecx, %%eax");
+    break;
+  case OPERATOR_BIT_XOR:
+    x86_emit("xorl %%ecx, %%eax");
+    break;
+  case OPERATOR_EQ:
+    setcc = "sete";
+    break;
+  case OPERATOR_NE:
+    setcc = "setne";
+    break;
+  case OPERATOR_LSS:
+    setcc = "setl";
+    break;
+  case OPERATOR_GTR:
+    setcc = "setg";
+    break;
+  case OPERATOR_LE:
+    setcc = "setle";
+    break;
+  case OPERATOR_GE:
+    setcc = "setge";
+    break;
+  default:
+    error("unknown case: op: '%i'", expr->binop.op);
+    break;
+  }
+  
+  if (setcc) {
+    x86_emit("subl %%ecx, %%eax");
+    x86_emit("testl %%eax, %%eax");
+    x86_emit("%s %%al", setcc);
+    x86_emit("movzbl %%al, %%eax");
+  }
+}
+
+int x86_tmp_label()
+{
+  return x86_num_lbl++;
+}
+
+void x86_runtime(int data_size)
+{
+  fprintf(x86_out, "\n");
+  fprintf(x86_out, "rt_exit:\n");
+  x86_emit("call rt_flush");
+  x86_emit("movl $60, %%eax");
+  x86_emit("xorl %%edi, %%edi");
+  x86_emit("syscall");
+  
+  fprintf(x86_out, "rt_overflow:\n");
+  x86_emit("call rt_flush");
+  x86_emit("movl $1, %%eax");
+  x86_emit("movl $2, %%edi");
+  x86_emit("leaq rt_overflow_msg(%%rip), %%rsi");
+  x86_emit("movl $rt_overflow_len, %%edx");
+  x86_emit("syscall");
+  x86_emit("movl $60, %%eax");
+  x86_emit("movl $255, %%edi");
+  x86_emit("syscall");
+  
+  fprintf(x86_out, "rt_flush:\n");
+  x86_emit("movl $1, %%eax");
+  x86_emit("movl $1, %%edi");
+  x86_emit("leaq rt_buf(%%rip), %%rsi");
+  x86_emit("movl rt_len(%%rip), %%edx");
+  x86_emit("syscall");
+  x86_emit("movl $0, rt_len(%%rip)");
+  x86_emit("ret");
+  
+  // %sil: byte to append to the output buffer
+  fprintf(x86_out, "rt_putc:\n");
+  x86_emit("movl rt_len(%%rip), %%edx");
+  x86_emit("cmpl $4096, %%edx");
+  x86_emit("jb 1f");
+  x86_emit("pushq %%rsi");
+  x86_emit("call rt_flush");
+  x86_emit("popq %%rsi");
+  x86_emit("xorl %%edx, %%edx");
+  fprintf(x86_out, "1:\n");
+  x86_emit("leaq rt_buf(%%rip), %%rdi");
+  x86_emit("movb %%sil, (%%rdi,%%rdx)");
+  x86_emit("incl %%edx");
+  x86_emit("movl %%edx, rt_len(%%rip)");
+  x86_emit("ret");
+  
+  // %eax: guest address of a string
+  fprintf(x86_out, "rt_write:\n");
+  x86_emit("pushq %%rbx");
+  x86_emit("leaq (%%r15,%%rax), %%rbx");
+  fprintf(x86_out, "1:\n");
+  x86_emit("movzbl (%%rbx), %%esi");
+  x86_emit("testl %%esi, %%esi");
+  x86_emit("je 2f");
+  x86_emit("call rt_putc");
+  x86_emit("incq %%rbx");
+  x86_emit("jmp 1b");
+  fprintf(x86_out, "2:\n");
+  x86_emit("popq %%rbx");
+  x86_emit("ret");
+  
+  // %eax: number to print in decimal followed by a newline
+  fprintf(x86_out, "rt_print:\n");
+  x86_emit("pushq %%rbx");
+  x86_emit("subq $16, %%rsp");
+  x86_emit("movl %%eax, %%ecx");
+  x86_emit("testl %%ecx, %%ecx");
+  x86_emit("jns 1f");
+  x86_emit("pushq %%rcx");
+  x86_emit("movl $45, %%esi");
+  x86_emit("call rt_putc");
+  x86_emit("popq %%rcx");
+  x86_emit("negl %%ecx");
+  fprintf(x86_out, "1:\n");
+  x86_emit("xorl %%ebx, %%ebx");
+  x86_emit("movl %%ecx, %%eax");
+  fprintf(x86_out, "2:\n");
+  x86_emit("xorl %%edx, %%edx");
+  x86_emit("movl $10, %%ecx");
+  x86_emit("divl %%ecx");
+  x86_emit("addl $48, %%edx");
+  x86_emit("movb %%dl, (%%rsp,%%rbx)");
+  x86_emit("incl %%ebx");
+  x86_emit("testl %%eax, %%eax");
+  x86_emit("jne 2b");
+  fprintf(x86_out, "3:\n");
+  x86_emit("decl %%ebx");
+  x86_emit("movzbl (%%rsp,%%rbx), %%esi");
+  x86_emit("call rt_putc");
+  x86_emit("testl %%ebx, %%ebx");
+  x86_emit("jne 3b");
+  x86_emit("movl $10, %%esi");
+  x86_emit("call rt_putc");
+  x86_emit("addq $16, %%rsp");
+  x86_emit("popq %%rbx");
+  x86_emit("ret");
+  
+  fprintf(x86_out, "\n  .section .rodata\n");
+  fprintf(x86_out, "data:\n");
+  for (x86_str_t *str = x86_str_list; str; str = str->next) {
+    fprintf(x86_out, "  .byte ");
+    for (char *c = hash_get(str->str_hash); *c; c++)
+      fprintf(x86_out, "%i,", (unsigned char) *c);
+    fprintf(x86_out, "0\n");
+  }
+  fprintf(x86_out, "  .set data_size, %i\n", data_size);
+  fprintf(x86_out, "  .set stack_end, %i\n", ((x86_data_base + data_size + 15) & ~15) + X86_STACK_SLACK);
+  fprintf(x86_out, "rt_overflow_msg:\n");
+  x86_emit(".ascii \"vm: stack overflow, a frame runs into the program data\\n\"");
+  fprintf(x86_out, "  .set rt_overflow_len, . - rt_overflow_msg\n");
+  
+  fprintf(x86_out, "\n  .bss\n");
+  fprintf(x86_out, "rt_len:\n");
+  x86_emit(".zero 4");
+  fprintf(x86_out, "rt_buf:\n");
+  x86_emit(".zero 4096");
+  x86_emit(".align 4096");
+  fprintf(x86_out, "mem:\n");
+  x86_emit(".zero %u", x86_mem_size);
+}
+
+static int x86_run(char **argv)
+{
+  pid_t pid = fork();
+  if (pid < 0)
+    return 0;
+  
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+    return 0;
+  
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static char *x86_tmp_name(const char *suffix, int *fd)
+{
+  const char *dir = getenv("TMPDIR");
+  if (!dir || !*dir)
+    dir = "/tmp";
+  
+  char *name = malloc(strlen(dir) + strlen(suffix) + 16);
+  sprintf(name, "%s/9cXXXXXX%s", dir, suffix);
+  
+  *fd = mkstemps(name, strlen(suffix));
+  if (*fd < 0) {
+    free(name);
+    return NULL;
+  }
+  
+  return name;
+}
+
+int gen_x86_exe(unit_t *unit, char *out_name, unsigned mem_size)
+{
+  int asm_fd, obj_fd;
+  
+  char *asm_name = x86_tmp_name(".s", &asm_fd);
+  if (!asm_name)
+    return 0;
+  
+  char *obj_name = x86_tmp_name(".o", &obj_fd);
+  if (!obj_name) {
+    close(asm_fd);
+    unlink(asm_name);
+    free(asm_name);
+    return 0;
+  }
+  
+  close(obj_fd);
+  
+  FILE *out = fdopen(asm_fd, "w");
+  gen_x86(unit, out, mem_size);
+  fclose(out);
+  
+  // run as and ld directly rather than through the shell, so the output
+  // name is passed on as it is, spaces and all
+  char *as_argv[] = { "as", "-o", obj_name, asm_name, NULL };
+  char *ld_argv[] = { "ld", "-o", out_name, obj_name, NULL };
+  
+  int ok = x86_run(as_argv) && x86_run(ld_argv);
+  
+  unlink(asm_name);
+  unlink(obj_name);
+  free(asm_name);
+  free(obj_name);
+  
+  return ok;
+}
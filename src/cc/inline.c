@@ -0,0 +1,153 @@
+#include "gen.h"
+
+#include "../vm/instr.h"
+
+//
+// inlining candidates
+//
+// gen_inline can take any callee whose body is small, does not call itself
+// and has no asm that would notice it is not in a frame of its own. size is
+// counted in statements and expression nodes. functions have to be declared
+// before they are used, so calling itself is the only way a function can be
+// recursive.
+//
+
+typedef struct walk_s walk_t;
+
+struct walk_s {
+  func_t *func;
+  int max_size;
+  int size;
+  int fail;
+  int found;
+};
+
+static void walk_stmt(walk_t *walk, stmt_t *stmt);
+static void walk_expr(walk_t *walk, expr_t *expr);
+static int asm_ok(char *code);
+
+int inline_ok(func_t *func, int max_size)
+{
+  if (!func || !func->body || max_size <= 0)
+    return 0;
+  
+  walk_t walk = { func, max_size, 0, 0, 0 };
+  walk_stmt(&walk, func->body);
+  
+  return !walk.fail;
+}
+
+int inline_any(stmt_t *stmt, int max_size)
+{
+  walk_t walk = { NULL, max_size, 0, 0, 0 };
+  walk_stmt(&walk, stmt);
+  
+  return walk.found;
+}
+
+static void walk_stmt(walk_t *walk, stmt_t *stmt)
+{
+  while (stmt && !walk->fail) {
+    walk->size++;
+    
+    switch (stmt->tstmt) {
+    case STMT_EXPR:
+      walk_expr(walk, stmt->expr);
+      break;
+    case STMT_IF:
+      for (stmt_t *next_if = stmt; next_if; next_if = next_if->if_stmt.next_if) {
+        walk_expr(walk, next_if->if_stmt.cond);
+        walk_stmt(walk, next_if->if_stmt.body);
+        walk_stmt(walk, next_if->if_stmt.else_body);
+      }
+      break;
+    case STMT_WHILE:
+      walk_expr(walk, stmt->while_stmt.cond);
+      walk_stmt(walk, stmt->while_stmt.body);
+      break;
+    case STMT_RETURN:
+      walk_expr(walk, stmt->ret_stmt.value);
+      break;
+    case STMT_INLINE_ASM:
+      if (!asm_ok(stmt->inline_asm_stmt.code))
+        walk->fail = 1;
+      break;
+    }
+    
+    if (walk->func && walk->size > walk->max_size)
+      walk->fail = 1;
+    
+    stmt = stmt->next;
+  }
+}
+
+static void walk_expr(walk_t *walk, expr_t *expr)
+{
+  while (expr && !walk->fail) {
+    walk->size++;
+    
+    switch (expr->texpr) {
+    case EXPR_ADDR:
+    case EXPR_LOAD:
+      walk_expr(walk, expr->addr.base);
+      break;
+    case EXPR_BINOP:
+      walk_expr(walk, expr->binop.lhs);
+      walk_expr(walk, expr->binop.rhs);
+      break;
+    case EXPR_CAST:
+      walk_expr(walk, expr->unary.base);
+      break;
+    case EXPR_CALL:
+      if (expr->post.base->func.func == walk->func)
+        walk->fail = 1;
+      else if (!walk->func && inline_ok(expr->post.base->func.func, walk->max_size))
+        walk->found = 1;
+      
+      for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next)
+        walk_expr(walk, arg->arg.base);
+      break;
+    default:
+      break;
+    }
+    
+    expr = expr->next;
+  }
+}
+
+// anything that jumps or touches the frame or call stack is left alone,
+// bare LBP gets relocated by gen_asm
+static int asm_ok(char *code)
+{
+  int word, kind;
+  
+  while ((kind = asm_next(&code, &word)) != ASM_END) {
+    if (kind != ASM_OP)
+      continue;
+    
+    switch (word) {
+    case ENTER:
+    case LEAVE:
+    case CALL:
+    case RET:
+    case JMP:
+    case JE:
+    case JNE:
+    case JL:
+    case JG:
+    case JLE:
+    case JGE:
+    case CJE:
+    case CJNE:
+    case CJL:
+    case CJG:
+    case CJLE:
+    case CJGE:
+      return 0;
+    default:
+      break;
+    }
+  }
+  
+  return 1;
+}
@@ -0,0 +1,838 @@
+#include "ir.h"
+
+#include "gen.h"
+#include "../common/error.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// ast to ssa
+//
+// built in one pass the way braun et al. do it: a block remembers the
+// value each variable was last given in it, and reading a variable it
+// has not seen asks its predecessors, through a phi when there is more
+// than one. blocks whose predecessors are not all known yet (loop heads)
+// get empty phis that are filled in when the block is sealed. phis that
+// turn out to merge one value are replaced by it. statements after a
+// return go into a block nothing jumps to, which opt drops.
+//
+
+static ir_func_t *ir;
+static ir_block_t *cur;
+
+static ir_t *build_expr(expr_t *expr);
+static void build_stmt(stmt_t *stmt);
+static void build_cond(expr_t *expr, ir_block_t *yes, ir_block_t *no);
+static ir_t *read_var(int var, ir_block_t *block);
+
+static void *grow(void *buf, int *max, int num, int size)
+{
+  if (num < *max)
+    return buf;
+  
+  *max = *max ? *max * 2 : 4;
+  
+  return realloc(buf, *max * size);
+}
+
+ir_t *ir_get(ir_t *value)
+{
+  while (value && value->replace)
+    value = value->replace;
+  
+  return value;
+}
+
+int ir_has_value(ir_t *instr)
+{
+  switch (instr->op) {
+  case IR_CONST:
+  case IR_STR:
+  case IR_FRAME:
+  case IR_PHI:
+  case IR_LOAD:
+  case IR_LOAD8:
+    return 1;
+  case IR_ARG:
+    return instr->imm < 0;
+  case IR_CALL:
+    return instr->func->type.spec != NULL;
+  default:
+    return instr->op >= IR_ADD && instr->op <= IR_SX32_8;
+  }
+}
+
+// no side effects, so it can go if nothing uses it
+int ir_is_pure(ir_t *instr)
+{
+  switch (instr->op) {
+  case IR_CONST:
+  case IR_STR:
+  case IR_FRAME:
+  case IR_PHI:
+  case IR_LOAD:
+  case IR_LOAD8:
+    return 1;
+  default:
+    return instr->op >= IR_ADD && instr->op <= IR_SX32_8;
+  }
+}
+
+int ir_count(ir_func_t *ir)
+{
+  int count = 0;
+  
+  for (int i = 0; i < ir->num_block; i++)
+    count += ir->block[i]->num_instr;
+  
+  return count;
+}
+
+static ir_t *make_ir(ir_op_t op)
+{
+  ir_t *instr = calloc(1, sizeof(ir_t));
+  instr->op = op;
+  instr->id = ir->num_value++;
+  instr->home = -1;
+  return instr;
+}
+
+static void push_arg(ir_t *instr, ir_t *arg)
+{
+  instr->arg = grow(instr->arg, &instr->max_arg, instr->num_arg, sizeof(ir_t*));
+  instr->arg[instr->num_arg++] = arg;
+}
+
+static ir_t *append(ir_block_t *block, ir_t *instr)
+{
+  block->instr = grow(block->instr, &block->max_instr, block->num_instr, sizeof(ir_t*));
+  block->instr[block->num_instr++] = instr;
+  instr->block = block;
+  return instr;
+}
+
+// phis and undefined values go in front, nothing is emitted for them
+// where they stand
+static ir_t *prepend(ir_block_t *block, ir_t *instr)
+{
+  block->instr = grow(block->instr, &block->max_instr, block->num_instr, sizeof(ir_t*));
+  memmove(&block->instr[1], &block->instr[0], block->num_instr * sizeof(ir_t*));
+  block->instr[0] = instr;
+  block->num_instr++;
+  instr->block = block;
+  return instr;
+}
+
+static ir_t *op_imm(ir_op_t op, int imm)
+{
+  ir_t *instr = make_ir(op);
+  instr->imm = imm;
+  return append(cur, instr);
+}
+
+static ir_t *op_1(ir_op_t op, ir_t *a)
+{
+  ir_t *instr = make_ir(op);
+  push_arg(instr, a);
+  return append(cur, instr);
+}
+
+static ir_t *op_2(ir_op_t op, ir_t *a, ir_t *b)
+{
+  ir_t *instr = make_ir(op);
+  push_arg(instr, a);
+  push_arg(instr, b);
+  return append(cur, instr);
+}
+
+static ir_block_t *new_block()
+{
+  ir_block_t *block = calloc(1, sizeof(ir_block_t));
+  block->id = ir->num_block;
+  
+  ir->block = grow(ir->block, &ir->max_block, ir->num_block, sizeof(ir_block_t*));
+  ir->block[ir->num_block++] = block;
+  
+  return block;
+}
+
+void ir_add_pred(ir_block_t *block, ir_block_t *pred)
+{
+  block->pred = grow(block->pred, &block->max_pred, block->num_pred, sizeof(ir_block_t*));
+  block->pred[block->num_pred++] = pred;
+}
+
+// the phis in block lose their arg for pred along with it
+void ir_remove_pred(ir_block_t *block, ir_block_t *pred)
+{
+  int i = 0;
+  while (block->pred[i] != pred)
+    i++;
+  
+  block->num_pred--;
+  memmove(&block->pred[i], &block->pred[i + 1], (block->num_pred - i) * sizeof(ir_block_t*));
+  
+  for (int j = 0; j < block->num_instr; j++) {
+    ir_t *phi = block->instr[j];
+    if (phi->op != IR_PHI)
+      continue;
+    
+    phi->num_arg--;
+    memmove(&phi->arg[i], &phi->arg[i + 1], (phi->num_arg - i) * sizeof(ir_t*));
+  }
+}
+
+static int num_order;
+
+// succ[0] is visited last so it comes straight after its block, which
+// is where the ast generator puts the taken side of a branch too
+static void visit(ir_block_t **order, ir_block_t *block)
+{
+  block->live = 1;
+  
+  for (int i = block->num_succ - 1; i >= 0; i--) {
+    if (!block->succ[i]->live)
+      visit(order, block->succ[i]);
+  }
+  
+  order[num_order++] = block;
+}
+
+// sorts the blocks into reverse postorder, dropping any that can no
+// longer be reached
+void ir_order(ir_func_t *ir)
+{
+  ir_block_t **order = malloc(ir->num_block * sizeof(ir_block_t*));
+  
+  for (int i = 0; i < ir->num_block; i++)
+    ir->block[i]->live = 0;
+  
+  num_order = 0;
+  visit(order, ir->block[0]);
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    if (block->live)
+      continue;
+    
+    for (int j = 0; j < block->num_succ; j++) {
+      if (block->succ[j]->live)
+        ir_remove_pred(block->succ[j], block);
+    }
+  }
+  
+  for (int i = 0; i < num_order; i++) {
+    ir->block[i] = order[num_order - i - 1];
+    ir->block[i]->rpo = i;
+  }
+  
+  ir->num_block = num_order;
+  free(order);
+}
+
+// puts an empty block on the edge from block to its succ[i], taking
+// block's place among the preds so the phis there still line up
+void ir_split_edge(ir_func_t *func_ir, ir_block_t *block, int i)
+{
+  ir = func_ir;
+  
+  ir_block_t *succ = block->succ[i];
+  ir_block_t *mid = new_block();
+  
+  append(mid, make_ir(IR_JMP));
+  mid->succ[0] = succ;
+  mid->num_succ = 1;
+  mid->sealed = 1;
+  ir_add_pred(mid, block);
+  
+  for (int j = 0; j < succ->num_pred; j++) {
+    if (succ->pred[j] == block)
+      succ->pred[j] = mid;
+  }
+  
+  block->succ[i] = mid;
+}
+
+static void jmp(ir_block_t *target)
+{
+  append(cur, make_ir(IR_JMP));
+  cur->succ[0] = target;
+  cur->num_succ = 1;
+  ir_add_pred(target, cur);
+}
+
+static void br(ir_t *cond, ir_block_t *yes, ir_block_t *no)
+{
+  op_1(IR_BR, cond);
+  cur->succ[0] = yes;
+  cur->succ[1] = no;
+  cur->num_succ = 2;
+  ir_add_pred(yes, cur);
+  ir_add_pred(no, cur);
+}
+
+//
+// variables
+//
+
+static int find_var(int ofs)
+{
+  for (int i = 0; i < ir->num_var; i++) {
+    if (ir->var_ofs[i] == ofs)
+      return i;
+  }
+  
+  return -1;
+}
+
+// ofs is -1 for temporaries that live in no frame slot
+static int new_var(int ofs)
+{
+  ir->var_ofs = grow(ir->var_ofs, &ir->max_var, ir->num_var, sizeof(int));
+  ir->var_ofs[ir->num_var] = ofs;
+  return ir->num_var++;
+}
+
+static void write_var(int var, ir_block_t *block, ir_t *value)
+{
+  for (ir_def_t *def = block->def; def; def = def->next) {
+    if (def->var == var) {
+      def->value = value;
+      return;
+    }
+  }
+  
+  ir_def_t *def = malloc(sizeof(ir_def_t));
+  def->var = var;
+  def->value = value;
+  def->next = block->def;
+  block->def = def;
+}
+
+static ir_t *undef()
+{
+  ir_t *instr = make_ir(IR_CONST);
+  return prepend(ir->block[0], instr);
+}
+
+static ir_t *remove_trivial_phi(ir_t *phi)
+{
+  ir_t *same = NULL;
+  
+  for (int i = 0; i < phi->num_arg; i++) {
+    ir_t *arg = ir_get(phi->arg[i]);
+    
+    if (arg == same || arg == phi)
+      continue;
+    
+    if (same)
+      return phi;
+    
+    same = arg;
+  }
+  
+  if (!same)
+    same = undef();
+  
+  phi->replace = same;
+  
+  return same;
+}
+
+static ir_t *add_phi_args(int var, ir_t *phi)
+{
+  ir_block_t *block = phi->block;
+  
+  for (int i = 0; i < block->num_pred; i++)
+    push_arg(phi, read_var(var, block->pred[i]));
+  
+  return remove_trivial_phi(phi);
+}
+
+static ir_t *new_phi(int var, ir_block_t *block)
+{
+  ir_t *phi = make_ir(IR_PHI);
+  phi->var = var;
+  return prepend(block, phi);
+}
+
+static ir_t *read_var(int var, ir_block_t *block)
+{
+  for (ir_def_t *def = block->def; def; def = def->next) {
+    if (def->var == var)
+      return ir_get(def->value);
+  }
+  
+  ir_t *value;
+  
+  if (!block->sealed) {
+    value = new_phi(var, block);
+    
+    ir_def_t *def = malloc(sizeof(ir_def_t));
+    def->var = var;
+    def->value = value;
+    def->next = block->incomplete;
+    block->incomplete = def;
+  } else if (block->num_pred == 0) {
+    value = undef();
+  } else if (block->num_pred == 1) {
+    value = read_var(var, block->pred[0]);
+  } else {
+    // written first so a loop back to here finds the phi and stops
+    ir_t *phi = new_phi(var, block);
+    write_var(var, block, phi);
+    value = add_phi_args(var, phi);
+  }
+  
+  write_var(var, block, value);
+  
+  return ir_get(value);
+}
+
+static void seal(ir_block_t *block)
+{
+  for (ir_def_t *def = block->incomplete; def; def = def->next)
+    add_phi_args(def->var, def->value);
+  
+  block->incomplete = NULL;
+  block->sealed = 1;
+}
+
+//
+// what gets promoted
+//
+// the locals slot.c found a frame slot for, which are exactly the ones
+// nothing can reach through memory
+//
+
+static int has_asm(stmt_t *stmt)
+{
+  for (; stmt; stmt = stmt->next) {
+    switch (stmt->tstmt) {
+    case STMT_IF:
+      for (stmt_t *next_if = stmt; next_if; next_if = next_if->if_stmt.next_if) {
+        if (has_asm(next_if->if_stmt.body) || has_asm(next_if->if_stmt.else_body))
+          return 1;
+      }
+      break;
+    case STMT_WHILE:
+      if (has_asm(stmt->while_stmt.body))
+        return 1;
+      break;
+    case STMT_INLINE_ASM:
+      return 1;
+    default:
+      break;
+    }
+  }
+  
+  return 0;
+}
+
+//
+// expressions
+//
+
+static int local_var(expr_t *expr)
+{
+  if (expr->addr.taddr != ADDR_LOCAL || expr->addr.base->texpr != EXPR_CONST)
+    return -1;
+  
+  return find_var(expr->addr.base->num);
+}
+
+// built as base + ofs + index * scale, see fold_split, which lowers to the
+// base followed by a single ldo or ldx
+static ir_t *build_addr(expr_t *expr)
+{
+  expr_t *index;
+  int scale, ofs;
+  expr_t *base = fold_split(expr->addr.base, &index, &scale, &ofs);
+  
+  ir_t *addr;
+  if (expr->addr.taddr == ADDR_LOCAL) {
+    addr = op_imm(IR_FRAME, ofs);
+    if (base)
+      addr = op_2(IR_ADD, addr, build_expr(base));
+  } else if (base) {
+    addr = build_expr(base);
+    if (ofs)
+      addr = op_2(IR_ADD, addr, op_imm(IR_CONST, ofs));
+  } else {
+    addr = op_imm(IR_CONST, ofs);
+  }
+  
+  if (index)
+    addr = op_2(IR_ADD, addr, op_2(IR_MUL, build_expr(index), op_imm(IR_CONST, scale)));
+  
+  return addr;
+}
+
+static ir_t *build_load(expr_t *expr)
+{
+  int var = local_var(expr);
+  if (var >= 0)
+    return read_var(var, cur);
+  
+  switch (simplify_type_spec(&expr->type)) {
+  case TY_I8:
+    return op_1(IR_LOAD8, build_addr(expr));
+  case TY_I32:
+    return op_1(IR_LOAD, build_addr(expr));
+  default:
+    error("assign: unknown operator");
+    return NULL;
+  }
+}
+
+static ir_t *build_assign(expr_t *expr)
+{
+  ir_t *value = build_expr(expr->binop.rhs);
+  
+  int var = local_var(expr->binop.lhs);
+  if (var >= 0) {
+    write_var(var, cur, value);
+    return value;
+  }
+  
+  ir_t *addr = build_addr(expr->binop.lhs);
+  
+  switch (simplify_type_spec(&expr->type)) {
+  case TY_I8:
+    op_2(IR_STORE8, value, addr);
+    break;
+  case TY_I32:
+    op_2(IR_STORE, value, addr);
+    break;
+  default:
+    error("assign: unknown operator");
+    break;
+  }
+  
+  return value;
+}
+
+// && and || as values, 1 or 0 through a temporary
+static ir_t *build_logic(expr_t *expr)
+{
+  int var = new_var(-1);
+  
+  ir_block_t *yes = new_block();
+  ir_block_t *no = new_block();
+  ir_block_t *join = new_block();
+  
+  build_cond(expr, yes, no);
+  seal(yes);
+  seal(no);
+  
+  cur = yes;
+  write_var(var, cur, op_imm(IR_CONST, 1));
+  jmp(join);
+  
+  cur = no;
+  write_var(var, cur, op_imm(IR_CONST, 0));
+  jmp(join);
+  
+  seal(join);
+  cur = join;
+  
+  return read_var(var, cur);
+}
+
+static ir_op_t binop_op(operator_t op)
+{
+  switch (op) {
+  case OPERATOR_ADD:
+    return IR_ADD;
+  case OPERATOR_SUB:
+    return IR_SUB;
+  case OPERATOR_MUL:
+    return IR_MUL;
+  case OPERATOR_DIV:
+    return IR_DIV;
+  case OPERATOR_MOD:
+    return IR_MOD;
+  case OPERATOR_SHL:
+    return IR_SHL;
+  case OPERATOR_SHR:
+    return IR_SHR;
+  case OPERATOR_BIT_AND:
+    return IR_AND;
+  case OPERATOR_BIT_OR:
+    return IR_OR;
+  case OPERATOR_BIT_XOR:
+    return IR_XOR;
+  case OPERATOR_EQ:
+    return IR_SEQ;
+  case OPERATOR_NE:
+    return IR_SNE;
+  case OPERATOR_LSS:
+    return IR_SLT;
+  case OPERATOR_GTR:
+    return IR_SGT;
+  case OPERATOR_LE:
+    return IR_SLE;
+  case OPERATOR_GE:
+    return IR_SGE;
+  default:
+    error("unknown case: op: '%i'", op);
+    return IR_NOP;
+  }
+}
+
+static ir_t *build_binop(expr_t *expr)
+{
+  switch (expr->binop.op) {
+  case OPERATOR_ASSIGN:
+    return build_assign(expr);
+  case OPERATOR_OR:
+  case OPERATOR_AND:
+    return build_logic(expr);
+  default:
+    break;
+  }
+  
+  ir_t *lhs = build_expr(expr->binop.lhs);
+  ir_t *rhs = build_expr(expr->binop.rhs);
+  
+  return op_2(binop_op(expr->binop.op), lhs, rhs);
+}
+
+static ir_t *build_call(expr_t *expr)
+{
+  ir_t *call = make_ir(IR_CALL);
+  call->func = expr->post.base->func.func;
+  
+  for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next)
+    push_arg(call, build_expr(arg->arg.base));
+  
+  return append(cur, call);
+}
+
+static ir_t *build_cast(expr_t *expr)
+{
+  ir_t *base = build_expr(expr->unary.base);
+  
+  tspec_t type_a = simplify_type_spec(&expr->type);
+  tspec_t type_b = simplify_type_spec(&expr->unary.base->type);
+  
+  if (type_a == TY_I8 && type_b == TY_I32)
+    return op_1(IR_SX32_8, base);
+  
+  if (type_a == TY_I32 && type_b == TY_I8)
+    return op_1(IR_SX8_32, base);
+  
+  return base;
+}
+
+static ir_t *build_expr(expr_t *expr)
+{
+  ir_t *value = NULL;
+  
+  for (; expr; expr = expr->next) {
+    switch (expr->texpr) {
+    case EXPR_CONST:
+      value = op_imm(IR_CONST, expr->num);
+      break;
+    case EXPR_STR:
+      value = op_imm(IR_STR, expr->str_hash);
+      break;
+    case EXPR_ADDR:
+      value = build_addr(expr);
+      break;
+    case EXPR_LOAD:
+      value = build_load(expr);
+      break;
+    case EXPR_BINOP:
+      value = build_binop(expr);
+      break;
+    case EXPR_CALL:
+      value = build_call(expr);
+      break;
+    case EXPR_CAST:
+      value = build_cast(expr);
+      break;
+    default:
+      error("unknown case");
+      break;
+    }
+  }
+  
+  return value;
+}
+
+static void build_cond(expr_t *expr, ir_block_t *yes, ir_block_t *no)
+{
+  ir_block_t *mid;
+  
+  switch (expr->texpr) {
+  case EXPR_CONST:
+    jmp(expr->num ? yes : no);
+    return;
+  case EXPR_BINOP:
+    switch (expr->binop.op) {
+    case OPERATOR_AND:
+      mid = new_block();
+      build_cond(expr->binop.lhs, mid, no);
+      seal(mid);
+      cur = mid;
+      build_cond(expr->binop.rhs, yes, no);
+      return;
+    case OPERATOR_OR:
+      mid = new_block();
+      build_cond(expr->binop.lhs, yes, mid);
+      seal(mid);
+      cur = mid;
+      build_cond(expr->binop.rhs, yes, no);
+      return;
+    default:
+      break;
+    }
+    break;
+  default:
+    break;
+  }
+  
+  br(build_expr(expr), yes, no);
+}
+
+//
+// statements
+//
+
+static void build_if(stmt_t *stmt)
+{
+  ir_block_t *join = new_block();
+  
+  for (; stmt; stmt = stmt->if_stmt.next_if) {
+    ir_block_t *yes = new_block();
+    ir_block_t *no = new_block();
+    
+    build_cond(stmt->if_stmt.cond, yes, no);
+    seal(yes);
+    seal(no);
+    
+    cur = yes;
+    build_stmt(stmt->if_stmt.body);
+    jmp(join);
+    
+    cur = no;
+    build_stmt(stmt->if_stmt.else_body);
+  }
+  
+  jmp(join);
+  seal(join);
+  cur = join;
+}
+
+static void build_while(stmt_t *stmt)
+{
+  ir_block_t *head = new_block();
+  ir_block_t *body = new_block();
+  ir_block_t *exit = new_block();
+  
+  jmp(head);
+  cur = head;
+  
+  build_cond(stmt->while_stmt.cond, body, exit);
+  seal(body);
+  seal(exit);
+  
+  cur = body;
+  build_stmt(stmt->while_stmt.body);
+  jmp(head);
+  seal(head);
+  
+  cur = exit;
+}
+
+static void build_ret(stmt_t *stmt)
+{
+  ir_t *ret = make_ir(IR_RET);
+  
+  // a tail call is a ret that takes the call's args and jumps to it
+  ret->func = tail_callee(stmt);
+  
+  if (ret->func) {
+    for (expr_t *arg = stmt->ret_stmt.value->post.post; arg; arg = arg->arg.next)
+      push_arg(ret, build_expr(arg->arg.base));
+  } else if (stmt->ret_stmt.value) {
+    push_arg(ret, build_expr(stmt->ret_stmt.value));
+  }
+  
+  append(cur, ret);
+  
+  cur = new_block();
+  seal(cur);
+}
+
+static void build_stmt(stmt_t *stmt)
+{
+  for (; stmt; stmt = stmt->next) {
+    switch (stmt->tstmt) {
+    case STMT_EXPR:
+      build_expr(stmt->expr);
+      break;
+    case STMT_IF:
+      build_if(stmt);
+      break;
+    case STMT_WHILE:
+      build_while(stmt);
+      break;
+    case STMT_RETURN:
+      build_ret(stmt);
+      break;
+    default:
+      error("unknown case");
+      break;
+    }
+  }
+}
+
+// params arrive on the eval stack, last one on top, and are taken off in
+// that order
+static void build_params(param_t *param)
+{
+  if (!param)
+    return;
+  
+  build_params(param->next);
+  
+  int ofs = param->addr->addr.base->num;
+  int var = find_var(ofs);
+  
+  if (var >= 0) {
+    write_var(var, cur, op_imm(IR_ARG, -1));
+  } else {
+    op_imm(IR_ARG, ofs);
+  }
+}
+
+// NULL for the top level, and when the body has to go through the ast
+// generator instead
+ir_func_t *ir_build(func_t *func, stmt_t *body)
+{
+  if (has_asm(body))
+    return NULL;
+  
+  ir = calloc(1, sizeof(ir_func_t));
+  ir->func = func;
+  
+  if (func) {
+    for (decl_t *decl = func->locals; decl; decl = decl->next_in_scope) {
+      if (decl->slot >= 0)
+        new_var(decl->offset);
+    }
+  }
+  
+  cur = new_block();
+  seal(cur);
+  
+  if (func)
+    build_params(func->params);
+  
+  build_stmt(body);
+  append(cur, make_ir(IR_RET));
+  
+  return ir;
+}
@@ -0,0 +1,140 @@
+#ifndef IR_H
+#define IR_H
+
+#include "parse.h"
+#include "../vm/instr.h"
+
+typedef enum ir_op_e ir_op_t;
+typedef struct ir_s ir_t;
+typedef struct ir_block_s ir_block_t;
+typedef struct ir_func_s ir_func_t;
+typedef struct ir_def_s ir_def_t;
+
+//
+// ssa form of one function, or of the top level statements
+//
+// every instruction is also the value it defines. locals that are plain
+// i32 or pointer and never have their address taken become ssa variables,
+// everything else stays in memory behind FRAME addresses. asm is not
+// modelled: a body with asm in it is left to the ast generator.
+//
+
+enum ir_op_e {
+  IR_NOP,
+  IR_CONST,
+  IR_STR,
+  IR_FRAME,
+  IR_ARG,
+  IR_PHI,
+  IR_ADD,
+  IR_SUB,
+  IR_MUL,
+  IR_DIV,
+  IR_MOD,
+  IR_SHL,
+  IR_SHR,
+  IR_AND,
+  IR_OR,
+  IR_XOR,
+  IR_SEQ,
+  IR_SNE,
+  IR_SLT,
+  IR_SGT,
+  IR_SLE,
+  IR_SGE,
+  IR_SX8_32,
+  IR_SX32_8,
+  IR_LOAD,
+  IR_LOAD8,
+  IR_STORE,
+  IR_STORE8,
+  IR_CALL,
+  IR_JMP,
+  IR_BR,
+  IR_RET
+};
+
+struct ir_s {
+  ir_op_t op;
+  int id;
+  int imm;
+  func_t *func;
+  ir_t **arg;
+  int num_arg, max_arg;
+  ir_t *replace;
+  ir_block_t *block;
+  int var;
+  int uses;
+  ir_t *user;
+  int lat, lat_num;
+  int home;
+  int deferred;
+  int pos, start;
+  unsigned hoist;
+  ir_t **pre;
+  int num_pre, max_pre;
+};
+
+struct ir_def_s {
+  int var;
+  ir_t *value;
+  ir_def_t *next;
+};
+
+struct ir_block_s {
+  int id;
+  ir_t **instr;
+  int num_instr, max_instr;
+  ir_block_t **pred;
+  int num_pred, max_pred;
+  ir_block_t *succ[2];
+  int edge_live[2];
+  int num_succ;
+  ir_def_t *def;
+  ir_def_t *incomplete;
+  int sealed;
+  int live;
+  int rpo;
+  int depth;
+  ir_block_t *idom;
+};
+
+struct ir_func_s {
+  func_t *func;
+  ir_block_t **block;
+  int num_block, max_block;
+  int *var_ofs;
+  int num_var, max_var;
+  int num_value;
+};
+
+// ir.c
+ir_func_t *ir_build(func_t *func, stmt_t *body);
+ir_t *ir_get(ir_t *value);
+int ir_has_value(ir_t *instr);
+int ir_is_pure(ir_t *instr);
+int ir_count(ir_func_t *ir);
+void ir_add_pred(ir_block_t *block, ir_block_t *pred);
+void ir_remove_pred(ir_block_t *block, ir_block_t *pred);
+void ir_order(ir_func_t *ir);
+void ir_split_edge(ir_func_t *func_ir, ir_block_t *block, int i);
+
+// opt.c
+void ir_opt(ir_func_t *ir);
+
+// lower.c
+void ir_lower(ir_func_t *ir, hash_t ret_lbl);
+
+// gen.c, for ir.c and lower.c
+int emit(instr_t instr);
+void emit_label(instr_t instr, hash_t lbl);
+void set_label(hash_t name);
+hash_t tmp_label();
+void emit_str(hash_t str_hash);
+int frame_reserve(int size);
+int slot_reserve(int num);
+void emit_call(func_t *func);
+func_t *tail_callee(stmt_t *stmt);
+void emit_tail(func_t *func);
+
+#endif
@@ -558,7 +558,8 @@ char *filename()
     
     dir = realloc(dir, strlen(dir) + pos + 1);
     dir[len] = '/';
-    strcat(dir + 1, buf);
+    dir[len + 1] = '\0';
+    strcat(dir, buf);
     
     free(buf);
     
@@ -645,6 +646,9 @@ void lex_init()
 
 void lexify(FILE *file, char *fname)
 {
+  lex.files = realloc(lex.files, (lex.num_files + 1) * sizeof(char*));
+  lex.files[lex.num_files++] = strdup(fname);
+  
   ++lex.fid;
   lex.fid->file = file;
   lex.fid->fname = fname;
@@ -64,6 +64,9 @@ struct lex_s {
   file_t fstack[MAX_FSTACK];
   file_t *fid;
   
+  char **files;
+  int num_files;
+  
   token_t token;
   int     token_num;
   hash_t  token_hash;
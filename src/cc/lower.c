@@ -0,0 +1,963 @@
+#include "ir.h"
+
+#include "../common/error.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// ssa to stack code
+//
+// blocks go out in reverse postorder so most jumps fall through. a value
+// used once, later in its own block, is left on the eval stack for its
+// user when nothing in between gets in the way, which is how the ast
+// generator would have had it. every other value is kept in a place of
+// its own, its home, and loaded from there where it is used, except
+// constants, strings and frame addresses, which are just pushed again
+// wherever they are needed. a phi has a home too, and each pred copies
+// its arg in there before jumping. homes are vm frame slots when there
+// are enough left for all of them, and words in the memory frame if not.
+//
+
+static ir_func_t *ir;
+static hash_t *block_lbl;
+static int scratch;
+static int in_slots;
+static ir_t **copy;
+static int max_copy;
+
+static int is_remat(ir_t *value)
+{
+  return value->op == IR_CONST || value->op == IR_STR || value->op == IR_FRAME;
+}
+
+static int is_compare(ir_t *value)
+{
+  return value->op >= IR_SEQ && value->op <= IR_SGE;
+}
+
+static void count_uses()
+{
+  for (int i = 0; i < ir->num_block; i++) {
+    for (int j = 0; j < ir->block[i]->num_instr; j++)
+      ir->block[i]->instr[j]->uses = 0;
+  }
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    for (int j = 0; j < ir->block[i]->num_instr; j++) {
+      ir_t *instr = ir->block[i]->instr[j];
+      
+      for (int k = 0; k < instr->num_arg; k++) {
+        instr->arg[k]->uses++;
+        instr->arg[k]->user = instr;
+      }
+    }
+  }
+}
+
+// the args a jump copies into the phis of the block it goes to
+static int num_copy(ir_block_t *block)
+{
+  ir_block_t *succ = block->succ[0];
+  int num = 0;
+  
+  int k = 0;
+  while (succ->pred[k] != block)
+    k++;
+  
+  for (int i = 0; i < succ->num_instr; i++) {
+    if (succ->instr[i]->op != IR_PHI)
+      continue;
+    
+    if (num >= max_copy) {
+      max_copy = max_copy * 2 + 4;
+      copy = realloc(copy, max_copy * sizeof(ir_t*));
+    }
+    
+    copy[num++] = succ->instr[i]->arg[k];
+  }
+  
+  return num;
+}
+
+// what instr takes off the stack. a jump takes the args of the phis it
+// copies into, and a phi takes nothing: its args belong to the blocks it
+// comes from, and are left on the stack for their jumps
+static ir_t **arg_list(ir_t *instr, int *num_arg)
+{
+  if (instr->op == IR_JMP) {
+    *num_arg = num_copy(instr->block);
+    return copy;
+  }
+  
+  if (instr->op == IR_PHI) {
+    *num_arg = 0;
+    return NULL;
+  }
+  
+  *num_arg = instr->num_arg;
+  return instr->arg;
+}
+
+static int can_hoist(ir_t *value, ir_t *at)
+{
+  if (is_remat(value) || value->op == IR_PHI || value->block != at->block)
+    return 1;
+  
+  return value->pos < at->pos;
+}
+
+// puts values in front of whatever at already loads first
+static void add_pre(ir_t *at, ir_t **value, int num)
+{
+  if (at->num_pre + num > at->max_pre) {
+    at->max_pre = at->num_pre + num + 4;
+    at->pre = realloc(at->pre, at->max_pre * sizeof(ir_t*));
+  }
+  
+  memmove(&at->pre[num], &at->pre[0], at->num_pre * sizeof(ir_t*));
+  memcpy(&at->pre[0], value, num * sizeof(ir_t*));
+  at->num_pre += num;
+}
+
+// an arg that comes before a deferred one has to be under it on the
+// stack, so it is loaded where the code for the deferred one starts
+static int find_hoists(ir_block_t *block, ir_t *instr)
+{
+  int num_arg;
+  ir_t **arg = arg_list(instr, &num_arg);
+  
+  instr->start = instr->pos;
+  
+  // copies can go in any order, see lower_jmp
+  if (instr->op == IR_JMP)
+    return 1;
+  
+  for (int i = 0; i < num_arg; i++) {
+    if (arg[i]->deferred && arg[i]->start < instr->start)
+      instr->start = arg[i]->start;
+  }
+  
+  int first = 0;
+  
+  for (int i = 0; i < num_arg; i++) {
+    if (!arg[i]->deferred)
+      continue;
+    
+    if (i > first) {
+      ir_t *at = block->instr[arg[i]->start];
+      
+      for (int j = first; j < i; j++) {
+        if (j >= 32 || !can_hoist(arg[j], at))
+          return 0;
+        
+        instr->hoist |= 1u << j;
+      }
+      
+      add_pre(at, &arg[first], i - first);
+    }
+    
+    first = i + 1;
+  }
+  
+  return 1;
+}
+
+// walks the block keeping track of what would be on the eval stack. a
+// user has to find its deferred and hoisted args on top, in order and
+// ahead of any it loads itself. where it does not, they go to the frame
+// instead and the walk starts over.
+static int check_block(ir_block_t *block)
+{
+  int max_stack = 1;
+  
+  for (int i = 0; i < block->num_instr; i++) {
+    ir_t *instr = block->instr[i];
+    
+    instr->pos = i;
+    instr->num_pre = 0;
+    instr->hoist = 0;
+    
+    max_stack += 1 + instr->num_arg;
+  }
+  
+  if (block->num_succ == 1)
+    max_stack += num_copy(block);
+  
+  for (int i = 0; i < block->num_instr; i++) {
+    ir_t *instr = block->instr[i];
+    
+    if (!find_hoists(block, instr)) {
+      int num_arg;
+      ir_t **arg = arg_list(instr, &num_arg);
+      
+      for (int j = 0; j < num_arg; j++)
+        arg[j]->deferred = 0;
+      
+      return 0;
+    }
+  }
+  
+  ir_t **stack = malloc(max_stack * sizeof(ir_t*));
+  int top = 0;
+  int ok = 1;
+  
+  for (int i = 0; i < block->num_instr && ok; i++) {
+    ir_t *instr = block->instr[i];
+    
+    // the args a function starts with are under anything pushed since
+    if (instr->op == IR_ARG && top > 0) {
+      for (int j = 0; j < top; j++)
+        stack[j]->deferred = 0;
+      ok = 0;
+      break;
+    }
+    
+    for (int j = 0; j < instr->num_pre; j++)
+      stack[top++] = instr->pre[j];
+    
+    int num_arg;
+    ir_t **arg = arg_list(instr, &num_arg);
+    int num_ready = 0;
+    
+    if (instr->op == IR_JMP) {
+      for (int j = 0; j < num_arg; j++)
+        num_ready += arg[j]->deferred;
+      
+      for (int j = top - num_ready; j < top && ok; j++)
+        ok = j >= 0 && stack[j]->deferred && stack[j]->user->block == block->succ[0];
+      
+      if (!ok) {
+        for (int j = 0; j < num_arg; j++)
+          arg[j]->deferred = 0;
+      }
+      
+      break;
+    }
+    
+    for (int j = 0; j < num_arg; j++) {
+      if (!arg[j]->deferred && !((instr->hoist >> j) & 1))
+        continue;
+      
+      if (j != num_ready)
+        ok = 0;
+      
+      num_ready++;
+    }
+    
+    if (num_ready > top)
+      ok = 0;
+    
+    for (int j = 0; j < num_ready && ok; j++) {
+      if (stack[top - num_ready + j] != arg[j])
+        ok = 0;
+    }
+    
+    if (!ok) {
+      for (int j = 0; j < num_arg; j++)
+        arg[j]->deferred = 0;
+      break;
+    }
+    
+    top -= num_ready;
+    
+    if (instr->deferred)
+      stack[top++] = instr;
+  }
+  
+  free(stack);
+  
+  return ok;
+}
+
+static int is_commutative(ir_op_t op)
+{
+  return op == IR_ADD || op == IR_MUL || op == IR_AND || op == IR_OR || op == IR_XOR || op == IR_SEQ || op == IR_SNE;
+}
+
+// used by a later instr in block, or copied into a phi by its jump
+static int is_local_use(ir_t *user, ir_block_t *block)
+{
+  if (user->op != IR_PHI)
+    return user->block == block;
+  
+  return block->num_succ == 1 && block->succ[0] == user->block;
+}
+
+static void find_deferred()
+{
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    
+    for (int j = 0; j < block->num_instr; j++) {
+      ir_t *instr = block->instr[j];
+      
+      instr->deferred = ir_has_value(instr)
+        && instr->op != IR_PHI
+        && instr->op != IR_ARG
+        && instr->uses == 1
+        && is_local_use(instr->user, block);
+    }
+    
+    // x + y wants y on the stack first when only y can be left there
+    for (int j = 0; j < block->num_instr; j++) {
+      ir_t *instr = block->instr[j];
+      
+      if (is_commutative(instr->op) && !instr->arg[0]->deferred && instr->arg[1]->deferred && !is_remat(instr->arg[1])) {
+        ir_t *arg = instr->arg[0];
+        instr->arg[0] = instr->arg[1];
+        instr->arg[1] = arg;
+      }
+    }
+    
+    while (!check_block(block));
+  }
+}
+
+//
+// homes
+//
+// a phi and its args share a home whenever they are never live at the
+// same time, which takes the copy off that edge. that is the usual case
+// for a local assigned in a loop or on one side of an if.
+//
+
+static ir_t **homed;
+static int num_homed, num_word;
+static unsigned *live_in, *live_out, *clash;
+static int *parent;
+
+static int bit(unsigned *set, int i)
+{
+  return (set[i / 32] >> (i % 32)) & 1;
+}
+
+static void set_bit(unsigned *set, int i)
+{
+  set[i / 32] |= 1u << (i % 32);
+}
+
+static void clear_bit(unsigned *set, int i)
+{
+  set[i / 32] &= ~(1u << (i % 32));
+}
+
+static int has_home(ir_t *value)
+{
+  return value->home >= 0;
+}
+
+// the phi args the jump from block to succ reads, live at the end of block
+static void add_copies(unsigned *set, ir_block_t *block, ir_block_t *succ)
+{
+  int k = 0;
+  while (succ->pred[k] != block)
+    k++;
+  
+  for (int i = 0; i < succ->num_instr; i++) {
+    ir_t *phi = succ->instr[i];
+    
+    if (phi->op == IR_PHI && has_home(phi->arg[k]))
+      set_bit(set, phi->arg[k]->home);
+  }
+}
+
+// walks block backwards from what is live out of it, calling back with
+// each value defined and the set live right after it
+static void walk_block(ir_block_t *block, unsigned *live, void (*def)(ir_t *value, unsigned *live))
+{
+  memcpy(live, &live_out[block->rpo * num_word], num_word * sizeof(unsigned));
+  
+  for (int i = block->num_instr - 1; i >= 0; i--) {
+    ir_t *instr = block->instr[i];
+    
+    if (has_home(instr)) {
+      if (def)
+        def(instr, live);
+      clear_bit(live, instr->home);
+    }
+    
+    if (instr->op == IR_PHI)
+      continue;
+    
+    for (int j = 0; j < instr->num_arg; j++) {
+      if (has_home(instr->arg[j]))
+        set_bit(live, instr->arg[j]->home);
+    }
+  }
+}
+
+static void find_live()
+{
+  unsigned *live = malloc(num_word * sizeof(unsigned));
+  int changed = 1;
+  
+  while (changed) {
+    changed = 0;
+    
+    for (int i = ir->num_block - 1; i >= 0; i--) {
+      ir_block_t *block = ir->block[i];
+      unsigned *out = &live_out[i * num_word];
+      
+      for (int j = 0; j < block->num_succ; j++) {
+        ir_block_t *succ = block->succ[j];
+        
+        for (int k = 0; k < num_word; k++)
+          out[k] |= live_in[succ->rpo * num_word + k];
+        
+        add_copies(out, block, succ);
+      }
+      
+      walk_block(block, live, NULL);
+      
+      for (int k = 0; k < num_word; k++) {
+        if (live[k] != live_in[i * num_word + k]) {
+          live_in[i * num_word + k] = live[k];
+          changed = 1;
+        }
+      }
+    }
+  }
+  
+  free(live);
+}
+
+static void add_clash(ir_t *value, unsigned *live)
+{
+  for (int i = 0; i < num_homed; i++) {
+    if (i != value->home && bit(live, i)) {
+      set_bit(&clash[value->home * num_word], i);
+      set_bit(&clash[i * num_word], value->home);
+    }
+  }
+}
+
+// the phis of a block are all written at once on the way in
+static void phi_clash(ir_block_t *block)
+{
+  for (int i = 0; i < block->num_instr; i++) {
+    ir_t *a = block->instr[i];
+    if (a->op != IR_PHI || !has_home(a))
+      continue;
+    
+    for (int j = 0; j < block->num_instr; j++) {
+      ir_t *b = block->instr[j];
+      
+      if (b != a && b->op == IR_PHI && has_home(b))
+        set_bit(&clash[a->home * num_word], b->home);
+    }
+  }
+}
+
+static int find(int i)
+{
+  while (parent[i] != i)
+    i = parent[i] = parent[parent[i]];
+  
+  return i;
+}
+
+static int classes_clash(int a, int b)
+{
+  for (int i = 0; i < num_homed; i++) {
+    if (find(i) != a)
+      continue;
+    
+    for (int j = 0; j < num_homed; j++) {
+      if (find(j) == b && bit(&clash[i * num_word], j))
+        return 1;
+    }
+  }
+  
+  return 0;
+}
+
+static void coalesce()
+{
+  unsigned *live = malloc(num_word * sizeof(unsigned));
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    walk_block(ir->block[i], live, add_clash);
+    phi_clash(ir->block[i]);
+  }
+  
+  free(live);
+  
+  for (int i = 0; i < num_homed; i++)
+    parent[i] = i;
+  
+  for (int i = 0; i < num_homed; i++) {
+    ir_t *phi = homed[i];
+    if (phi->op != IR_PHI)
+      continue;
+    
+    for (int j = 0; j < phi->num_arg; j++) {
+      if (!has_home(phi->arg[j]))
+        continue;
+      
+      int a = find(phi->home);
+      int b = find(phi->arg[j]->home);
+      
+      if (a != b && !classes_clash(a, b))
+        parent[b] = a;
+    }
+  }
+}
+
+// homes are handed out past whatever the frame already has in use
+static void find_homes()
+{
+  num_homed = 0;
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    
+    for (int j = 0; j < block->num_instr; j++) {
+      ir_t *instr = block->instr[j];
+      
+      instr->home = -1;
+      
+      if (ir_has_value(instr) && !is_remat(instr) && !instr->deferred && instr->uses > 0)
+        instr->home = num_homed++;
+    }
+  }
+  
+  homed = malloc((num_homed + 1) * sizeof(ir_t*));
+  parent = malloc((num_homed + 1) * sizeof(int));
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    for (int j = 0; j < ir->block[i]->num_instr; j++) {
+      ir_t *instr = ir->block[i]->instr[j];
+      
+      if (has_home(instr))
+        homed[instr->home] = instr;
+    }
+  }
+  
+  num_word = num_homed / 32 + 1;
+  live_in = calloc(ir->num_block * num_word, sizeof(unsigned));
+  live_out = calloc(ir->num_block * num_word, sizeof(unsigned));
+  clash = calloc(num_homed * num_word + 1, sizeof(unsigned));
+  
+  find_live();
+  coalesce();
+  
+  int *slot = malloc((num_homed + 1) * sizeof(int));
+  int num_slot = 0;
+  
+  for (int i = 0; i < num_homed; i++) {
+    if (find(i) == i)
+      slot[i] = num_slot++;
+  }
+  
+  int base = slot_reserve(num_slot + 1);
+  int size = 1;
+  
+  in_slots = base >= 0;
+  if (!in_slots) {
+    base = frame_reserve((num_slot + 1) * 4);
+    size = 4;
+  }
+  
+  for (int i = 0; i < num_homed; i++)
+    homed[i]->home = base + slot[find(i)] * size;
+  
+  scratch = base + num_slot * size;
+  
+  free(slot);
+  free(homed);
+  free(parent);
+  free(live_in);
+  free(live_out);
+  free(clash);
+}
+
+static void emit_frame(int ofs)
+{
+  emit(LBP);
+  emit(PUSH);
+  emit(ofs);
+  emit(ADD);
+}
+
+static void load_home(int home)
+{
+  if (in_slots) {
+    emit(LDS);
+    emit(home);
+  } else {
+    emit_frame(home);
+    emit(LDR);
+  }
+}
+
+static void store_home(int home)
+{
+  if (in_slots) {
+    emit(STS);
+    emit(home);
+  } else {
+    emit_frame(home);
+    emit(STR);
+  }
+}
+
+static void load_value(ir_t *value)
+{
+  if (value->deferred)
+    return;
+  
+  switch (value->op) {
+  case IR_CONST:
+    emit(PUSH);
+    emit(value->imm);
+    break;
+  case IR_STR:
+    emit_str(value->imm);
+    break;
+  case IR_FRAME:
+    emit_frame(value->imm);
+    break;
+  default:
+    load_home(value->home);
+    break;
+  }
+}
+
+static void store_value(ir_t *value)
+{
+  if (!ir_has_value(value) || value->deferred)
+    return;
+  
+  store_home(value->home >= 0 ? value->home : scratch);
+}
+
+static void load_args(ir_t *instr)
+{
+  for (int i = 0; i < instr->num_arg; i++) {
+    if (!((instr->hoist >> i) & 1))
+      load_value(instr->arg[i]);
+  }
+}
+
+static instr_t lower_op(ir_op_t op)
+{
+  switch (op) {
+  case IR_ADD:
+    return ADD;
+  case IR_SUB:
+    return SUB;
+  case IR_MUL:
+    return MUL;
+  case IR_DIV:
+    return DIV;
+  case IR_MOD:
+    return MOD;
+  case IR_SHL:
+    return SHL;
+  case IR_SHR:
+    return SHR;
+  case IR_AND:
+    return AND;
+  case IR_OR:
+    return OR;
+  case IR_XOR:
+    return XOR;
+  case IR_SEQ:
+    return SEQ;
+  case IR_SNE:
+    return SNE;
+  case IR_SLT:
+    return SLT;
+  case IR_SGT:
+    return SGT;
+  case IR_SLE:
+    return SLE;
+  case IR_SGE:
+    return SGE;
+  case IR_SX8_32:
+    return SX8_32;
+  case IR_SX32_8:
+    return SX32_8;
+  case IR_LOAD:
+    return LDR;
+  case IR_LOAD8:
+    return LDR8;
+  case IR_STORE:
+    return STR;
+  case IR_STORE8:
+    return STR8;
+  default:
+    error("unknown case: op: '%i'", op);
+    return PUSH;
+  }
+}
+
+static instr_t jump_op(ir_op_t op, int negate)
+{
+  switch (op) {
+  case IR_SEQ:
+    return negate ? CJNE : CJE;
+  case IR_SNE:
+    return negate ? CJE : CJNE;
+  case IR_SLT:
+    return negate ? CJGE : CJL;
+  case IR_SGT:
+    return negate ? CJLE : CJG;
+  case IR_SLE:
+    return negate ? CJG : CJLE;
+  default:
+    return negate ? CJL : CJGE;
+  }
+}
+
+// a compare straight before the branch on it becomes the jump itself
+static int is_fused(ir_t *instr)
+{
+  ir_block_t *block = instr->block;
+  ir_t *br = block->instr[block->num_instr - 1];
+  
+  return is_compare(instr)
+    && instr->deferred
+    && instr->user == br
+    && br->op == IR_BR
+    && block->num_instr >= 2
+    && block->instr[block->num_instr - 2] == instr;
+}
+
+static int is_next(ir_block_t *block, ir_block_t *target)
+{
+  return block->rpo + 1 < ir->num_block && ir->block[block->rpo + 1] == target;
+}
+
+static int by_pos(const void *a, const void *b)
+{
+  return (*(ir_t**) a)->pos - (*(ir_t**) b)->pos;
+}
+
+// the phis of succ are written as one: the deferred args are already on
+// the stack in the order they were worked out, the rest are loaded on
+// top, and then each phi is stored off the top in reverse. a phi that
+// shares the home of its arg needs nothing.
+static void lower_jmp(ir_t *instr)
+{
+  ir_block_t *block = instr->block;
+  ir_block_t *succ = block->succ[0];
+  
+  int num_arg;
+  ir_t **arg = arg_list(instr, &num_arg);
+  
+  ir_t **phi = malloc((num_arg + 1) * sizeof(ir_t*));
+  int num_phi = 0;
+  
+  for (int i = 0; i < succ->num_instr; i++) {
+    if (succ->instr[i]->op == IR_PHI)
+      phi[num_phi++] = succ->instr[i];
+  }
+  
+  ir_t **order = malloc((num_arg + 1) * sizeof(ir_t*));
+  ir_t **dest = malloc((num_arg + 1) * sizeof(ir_t*));
+  int num_order = 0;
+  
+  for (int i = 0; i < num_arg; i++) {
+    if (arg[i]->deferred)
+      order[num_order++] = arg[i];
+  }
+  
+  qsort(order, num_order, sizeof(ir_t*), by_pos);
+  
+  for (int i = 0; i < num_order; i++) {
+    for (int j = 0; j < num_arg; j++) {
+      if (arg[j] == order[i])
+        dest[i] = phi[j];
+    }
+  }
+  
+  for (int i = 0; i < num_arg; i++) {
+    if (arg[i]->deferred || (phi[i]->home >= 0 && phi[i]->home == arg[i]->home))
+      continue;
+    
+    load_value(arg[i]);
+    order[num_order] = arg[i];
+    dest[num_order++] = phi[i];
+  }
+  
+  for (int i = num_order - 1; i >= 0; i--)
+    store_value(dest[i]);
+  
+  free(phi);
+  free(order);
+  free(dest);
+  
+  if (!is_next(block, succ))
+    emit_label(JMP, block_lbl[succ->rpo]);
+}
+
+static void lower_br(ir_t *instr)
+{
+  ir_block_t *block = instr->block;
+  ir_t *cond = instr->arg[0];
+  ir_block_t *yes = block->succ[0];
+  ir_block_t *no = block->succ[1];
+  
+  if (is_fused(cond)) {
+    if (is_next(block, yes)) {
+      emit_label(jump_op(cond->op, 1), block_lbl[no->rpo]);
+      return;
+    }
+    
+    emit_label(jump_op(cond->op, 0), block_lbl[yes->rpo]);
+  } else {
+    load_value(cond);
+    emit(PUSH);
+    emit(0);
+    
+    if (is_next(block, yes)) {
+      emit_label(CJE, block_lbl[no->rpo]);
+      return;
+    }
+    
+    emit_label(CJNE, block_lbl[yes->rpo]);
+  }
+  
+  if (!is_next(block, no))
+    emit_label(JMP, block_lbl[no->rpo]);
+}
+
+static void lower_instr(ir_t *instr, hash_t ret_lbl)
+{
+  for (int i = 0; i < instr->num_pre; i++)
+    load_value(instr->pre[i]);
+  
+  switch (instr->op) {
+  case IR_NOP:
+  case IR_PHI:
+    return;
+  case IR_CONST:
+  case IR_STR:
+  case IR_FRAME:
+    if (instr->deferred) {
+      instr->deferred = 0;
+      load_value(instr);
+      instr->deferred = 1;
+    }
+    return;
+  case IR_ARG:
+    if (instr->imm >= 0) {
+      emit_frame(instr->imm);
+      emit(STR);
+      return;
+    }
+    break;
+  case IR_CALL:
+    load_args(instr);
+    emit_call(instr->func);
+    break;
+  case IR_JMP:
+    lower_jmp(instr);
+    return;
+  case IR_BR:
+    lower_br(instr);
+    return;
+  case IR_RET:
+    load_args(instr);
+    if (instr->func)
+      emit_tail(instr->func);
+    else if (instr->block->rpo + 1 < ir->num_block)
+      emit_label(JMP, ret_lbl);
+    return;
+  default:
+    load_args(instr);
+    if (!is_fused(instr))
+      emit(lower_op(instr->op));
+    break;
+  }
+  
+  store_value(instr);
+}
+
+// an edge split for copies that all turned out to share a home goes
+// back to being a plain edge
+static void unsplit_edges()
+{
+  for (int i = 1; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    ir_block_t *succ = block->succ[0];
+    
+    if (block->num_instr != 1 || block->instr[0]->op != IR_JMP || block->num_pred != 1 || block->instr[0]->num_pre)
+      continue;
+    
+    int k = 0;
+    while (succ->pred[k] != block)
+      k++;
+    
+    int same = 1;
+    for (int j = 0; j < succ->num_instr; j++) {
+      ir_t *phi = succ->instr[j];
+      
+      if (phi->op == IR_PHI && (phi->home < 0 || phi->home != phi->arg[k]->home))
+        same = 0;
+    }
+    
+    if (!same)
+      continue;
+    
+    ir_block_t *pred = block->pred[0];
+    
+    for (int j = 0; j < pred->num_succ; j++) {
+      if (pred->succ[j] == block)
+        pred->succ[j] = succ;
+    }
+    
+    succ->pred[k] = pred;
+    block->num_pred = 0;
+    block->num_succ = 0;
+  }
+  
+  ir_order(ir);
+}
+
+// ret_lbl is where the caller leaves the function, straight after the
+// last block
+void ir_lower(ir_func_t *func_ir, hash_t ret_lbl)
+{
+  ir = func_ir;
+  
+  // a phi copy on an edge out of a branch would run on the other edge too
+  int num_block = ir->num_block;
+  for (int i = 0; i < num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    
+    for (int j = 0; j < block->num_succ && block->num_succ > 1; j++) {
+      ir_block_t *succ = block->succ[j];
+      
+      for (int k = 0; k < succ->num_instr; k++) {
+        if (succ->instr[k]->op == IR_PHI && succ->num_pred > 1) {
+          ir_split_edge(ir, block, j);
+          break;
+        }
+      }
+    }
+  }
+  
+  ir_order(ir);
+  count_uses();
+  find_deferred();
+  find_homes();
+  unsplit_edges();
+  
+  block_lbl = malloc(ir->num_block * sizeof(hash_t));
+  for (int i = 0; i < ir->num_block; i++)
+    block_lbl[i] = tmp_label();
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    
+    if (i > 0)
+      set_label(block_lbl[i]);
+    
+    for (int j = 0; j < block->num_instr; j++)
+      lower_instr(block->instr[j], ret_lbl);
+  }
+  
+  free(block_lbl);
+}
@@ -0,0 +1,779 @@
+#include "ir.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//
+// ssa optimisations
+//
+// run twice over, each round being:
+//
+//   sccp       values and branches that are constant on every path that
+//              can actually run, dropping the blocks that cannot
+//   simplify   x + 0, x * 1, x - x, phis of one value and the like
+//   gvn        an op whose twin dominates it becomes the twin
+//   dce        whatever nothing with a side effect depends on
+//   cfg        blocks that only jump are skipped, straight lines merged
+//
+// loads are never merged: any store or call between two of them could
+// change what they read. nor are constants, strings and frame addresses,
+// which are as cheap to push again as they would be to keep.
+//
+
+#define LAT_TOP 0
+#define LAT_CONST 1
+#define LAT_BOTTOM 2
+
+static int is_const(ir_t *value, int num)
+{
+  return value->op == IR_CONST && value->imm == num;
+}
+
+static void to_const(ir_t *instr, int num)
+{
+  instr->op = IR_CONST;
+  instr->imm = num;
+  instr->num_arg = 0;
+}
+
+// points every arg past replaced values and drops the replaced values
+static void resolve(ir_func_t *ir)
+{
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    int num_instr = 0;
+    
+    for (int j = 0; j < block->num_instr; j++) {
+      ir_t *instr = block->instr[j];
+      if (instr->replace || instr->op == IR_NOP)
+        continue;
+      
+      for (int k = 0; k < instr->num_arg; k++)
+        instr->arg[k] = ir_get(instr->arg[k]);
+      
+      block->instr[num_instr++] = instr;
+    }
+    
+    block->num_instr = num_instr;
+  }
+}
+
+static operator_t fold_op(ir_op_t op)
+{
+  switch (op) {
+  case IR_ADD:
+    return OPERATOR_ADD;
+  case IR_SUB:
+    return OPERATOR_SUB;
+  case IR_MUL:
+    return OPERATOR_MUL;
+  case IR_DIV:
+    return OPERATOR_DIV;
+  case IR_MOD:
+    return OPERATOR_MOD;
+  case IR_SHL:
+    return OPERATOR_SHL;
+  case IR_SHR:
+    return OPERATOR_SHR;
+  case IR_AND:
+    return OPERATOR_BIT_AND;
+  case IR_OR:
+    return OPERATOR_BIT_OR;
+  case IR_XOR:
+    return OPERATOR_BIT_XOR;
+  case IR_SEQ:
+    return OPERATOR_EQ;
+  case IR_SNE:
+    return OPERATOR_NE;
+  case IR_SLT:
+    return OPERATOR_LSS;
+  case IR_SGT:
+    return OPERATOR_GTR;
+  case IR_SLE:
+    return OPERATOR_LE;
+  default:
+    return OPERATOR_GE;
+  }
+}
+
+//
+// sparse conditional constant propagation
+//
+// every value starts out unknown (top) and only ever moves down, to one
+// constant and then to not constant (bottom). only blocks reached along
+// live edges are looked at, and a branch on a constant only makes one of
+// its edges live, so a phi ignores values from paths that never run.
+//
+
+static int lower_to(ir_t *instr, int lat, int num)
+{
+  if (lat == LAT_TOP || instr->lat == LAT_BOTTOM)
+    return 0;
+  
+  if (instr->lat == LAT_CONST) {
+    if (lat == LAT_CONST && num == instr->lat_num)
+      return 0;
+    
+    instr->lat = LAT_BOTTOM;
+    return 1;
+  }
+  
+  instr->lat = lat;
+  instr->lat_num = num;
+  
+  return 1;
+}
+
+static int edge_live(ir_block_t *pred, ir_block_t *block)
+{
+  for (int i = 0; i < pred->num_succ; i++) {
+    if (pred->succ[i] == block && pred->edge_live[i])
+      return 1;
+  }
+  
+  return 0;
+}
+
+static int mark_edge(ir_block_t *block, int i)
+{
+  if (block->edge_live[i])
+    return 0;
+  
+  block->edge_live[i] = 1;
+  block->succ[i]->live = 1;
+  
+  return 1;
+}
+
+static int sccp_instr(ir_t *instr)
+{
+  ir_block_t *block = instr->block;
+  int changed = 0;
+  int num;
+  
+  switch (instr->op) {
+  case IR_CONST:
+    return lower_to(instr, LAT_CONST, instr->imm);
+  case IR_PHI:
+    for (int i = 0; i < instr->num_arg; i++) {
+      if (edge_live(block->pred[i], block))
+        changed |= lower_to(instr, instr->arg[i]->lat, instr->arg[i]->lat_num);
+    }
+    return changed;
+  case IR_SX8_32:
+  case IR_SX32_8:
+    if (instr->arg[0]->lat == LAT_TOP)
+      return 0;
+    if (instr->arg[0]->lat == LAT_BOTTOM)
+      return lower_to(instr, LAT_BOTTOM, 0);
+    return lower_to(instr, LAT_CONST, fold_sx(instr->arg[0]->lat_num, instr->op == IR_SX32_8));
+  case IR_JMP:
+    return mark_edge(block, 0);
+  case IR_BR:
+    switch (instr->arg[0]->lat) {
+    case LAT_CONST:
+      return mark_edge(block, instr->arg[0]->lat_num ? 0 : 1);
+    case LAT_BOTTOM:
+      changed |= mark_edge(block, 0);
+      changed |= mark_edge(block, 1);
+      return changed;
+    default:
+      return 0;
+    }
+  default:
+    break;
+  }
+  
+  if (instr->op >= IR_ADD && instr->op <= IR_SGE) {
+    ir_t *lhs = instr->arg[0];
+    ir_t *rhs = instr->arg[1];
+    
+    if (lhs->lat == LAT_BOTTOM || rhs->lat == LAT_BOTTOM)
+      return lower_to(instr, LAT_BOTTOM, 0);
+    
+    if (lhs->lat == LAT_TOP || rhs->lat == LAT_TOP)
+      return 0;
+    
+    if (fold_const(fold_op(instr->op), lhs->lat_num, rhs->lat_num, &num))
+      return lower_to(instr, LAT_CONST, num);
+    
+    return lower_to(instr, LAT_BOTTOM, 0);
+  }
+  
+  if (ir_has_value(instr))
+    return lower_to(instr, LAT_BOTTOM, 0);
+  
+  return 0;
+}
+
+static void sccp(ir_func_t *ir)
+{
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    
+    block->live = 0;
+    block->edge_live[0] = 0;
+    block->edge_live[1] = 0;
+    
+    for (int j = 0; j < block->num_instr; j++)
+      block->instr[j]->lat = LAT_TOP;
+  }
+  
+  ir->block[0]->live = 1;
+  
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    
+    for (int i = 0; i < ir->num_block; i++) {
+      ir_block_t *block = ir->block[i];
+      if (!block->live)
+        continue;
+      
+      for (int j = 0; j < block->num_instr; j++)
+        changed |= sccp_instr(block->instr[j]);
+    }
+  }
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    if (!block->live)
+      continue;
+    
+    for (int j = 0; j < block->num_instr; j++) {
+      ir_t *instr = block->instr[j];
+      
+      if (instr->lat == LAT_CONST && instr->op != IR_CONST)
+        to_const(instr, instr->lat_num);
+      
+      if (instr->op == IR_BR && instr->arg[0]->lat == LAT_CONST) {
+        int taken = instr->arg[0]->lat_num ? 0 : 1;
+        
+        ir_remove_pred(block->succ[1 - taken], block);
+        block->succ[0] = block->succ[taken];
+        block->num_succ = 1;
+        
+        instr->op = IR_JMP;
+        instr->num_arg = 0;
+      }
+    }
+  }
+  
+  ir_order(ir);
+}
+
+//
+// simplify
+//
+
+static ir_t *simplify_instr(ir_t *instr)
+{
+  if (instr->op == IR_PHI) {
+    ir_t *same = NULL;
+    
+    for (int i = 0; i < instr->num_arg; i++) {
+      ir_t *arg = ir_get(instr->arg[i]);
+      
+      if (arg == same || arg == instr)
+        continue;
+      
+      if (same)
+        return NULL;
+      
+      same = arg;
+    }
+    
+    return same;
+  }
+  
+  if (instr->num_arg != 2 || instr->op < IR_ADD || instr->op > IR_SGE)
+    return NULL;
+  
+  ir_t *lhs = ir_get(instr->arg[0]);
+  ir_t *rhs = ir_get(instr->arg[1]);
+  
+  switch (instr->op) {
+  case IR_ADD:
+    if (is_const(rhs, 0))
+      return lhs;
+    if (is_const(lhs, 0))
+      return rhs;
+    break;
+  case IR_SUB:
+    if (is_const(rhs, 0))
+      return lhs;
+    if (lhs == rhs)
+      to_const(instr, 0);
+    break;
+  case IR_MUL:
+    if (is_const(rhs, 1))
+      return lhs;
+    if (is_const(lhs, 1))
+      return rhs;
+    if (is_const(lhs, 0) || is_const(rhs, 0))
+      to_const(instr, 0);
+    break;
+  case IR_DIV:
+    if (is_const(rhs, 1))
+      return lhs;
+    break;
+  case IR_MOD:
+    if (is_const(rhs, 1))
+      to_const(instr, 0);
+    break;
+  case IR_SHL:
+  case IR_SHR:
+    if (is_const(rhs, 0))
+      return lhs;
+    if (is_const(lhs, 0))
+      to_const(instr, 0);
+    break;
+  case IR_AND:
+    if (is_const(rhs, -1))
+      return lhs;
+    if (lhs == rhs)
+      return lhs;
+    if (is_const(rhs, 0))
+      to_const(instr, 0);
+    break;
+  case IR_OR:
+    if (is_const(rhs, 0))
+      return lhs;
+    if (lhs == rhs)
+      return lhs;
+    if (is_const(rhs, -1))
+      to_const(instr, -1);
+    break;
+  case IR_XOR:
+    if (is_const(rhs, 0))
+      return lhs;
+    if (lhs == rhs)
+      to_const(instr, 0);
+    break;
+  case IR_SEQ:
+  case IR_SLE:
+  case IR_SGE:
+    if (lhs == rhs)
+      to_const(instr, 1);
+    break;
+  default:
+    if (lhs == rhs)
+      to_const(instr, 0);
+    break;
+  }
+  
+  return NULL;
+}
+
+static void simplify(ir_func_t *ir)
+{
+  int changed = 1;
+  
+  while (changed) {
+    changed = 0;
+    
+    for (int i = 0; i < ir->num_block; i++) {
+      ir_block_t *block = ir->block[i];
+      
+      for (int j = 0; j < block->num_instr; j++) {
+        ir_t *instr = block->instr[j];
+        if (instr->replace)
+          continue;
+        
+        ir_t *same = simplify_instr(instr);
+        if (same) {
+          instr->replace = same;
+          changed = 1;
+        }
+      }
+    }
+    
+    resolve(ir);
+  }
+}
+
+//
+// global value numbering
+//
+// dominators are found the cooper, harvey and kennedy way, over the
+// blocks in reverse postorder. an op that has a twin in a block that
+// dominates it, or earlier in its own block, is replaced by the twin.
+//
+
+static ir_block_t *intersect(ir_block_t *a, ir_block_t *b)
+{
+  while (a != b) {
+    while (a->rpo > b->rpo)
+      a = a->idom;
+    while (b->rpo > a->rpo)
+      b = b->idom;
+  }
+  
+  return a;
+}
+
+static void find_idom(ir_func_t *ir)
+{
+  for (int i = 0; i < ir->num_block; i++)
+    ir->block[i]->idom = NULL;
+  
+  ir->block[0]->idom = ir->block[0];
+  
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    
+    for (int i = 1; i < ir->num_block; i++) {
+      ir_block_t *block = ir->block[i];
+      ir_block_t *idom = NULL;
+      
+      for (int j = 0; j < block->num_pred; j++) {
+        ir_block_t *pred = block->pred[j];
+        if (!pred->idom)
+          continue;
+        
+        idom = idom ? intersect(pred, idom) : pred;
+      }
+      
+      if (block->idom != idom) {
+        block->idom = idom;
+        changed = 1;
+      }
+    }
+  }
+}
+
+static int dominates(ir_block_t *a, ir_block_t *b)
+{
+  while (b != a) {
+    if (b == b->idom)
+      return 0;
+    
+    b = b->idom;
+  }
+  
+  return 1;
+}
+
+static int is_commutative(ir_op_t op)
+{
+  return op == IR_ADD || op == IR_MUL || op == IR_AND || op == IR_OR || op == IR_XOR || op == IR_SEQ || op == IR_SNE;
+}
+
+static int same_value(ir_t *a, ir_t *b);
+
+// constants, strings and frame addresses are told apart by what they are
+// and ops by what they work out, whether they were merged or not
+static int same_arg(ir_t *a, ir_t *b)
+{
+  a = ir_get(a);
+  b = ir_get(b);
+  
+  if (a == b)
+    return 1;
+  
+  if (a->op >= IR_ADD && a->op <= IR_SX32_8)
+    return same_value(a, b);
+  
+  if (a->op != b->op || a->imm != b->imm)
+    return 0;
+  
+  return a->op == IR_CONST || a->op == IR_STR || a->op == IR_FRAME;
+}
+
+static int same_value(ir_t *a, ir_t *b)
+{
+  if (a->op != b->op || a->num_arg != b->num_arg)
+    return 0;
+  
+  if (a->num_arg == 1)
+    return same_arg(a->arg[0], b->arg[0]);
+  
+  if (same_arg(a->arg[0], b->arg[0]) && same_arg(a->arg[1], b->arg[1]))
+    return 1;
+  
+  return is_commutative(a->op) && same_arg(a->arg[0], b->arg[1]) && same_arg(a->arg[1], b->arg[0]);
+}
+
+static void mark_loop(ir_block_t *block, ir_block_t *head, int *seen)
+{
+  if (seen[block->rpo])
+    return;
+  
+  seen[block->rpo] = 1;
+  block->depth++;
+  
+  if (block == head)
+    return;
+  
+  for (int i = 0; i < block->num_pred; i++)
+    mark_loop(block->pred[i], head, seen);
+}
+
+// how many loops each block is in, counting a jump back to a block that
+// dominates it as a loop
+static void find_depth(ir_func_t *ir)
+{
+  int *seen = malloc(ir->num_block * sizeof(int));
+  
+  for (int i = 0; i < ir->num_block; i++)
+    ir->block[i]->depth = 0;
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    
+    for (int j = 0; j < block->num_succ; j++) {
+      if (dominates(block->succ[j], block)) {
+        memset(seen, 0, ir->num_block * sizeof(int));
+        mark_loop(block, block->succ[j], seen);
+      }
+    }
+  }
+  
+  free(seen);
+}
+
+// roughly the instructions it takes to work a value out again, capped. an
+// element address x + i * c costs just x and i, the rest goes into the
+// ldx that reads or writes through it
+static int cost(ir_t *value)
+{
+  if (value->op < IR_ADD || value->op > IR_SX32_8)
+    return 1;
+  
+  if (value->op == IR_ADD && value->arg[1]->op == IR_MUL && value->arg[1]->arg[1]->op == IR_CONST)
+    return cost(value->arg[0]) + cost(value->arg[1]->arg[0]);
+  
+  int sum = 1;
+  for (int i = 0; i < value->num_arg && sum < 8; i++)
+    sum += cost(value->arg[i]);
+  
+  return sum;
+}
+
+// a value kept for later costs a store where it is made and a load where
+// it is used. it is only kept when working it out again would take more
+// than that, and for a use that runs at least as often as it is made.
+static void gvn(ir_func_t *ir)
+{
+  ir_t **seen = malloc(ir->num_value * sizeof(ir_t*));
+  int num_seen = 0;
+  
+  find_idom(ir);
+  find_depth(ir);
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    ir_block_t *block = ir->block[i];
+    
+    for (int j = 0; j < block->num_instr; j++) {
+      ir_t *instr = block->instr[j];
+      
+      if (instr->op < IR_ADD || instr->op > IR_SX32_8 || cost(instr) < 4)
+        continue;
+      
+      int k;
+      for (k = 0; k < num_seen; k++) {
+        if (same_value(seen[k], instr) && dominates(seen[k]->block, block) && block->depth >= seen[k]->block->depth)
+          break;
+      }
+      
+      if (k < num_seen)
+        instr->replace = seen[k];
+      else
+        seen[num_seen++] = instr;
+    }
+  }
+  
+  free(seen);
+  resolve(ir);
+}
+
+//
+// dead code elimination
+//
+
+static void mark(ir_t *instr)
+{
+  if (instr->uses)
+    return;
+  
+  instr->uses = 1;
+  
+  for (int i = 0; i < instr->num_arg; i++)
+    mark(instr->arg[i]);
+}
+
+static void dce(ir_func_t *ir)
+{
+  for (int i = 0; i < ir->num_block; i++) {
+    for (int j = 0; j < ir->block[i]->num_instr; j++)
+      ir->block[i]->instr[j]->uses = 0;
+  }
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    for (int j = 0; j < ir->block[i]->num_instr; j++) {
+      ir_t *instr = ir->block[i]->instr[j];
+      if (!ir_is_pure(instr))
+        mark(instr);
+    }
+  }
+  
+  for (int i = 0; i < ir->num_block; i++) {
+    for (int j = 0; j < ir->block[i]->num_instr; j++) {
+      ir_t *instr = ir->block[i]->instr[j];
+      if (!instr->uses)
+        instr->op = IR_NOP;
+    }
+  }
+  
+  resolve(ir);
+}
+
+//
+// control flow
+//
+
+static int pred_index(ir_block_t *block, ir_block_t *pred)
+{
+  for (int i = 0; i < block->num_pred; i++) {
+    if (block->pred[i] == pred)
+      return i;
+  }
+  
+  return -1;
+}
+
+// preds of a block that only jumps to target go straight to target
+// instead, as long as none of them would then reach it twice
+static int skip_block(ir_block_t *block)
+{
+  ir_block_t *target = block->succ[0];
+  
+  if (block->num_instr != 1 || block->num_succ != 1 || target == block || block->num_pred == 0)
+    return 0;
+  
+  for (int i = 0; i < block->num_pred; i++) {
+    ir_block_t *pred = block->pred[i];
+    
+    if (pred_index(target, pred) >= 0)
+      return 0;
+    
+    if (pred->num_succ == 2 && pred->succ[0] == pred->succ[1])
+      return 0;
+  }
+  
+  int k = pred_index(target, block);
+  
+  for (int i = 0; i < block->num_pred; i++) {
+    ir_block_t *pred = block->pred[i];
+    
+    for (int j = 0; j < pred->num_succ; j++) {
+      if (pred->succ[j] == block)
+        pred->succ[j] = target;
+    }
+    
+    if (i == 0) {
+      target->pred[k] = pred;
+      continue;
+    }
+    
+    ir_add_pred(target, pred);
+    
+    for (int j = 0; j < target->num_instr; j++) {
+      ir_t *phi = target->instr[j];
+      if (phi->op != IR_PHI)
+        continue;
+      
+      ir_t *arg = phi->arg[k];
+      
+      phi->arg = realloc(phi->arg, (phi->num_arg + 1) * sizeof(ir_t*));
+      phi->arg[phi->num_arg++] = arg;
+      phi->max_arg = phi->num_arg;
+    }
+  }
+  
+  block->num_pred = 0;
+  block->num_succ = 0;
+  
+  return 1;
+}
+
+// a block whose only pred only goes to it is appended to that pred
+static int merge_block(ir_block_t *block)
+{
+  if (block->num_pred != 1)
+    return 0;
+  
+  ir_block_t *pred = block->pred[0];
+  if (pred == block || pred->num_succ != 1)
+    return 0;
+  
+  pred->num_instr--;
+  
+  for (int i = 0; i < block->num_instr; i++) {
+    ir_t *instr = block->instr[i];
+    
+    if (instr->op == IR_PHI) {
+      instr->replace = ir_get(instr->arg[0]);
+      continue;
+    }
+    
+    if (pred->num_instr >= pred->max_instr) {
+      pred->max_instr = pred->max_instr * 2 + 4;
+      pred->instr = realloc(pred->instr, pred->max_instr * sizeof(ir_t*));
+    }
+    
+    pred->instr[pred->num_instr++] = instr;
+    instr->block = pred;
+  }
+  
+  pred->num_succ = block->num_succ;
+  
+  for (int i = 0; i < block->num_succ; i++) {
+    ir_block_t *succ = block->succ[i];
+    
+    pred->succ[i] = succ;
+    succ->pred[pred_index(succ, block)] = pred;
+  }
+  
+  block->num_pred = 0;
+  block->num_succ = 0;
+  block->num_instr = 0;
+  
+  return 1;
+}
+
+static void cfg(ir_func_t *ir)
+{
+  int changed = 1;
+  
+  while (changed) {
+    changed = 0;
+    
+    for (int i = 1; i < ir->num_block; i++) {
+      if (ir->block[i]->num_pred == 0)
+        continue;
+      
+      changed |= merge_block(ir->block[i]) || skip_block(ir->block[i]);
+    }
+    
+    ir_order(ir);
+    resolve(ir);
+  }
+}
+
+void ir_opt(ir_func_t *ir)
+{
+  resolve(ir);
+  ir_order(ir);
+  
+  for (int i = 0; i < 2; i++) {
+    sccp(ir);
+    resolve(ir);
+    simplify(ir);
+    gvn(ir);
+    simplify(ir);
+    dce(ir);
+    cfg(ir);
+  }
+}
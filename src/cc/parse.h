@@ -52,7 +52,12 @@ enum operator_e {
   OPERATOR_GTR,
   OPERATOR_LE,
   OPERATOR_GE,
-  OPERATOR_MOD
+  OPERATOR_MOD,
+  OPERATOR_SHL,
+  OPERATOR_SHR,
+  OPERATOR_BIT_AND,
+  OPERATOR_BIT_OR,
+  OPERATOR_BIT_XOR
 };
 
 enum texpr_e {
@@ -105,6 +110,8 @@ struct decl_s {
   int offset;
   expr_t *init;
   decl_t *next;
+  decl_t *next_in_scope;
+  int slot;
 };
 
 struct param_s {
@@ -118,7 +125,9 @@ struct func_s {
   type_t type;
   stmt_t *body;
   param_t *params;
+  decl_t *locals;
   int local_size;
+  int num_slot;
   func_t *next;
 };
 
@@ -126,6 +135,7 @@ struct scope_s {
   map_t map;
   taddr_t taddr;
   int size;
+  decl_t *decls;
 };
 
 struct expr_s {
@@ -174,6 +184,7 @@ struct stmt_s {
     } while_stmt;
     struct {
       expr_t *value;
+      int tail;
     } ret_stmt;
     struct {
       expr_t *init_value;
@@ -194,5 +205,12 @@ struct unit_s {
 
 void parse_init();
 unit_t *translation_unit();
+void fold(unit_t *unit, int report);
+int fold_const(operator_t op, int lhs, int rhs, int *num);
+int fold_sx(int num, int to_i8);
+expr_t *fold_split(expr_t *addr, expr_t **index, int *scale, int *ofs);
+void reduce(unit_t *unit, int report);
+void assign_slots(unit_t *unit, int report);
+void find_tails(unit_t *unit, int report);
 
 #endif
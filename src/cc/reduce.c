@@ -0,0 +1,165 @@
+#include "p_local.h"
+
+#include "../common/magic.h"
+#include <stdio.h>
+
+//
+// strength reduction
+//
+// runs after fold, so a constant operand is already on the rhs:
+//
+//   x * 2^k            ->  x << k
+//   x / 2^k            ->  x >> k,        if x >= 0
+//   x % 2^k            ->  x & (2^k - 1), if x >= 0
+//
+// division truncates towards zero and an arithmetic shift rounds down, so
+// the last two only hold for an x that cannot be negative. with the sign
+// unknown the fixup costs more ops than the one div it saves in the stack
+// vm, so it is left as is and fuse makes it a divi or modi, which the jit
+// and the x86 backend turn into a shift or multiply of their own.
+//
+
+static int num_reduce;
+
+static void reduce_stmt(stmt_t *stmt);
+static void reduce_expr(expr_t *expr);
+static void reduce_binop(expr_t *expr);
+
+// a conservative check, anything that could overflow counts as signed
+static int is_nonneg(expr_t *expr)
+{
+  switch (expr->texpr) {
+  case EXPR_CONST:
+    return expr->num >= 0;
+  case EXPR_BINOP:
+    switch (expr->binop.op) {
+    case OPERATOR_OR:
+    case OPERATOR_AND:
+    case OPERATOR_EQ:
+    case OPERATOR_NE:
+    case OPERATOR_LSS:
+    case OPERATOR_GTR:
+    case OPERATOR_LE:
+    case OPERATOR_GE:
+      return 1;
+    case OPERATOR_BIT_AND:
+      return is_nonneg(expr->binop.lhs) || is_nonneg(expr->binop.rhs);
+    case OPERATOR_BIT_OR:
+    case OPERATOR_BIT_XOR:
+    case OPERATOR_DIV:
+      return is_nonneg(expr->binop.lhs) && is_nonneg(expr->binop.rhs);
+    case OPERATOR_SHR:
+    case OPERATOR_MOD:
+      return is_nonneg(expr->binop.lhs);
+    default:
+      return 0;
+    }
+  default:
+    return 0;
+  }
+}
+
+void reduce(unit_t *unit, int report)
+{
+  num_reduce = 0;
+  
+  reduce_stmt(unit->stmt);
+  
+  for (func_t *func = unit->func; func; func = func->next)
+    reduce_stmt(func->body);
+  
+  if (report)
+    fprintf(stderr, "reduce: %i operations strength reduced\n", num_reduce);
+}
+
+static void reduce_stmt(stmt_t *stmt)
+{
+  while (stmt) {
+    switch (stmt->tstmt) {
+    case STMT_EXPR:
+      reduce_expr(stmt->expr);
+      break;
+    case STMT_IF:
+      for (stmt_t *next_if = stmt; next_if; next_if = next_if->if_stmt.next_if) {
+        reduce_expr(next_if->if_stmt.cond);
+        reduce_stmt(next_if->if_stmt.body);
+        reduce_stmt(next_if->if_stmt.else_body);
+      }
+      break;
+    case STMT_WHILE:
+      reduce_expr(stmt->while_stmt.cond);
+      reduce_stmt(stmt->while_stmt.body);
+      break;
+    case STMT_RETURN:
+      reduce_expr(stmt->ret_stmt.value);
+      break;
+    default:
+      break;
+    }
+    
+    stmt = stmt->next;
+  }
+}
+
+// everything is rewritten in place, a load shared with a compound
+// assignment is reached twice but only ever looked at
+static void reduce_expr(expr_t *expr)
+{
+  for (; expr; expr = expr->next) {
+    switch (expr->texpr) {
+    case EXPR_ADDR:
+    case EXPR_LOAD:
+      reduce_expr(expr->addr.base);
+      break;
+    case EXPR_BINOP:
+      reduce_expr(expr->binop.lhs);
+      reduce_expr(expr->binop.rhs);
+      reduce_binop(expr);
+      break;
+    case EXPR_CAST:
+      reduce_expr(expr->unary.base);
+      break;
+    case EXPR_CALL:
+      for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next)
+        reduce_expr(arg->arg.base);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static void reduce_binop(expr_t *expr)
+{
+  expr_t *rhs = expr->binop.rhs;
+  
+  if (rhs->texpr != EXPR_CONST)
+    return;
+  
+  int k = log2_exact(rhs->num);
+  if (k <= 0 || k >= 31)
+    return;
+  
+  switch (expr->binop.op) {
+  case OPERATOR_MUL:
+    expr->binop.op = OPERATOR_SHL;
+    expr->binop.rhs = make_const(k);
+    break;
+  case OPERATOR_DIV:
+    if (!is_nonneg(expr->binop.lhs))
+      return;
+    expr->binop.op = OPERATOR_SHR;
+    expr->binop.rhs = make_const(k);
+    break;
+  case OPERATOR_MOD:
+    if (!is_nonneg(expr->binop.lhs))
+      return;
+    expr->binop.op = OPERATOR_BIT_AND;
+    expr->binop.rhs = make_const(rhs->num - 1);
+    break;
+  default:
+    return;
+  }
+  
+  num_reduce++;
+}
@@ -0,0 +1,131 @@
+#include "p_local.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// frame slots
+//
+// a local that is a plain i32 or pointer and never has its address taken
+// cannot be reached through memory, so it does not need to be there: it
+// gets a slot in the vm's frame instead, read and written by index with
+// lds and sts. slots are numbered from 0 per function, gen moves them up
+// past whatever is in use when the function is inlined and keeps any that
+// do not fit in memory. a body with asm keeps all of its locals in memory,
+// since asm can reach them through lbp.
+//
+
+static int *taken;
+static int num_taken, max_taken;
+
+static void note_taken(expr_t *expr)
+{
+  if (expr->addr.taddr != ADDR_LOCAL || expr->addr.base->texpr != EXPR_CONST)
+    return;
+  
+  if (num_taken == max_taken) {
+    max_taken = max_taken ? max_taken * 2 : 16;
+    taken = realloc(taken, max_taken * sizeof(int));
+  }
+  
+  taken[num_taken++] = expr->addr.base->num;
+}
+
+static void scan_expr(expr_t *expr)
+{
+  for (; expr; expr = expr->next) {
+    switch (expr->texpr) {
+    case EXPR_ADDR:
+      note_taken(expr);
+      scan_expr(expr->addr.base);
+      break;
+    case EXPR_LOAD:
+      scan_expr(expr->addr.base);
+      break;
+    case EXPR_BINOP:
+      scan_expr(expr->binop.lhs);
+      scan_expr(expr->binop.rhs);
+      break;
+    case EXPR_CAST:
+      scan_expr(expr->unary.base);
+      break;
+    case EXPR_CALL:
+      for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next)
+        scan_expr(arg->arg.base);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+// notes every local whose address is taken, fails on asm
+static int scan_stmt(stmt_t *stmt)
+{
+  for (; stmt; stmt = stmt->next) {
+    switch (stmt->tstmt) {
+    case STMT_EXPR:
+      scan_expr(stmt->expr);
+      break;
+    case STMT_IF:
+      for (stmt_t *next_if = stmt; next_if; next_if = next_if->if_stmt.next_if) {
+        scan_expr(next_if->if_stmt.cond);
+        if (!scan_stmt(next_if->if_stmt.body) || !scan_stmt(next_if->if_stmt.else_body))
+          return 0;
+      }
+      break;
+    case STMT_WHILE:
+      scan_expr(stmt->while_stmt.cond);
+      if (!scan_stmt(stmt->while_stmt.body))
+        return 0;
+      break;
+    case STMT_RETURN:
+      scan_expr(stmt->ret_stmt.value);
+      break;
+    case STMT_INLINE_ASM:
+      return 0;
+    }
+  }
+  
+  return 1;
+}
+
+static int is_slot(decl_t *decl)
+{
+  if (decl->type.dcltr) {
+    if (decl->type.dcltr->type != DCLTR_POINTER)
+      return 0;
+  } else if (decl->type.spec->tspec != TY_I32) {
+    return 0;
+  }
+  
+  for (int i = 0; i < num_taken; i++) {
+    if (taken[i] == decl->offset)
+      return 0;
+  }
+  
+  return 1;
+}
+
+void assign_slots(unit_t *unit, int report)
+{
+  int num_slot = 0;
+  
+  for (func_t *func = unit->func; func; func = func->next) {
+    num_taken = 0;
+    func->num_slot = 0;
+    
+    if (!scan_stmt(func->body))
+      continue;
+    
+    for (decl_t *decl = func->locals; decl; decl = decl->next_in_scope) {
+      if (is_slot(decl))
+        decl->slot = func->num_slot++;
+    }
+    
+    num_slot += func->num_slot;
+  }
+  
+  if (report)
+    fprintf(stderr, "slot: %i locals in frame slots\n", num_slot);
+}
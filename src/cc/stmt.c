@@ -207,6 +207,7 @@ stmt_t *make_ret_stmt(expr_t *value)
   stmt_t *stmt = make_stmt();
   stmt->tstmt = STMT_RETURN;
   stmt->ret_stmt.value = value;
+  stmt->ret_stmt.tail = 0;
   stmt->next = NULL;
   return stmt;
 }
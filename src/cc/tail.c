@@ -0,0 +1,124 @@
+#include "p_local.h"
+
+#include <stdio.h>
+
+//
+// tail calls
+//
+// a call whose value is returned straight away is the last thing its
+// function does, so the function can leave its frame before the call
+// instead of after it and the callee can return to the caller's caller.
+// gen does it with a leave and a jmp to the callee, or a jmp past the enter
+// for a call to itself, which keeps the frame and turns the recursion into
+// a loop. either way the frame is gone or reused by the time the callee
+// runs, so a function that takes the address of a local, or has asm that
+// could, gets none.
+//
+
+static int num_tail;
+
+static int frame_taken(expr_t *expr)
+{
+  for (; expr; expr = expr->next) {
+    switch (expr->texpr) {
+    case EXPR_ADDR:
+      if (expr->addr.taddr == ADDR_LOCAL)
+        return 1;
+      if (frame_taken(expr->addr.base))
+        return 1;
+      break;
+    case EXPR_LOAD:
+      if (frame_taken(expr->addr.base))
+        return 1;
+      break;
+    case EXPR_BINOP:
+      if (frame_taken(expr->binop.lhs) || frame_taken(expr->binop.rhs))
+        return 1;
+      break;
+    case EXPR_CAST:
+      if (frame_taken(expr->unary.base))
+        return 1;
+      break;
+    case EXPR_CALL:
+      for (expr_t *arg = expr->post.post; arg; arg = arg->arg.next) {
+        if (frame_taken(arg->arg.base))
+          return 1;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  
+  return 0;
+}
+
+static int frame_safe(stmt_t *stmt)
+{
+  for (; stmt; stmt = stmt->next) {
+    switch (stmt->tstmt) {
+    case STMT_EXPR:
+      if (frame_taken(stmt->expr))
+        return 0;
+      break;
+    case STMT_IF:
+      for (stmt_t *next_if = stmt; next_if; next_if = next_if->if_stmt.next_if) {
+        if (frame_taken(next_if->if_stmt.cond))
+          return 0;
+        if (!frame_safe(next_if->if_stmt.body) || !frame_safe(next_if->if_stmt.else_body))
+          return 0;
+      }
+      break;
+    case STMT_WHILE:
+      if (frame_taken(stmt->while_stmt.cond) || !frame_safe(stmt->while_stmt.body))
+        return 0;
+      break;
+    case STMT_RETURN:
+      if (frame_taken(stmt->ret_stmt.value))
+        return 0;
+      break;
+    case STMT_INLINE_ASM:
+      return 0;
+    }
+  }
+  
+  return 1;
+}
+
+static void mark_tails(stmt_t *stmt)
+{
+  for (; stmt; stmt = stmt->next) {
+    switch (stmt->tstmt) {
+    case STMT_IF:
+      for (stmt_t *next_if = stmt; next_if; next_if = next_if->if_stmt.next_if) {
+        mark_tails(next_if->if_stmt.body);
+        mark_tails(next_if->if_stmt.else_body);
+      }
+      break;
+    case STMT_WHILE:
+      mark_tails(stmt->while_stmt.body);
+      break;
+    case STMT_RETURN:
+      if (stmt->ret_stmt.value && stmt->ret_stmt.value->texpr == EXPR_CALL && !stmt->ret_stmt.value->next) {
+        stmt->ret_stmt.tail = 1;
+        num_tail++;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void find_tails(unit_t *unit, int report)
+{
+  num_tail = 0;
+  
+  for (func_t *func = unit->func; func; func = func->next) {
+    if (frame_safe(func->body))
+      mark_tails(func->body);
+  }
+  
+  if (report)
+    fprintf(stderr, "tail: %i calls in tail position\n", num_tail);
+}
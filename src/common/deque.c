@@ -0,0 +1,78 @@
+#include "deque.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+
+// the buffer does not grow, make_deque rounds size up to a power of two
+deque_t *make_deque(int size)
+{
+  long cap = 16;
+  while (cap < size)
+    cap *= 2;
+  
+  deque_t *deque = malloc(sizeof(deque_t));
+  deque->buf = malloc(cap * sizeof(atomic_int));
+  deque->mask = cap - 1;
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  
+  return deque;
+}
+
+void deque_push(deque_t *deque, int job)
+{
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  
+  if (b - t > deque->mask)
+    error("deque: full");
+  
+  atomic_store_explicit(&deque->buf[b & deque->mask], job, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
+
+int deque_pop(deque_t *deque, int *job)
+{
+  long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  
+  if (t > b) {
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+  }
+  
+  *job = atomic_load_explicit(&deque->buf[b & deque->mask], memory_order_relaxed);
+  
+  if (t < b)
+    return 1;
+  
+  // last job, race the thieves for it
+  int won = atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+    memory_order_seq_cst, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+  
+  return won;
+}
+
+int deque_steal(deque_t *deque, int *job)
+{
+  long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  
+  if (t >= b)
+    return 0;
+  
+  *job = atomic_load_explicit(&deque->buf[t & deque->mask], memory_order_relaxed);
+  
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+    memory_order_seq_cst, memory_order_relaxed))
+    return -1;
+  
+  return 1;
+}
@@ -0,0 +1,25 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdatomic.h>
+
+typedef struct deque_s deque_t;
+
+// chase-lev work stealing deque of job ids. the owner pushes and pops at
+// the bottom, any other thread steals from the top
+struct deque_s {
+  atomic_long top;
+  atomic_long bottom;
+  atomic_int *buf;
+  long mask;
+};
+
+deque_t *make_deque(int size);
+
+void deque_push(deque_t *deque, int job);
+int deque_pop(deque_t *deque, int *job);
+
+// 1 on success, 0 if empty, -1 if another thread got there first
+int deque_steal(deque_t *deque, int *job);
+
+#endif
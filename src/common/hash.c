@@ -25,9 +25,19 @@ void *str_alloc(char *value)
 {
   int len = strlen(value);
   
+  // strings are handed out by pointer so a full buffer is never moved, a
+  // fresh one is started instead
   if (str_ptr + len >= &str_buf[str_size]) {
-    printf("str_alloc(): ran out of memory\n");
-    exit(-1);
+    if (len >= str_size)
+      str_size = len + 1;
+    
+    str_buf = malloc(str_size);
+    if (!str_buf) {
+      printf("str_alloc(): ran out of memory\n");
+      exit(-1);
+    }
+    
+    str_ptr = str_buf;
   }
   
   char *ptr = str_ptr;
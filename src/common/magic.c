@@ -0,0 +1,26 @@
+#include "magic.h"
+
+// with l = ceil(log2 d) and shift = 31 + l, mul = 2^shift / d + 1 is too big
+// by less than 1 / d over the whole range of n, which never carries the
+// quotient past the next integer
+void div_magic(int d, unsigned *mul, int *shift)
+{
+  int l = 0;
+  while ((1UL << l) < (unsigned) d)
+    l++;
+  
+  *shift = 31 + l;
+  *mul = (1UL << *shift) / d + 1;
+}
+
+int log2_exact(unsigned d)
+{
+  if (d == 0 || (d & (d - 1)))
+    return -1;
+  
+  int k = 0;
+  while ((1U << k) != d)
+    k++;
+  
+  return k;
+}
@@ -0,0 +1,13 @@
+#ifndef MAGIC_H
+#define MAGIC_H
+
+// signed 32-bit division by a constant d > 1 that is not a power of two
+// as a multiply and a shift: for every n,
+//   n / d == ((long) n * mul >> shift) + (n < 0)
+// mul always fits in 32 bits unsigned and the product in 63
+void div_magic(int d, unsigned *mul, int *shift);
+
+// k where d == 1 << k, or -1
+int log2_exact(unsigned d);
+
+#endif
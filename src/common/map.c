@@ -36,24 +36,25 @@ entry_t *new_entry(int map, hash_t key, void *value)
 
 void map_flush(map_t map)
 {
-  entry_t *prev_entry = NULL;
   for (int i = 0; i < MAX_ENTRIES; i++) {
+    entry_t *prev_entry = NULL;
     entry_t *entry = entry_dict[i];
     
-    if (entry) {
-      while (entry) {
-        if (entry->map == map) {
-          if (prev_entry)
-            prev_entry->next = entry->next;
-          else
-            entry_dict[i] = entry->next;
-          
-          free(entry);
-        }
+    while (entry) {
+      entry_t *next = entry->next;
+      
+      if (entry->map == map) {
+        if (prev_entry)
+          prev_entry->next = next;
+        else
+          entry_dict[i] = next;
         
+        free(entry);
+      } else {
         prev_entry = entry;
-        entry = entry->next;
       }
+      
+      entry = next;
     }
   }
 }
@@ -1,13 +1,113 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <unistd.h>
+#include <getopt.h>
 
 #include "common/error.h"
 #include "cc/lex.h"
 #include "cc/gen.h"
 #include "cc/parse.h"
 #include "vm/vm.h"
+#include "vm/cache.h"
+
+// size with an optional k, m or g suffix, 0 if malformed
+static unsigned long parse_size(char *str)
+{
+  char *end;
+  unsigned long size = strtoul(str, &end, 0);
+  
+  switch (*end) {
+  case 'k':
+  case 'K':
+    size *= KB(1ul);
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    size *= MB(1ul);
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    size *= MB(1024ul);
+    end++;
+    break;
+  }
+  
+  if (*end)
+    return 0;
+  
+  return size;
+}
+
+// a whole number from min to max and nothing after it
+static int parse_int(char *str, int *a, int min, int max)
+{
+  char *end;
+  long n = strtol(str, &end, 10);
+  
+  if (end == str || *end || n < min || n > max)
+    return 0;
+  
+  *a = n;
+  
+  return 1;
+}
+
+// a[,b], b stays as it was if left out
+static int parse_pair(char *str, int *a, int *b, int min)
+{
+  char *end;
+  long n = strtol(str, &end, 10);
+  
+  if (end == str || n < min || n > 1 << 30)
+    return 0;
+  
+  *a = n;
+  
+  if (*end == ',') {
+    str = end + 1;
+    n = strtol(str, &end, 10);
+    
+    if (end == str || n < min || n > 1 << 30)
+      return 0;
+    
+    *b = n;
+  }
+  
+  return *end == 0;
+}
+
+// one job per line, trailing newline stripped
+static char **read_lines(FILE *in, int *num_lines)
+{
+  char **lines = NULL;
+  int num = 0, max = 0;
+  
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  
+  while ((len = getline(&line, &size, in)) != -1) {
+    if (len > 0 && line[len - 1] == '\n')
+      line[len - 1] = '\0';
+    
+    if (num >= max) {
+      max += 256;
+      lines = realloc(lines, max * sizeof(char*));
+    }
+    
+    lines[num++] = strdup(line);
+  }
+  
+  free(line);
+  
+  *num_lines = num;
+  
+  return lines;
+}
 
 int main(int argc, char **argv)
 {
@@ -16,14 +116,132 @@ int main(int argc, char **argv)
   
   int c, err = 0;
   int flag_dump = 0;
+  int flag_stats = 0;
+  int flag_huge = 0;
+  int flag_nocache = 0;
+  int flag_prof = 0;
+  unsigned long mem_size = 0;
+  int tier_calls = TIER_CALLS;
+  int tier_trips = TIER_TRIPS;
+  int inline_size = INLINE_SIZE;
+  int inline_depth = INLINE_DEPTH;
+  int opt_level = OPT_LEVEL;
+  int num_thread = sysconf(_SC_NPROCESSORS_ONLN);
+  char *batch_name = NULL;
+  char *snap_name = NULL;
+  char *restore_name = NULL;
+  char *asm_name = NULL;
+  char *exe_name = NULL;
+  char *c_name = NULL;
+  char *bin_name = NULL;
+  char *prof_name = NULL;
+  char *folded_name = NULL;
+  engine_t engine = ENGINE_SWITCH;
+  
+  static char usage[] = "usage: %s [-dDvHNp] [-e switch|thread|jit|reg|tos|trace|tier] [-T calls[,trips]] [-i size[,depth]] [-O level] [--jit] [-m size] [-P prof.json] [-g out.folded] [-b inputs] [-j threads] [-k snap] [-r snap] [-o out.9cb] [-S out.s] [-x out] [-c out.c] file\n";
   
-  static char usage[] = "usage: %s [-dD] file\n";
+  static struct option long_opts[] = {
+    { "jit", no_argument, NULL, 'J' },
+    { 0 }
+  };
   
-  while ((c = getopt(argc, argv, "dD")) != -1) {
+  while ((c = getopt_long(argc, argv, "b:c:dDe:g:Hi:j:k:m:No:O:pP:r:S:T:vx:", long_opts, NULL)) != -1) {
     switch (c) {
+    case 'b':
+      batch_name = optarg;
+      break;
+    case 'c':
+      c_name = optarg;
+      break;
     case 'D':
       flag_dump = 1;
       break;
+    case 'e':
+      if (strcmp(optarg, "switch") == 0)
+        engine = ENGINE_SWITCH;
+      else if (strcmp(optarg, "thread") == 0)
+        engine = ENGINE_THREAD;
+      else if (strcmp(optarg, "jit") == 0)
+        engine = ENGINE_JIT;
+      else if (strcmp(optarg, "reg") == 0)
+        engine = ENGINE_REG;
+      else if (strcmp(optarg, "tos") == 0)
+        engine = ENGINE_TOS;
+      else if (strcmp(optarg, "trace") == 0)
+        engine = ENGINE_TRACE;
+      else if (strcmp(optarg, "tier") == 0)
+        engine = ENGINE_TIER;
+      else
+        err = 1;
+      break;
+    case 'g':
+      folded_name = optarg;
+      break;
+    case 'H':
+      flag_huge = 1;
+      break;
+    case 'i':
+      if (!parse_pair(optarg, &inline_size, &inline_depth, 0)) {
+        fprintf(stderr, "%s: -i expects size[,depth], 0 turns inlining off\n", argv[0]);
+        exit(1);
+      }
+      break;
+    case 'j':
+      num_thread = atoi(optarg);
+      if (num_thread < 1) {
+        fprintf(stderr, "%s: -j expects a positive thread count\n", argv[0]);
+        exit(1);
+      }
+      break;
+    case 'J':
+      engine = ENGINE_JIT;
+      break;
+    case 'k':
+      snap_name = optarg;
+      break;
+    case 'm':
+      mem_size = parse_size(optarg);
+      if (mem_size < KB(4) || mem_size > MEM_MAX) {
+        fprintf(stderr, "%s: memory size must be between 4k and %luk\n", argv[0], MEM_MAX / KB(1ul));
+        exit(1);
+      }
+      break;
+    case 'N':
+      flag_nocache = 1;
+      break;
+    case 'o':
+      bin_name = optarg;
+      break;
+    case 'O':
+      if (!parse_int(optarg, &opt_level, 0, 1)) {
+        fprintf(stderr, "%s: -O expects 0 or 1\n", argv[0]);
+        exit(1);
+      }
+      break;
+    case 'p':
+      flag_prof = 1;
+      break;
+    case 'P':
+      prof_name = optarg;
+      break;
+    case 'r':
+      restore_name = optarg;
+      break;
+    case 'S':
+      asm_name = optarg;
+      break;
+    case 'T':
+      if (!parse_pair(optarg, &tier_calls, &tier_trips, 1)) {
+        fprintf(stderr, "%s: -T expects calls[,trips], both positive\n", argv[0]);
+        exit(1);
+      }
+      break;
+    case 'v':
+      flag_stats = 1;
+      break;
+    case 'x':
+      exe_name = optarg;
+      break;
     case '?':
       err = 1;
       break;
@@ -51,20 +269,187 @@ int main(int argc, char **argv)
   hash_init();
   parse_init();
   
-  lexify(in, fname);
+  bin_t *bin = NULL;
+  // entries are only ever made with the default inlining and optimising
+  int use_cache = !flag_nocache && !c_name && !asm_name && !exe_name
+    && inline_size == INLINE_SIZE && inline_depth == INLINE_DEPTH
+    && opt_level == OPT_LEVEL;
   
-  unit_t *unit = translation_unit();
+  if (bin_check(in)) {
+    if (c_name || asm_name || exe_name) {
+      fprintf(stderr, "%s: -c, -S and -x need the source, not a compiled binary\n", argv[0]);
+      exit(1);
+    }
+    
+    bin = bin_read(in);
+    if (!bin) {
+      fprintf(stderr, "%s: %s is not a binary of this version, or is corrupt\n", argv[0], fname);
+      exit(1);
+    }
+  } else if (use_cache) {
+    bin = cache_load(fname);
+  }
+  
+  if (!bin) {
+    lexify(in, fname);
+    
+    unit_t *unit = translation_unit();
+    fold(unit, flag_stats);
+    reduce(unit, flag_stats);
+    
+    // -c and -x bake the memory size into their output, as -o does
+    unsigned aot_mem = mem_size ? mem_size : MEM_DEFAULT;
+    
+    if (c_name) {
+      FILE *out = fopen(c_name, "w");
+      if (!out) {
+        fprintf(stderr, "%s: could not open %s\n", argv[0], c_name);
+        exit(1);
+      }
+      
+      gen_c(unit, out, aot_mem);
+      fclose(out);
+      fclose(in);
+      
+      return 0;
+    }
+    
+    if (asm_name || exe_name) {
+      if (asm_name) {
+        FILE *out = fopen(asm_name, "w");
+        if (!out) {
+          fprintf(stderr, "%s: could not open %s\n", argv[0], asm_name);
+          exit(1);
+        }
+        
+        gen_x86(unit, out, aot_mem);
+        fclose(out);
+      }
+      
+      if (exe_name && !gen_x86_exe(unit, exe_name, aot_mem)) {
+        fprintf(stderr, "%s: could not build %s\n", argv[0], exe_name);
+        exit(1);
+      }
+      
+      fclose(in);
+      
+      return 0;
+    }
+    
+    assign_slots(unit, flag_stats);
+    find_tails(unit, flag_stats);
+    bin = gen(unit, inline_size, inline_depth, opt_level, flag_stats);
+    fuse(bin, flag_stats);
+    
+    if (use_cache)
+      cache_store(fname, bin, lex.files, lex.num_files);
+  }
   
-  bin_t *bin = gen(unit);
+  // before -o, so the size goes into the binary too
+  if (mem_size)
+    bin->mem_size = mem_size;
+  
+  if (bin_name) {
+    FILE *out = fopen(bin_name, "wb");
+    if (!out) {
+      fprintf(stderr, "%s: could not open %s\n", argv[0], bin_name);
+      exit(1);
+    }
+    
+    bin_write(bin, out);
+    fclose(out);
+    fclose(in);
+    
+    return 0;
+  }
   
   if (flag_dump)
     bin_dump(bin);
   
+  if (folded_name && (flag_prof || prof_name)) {
+    fprintf(stderr, "%s: -g does not work with -p or -P\n", argv[0]);
+    exit(1);
+  }
+  
+  if (folded_name && engine != ENGINE_SWITCH) {
+    fprintf(stderr, "%s: -g only runs on the switch engine\n", argv[0]);
+    exit(1);
+  }
+  
+  if (batch_name && (flag_prof || prof_name || folded_name || snap_name)) {
+    fprintf(stderr, "%s: -p, -P, -g and -k do not work with -b\n", argv[0]);
+    exit(1);
+  }
+  
+  if (batch_name) {
+    FILE *inputs = fopen(batch_name, "r");
+    if (!inputs) {
+      fprintf(stderr, "%s: could not open %s\n", argv[0], batch_name);
+      exit(1);
+    }
+    
+    batch_t batch;
+    batch.bin = bin;
+    batch.engine = engine;
+    batch.stats = flag_stats;
+    batch.tier_calls = tier_calls;
+    batch.tier_trips = tier_trips;
+    batch.mem_huge = flag_huge;
+    batch.num_thread = num_thread;
+    batch.restore_name = restore_name;
+    batch.input = read_lines(inputs, &batch.num_input);
+    fclose(inputs);
+    
+    int num_error = vm_batch(&batch, stdout);
+    fclose(in);
+    
+    return num_error ? 1 : 0;
+  }
+  
   vm_t *vm = make_vm();
+  vm->engine = engine;
+  vm->stats = flag_stats;
+  vm->tier_calls = tier_calls;
+  vm->tier_trips = tier_trips;
+  vm->mem_huge = flag_huge;
+  vm->snap_name = snap_name;
+  vm->profile = flag_prof || prof_name;
+  vm->sample = folded_name != NULL;
   vm_load(vm, bin);
   
+  if (restore_name)
+    vm_restore(vm, restore_name);
+  
   vm_exec(vm);
   
+  if (flag_stats)
+    vm_heap_stats(vm, stderr);
+  
+  if (flag_prof)
+    vm_prof_report(vm, stderr);
+  
+  if (prof_name) {
+    FILE *out = fopen(prof_name, "w");
+    if (!out) {
+      fprintf(stderr, "%s: could not open %s\n", argv[0], prof_name);
+      exit(1);
+    }
+    
+    vm_prof_json(vm, out);
+    fclose(out);
+  }
+  
+  if (folded_name) {
+    FILE *out = fopen(folded_name, "w");
+    if (!out) {
+      fprintf(stderr, "%s: could not open %s\n", argv[0], folded_name);
+      exit(1);
+    }
+    
+    vm_prof_folded(vm, out);
+    fclose(out);
+  }
+  
   fclose(in);
   
   return 0;
@@ -0,0 +1,157 @@
+#include "v_local.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../common/deque.h"
+
+//
+// batch runner
+//
+// one bin, many inputs. each worker thread owns a vm which is loaded again
+// for every job, so the decoded code and the memory reservation are made
+// once per worker and the bin itself is shared read only. jobs are dealt
+// round robin onto the workers' deques up front and a worker that runs dry
+// steals from the others. output is captured per job and written out in
+// input order once every job is done. a job that stops on a guest error
+// keeps the output it had, the error follows it on stderr tagged with the
+// job's input line, and the other jobs carry on.
+//
+
+typedef struct worker_s worker_t;
+typedef struct job_s job_t;
+
+struct job_s {
+  char *out;
+  size_t out_size;
+  char *error;
+};
+
+struct worker_s {
+  pthread_t thread;
+  batch_t *batch;
+  worker_t *pool;
+  job_t *job;
+  deque_t *deque;
+  int id;
+  int num_job;
+  int num_steal;
+};
+
+// nothing is queued once the workers are running, so when every deque is
+// empty the batch is done
+static int worker_next(worker_t *worker, int *job)
+{
+  int num_thread = worker->batch->num_thread;
+  
+  if (deque_pop(worker->deque, job))
+    return 1;
+  
+  for (int i = 1; i < num_thread; i++) {
+    worker_t *victim = &worker->pool[(worker->id + i) % num_thread];
+    
+    int found;
+    while ((found = deque_steal(victim->deque, job)) < 0);
+    
+    if (found) {
+      worker->num_steal++;
+      return 1;
+    }
+  }
+  
+  return 0;
+}
+
+static void *worker_run(void *arg)
+{
+  worker_t *worker = arg;
+  batch_t *batch = worker->batch;
+  
+  vm_t *vm = make_vm();
+  vm->engine = batch->engine;
+  vm->tier_calls = batch->tier_calls;
+  vm->tier_trips = batch->tier_trips;
+  vm->mem_huge = batch->mem_huge;
+  vm->batch = 1;
+  
+  int id;
+  while (worker_next(worker, &id)) {
+    job_t *job = &worker->job[id];
+    
+    vm->out = open_memstream(&job->out, &job->out_size);
+    if (!vm->out)
+      error("batch: could not open output buffer");
+    
+    vm->input = batch->input[id];
+    vm_load(vm, batch->bin);
+    if (batch->restore_name)
+      vm_restore(vm, batch->restore_name);
+    if (!vm_exec(vm))
+      job->error = strdup(vm->error);
+    
+    fclose(vm->out);
+    worker->num_job++;
+  }
+  
+  return NULL;
+}
+
+// returns the number of jobs that stopped on an error
+int vm_batch(batch_t *batch, FILE *out)
+{
+  int num_thread = batch->num_thread;
+  
+  if (num_thread < 1)
+    num_thread = 1;
+  if (num_thread > batch->num_input && batch->num_input > 0)
+    num_thread = batch->num_input;
+  
+  batch->num_thread = num_thread;
+  
+  job_t *job = calloc(batch->num_input, sizeof(job_t));
+  worker_t *pool = calloc(num_thread, sizeof(worker_t));
+  
+  for (int i = 0; i < num_thread; i++) {
+    pool[i].batch = batch;
+    pool[i].pool = pool;
+    pool[i].job = job;
+    pool[i].id = i;
+    pool[i].deque = make_deque(batch->num_input / num_thread + 1);
+  }
+  
+  for (int i = 0; i < batch->num_input; i++)
+    deque_push(pool[i % num_thread].deque, i);
+  
+  for (int i = 0; i < num_thread; i++) {
+    if (pthread_create(&pool[i].thread, NULL, worker_run, &pool[i]) != 0)
+      error("batch: could not start worker %i", i);
+  }
+  
+  for (int i = 0; i < num_thread; i++)
+    pthread_join(pool[i].thread, NULL);
+  
+  int num_error = 0;
+  
+  for (int i = 0; i < batch->num_input; i++) {
+    fwrite(job[i].out, 1, job[i].out_size, out);
+    free(job[i].out);
+    
+    if (job[i].error) {
+      fflush(out);
+      fprintf(stderr, "batch: input line %i: %s\n", i + 1, job[i].error);
+      free(job[i].error);
+      num_error++;
+    }
+  }
+  
+  if (batch->stats) {
+    for (int i = 0; i < num_thread; i++)
+      fprintf(stderr, "batch: worker %i ran %i jobs, %i stolen\n", i, pool[i].num_job, pool[i].num_steal);
+  }
+  
+  free(job);
+  free(pool);
+  
+  return num_error;
+}
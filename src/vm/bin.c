@@ -1,6 +1,24 @@
 #include "bin.h"
+#include "vm.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// bin files
+//
+// a header page, then one lump per page aligned run. the file is mapped
+// read only and the instructions run straight from the mapping. the data
+// lump is laid out as the guest pages it lands in: it starts at the same
+// offset into its page as bss_size and is padded with zeros to whole pages
+// on both sides, so vm_load can map it copy on write in place.
+//
+
+#define BIN_MAGIC 0x62633960
+#define BIN_PAGE 4096
 
 typedef enum tlump_e tlump_t;
 typedef struct lump_s lump_t;
@@ -9,6 +27,8 @@ typedef struct header_s header_t;
 enum tlump_e {
   LUMP_DATA,
   LUMP_INSTR,
+  LUMP_SYM,
+  LUMP_NAME,
   MAX_LUMP
 };
 
@@ -18,7 +38,10 @@ struct lump_s {
 };
 
 struct header_s {
+  unsigned magic;
+  int version;
   int bss_size;
+  unsigned mem_size;
   lump_t lumps[MAX_LUMP];
 };
 
@@ -54,7 +77,36 @@ char *instr_tbl[] = {
   "setge",
   "sx8_32",
   "sx32_8",
-  "int"
+  "int",
+  "ldl",
+  "stl",
+  "leal",
+  "addi",
+  "cje",
+  "cjne",
+  "cjl",
+  "cjg",
+  "cjle",
+  "cjge",
+  "seq",
+  "sne",
+  "slt",
+  "sgt",
+  "sle",
+  "sge",
+  "lds",
+  "sts",
+  "ldo",
+  "sto",
+  "ldx",
+  "stx",
+  "shl",
+  "shr",
+  "and",
+  "or",
+  "xor",
+  "divi",
+  "modi"
 };
 
 int num_instr_tbl = sizeof(instr_tbl) / sizeof(char *);
@@ -67,80 +119,336 @@ bin_t *make_bin(instr_t *instr, int num_instr, void *data, int data_size, int bs
   bin->data = data;
   bin->data_size = data_size;
   bin->bss_size = bss_size;
+  bin->mem_size = 0;
+  bin->sym = NULL;
+  bin->num_sym = 0;
+  bin->data_fd = -1;
+  bin->data_ofs = 0;
   return bin;
 }
 
+int instr_len(instr_t instr)
+{
+  switch (instr) {
+  case PUSH:
+  case ENTER:
+  case CALL:
+  case JMP:
+  case JE:
+  case JNE:
+  case JL:
+  case JG:
+  case JLE:
+  case JGE:
+  case INT:
+  case LDL:
+  case STL:
+  case LEAL:
+  case ADDI:
+  case CJE:
+  case CJNE:
+  case CJL:
+  case CJG:
+  case CJLE:
+  case CJGE:
+  case LDS:
+  case STS:
+  case LDO:
+  case STO:
+  case LDX:
+  case STX:
+  case DIVI:
+  case MODI:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
 void bin_dump(bin_t *bin)
 {
   int i = 0;
   while (i < bin->num_instr) {
-    switch (bin->instr[i]) {
-    case PUSH:
-    case ENTER:
-    case CALL:
-    case JMP:
-    case JE:
-    case JNE:
-    case JL:
-    case JG:
-    case JLE:
-    case JGE:
-    case INT:
+    if (instr_len(bin->instr[i]) == 2) {
       printf("%03i %s %i\n", i, instr_tbl[bin->instr[i]], bin->instr[i + 1]);
       i += 2;
-      break;
-    default:
+    } else {
       printf("%03i %s\n", i, instr_tbl[bin->instr[i]]);
       i += 1;
-      break;
     }
   }
 }
 
-void write_lump(FILE *out, header_t *header, void *src, int size, tlump_t tlump)
+typedef struct sym_order_s sym_order_t;
+
+struct sym_order_s {
+  int pos;
+  int index;
+};
+
+// ties go to the lower index so the map is the same every time
+static int cmp_sym(const void *a, const void *b)
+{
+  const sym_order_t *sa = a;
+  const sym_order_t *sb = b;
+  
+  if (sa->pos != sb->pos)
+    return sa->pos - sb->pos;
+  
+  return sa->index - sb->index;
+}
+
+// index into bin->sym of the function holding each ip, code before the
+// first symbol goes to the first. -1 throughout if there are no symbols.
+// batch workers call this at once, so the sort keeps no state of its own
+int *bin_func_map(bin_t *bin)
+{
+  int *func_of = malloc((bin->num_instr + 1) * sizeof(int));
+  sym_order_t *order = malloc((bin->num_sym + 1) * sizeof(sym_order_t));
+  
+  for (int i = 0; i < bin->num_sym; i++) {
+    order[i].pos = bin->sym[i].pos;
+    order[i].index = i;
+  }
+  
+  qsort(order, bin->num_sym, sizeof(sym_order_t), cmp_sym);
+  
+  int func = 0;
+  for (int ip = 0; ip <= bin->num_instr; ip++) {
+    while (func + 1 < bin->num_sym && order[func + 1].pos <= ip)
+      func++;
+    
+    func_of[ip] = bin->num_sym ? order[func].index : -1;
+  }
+  
+  free(order);
+  
+  return func_of;
+}
+
+// fnv-1a over everything that shapes the program's memory and code
+unsigned bin_hash(bin_t *bin)
+{
+  unsigned hash = 2166136261u;
+  
+  unsigned char *p = (unsigned char *) bin->instr;
+  for (int i = 0; i < bin->num_instr * (int) sizeof(instr_t); i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  
+  p = bin->data;
+  for (int i = 0; i < bin->data_size; i++)
+    hash = (hash ^ p[i]) * 16777619u;
+  
+  hash = (hash ^ bin->bss_size) * 16777619u;
+  
+  return hash;
+}
+
+static void pad_to(FILE *out, long pos)
 {
-  header->lumps[tlump].fileofs = ftell(out);
+  for (long i = ftell(out); i < pos; i++)
+    fputc(0, out);
+}
+
+// start the lump at align bytes into a fresh page
+void write_lump(FILE *out, header_t *header, void *src, int size, tlump_t tlump, int align)
+{
+  long pos = ((ftell(out) + BIN_PAGE - 1) & ~(long) (BIN_PAGE - 1)) + align;
+  pad_to(out, pos);
+  
+  header->lumps[tlump].fileofs = pos;
   header->lumps[tlump].filelen = size;
   fwrite(src, 1, size, out);
 }
 
 void bin_write(bin_t *bin, FILE *out)
 {
-  fseek(out, sizeof(header_t), SEEK_SET);
+  fseek(out, 0, SEEK_SET);
   
   header_t header;
+  memset(&header, 0, sizeof(header_t));
+  header.magic = BIN_MAGIC;
+  header.version = BIN_VERSION;
   header.bss_size = bin->bss_size;
+  header.mem_size = bin->mem_size;
+  
+  fwrite(&header, 1, sizeof(header_t), out);
   
-  write_lump(out, &header, bin->data, bin->data_size, LUMP_DATA);
-  write_lump(out, &header, bin->instr, bin->num_instr * sizeof(instr_t), LUMP_INSTR);
+  // symbol names are stored as strings, hashes only mean something to the
+  // process that made them
+  int name_size = 0;
+  for (int i = 0; i < bin->num_sym; i++)
+    name_size += strlen(hash_get(bin->sym[i].name)) + 1;
+  
+  sym_t *sym = malloc((bin->num_sym + 1) * sizeof(sym_t));
+  char *name = malloc(name_size + 1);
+  
+  int name_pos = 0;
+  for (int i = 0; i < bin->num_sym; i++) {
+    char *str = hash_get(bin->sym[i].name);
+    sym[i].name = name_pos;
+    sym[i].pos = bin->sym[i].pos;
+    strcpy(&name[name_pos], str);
+    name_pos += strlen(str) + 1;
+  }
+  
+  write_lump(out, &header, bin->data, bin->data_size, LUMP_DATA, bin->bss_size % BIN_PAGE);
+  write_lump(out, &header, bin->instr, bin->num_instr * sizeof(instr_t), LUMP_INSTR, 0);
+  write_lump(out, &header, sym, bin->num_sym * sizeof(sym_t), LUMP_SYM, 0);
+  write_lump(out, &header, name, name_size, LUMP_NAME, 0);
+  
+  pad_to(out, (ftell(out) + BIN_PAGE - 1) & ~(long) (BIN_PAGE - 1));
   
   fseek(out, 0, SEEK_SET);
   fwrite(&header, 1, sizeof(header_t), out);
+  
+  free(sym);
+  free(name);
 }
 
-void *copy_lump(FILE *in, header_t *header, int *size, tlump_t tlump)
+int bin_check(FILE *in)
 {
-  fseek(in, header->lumps[tlump].fileofs, SEEK_SET);
+  unsigned magic = 0;
+  
+  fseek(in, 0, SEEK_SET);
+  int n = fread(&magic, 1, sizeof(magic), in);
+  fseek(in, 0, SEEK_SET);
   
-  *size = header->lumps[tlump].filelen;
-  char *buffer = malloc(*size);
-  fread(buffer, 1, *size, in);
+  return n == sizeof(magic) && magic == BIN_MAGIC;
+}
+
+static int lump_valid(header_t *header, tlump_t tlump, long file_size)
+{
+  lump_t *lump = &header->lumps[tlump];
   
-  return buffer;
+  return lump->fileofs >= BIN_PAGE && lump->filelen >= 0
+    && lump->fileofs + (long) lump->filelen <= file_size;
+}
+
+static int is_branch(instr_t op)
+{
+  switch (op) {
+  case CALL:
+  case JMP:
+  case JE:
+  case JNE:
+  case JL:
+  case JG:
+  case JLE:
+  case JGE:
+  case CJE:
+  case CJNE:
+  case CJL:
+  case CJG:
+  case CJLE:
+  case CJGE:
+    return 1;
+  default:
+    return 0;
+  }
 }
 
+// the engines trust the code they are given, so a bin off disk is walked
+// once: every opcode known with its operand inside the lump, every branch
+// onto the start of an instruction, every slot one the vm has, the code
+// unable to run off its end and every symbol inside it
+static int code_valid(instr_t *instr, int num_instr, sym_t *sym, int num_sym)
+{
+  if (num_instr <= 0)
+    return 0;
+  
+  char *start = calloc(num_instr, 1);
+  int valid = 1;
+  int last = 0;
+  
+  for (int ip = 0; valid && ip < num_instr; ip += instr_len(instr[ip])) {
+    valid = (unsigned) instr[ip] < (unsigned) num_instr_tbl && ip + instr_len(instr[ip]) <= num_instr;
+    start[ip] = 1;
+    last = ip;
+  }
+  
+  for (int ip = 0; valid && ip < num_instr; ip += instr_len(instr[ip])) {
+    instr_t op = instr[ip];
+    int arg = instr_len(op) == 2 ? instr[ip + 1] : 0;
+    
+    if (is_branch(op))
+      valid = arg >= 0 && arg < num_instr && start[arg];
+    else if (op == LDS || op == STS)
+      valid = arg >= 0 && arg < MAX_SLOT;
+  }
+  
+  if (valid)
+    valid = instr[last] == JMP || instr[last] == RET || (instr[last] == INT && instr[last + 1] == SYS_EXIT);
+  
+  for (int i = 0; valid && i < num_sym; i++)
+    valid = sym[i].pos >= 0 && sym[i].pos <= num_instr;
+  
+  free(start);
+  
+  return valid;
+}
+
+// NULL if the file is not a bin of this version, is cut short or holds
+// code the vm could not run safely
 bin_t *bin_read(FILE *in)
 {
-  header_t header;
-  fread(&header, 1, sizeof(header_t), in);
+  int fd = fileno(in);
   
-  int data_size;
-  void *data = copy_lump(in, &header, &data_size, LUMP_DATA);
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < BIN_PAGE || st.st_size % BIN_PAGE)
+    return NULL;
   
-  int instr_size;
-  instr_t *instr_buf  = copy_lump(in, &header, &instr_size, LUMP_INSTR);
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  
+  header_t *header = (header_t*) map;
+  
+  int valid = header->magic == BIN_MAGIC && header->version == BIN_VERSION && header->bss_size >= 0;
+  for (int i = 0; valid && i < MAX_LUMP; i++)
+    valid = lump_valid(header, i, st.st_size);
+  
+  if (valid)
+    valid = header->lumps[LUMP_DATA].fileofs % BIN_PAGE == header->bss_size % BIN_PAGE
+      && header->lumps[LUMP_INSTR].fileofs % BIN_PAGE == 0;
+  
+  if (valid) {
+    lump_t *lumps = header->lumps;
+    valid = code_valid((instr_t*) (map + lumps[LUMP_INSTR].fileofs), lumps[LUMP_INSTR].filelen / sizeof(instr_t),
+      (sym_t*) (map + lumps[LUMP_SYM].fileofs), lumps[LUMP_SYM].filelen / sizeof(sym_t));
+  }
   
-  int num_instr = instr_size / sizeof(instr_t);
+  int data_fd = valid ? dup(fd) : -1;
   
-  return make_bin(instr_buf, num_instr, data, data_size, header.bss_size);
+  if (data_fd < 0) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  
+  lump_t *lumps = header->lumps;
+  
+  bin_t *bin = make_bin((instr_t*) (map + lumps[LUMP_INSTR].fileofs), lumps[LUMP_INSTR].filelen / sizeof(instr_t),
+    map + lumps[LUMP_DATA].fileofs, lumps[LUMP_DATA].filelen, header->bss_size);
+  bin->mem_size = header->mem_size;
+  bin->data_fd = data_fd;
+  bin->data_ofs = lumps[LUMP_DATA].fileofs;
+  
+  // symbols are small and get their names hashed again, so copy them
+  int name_size = lumps[LUMP_NAME].filelen;
+  char *name = map + lumps[LUMP_NAME].fileofs;
+  
+  bin->num_sym = lumps[LUMP_SYM].filelen / sizeof(sym_t);
+  bin->sym = malloc((bin->num_sym + 1) * sizeof(sym_t));
+  memcpy(bin->sym, map + lumps[LUMP_SYM].fileofs, bin->num_sym * sizeof(sym_t));
+  
+  for (int i = 0; i < bin->num_sym; i++) {
+    int pos = bin->sym[i].name;
+    
+    if (pos >= 0 && pos < name_size && memchr(&name[pos], 0, name_size - pos))
+      bin->sym[i].name = hash_value(&name[pos]);
+    else
+      bin->sym[i].name = hash_value("?");
+  }
+  
+  return bin;
 }
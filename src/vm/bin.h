@@ -5,6 +5,8 @@
 #include "../common/hash.h"
 #include <stdio.h>
 
+#define BIN_VERSION 7
+
 typedef struct bin_s bin_t;
 typedef struct sym_s sym_t;
 
@@ -14,6 +16,11 @@ struct bin_s {
   void *data;
   int data_size;
   int bss_size;
+  unsigned mem_size;
+  sym_t *sym;
+  int num_sym;
+  int data_fd;
+  long data_ofs;
 };
 
 struct sym_s {
@@ -24,8 +31,12 @@ struct sym_s {
 extern char *instr_tbl[];
 extern int num_instr_tbl;
 
+int instr_len(instr_t instr);
 void bin_dump(bin_t *bin);
+unsigned bin_hash(bin_t *bin);
+int *bin_func_map(bin_t *bin);
 void bin_write(bin_t *bin, FILE *out);
+int bin_check(FILE *in);
 bin_t *bin_read(FILE *in);
 
 bin_t *make_bin(instr_t *instr, int num_instr, void *data, int data_size, int bss_size);
@@ -0,0 +1,196 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//
+// compile cache
+//
+// compiled bins are kept in $XDG_CACHE_HOME/9c (~/.cache/9c by default),
+// named after a hash of the compiler build, the source's path and its
+// contents. every entry has a .dep file next to it listing each file the
+// lexer opened, includes and all, with the hash of its contents. an entry
+// is used only if every one of them still matches.
+//
+
+#define BUILD_ID __DATE__ " " __TIME__
+
+typedef unsigned long long key_t64;
+
+static key_t64 fnv(key_t64 hash, void *buf, int size)
+{
+  unsigned char *p = buf;
+  
+  for (int i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 1099511628211ull;
+  
+  return hash;
+}
+
+static int file_hash(char *path, key_t64 *hash)
+{
+  FILE *in = fopen(path, "rb");
+  if (!in)
+    return 0;
+  
+  char buf[4096];
+  int n;
+  
+  *hash = 14695981039346656037ull;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    *hash = fnv(*hash, buf, n);
+  
+  fclose(in);
+  
+  return 1;
+}
+
+static int make_dir(char *path)
+{
+  return mkdir(path, 0755) == 0 || access(path, W_OK) == 0;
+}
+
+// entry path without its extension, NULL if there is nowhere to cache
+static char *cache_entry(char *fname)
+{
+  char dir[PATH_MAX];
+  char real[PATH_MAX];
+  
+  char *xdg = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  
+  if (xdg && *xdg) {
+    snprintf(dir, sizeof(dir), "%s", xdg);
+  } else if (home && *home) {
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  } else {
+    return NULL;
+  }
+  
+  if (!make_dir(dir))
+    return NULL;
+  
+  strncat(dir, "/9c", sizeof(dir) - strlen(dir) - 1);
+  
+  if (!make_dir(dir))
+    return NULL;
+  
+  key_t64 content;
+  if (!realpath(fname, real) || !file_hash(real, &content))
+    return NULL;
+  
+  key_t64 key = 14695981039346656037ull;
+  key = fnv(key, BUILD_ID, strlen(BUILD_ID));
+  key = fnv(key, real, strlen(real));
+  key = fnv(key, &content, sizeof(content));
+  
+  char *entry = malloc(strlen(dir) + 32);
+  sprintf(entry, "%s/%016llx", dir, key);
+  
+  return entry;
+}
+
+static int deps_valid(char *entry)
+{
+  char path[PATH_MAX + 64];
+  snprintf(path, sizeof(path), "%s.dep", entry);
+  
+  FILE *in = fopen(path, "r");
+  if (!in)
+    return 0;
+  
+  key_t64 hash, current;
+  char dep[PATH_MAX];
+  int valid = 1;
+  
+  while (valid && fscanf(in, "%llx %4095[^\n]\n", &hash, dep) == 2)
+    valid = file_hash(dep, &current) && current == hash;
+  
+  fclose(in);
+  
+  return valid;
+}
+
+bin_t *cache_load(char *fname)
+{
+  char *entry = cache_entry(fname);
+  if (!entry)
+    return NULL;
+  
+  bin_t *bin = NULL;
+  
+  if (deps_valid(entry)) {
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s.9cb", entry);
+    
+    FILE *in = fopen(path, "rb");
+    if (in) {
+      bin = bin_read(in);
+      fclose(in);
+    }
+  }
+  
+  free(entry);
+  
+  return bin;
+}
+
+// written under a temporary name and renamed, so runs racing on the same
+// entry only ever see whole files
+static FILE *open_tmp(char *entry, char *ext, char *tmp, int size)
+{
+  snprintf(tmp, size, "%s.%s.%i", entry, ext, (int) getpid());
+  
+  return fopen(tmp, "wb");
+}
+
+static void commit_tmp(char *entry, char *ext, char *tmp)
+{
+  char path[PATH_MAX + 64];
+  snprintf(path, sizeof(path), "%s.%s", entry, ext);
+  
+  if (rename(tmp, path) < 0)
+    unlink(tmp);
+}
+
+void cache_store(char *fname, bin_t *bin, char **deps, int num_deps)
+{
+  char *entry = cache_entry(fname);
+  if (!entry)
+    return;
+  
+  char tmp[PATH_MAX + 64];
+  char real[PATH_MAX];
+  key_t64 hash;
+  
+  FILE *out = open_tmp(entry, "9cb", tmp, sizeof(tmp));
+  if (!out)
+    goto done;
+  
+  bin_write(bin, out);
+  fclose(out);
+  commit_tmp(entry, "9cb", tmp);
+  
+  out = open_tmp(entry, "dep", tmp, sizeof(tmp));
+  if (!out)
+    goto done;
+  
+  for (int i = 0; i < num_deps; i++) {
+    if (!realpath(deps[i], real) || !file_hash(real, &hash)) {
+      fclose(out);
+      unlink(tmp);
+      goto done;
+    }
+    
+    fprintf(out, "%016llx %s\n", hash, real);
+  }
+  
+  fclose(out);
+  commit_tmp(entry, "dep", tmp);
+
+done:
+  free(entry);
+}
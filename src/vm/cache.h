@@ -0,0 +1,9 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "bin.h"
+
+bin_t *cache_load(char *fname);
+void cache_store(char *fname, bin_t *bin, char **deps, int num_deps);
+
+#endif
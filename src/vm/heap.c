@@ -0,0 +1,323 @@
+#include "v_local.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//
+// guest heap
+//
+// the heap sits between the program data and the stack. small blocks come
+// from per size class free lists, refilled by carving whole slabs off the
+// bottom of the heap; large blocks are whole pages on a first fit list. the
+// arena bumps down from the top of the heap and is released all at once.
+//
+// every block has a 4 byte header in front of it holding its size class, or
+// its size in bytes for large blocks. free lists are threaded through the
+// first word of the free blocks, so all heap state except the list heads and
+// counters lives in guest memory.
+//
+
+#define MIN_CLASS 4
+#define NUM_CLASS 8
+#define MAX_SMALL (1 << (MIN_CLASS + NUM_CLASS - 1))
+#define SLAB_SIZE KB(16)
+#define PAGE_SIZE KB(4)
+#define HEADER 4
+
+#define STACK_MIN KB(4)
+#define STACK_MAX MB(8)
+
+typedef struct class_s class_t;
+
+struct class_s {
+  unsigned head;
+  int live;
+  int num_alloc;
+  int num_free;
+  unsigned carved;
+};
+
+struct heap_s {
+  unsigned base, end;
+  unsigned brk;
+  unsigned arena;
+  class_t cls[NUM_CLASS];
+  unsigned large;
+  int large_live;
+  unsigned large_bytes;
+  unsigned arena_peak;
+  int arena_resets;
+  int num_fail;
+};
+
+static unsigned *word(vm_t *vm, unsigned addr)
+{
+  return (unsigned*) &vm->m_i8[addr];
+}
+
+static int size_class(unsigned size)
+{
+  int cls = 0;
+  while ((1u << (cls + MIN_CLASS)) < size)
+    cls++;
+  return cls;
+}
+
+void heap_init(vm_t *vm)
+{
+  bin_t *bin = vm->bin;
+  
+  if (!vm->heap)
+    vm->heap = malloc(sizeof(heap_t));
+  
+  heap_t *heap = vm->heap;
+  memset(heap, 0, sizeof(heap_t));
+  
+  unsigned stack_size = vm->mem_size / 4;
+  if (stack_size < STACK_MIN)
+    stack_size = STACK_MIN;
+  if (stack_size > STACK_MAX)
+    stack_size = STACK_MAX;
+  
+  // keep address 0 out of the heap so it can stand for a failed allocation
+  heap->base = (bin->bss_size + bin->data_size + 15) & ~15u;
+  if (heap->base < 16)
+    heap->base = 16;
+  heap->end = vm->mem_size > stack_size ? (vm->mem_size - stack_size) & ~15u : heap->base;
+  if (heap->end < heap->base)
+    heap->end = heap->base;
+  
+  heap->brk = heap->base;
+  heap->arena = heap->end;
+  
+  vm->stack_end = heap->end;
+}
+
+static int heap_fail(heap_t *heap)
+{
+  heap->num_fail++;
+  return 0;
+}
+
+// take n bytes off the bottom of the free space
+static unsigned heap_sbrk(heap_t *heap, unsigned n)
+{
+  if (heap->arena - heap->brk < n)
+    return 0;
+  
+  unsigned addr = heap->brk;
+  heap->brk += n;
+  
+  return addr;
+}
+
+static int heap_refill(vm_t *vm, int cls)
+{
+  heap_t *heap = vm->heap;
+  unsigned block = 1u << (cls + MIN_CLASS);
+  
+  unsigned slab_size = SLAB_SIZE;
+  unsigned slab = heap_sbrk(heap, slab_size);
+  if (!slab) {
+    slab_size = block;
+    slab = heap_sbrk(heap, slab_size);
+    if (!slab)
+      return 0;
+  }
+  
+  for (unsigned ofs = slab_size; ofs >= block; ofs -= block) {
+    unsigned addr = slab + ofs - block;
+    *word(vm, addr) = cls;
+    *word(vm, addr + HEADER) = heap->cls[cls].head;
+    heap->cls[cls].head = addr;
+  }
+  
+  heap->cls[cls].carved += slab_size;
+  
+  return 1;
+}
+
+int heap_alloc(vm_t *vm, unsigned size)
+{
+  heap_t *heap = vm->heap;
+  
+  // anything bigger could wrap round to a small block once the header
+  // is added and it is rounded to a page
+  if (size > MEM_MAX - PAGE_SIZE - HEADER)
+    return heap_fail(heap);
+  
+  unsigned total = size + HEADER;
+  
+  if (total <= MAX_SMALL) {
+    int cls = size_class(total);
+    class_t *c = &heap->cls[cls];
+    
+    if (!c->head && !heap_refill(vm, cls))
+      return heap_fail(heap);
+    
+    unsigned addr = c->head;
+    c->head = *word(vm, addr + HEADER);
+    c->live++;
+    c->num_alloc++;
+    
+    return addr + HEADER;
+  }
+  
+  total = (total + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  
+  unsigned *prev = &heap->large;
+  for (unsigned addr = heap->large; addr; addr = *word(vm, addr + HEADER)) {
+    if (*word(vm, addr) >= total) {
+      *prev = *word(vm, addr + HEADER);
+      heap->large_live++;
+      heap->large_bytes += *word(vm, addr);
+      return addr + HEADER;
+    }
+    prev = word(vm, addr + HEADER);
+  }
+  
+  unsigned addr = heap_sbrk(heap, total);
+  if (!addr)
+    return heap_fail(heap);
+  
+  *word(vm, addr) = total;
+  heap->large_live++;
+  heap->large_bytes += total;
+  
+  return addr + HEADER;
+}
+
+// usable bytes of an allocated block
+static unsigned heap_capacity(vm_t *vm, unsigned ptr)
+{
+  heap_t *heap = vm->heap;
+  
+  if (ptr < heap->base + HEADER || ptr >= heap->brk)
+    vm_error(vm, "heap: invalid pointer 0x%08x", ptr);
+  
+  unsigned hdr = *word(vm, ptr - HEADER);
+  
+  if (hdr < NUM_CLASS)
+    return (1u << (hdr + MIN_CLASS)) - HEADER;
+  
+  return hdr - HEADER;
+}
+
+void heap_free(vm_t *vm, unsigned ptr)
+{
+  heap_t *heap = vm->heap;
+  
+  if (!ptr)
+    return;
+  
+  heap_capacity(vm, ptr);
+  
+  unsigned addr = ptr - HEADER;
+  unsigned hdr = *word(vm, addr);
+  
+  if (hdr < NUM_CLASS) {
+    class_t *c = &heap->cls[hdr];
+    *word(vm, ptr) = c->head;
+    c->head = addr;
+    c->live--;
+    c->num_free++;
+  } else {
+    *word(vm, ptr) = heap->large;
+    heap->large = addr;
+    heap->large_live--;
+    heap->large_bytes -= hdr;
+  }
+}
+
+int heap_realloc(vm_t *vm, unsigned ptr, unsigned size)
+{
+  if (!ptr)
+    return heap_alloc(vm, size);
+  
+  if (!size) {
+    heap_free(vm, ptr);
+    return 0;
+  }
+  
+  unsigned capacity = heap_capacity(vm, ptr);
+  if (size <= capacity)
+    return ptr;
+  
+  unsigned new_ptr = heap_alloc(vm, size);
+  if (!new_ptr)
+    return 0;
+  
+  memcpy(&vm->m_i8[new_ptr], &vm->m_i8[ptr], capacity);
+  heap_free(vm, ptr);
+  
+  return new_ptr;
+}
+
+int heap_arena_alloc(vm_t *vm, unsigned size)
+{
+  heap_t *heap = vm->heap;
+  
+  // checked before rounding too, which could wrap a huge size round to 0
+  if (size > heap->arena - heap->brk)
+    return heap_fail(heap);
+  
+  size = (size + 3) & ~3u;
+  if (size > heap->arena - heap->brk)
+    return heap_fail(heap);
+  
+  heap->arena -= size;
+  
+  if (heap->end - heap->arena > heap->arena_peak)
+    heap->arena_peak = heap->end - heap->arena;
+  
+  return heap->arena;
+}
+
+void heap_arena_reset(vm_t *vm)
+{
+  heap_t *heap = vm->heap;
+  
+  heap->arena = heap->end;
+  heap->arena_resets++;
+}
+
+// the host side of the heap, saved and restored whole by snapshots
+void *heap_state(vm_t *vm, int *size)
+{
+  *size = sizeof(heap_t);
+  
+  return vm->heap;
+}
+
+unsigned heap_end(vm_t *vm)
+{
+  return vm->heap->end;
+}
+
+void vm_heap_stats(vm_t *vm, FILE *out)
+{
+  heap_t *heap = vm->heap;
+  
+  if (!heap)
+    return;
+  
+  fprintf(out, "heap: 0x%08x-0x%08x, %u bytes carved, %u free\n",
+    heap->base, heap->end, heap->brk - heap->base, heap->arena - heap->brk);
+  fprintf(out, "heap: %5s %6s %8s %8s %8s\n", "size", "live", "allocs", "frees", "carved");
+  
+  for (int i = 0; i < NUM_CLASS; i++) {
+    class_t *c = &heap->cls[i];
+    
+    if (!c->carved)
+      continue;
+    
+    fprintf(out, "heap: %5u %6i %8i %8i %8u\n", 1u << (i + MIN_CLASS), c->live, c->num_alloc, c->num_free, c->carved);
+  }
+  
+  fprintf(out, "heap: large %i live, %u bytes\n", heap->large_live, heap->large_bytes);
+  fprintf(out, "heap: arena %u bytes in use, peak %u, %i resets\n",
+    heap->end - heap->arena, heap->arena_peak, heap->arena_resets);
+  
+  if (heap->num_fail)
+    fprintf(out, "heap: %i failed allocations\n", heap->num_fail);
+}
@@ -35,7 +35,36 @@ enum instr_e {
   SETGE,
   SX8_32,
   SX32_8,
-  INT
+  INT,
+  LDL,
+  STL,
+  LEAL,
+  ADDI,
+  CJE,
+  CJNE,
+  CJL,
+  CJG,
+  CJLE,
+  CJGE,
+  SEQ,
+  SNE,
+  SLT,
+  SGT,
+  SLE,
+  SGE,
+  LDS,
+  STS,
+  LDO,
+  STO,
+  LDX,
+  STX,
+  SHL,
+  SHR,
+  AND,
+  OR,
+  XOR,
+  DIVI,
+  MODI
 };
 
 #endif
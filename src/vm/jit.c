@@ -0,0 +1,1434 @@
+#include "v_local.h"
+
+#include "../common/magic.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+//
+// register allocation for native code:
+//   rbx: vm_t *vm
+//   rbp: result of the last CMP (lhs - rhs), stands in for the flags
+//   r12: vm->s_i32
+//   r13: vm->sp
+//   r14: vm->m_i8
+//   r15: jit->addr, native address of every bytecode index
+//
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define NONE -1
+
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G 0xf
+
+#define VM(X) offsetof(vm_t, X)
+
+#define TRACE_HOT 50
+#define TRACE_MAX 1024
+#define TRACE_INLINE 8
+#define TRACE_CODE MB(4)
+
+typedef struct fixup_s fixup_t;
+typedef struct stub_s stub_t;
+
+struct fixup_s {
+  int pos;
+  int target;
+  int sp_ofs;
+  int depth;
+  fixup_t *next;
+};
+
+// an exit to the interpreter that can later be pointed at native code
+struct stub_s {
+  unsigned char *code;
+  int target;
+};
+
+struct jit_s {
+  int num_instr;
+  unsigned char *code;
+  int code_size;
+  int code_max;
+  void **addr;
+  char *is_op;
+  void (*enter)(vm_t *vm, void *target);
+  void *exit;
+  fixup_t *fixup;
+  int tracing;
+  int sp_ofs;
+  int depth;
+  int head;
+  int *hot;
+  int *rec;
+  void **side;
+  int *exit_head;
+  int *exit_depth;
+  stub_t *stub;
+  int num_stub;
+  int max_stub;
+  int tiered;
+  int *func_of;
+  int *num_calls;
+  int *num_trips;
+  int num_tier;
+  int num_osr;
+  int num_trace;
+  int num_abort;
+  int *s_min, *s_max;
+};
+
+static void x_u8(jit_t *jit, int u8)
+{
+  if (jit->code_size >= jit->code_max)
+    error("jit: ran out of code space");
+  
+  jit->code[jit->code_size++] = u8;
+}
+
+static void x_u32(jit_t *jit, int u32)
+{
+  for (int i = 0; i < 4; i++)
+    x_u8(jit, (u32 >> (i * 8)) & 0xff);
+}
+
+static void x_u64(jit_t *jit, unsigned long u64)
+{
+  for (int i = 0; i < 8; i++)
+    x_u8(jit, (u64 >> (i * 8)) & 0xff);
+}
+
+static void x_rex(jit_t *jit, int w, int reg, int index, int base)
+{
+  int rex = 0x40;
+  
+  if (w)
+    rex |= 0x08;
+  if (reg != NONE && reg & 8)
+    rex |= 0x04;
+  if (index != NONE && index & 8)
+    rex |= 0x02;
+  if (base != NONE && base & 8)
+    rex |= 0x01;
+  
+  if (rex != 0x40)
+    x_u8(jit, rex);
+}
+
+static void x_op(jit_t *jit, int op)
+{
+  if (op > 0xff)
+    x_u8(jit, op >> 8);
+  x_u8(jit, op & 0xff);
+}
+
+// op reg, [base + index * scale + disp]
+static void x_mem(jit_t *jit, int w, int op, int reg, int base, int index, int scale, int disp)
+{
+  x_rex(jit, w, reg, index, base);
+  x_op(jit, op);
+  
+  int mod;
+  if (disp == 0 && (base & 7) != RBP)
+    mod = 0;
+  else if (disp >= -128 && disp <= 127)
+    mod = 1;
+  else
+    mod = 2;
+  
+  if (index == NONE && (base & 7) != RSP) {
+    x_u8(jit, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  } else {
+    int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+    int idx = index == NONE ? RSP : index & 7;
+    
+    x_u8(jit, (mod << 6) | ((reg & 7) << 3) | RSP);
+    x_u8(jit, (ss << 6) | (idx << 3) | (base & 7));
+  }
+  
+  if (mod == 1)
+    x_u8(jit, disp & 0xff);
+  else if (mod == 2)
+    x_u32(jit, disp);
+}
+
+// op rm, reg
+static void x_rr(jit_t *jit, int w, int op, int reg, int rm)
+{
+  x_rex(jit, w, reg, NONE, rm);
+  x_op(jit, op);
+  x_u8(jit, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// slot -1 is the top of the eval stack, 0 the next free entry
+static void x_stk(jit_t *jit, int op, int reg, int slot)
+{
+  x_mem(jit, 0, op, reg, R12, R13, 4, (slot + jit->sp_ofs) * 4);
+}
+
+static void x_vm(jit_t *jit, int op, int reg, int ofs)
+{
+  x_mem(jit, 0, op, reg, RBX, NONE, 1, ofs);
+}
+
+static void x_add_sp(jit_t *jit, int n)
+{
+  x_rr(jit, 1, 0x83, n > 0 ? 0 : 5, R13);
+  x_u8(jit, n > 0 ? n : -n);
+}
+
+// straight line code knows the stack depth at every point, so traces only
+// move r13 on the way out
+static void x_sp(jit_t *jit, int n)
+{
+  if (jit->tracing)
+    jit->sp_ofs += n;
+  else
+    x_add_sp(jit, n);
+}
+
+static void x_flush_sp(jit_t *jit)
+{
+  if (jit->sp_ofs)
+    x_add_sp(jit, jit->sp_ofs);
+  jit->sp_ofs = 0;
+}
+
+static void x_push_reg(jit_t *jit, int reg)
+{
+  x_stk(jit, 0x89, reg, 0);
+  x_sp(jit, 1);
+}
+
+// rax = ALIGN_32(rax), zero extended for use as an index
+static void x_align_32(jit_t *jit)
+{
+  x_rr(jit, 0, 0xc1, 5, RAX);
+  x_u8(jit, 2);
+}
+
+// rax = ADDR(rax)
+static void x_addr(jit_t *jit)
+{
+  x_rr(jit, 0, 0x89, RAX, RAX);
+}
+
+static void x_fixup(jit_t *jit, int target)
+{
+  fixup_t *fixup = malloc(sizeof(fixup_t));
+  fixup->pos = jit->code_size;
+  fixup->target = target;
+  fixup->sp_ofs = jit->sp_ofs;
+  fixup->depth = jit->depth;
+  fixup->next = jit->fixup;
+  jit->fixup = fixup;
+  
+  x_u32(jit, 0);
+}
+
+static void x_jmp(jit_t *jit, int target)
+{
+  x_u8(jit, 0xe9);
+  x_fixup(jit, target);
+}
+
+static void x_jcc(jit_t *jit, int cc, int target)
+{
+  x_rr(jit, 0, 0x85, RBP, RBP);
+  x_u8(jit, 0x0f);
+  x_u8(jit, 0x80 | cc);
+  x_fixup(jit, target);
+}
+
+static void x_setcc(jit_t *jit, int cc)
+{
+  x_rr(jit, 0, 0x85, RBP, RBP);
+  x_rr(jit, 0, 0x0f90 | cc, 0, RAX);
+  x_rr(jit, 0, 0x0fb6, RAX, RAX);
+  x_push_reg(jit, RAX);
+}
+
+static void x_exit_at(jit_t *jit, int ip)
+{
+  x_vm(jit, 0xc7, 0, VM(ip));
+  x_u32(jit, ip);
+  x_u8(jit, 0xe9);
+  x_u32(jit, (unsigned char *) jit->exit - (jit->code + jit->code_size + 4));
+}
+
+// fp or cp, at ofs, already at max leaves for the interpreter at ip, where
+// the push is made again and reported as an overflow
+static void x_check_depth(jit_t *jit, int ofs, int max, int ip)
+{
+  x_vm(jit, 0x83, 7, ofs);
+  x_u8(jit, max);
+  x_u8(jit, 0x7c);
+  int pos = jit->code_size;
+  x_u8(jit, 0);
+  
+  if (jit->sp_ofs)
+    x_add_sp(jit, jit->sp_ofs);
+  x_exit_at(jit, ip);
+  
+  jit->code[pos] = jit->code_size - (pos + 1);
+}
+
+// sp outside what the function entered at ip allows, see stack.c, leaves
+// for the interpreter to report it
+static void x_check_stack(jit_t *jit, int ip)
+{
+  int min = jit->s_min[ip];
+  int max = jit->s_max[ip];
+  int pos = -1;
+  
+  // lea eax, [r13 + sp_ofs - min]; cmp eax, max - min; jbe over the exit
+  if (max >= min) {
+    x_mem(jit, 0, 0x8d, RAX, R13, NONE, 1, jit->sp_ofs - min);
+    x_u8(jit, 0x3d);
+    x_u32(jit, max - min);
+    x_u8(jit, 0x76);
+    pos = jit->code_size;
+    x_u8(jit, 0);
+  }
+  
+  if (jit->sp_ofs)
+    x_add_sp(jit, jit->sp_ofs);
+  x_exit_at(jit, ip);
+  
+  if (pos >= 0)
+    jit->code[pos] = jit->code_size - (pos + 1);
+}
+
+// a frame of size that would run from bp into the heap, see vm_check_bp
+static void x_check_bp(jit_t *jit, int size, int ip)
+{
+  // mov eax, bp; sub eax, stack_end; cmp eax, size; jae over the exit
+  x_vm(jit, 0x8b, RAX, VM(bp));
+  x_vm(jit, 0x2b, RAX, VM(stack_end));
+  x_u8(jit, 0x3d);
+  x_u32(jit, size);
+  x_u8(jit, 0x73);
+  int pos = jit->code_size;
+  x_u8(jit, 0);
+  
+  if (jit->sp_ofs)
+    x_add_sp(jit, jit->sp_ofs);
+  x_exit_at(jit, ip);
+  
+  jit->code[pos] = jit->code_size - (pos + 1);
+}
+
+static void x_jmp_to(jit_t *jit, unsigned char *dest)
+{
+  x_u8(jit, 0xe9);
+  x_u32(jit, dest - (jit->code + jit->code_size + 4));
+}
+
+static void x_arith(jit_t *jit, int op)
+{
+  x_stk(jit, 0x8b, RAX, -1);
+  x_stk(jit, op, RAX, -2);
+  x_sp(jit, -1);
+}
+
+static void x_div(jit_t *jit, int result)
+{
+  x_stk(jit, 0x8b, RAX, -2);
+  x_u8(jit, 0x99);
+  x_stk(jit, 0xf7, 7, -1);
+  x_stk(jit, 0x89, result, -2);
+  x_sp(jit, -1);
+}
+
+// the top of the stack divided by a constant, without idiv. a power of two
+// is an arithmetic shift with the quotient rounded towards zero by adding
+// d - 1 to a negative n first, anything else multiplies by div_magic's
+// reciprocal. a negative divisor divides by -d and negates the quotient, the
+// remainder is n - q * d either way. 0 and INT_MIN are left to idiv
+static void x_divi(jit_t *jit, int d, int mod)
+{
+  unsigned ud = d < 0 ? -(unsigned) d : d;
+  int k = log2_exact(ud);
+  
+  if (d == 0 || ud == 0x80000000) {
+    x_stk(jit, 0x8b, RAX, -1);
+    x_u8(jit, 0x99);
+    x_u8(jit, 0xb9);
+    x_u32(jit, d);
+    x_rr(jit, 0, 0xf7, 7, RCX);
+    x_stk(jit, 0x89, mod ? RDX : RAX, -1);
+    return;
+  }
+  
+  if (ud == 1) {
+    if (mod) {
+      x_stk(jit, 0xc7, 0, -1);
+      x_u32(jit, 0);
+    } else if (d < 0) {
+      x_stk(jit, 0xf7, 3, -1);
+    }
+    return;
+  }
+  
+  x_stk(jit, 0x8b, RDX, -1);
+  
+  if (k > 0) {
+    x_rr(jit, 0, 0x89, RDX, RAX);
+    x_rr(jit, 0, 0xc1, 7, RAX);
+    x_u8(jit, 31);
+    x_rr(jit, 0, 0xc1, 5, RAX);
+    x_u8(jit, 32 - k);
+    x_rr(jit, 0, 0x01, RDX, RAX);
+    x_rr(jit, 0, 0xc1, 7, RAX);
+    x_u8(jit, k);
+  } else {
+    unsigned mul;
+    int shift;
+    div_magic(ud, &mul, &shift);
+    
+    x_rr(jit, 1, 0x63, RAX, RDX);
+    x_u8(jit, 0xb9);
+    x_u32(jit, mul);
+    x_rr(jit, 1, 0x0faf, RAX, RCX);
+    x_rr(jit, 1, 0xc1, 7, RAX);
+    x_u8(jit, shift);
+    x_rr(jit, 0, 0xc1, 7, RDX);
+    x_u8(jit, 31);
+    x_rr(jit, 0, 0x29, RDX, RAX);
+  }
+  
+  if (mod) {
+    x_rr(jit, 0, 0x69, RAX, RAX);
+    x_u32(jit, ud);
+    x_stk(jit, 0x8b, RDX, -1);
+    x_rr(jit, 0, 0x29, RAX, RDX);
+    x_stk(jit, 0x89, RDX, -1);
+  } else {
+    if (d < 0)
+      x_rr(jit, 0, 0xf7, 3, RAX);
+    x_stk(jit, 0x89, RAX, -1);
+  }
+}
+
+// ecx = rhs, eax = lhs shifted by cl, as shl and sar mask the count to 5 bits
+static void x_shift(jit_t *jit, int ext)
+{
+  x_stk(jit, 0x8b, RCX, -1);
+  x_stk(jit, 0x8b, RAX, -2);
+  x_rr(jit, 0, 0xd3, ext, RAX);
+  x_stk(jit, 0x89, RAX, -2);
+  x_sp(jit, -1);
+}
+
+// eax = vm->bp + i32
+static void x_local(jit_t *jit, int i32)
+{
+  x_vm(jit, 0x8b, RAX, VM(bp));
+  x_rr(jit, 0, 0x81, 0, RAX);
+  x_u32(jit, i32);
+}
+
+// rax = offset of the current frame's slots from vm->slot
+static void x_slots(jit_t *jit)
+{
+  x_vm(jit, 0x8b, RAX, VM(fp));
+  x_rr(jit, 0, 0x69, RAX, RAX);
+  x_u32(jit, MAX_SLOT * 4);
+}
+
+// rax = ALIGN_32(base + index * i32), with base under index on the stack
+static void x_index(jit_t *jit, int i32)
+{
+  x_stk(jit, 0x8b, RAX, -1);
+  x_rr(jit, 0, 0x69, RAX, RAX);
+  x_u32(jit, i32);
+  x_stk(jit, 0x03, RAX, -2);
+  x_align_32(jit);
+}
+
+// eax = lhs - rhs with the flags set from it, rbp is left alone
+static void x_diff(jit_t *jit, int slot)
+{
+  x_stk(jit, 0x8b, RAX, slot);
+  x_stk(jit, 0x2b, RAX, slot + 1);
+  x_rr(jit, 0, 0x85, RAX, RAX);
+}
+
+static void x_cj(jit_t *jit, int cc, int target)
+{
+  x_sp(jit, -2);
+  x_diff(jit, 0);
+  x_u8(jit, 0x0f);
+  x_u8(jit, 0x80 | cc);
+  x_fixup(jit, target);
+}
+
+static void x_scc(jit_t *jit, int cc)
+{
+  x_diff(jit, -2);
+  x_rr(jit, 0, 0x0f90 | cc, 0, RAX);
+  x_rr(jit, 0, 0x0fb6, RAX, RAX);
+  x_stk(jit, 0x89, RAX, -2);
+  x_sp(jit, -1);
+}
+
+static void emit_enter(jit_t *jit)
+{
+  jit->enter = (void *) (jit->code + jit->code_size);
+  
+  x_u8(jit, 0x53);
+  x_u8(jit, 0x55);
+  x_u8(jit, 0x41); x_u8(jit, 0x54);
+  x_u8(jit, 0x41); x_u8(jit, 0x55);
+  x_u8(jit, 0x41); x_u8(jit, 0x56);
+  x_u8(jit, 0x41); x_u8(jit, 0x57);
+  x_rr(jit, 1, 0x83, 5, RSP);
+  x_u8(jit, 8);
+  
+  x_rr(jit, 1, 0x89, RDI, RBX);
+  x_mem(jit, 1, 0x8b, R12, RBX, NONE, 1, VM(s_i32));
+  x_vm(jit, 0x8b, R13, VM(sp));
+  x_mem(jit, 1, 0x8b, R14, RBX, NONE, 1, VM(m_i8));
+  x_u8(jit, 0x49); x_u8(jit, 0xbf);
+  x_u64(jit, (unsigned long) jit->addr);
+  x_vm(jit, 0x8b, RBP, VM(f_gtr));
+  x_vm(jit, 0x2b, RBP, VM(f_lss));
+  
+  x_rr(jit, 0, 0xff, 4, RSI);
+}
+
+// write sp and the flags back to the vm
+static void x_sync(jit_t *jit)
+{
+  x_vm(jit, 0x89, R13, VM(sp));
+  
+  x_rr(jit, 0, 0x85, RBP, RBP);
+  x_rr(jit, 0, 0x0f90 | CC_G, 0, RAX);
+  x_rr(jit, 0, 0x0fb6, RAX, RAX);
+  x_vm(jit, 0x89, RAX, VM(f_gtr));
+  x_rr(jit, 0, 0x0f90 | CC_L, 0, RAX);
+  x_rr(jit, 0, 0x0fb6, RAX, RAX);
+  x_vm(jit, 0x89, RAX, VM(f_lss));
+  x_rr(jit, 0, 0x0f90 | CC_E, 0, RAX);
+  x_rr(jit, 0, 0x0fb6, RAX, RAX);
+  x_vm(jit, 0x89, RAX, VM(f_equ));
+}
+
+static void emit_exit(jit_t *jit)
+{
+  jit->exit = jit->code + jit->code_size;
+  
+  x_sync(jit);
+  
+  x_rr(jit, 1, 0x83, 0, RSP);
+  x_u8(jit, 8);
+  x_u8(jit, 0x41); x_u8(jit, 0x5f);
+  x_u8(jit, 0x41); x_u8(jit, 0x5e);
+  x_u8(jit, 0x41); x_u8(jit, 0x5d);
+  x_u8(jit, 0x41); x_u8(jit, 0x5c);
+  x_u8(jit, 0x5d);
+  x_u8(jit, 0x5b);
+  x_u8(jit, 0xc3);
+}
+
+static int emit_op(jit_t *jit, instr_t *instr, int ip)
+{
+  int i32 = instr[ip + 1];
+  
+  switch (instr[ip]) {
+  case PUSH:
+    x_stk(jit, 0xc7, 0, 0);
+    x_u32(jit, i32);
+    x_sp(jit, 1);
+    break;
+  case ADD:
+    x_arith(jit, 0x01);
+    break;
+  case SUB:
+    x_arith(jit, 0x29);
+    break;
+  case MUL:
+    x_stk(jit, 0x8b, RAX, -2);
+    x_stk(jit, 0x0faf, RAX, -1);
+    x_stk(jit, 0x89, RAX, -2);
+    x_sp(jit, -1);
+    break;
+  case DIV:
+    x_div(jit, RAX);
+    break;
+  case MOD:
+    x_div(jit, RDX);
+    break;
+  case DIVI:
+    x_divi(jit, i32, 0);
+    break;
+  case MODI:
+    x_divi(jit, i32, 1);
+    break;
+  case SHL:
+    x_shift(jit, 4);
+    break;
+  case SHR:
+    x_shift(jit, 7);
+    break;
+  case AND:
+    x_arith(jit, 0x21);
+    break;
+  case OR:
+    x_arith(jit, 0x09);
+    break;
+  case XOR:
+    x_arith(jit, 0x31);
+    break;
+  case LDR:
+    x_stk(jit, 0x8b, RAX, -1);
+    x_align_32(jit);
+    x_mem(jit, 0, 0x8b, RAX, R14, RAX, 4, 0);
+    x_stk(jit, 0x89, RAX, -1);
+    break;
+  case LDR8:
+    x_stk(jit, 0x8b, RAX, -1);
+    x_addr(jit);
+    x_mem(jit, 0, 0x0fbe, RAX, R14, RAX, 1, 0);
+    x_stk(jit, 0x89, RAX, -1);
+    break;
+  case STR:
+    x_stk(jit, 0x8b, RAX, -1);
+    x_stk(jit, 0x8b, RCX, -2);
+    x_align_32(jit);
+    x_mem(jit, 0, 0x89, RCX, R14, RAX, 4, 0);
+    x_sp(jit, -2);
+    break;
+  case STR8:
+    x_stk(jit, 0x8b, RAX, -1);
+    x_stk(jit, 0x8b, RCX, -2);
+    x_addr(jit);
+    x_mem(jit, 0, 0x88, RCX, R14, RAX, 1, 0);
+    x_sp(jit, -2);
+    break;
+  case LBP:
+    x_vm(jit, 0x8b, RAX, VM(bp));
+    x_push_reg(jit, RAX);
+    break;
+  case ENTER:
+    x_check_depth(jit, VM(fp), MAX_FRAME, ip);
+    x_check_stack(jit, ip);
+    x_check_bp(jit, i32, ip);
+    x_vm(jit, 0x8b, RAX, VM(fp));
+    x_vm(jit, 0x8b, RCX, VM(bp));
+    x_mem(jit, 0, 0x89, RCX, RBX, RAX, 4, VM(frame));
+    x_rr(jit, 0, 0xff, 0, RAX);
+    x_vm(jit, 0x89, RAX, VM(fp));
+    x_rr(jit, 0, 0x81, 5, RCX);
+    x_u32(jit, i32);
+    x_vm(jit, 0x89, RCX, VM(bp));
+    break;
+  case LEAVE:
+    x_vm(jit, 0x8b, RAX, VM(fp));
+    x_rr(jit, 0, 0xff, 1, RAX);
+    x_vm(jit, 0x89, RAX, VM(fp));
+    x_mem(jit, 0, 0x8b, RCX, RBX, RAX, 4, VM(frame));
+    x_vm(jit, 0x89, RCX, VM(bp));
+    break;
+  case CALL:
+    x_check_depth(jit, VM(cp), MAX_CALL, ip);
+    x_vm(jit, 0x8b, RAX, VM(cp));
+    x_mem(jit, 0, 0xc7, 0, RBX, RAX, 4, VM(call));
+    x_u32(jit, ip + 2);
+    x_rr(jit, 0, 0xff, 0, RAX);
+    x_vm(jit, 0x89, RAX, VM(cp));
+    x_jmp(jit, i32);
+    break;
+  case RET:
+    x_vm(jit, 0x8b, RAX, VM(cp));
+    x_rr(jit, 0, 0xff, 1, RAX);
+    x_vm(jit, 0x89, RAX, VM(cp));
+    x_mem(jit, 0, 0x8b, RAX, RBX, RAX, 4, VM(call));
+    x_vm(jit, 0x89, RAX, VM(ip));
+    x_rr(jit, 0, 0x81, 7, RAX);
+    x_u32(jit, jit->num_instr);
+    x_u8(jit, 0x0f);
+    x_u8(jit, 0x83);
+    x_u32(jit, (unsigned char *) jit->exit - (jit->code + jit->code_size + 4));
+    x_mem(jit, 0, 0xff, 4, R15, RAX, 8, 0);
+    break;
+  case JMP:
+    x_jmp(jit, i32);
+    break;
+  case CMP:
+    x_stk(jit, 0x8b, RBP, -2);
+    x_stk(jit, 0x2b, RBP, -1);
+    x_sp(jit, -2);
+    break;
+  case JE:
+    x_jcc(jit, CC_E, i32);
+    break;
+  case JNE:
+    x_jcc(jit, CC_NE, i32);
+    break;
+  case JL:
+    x_jcc(jit, CC_L, i32);
+    break;
+  case JG:
+    x_jcc(jit, CC_G, i32);
+    break;
+  case JLE:
+    x_jcc(jit, CC_LE, i32);
+    break;
+  case JGE:
+    x_jcc(jit, CC_GE, i32);
+    break;
+  case SETE:
+    x_setcc(jit, CC_E);
+    break;
+  case SETNE:
+    x_setcc(jit, CC_NE);
+    break;
+  case SETL:
+    x_setcc(jit, CC_L);
+    break;
+  case SETG:
+    x_setcc(jit, CC_G);
+    break;
+  case SETLE:
+    x_setcc(jit, CC_LE);
+    break;
+  case SETGE:
+    x_setcc(jit, CC_GE);
+    break;
+  case SX8_32:
+    x_stk(jit, 0x8b, RAX, -1);
+    x_rr(jit, 0, 0x0fbe, RAX, RAX);
+    x_stk(jit, 0x89, RAX, -1);
+    break;
+  case SX32_8:
+    x_stk(jit, 0x8b, RAX, -1);
+    x_rr(jit, 0, 0x89, RAX, RDX);
+    x_rr(jit, 0, 0xc1, 5, RDX);
+    x_u8(jit, 24);
+    x_rr(jit, 0, 0x81, 4, RDX);
+    x_u32(jit, 0x80);
+    x_rr(jit, 0, 0x83, 4, RAX);
+    x_u8(jit, 0x7f);
+    x_rr(jit, 0, 0x09, RDX, RAX);
+    x_stk(jit, 0x89, RAX, -1);
+    break;
+  case LDL:
+    x_local(jit, i32);
+    x_align_32(jit);
+    x_mem(jit, 0, 0x8b, RAX, R14, RAX, 4, 0);
+    x_push_reg(jit, RAX);
+    break;
+  case STL:
+    x_local(jit, i32);
+    x_stk(jit, 0x8b, RCX, -1);
+    x_align_32(jit);
+    x_mem(jit, 0, 0x89, RCX, R14, RAX, 4, 0);
+    x_sp(jit, -1);
+    break;
+  case LEAL:
+    x_local(jit, i32);
+    x_push_reg(jit, RAX);
+    break;
+  case ADDI:
+    x_stk(jit, 0x81, 0, -1);
+    x_u32(jit, i32);
+    break;
+  case CJE:
+    x_cj(jit, CC_E, i32);
+    break;
+  case CJNE:
+    x_cj(jit, CC_NE, i32);
+    break;
+  case CJL:
+    x_cj(jit, CC_L, i32);
+    break;
+  case CJG:
+    x_cj(jit, CC_G, i32);
+    break;
+  case CJLE:
+    x_cj(jit, CC_LE, i32);
+    break;
+  case CJGE:
+    x_cj(jit, CC_GE, i32);
+    break;
+  case SEQ:
+    x_scc(jit, CC_E);
+    break;
+  case SNE:
+    x_scc(jit, CC_NE);
+    break;
+  case SLT:
+    x_scc(jit, CC_L);
+    break;
+  case SGT:
+    x_scc(jit, CC_G);
+    break;
+  case SLE:
+    x_scc(jit, CC_LE);
+    break;
+  case SGE:
+    x_scc(jit, CC_GE);
+    break;
+  case LDS:
+    x_slots(jit);
+    x_mem(jit, 0, 0x8b, RAX, RBX, RAX, 1, VM(slot) + i32 * 4);
+    x_push_reg(jit, RAX);
+    break;
+  case STS:
+    x_slots(jit);
+    x_stk(jit, 0x8b, RCX, -1);
+    x_mem(jit, 0, 0x89, RCX, RBX, RAX, 1, VM(slot) + i32 * 4);
+    x_sp(jit, -1);
+    break;
+  case LDO:
+    x_stk(jit, 0x8b, RAX, -1);
+    x_rr(jit, 0, 0x81, 0, RAX);
+    x_u32(jit, i32);
+    x_align_32(jit);
+    x_mem(jit, 0, 0x8b, RAX, R14, RAX, 4, 0);
+    x_stk(jit, 0x89, RAX, -1);
+    break;
+  case STO:
+    x_stk(jit, 0x8b, RAX, -1);
+    x_rr(jit, 0, 0x81, 0, RAX);
+    x_u32(jit, i32);
+    x_stk(jit, 0x8b, RCX, -2);
+    x_align_32(jit);
+    x_mem(jit, 0, 0x89, RCX, R14, RAX, 4, 0);
+    x_sp(jit, -2);
+    break;
+  case LDX:
+    x_index(jit, i32);
+    x_mem(jit, 0, 0x8b, RAX, R14, RAX, 4, 0);
+    x_stk(jit, 0x89, RAX, -2);
+    x_sp(jit, -1);
+    break;
+  case STX:
+    x_index(jit, i32);
+    x_stk(jit, 0x8b, RCX, -3);
+    x_mem(jit, 0, 0x89, RCX, R14, RAX, 4, 0);
+    x_sp(jit, -3);
+    break;
+  default:
+    return 0;
+  }
+  
+  return 1;
+}
+
+static void jit_stub(jit_t *jit, unsigned char *code, int target)
+{
+  if (jit->num_stub == jit->max_stub) {
+    jit->max_stub = jit->max_stub ? jit->max_stub * 2 : 64;
+    jit->stub = realloc(jit->stub, jit->max_stub * sizeof(stub_t));
+  }
+  
+  jit->stub[jit->num_stub].code = code;
+  jit->stub[jit->num_stub].target = target;
+  jit->num_stub++;
+}
+
+static void jit_patch_stub(stub_t *stub, void *dest)
+{
+  int rel = (unsigned char *) dest - (stub->code + 5);
+  stub->code[0] = 0xe9;
+  memcpy(stub->code + 1, &rel, 4);
+  stub->target = NONE;
+}
+
+// send every exit at target to dest instead, the code must be writable
+static void jit_patch(jit_t *jit, int target, void *dest)
+{
+  for (int i = 0; i < jit->num_stub; i++) {
+    if (jit->stub[i].target == target)
+      jit_patch_stub(&jit->stub[i], dest);
+  }
+}
+
+static void trace_guard(jit_t *jit, fixup_t *fixup, unsigned char *stub);
+
+// branches into compiled code go straight there, anything else exits to
+// the interpreter
+static void jit_link(jit_t *jit, bin_t *bin)
+{
+  while (jit->fixup) {
+    fixup_t *fixup = jit->fixup;
+    int target = fixup->target;
+    
+    unsigned char *dest;
+    if (target >= 0 && target < bin->num_instr && jit->is_op[target]) {
+      dest = jit->addr[target];
+    } else {
+      dest = jit->code + jit->code_size;
+      if (fixup->sp_ofs)
+        x_add_sp(jit, fixup->sp_ofs);
+      
+      if (jit->tracing && target >= 0 && target <= bin->num_instr && jit->side[target]) {
+        x_jmp_to(jit, jit->side[target]);
+      } else {
+        if (jit->tracing)
+          trace_guard(jit, fixup, jit->code + jit->code_size);
+        else if (jit->tiered)
+          jit_stub(jit, jit->code + jit->code_size, target);
+        x_exit_at(jit, target);
+      }
+    }
+    
+    int rel = dest - (jit->code + fixup->pos + 4);
+    memcpy(jit->code + fixup->pos, &rel, 4);
+    
+    jit->fixup = fixup->next;
+    free(fixup);
+  }
+}
+
+static void jit_compile(jit_t *jit, bin_t *bin, int start, int end)
+{
+  mprotect(jit->code, jit->code_max, PROT_READ | PROT_WRITE);
+  
+  int ip = start;
+  while (ip < end) {
+    jit->is_op[ip] = 1;
+    ip += instr_len(bin->instr[ip]);
+  }
+  
+  ip = start;
+  while (ip < end) {
+    jit->addr[ip] = jit->code + jit->code_size;
+    
+    if (ip + instr_len(bin->instr[ip]) > end || !emit_op(jit, bin->instr, ip))
+      x_exit_at(jit, ip);
+    
+    ip += instr_len(bin->instr[ip]);
+  }
+  
+  x_exit_at(jit, end);
+  
+  jit_link(jit, bin);
+  
+  mprotect(jit->code, jit->code_max, PROT_READ | PROT_EXEC);
+}
+
+jit_t *make_jit(vm_t *vm, int code_max)
+{
+  bin_t *bin = vm->bin;
+  jit_t *jit = malloc(sizeof(jit_t));
+  
+  jit->num_instr = bin->num_instr;
+  jit->code_max = (code_max + 4095) & ~4095;
+  jit->code = mmap(NULL, jit->code_max, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED)
+    error("jit: could not map code buffer");
+  
+  jit->code_size = 0;
+  jit->fixup = NULL;
+  jit->tracing = 0;
+  jit->sp_ofs = 0;
+  jit->depth = 0;
+  jit->head = 0;
+  jit->addr = malloc((bin->num_instr + 1) * sizeof(void *));
+  jit->is_op = calloc(bin->num_instr + 1, 1);
+  jit->hot = NULL;
+  jit->rec = NULL;
+  jit->side = NULL;
+  jit->exit_head = NULL;
+  jit->exit_depth = NULL;
+  jit->stub = NULL;
+  jit->num_stub = 0;
+  jit->max_stub = 0;
+  jit->tiered = 0;
+  jit->func_of = NULL;
+  jit->num_calls = NULL;
+  jit->num_trips = NULL;
+  jit->num_tier = 0;
+  jit->num_osr = 0;
+  jit->num_trace = 0;
+  jit->num_abort = 0;
+  jit->s_min = vm->s_min;
+  jit->s_max = vm->s_max;
+  
+  emit_exit(jit);
+  emit_enter(jit);
+  
+  for (int i = 0; i <= bin->num_instr; i++)
+    jit->addr[i] = jit->exit;
+  
+  return jit;
+}
+
+void vm_jit_load(vm_t *vm)
+{
+  vm->jit = make_jit(vm, vm->bin->num_instr * 96 + 4096);
+  jit_compile(vm->jit, vm->bin, 0, vm->bin->num_instr);
+}
+
+void vm_exec_jit(vm_t *vm)
+{
+  jit_t *jit = vm->jit;
+  
+  while (!vm->f_exit) {
+    if (vm->ip >= 0 && vm->ip < vm->bin->num_instr && jit->addr[vm->ip] != jit->exit)
+      jit->enter(vm, jit->addr[vm->ip]);
+    
+    if (!vm->f_exit)
+      vm_step(vm);
+  }
+}
+
+//
+// tracing
+//
+// the interpreter counts the backward jumps closing each loop. once a loop
+// is hot the next trip round it is recorded, following calls into their
+// callees, and the path taken is compiled as one straight run of native
+// code. every branch becomes a guard that exits to the interpreter at the
+// other side, calls and returns only move the call stack, and the end of
+// the trace jumps back to its start.
+//
+// a guard that keeps exiting gets a side trace of its own, recorded from
+// the exit back round to the loop head, and is patched to jump straight
+// into it. loops that leave their function, nest another loop or run too
+// long are never traced.
+//
+
+static int trace_cc(instr_t op)
+{
+  switch (op) {
+  case JE:
+  case CJE:
+    return CC_E;
+  case JNE:
+  case CJNE:
+    return CC_NE;
+  case JL:
+  case CJL:
+    return CC_L;
+  case JG:
+  case CJG:
+    return CC_G;
+  case JLE:
+  case CJLE:
+    return CC_LE;
+  case JGE:
+  case CJGE:
+    return CC_GE;
+  default:
+    return NONE;
+  }
+}
+
+// exit to the interpreter at target when cc holds
+static void x_guard(jit_t *jit, instr_t op, int cc, int target)
+{
+  if (op >= CJE && op <= CJGE)
+    x_cj(jit, cc, target);
+  else
+    x_jcc(jit, cc, target);
+}
+
+// syscalls go through vm_int with the vm up to date, the trace carries on
+// unless the program exited
+static void x_int(jit_t *jit, int ip, int code)
+{
+  x_flush_sp(jit);
+  x_sync(jit);
+  x_vm(jit, 0xc7, 0, VM(ip));
+  x_u32(jit, ip + 2);
+  
+  x_rr(jit, 1, 0x89, RBX, RDI);
+  x_u8(jit, 0xbe);
+  x_u32(jit, code);
+  x_u8(jit, 0x48); x_u8(jit, 0xb8);
+  x_u64(jit, (unsigned long) vm_int);
+  x_rr(jit, 0, 0xff, 2, RAX);
+  
+  x_vm(jit, 0x8b, R13, VM(sp));
+  x_vm(jit, 0x83, 7, VM(f_exit));
+  x_u8(jit, 0);
+  x_u8(jit, 0x0f);
+  x_u8(jit, 0x80 | CC_NE);
+  x_fixup(jit, ip + 2);
+}
+
+// note where a guard's exit stub is and which loop it leaves from, so a
+// side trace can be recorded and patched in later
+static void trace_guard(jit_t *jit, fixup_t *fixup, unsigned char *stub)
+{
+  int ip = fixup->target;
+  
+  jit_stub(jit, stub, ip);
+  
+  // an exit reached from two loops or at two depths has no single trace
+  // to record
+  if (jit->exit_head[ip] == NONE) {
+    jit->exit_head[ip] = jit->head;
+    jit->exit_depth[ip] = fixup->depth;
+  } else if (jit->exit_head[ip] != jit->head || jit->exit_depth[ip] != fixup->depth) {
+    jit->exit_head[ip] = -2;
+  }
+}
+
+// entry is head for a loop's own trace or a guard's exit for a side trace,
+// depth is how many calls deep into the loop entry is
+static int trace_compile(jit_t *jit, bin_t *bin, int head, int entry, int depth, int num_rec)
+{
+  if (jit->code_size + num_rec * 160 + 4096 > jit->code_max)
+    return 0;
+  
+  mprotect(jit->code, jit->code_max, PROT_READ | PROT_WRITE);
+  
+  instr_t *instr = bin->instr;
+  unsigned char *start = jit->code + jit->code_size;
+  
+  jit->tracing = 1;
+  jit->sp_ofs = 0;
+  jit->depth = depth;
+  jit->head = head;
+  
+  int num_call = 0;
+  
+  for (int i = 0; i < num_rec; i++) {
+    int ip = jit->rec[i];
+    int next = i + 1 < num_rec ? jit->rec[i + 1] : head;
+    int i32 = instr[ip + 1];
+    int cc = trace_cc(instr[ip]);
+    
+    if (cc != NONE) {
+      if (i32 == ip + 2) {
+        if (instr[ip] >= CJE && instr[ip] <= CJGE)
+          x_sp(jit, -2);
+      } else if (next == i32) {
+        x_guard(jit, instr[ip], cc ^ 1, ip + 2);
+      } else {
+        x_guard(jit, instr[ip], cc, i32);
+      }
+      continue;
+    }
+    
+    switch (instr[ip]) {
+    case JMP:
+      break;
+    case CALL:
+      x_check_depth(jit, VM(cp), MAX_CALL, ip);
+      x_vm(jit, 0x8b, RAX, VM(cp));
+      x_mem(jit, 0, 0xc7, 0, RBX, RAX, 4, VM(call));
+      x_u32(jit, ip + 2);
+      x_rr(jit, 0, 0xff, 0, RAX);
+      x_vm(jit, 0x89, RAX, VM(cp));
+      jit->depth++;
+      num_call++;
+      break;
+    case RET:
+      // a side trace can start inside a function called from more than
+      // one place, so a return from a call made before the trace was
+      // entered has to check it goes back where it did when recorded. the
+      // interpreter takes the return otherwise, a side trace from there
+      // would only hit the same check
+      if (num_call == 0) {
+        x_vm(jit, 0x8b, RAX, VM(cp));
+        x_mem(jit, 0, 0x8b, RAX, RBX, RAX, 4, VM(call) - 4);
+        x_rr(jit, 0, 0x81, 7, RAX);
+        x_u32(jit, next);
+        x_u8(jit, 0x0f);
+        x_u8(jit, 0x80 | CC_NE);
+        x_fixup(jit, ip);
+        jit->exit_head[ip] = -2;
+      } else {
+        num_call--;
+      }
+      x_vm(jit, 0xff, 1, VM(cp));
+      jit->depth--;
+      break;
+    case INT:
+      x_int(jit, ip, i32);
+      break;
+    default:
+      emit_op(jit, instr, ip);
+      break;
+    }
+  }
+  
+  x_flush_sp(jit);
+  x_jmp_to(jit, entry == head ? start : jit->addr[head]);
+  
+  jit_link(jit, bin);
+  jit->tracing = 0;
+  
+  if (entry == head) {
+    jit->addr[head] = start;
+  } else {
+    jit->side[entry] = start;
+    jit_patch(jit, entry, start);
+  }
+  
+  mprotect(jit->code, jit->code_max, PROT_READ | PROT_EXEC);
+  
+  jit->num_trace++;
+  
+  return 1;
+}
+
+// interpret from entry round to the loop at head, noting every ip on the
+// way. cp is the call depth the loop itself runs at
+static void trace_record(vm_t *vm, jit_t *jit, int head, int cp, int depth)
+{
+  instr_t *instr = vm->bin->instr;
+  int entry = vm->ip;
+  int num_rec = 0;
+  
+  while (!vm->f_exit) {
+    int ip = vm->ip;
+    instr_t op = instr[ip];
+    
+    if (ip == head && vm->cp == cp && num_rec > 0) {
+      if (trace_compile(jit, vm->bin, head, entry, depth, num_rec))
+        return;
+      break;
+    }
+    
+    if (num_rec >= TRACE_MAX)
+      break;
+    if (op == RET && vm->cp <= cp)
+      break;
+    if (op == CALL && vm->cp - cp >= TRACE_INLINE)
+      break;
+    
+    jit->rec[num_rec++] = ip;
+    vm_step(vm);
+    
+    if (op != CALL && op != RET && vm->ip <= ip && !(vm->ip == head && vm->cp == cp))
+      break;
+  }
+  
+  jit->hot[entry] = -1;
+  jit->num_abort++;
+}
+
+void vm_trace_load(vm_t *vm)
+{
+  int num_instr = vm->bin->num_instr;
+  
+  jit_t *jit = make_jit(vm, TRACE_CODE);
+  jit->hot = calloc(num_instr + 1, sizeof(int));
+  jit->rec = malloc(TRACE_MAX * sizeof(int));
+  jit->side = calloc(num_instr + 1, sizeof(void *));
+  jit->exit_head = malloc((num_instr + 1) * sizeof(int));
+  jit->exit_depth = malloc((num_instr + 1) * sizeof(int));
+  
+  for (int i = 0; i <= num_instr; i++)
+    jit->exit_head[i] = NONE;
+  
+  vm->jit = jit;
+}
+
+// run the trace at head and count the exits it leaves by
+static void trace_run(vm_t *vm, jit_t *jit, int head)
+{
+  vm->ip = head;
+  jit->enter(vm, jit->addr[head]);
+  
+  int ip = vm->ip;
+  if (vm->f_exit || jit->exit_head[ip] < 0 || jit->hot[ip] < 0)
+    return;
+  
+  if (++jit->hot[ip] >= TRACE_HOT)
+    trace_record(vm, jit, jit->exit_head[ip], vm->cp - jit->exit_depth[ip], jit->exit_depth[ip]);
+}
+
+void vm_exec_trace(vm_t *vm)
+{
+  jit_t *jit = vm->jit;
+  instr_t *instr = vm->bin->instr;
+  
+  while (!vm->f_exit) {
+    int ip = vm->ip;
+    
+    if (instr[ip] != JMP || instr[ip + 1] > ip) {
+      vm_step(vm);
+      continue;
+    }
+    
+    int head = instr[ip + 1];
+    
+    if (jit->addr[head] != jit->exit) {
+      trace_run(vm, jit, head);
+      continue;
+    }
+    
+    vm_step(vm);
+    
+    if (jit->hot[head] >= 0 && ++jit->hot[head] >= TRACE_HOT)
+      trace_record(vm, jit, head, vm->cp, 0);
+  }
+  
+  if (vm->stats)
+    fprintf(stderr, "trace: %i traces, %i given up on\n", jit->num_trace, jit->num_abort);
+}
+
+//
+// tiers
+//
+// every function starts out interpreted, counting the times it is entered
+// and the trips round its loops. whichever passes its threshold first
+// gets the function compiled whole by the method jit. code compiled
+// earlier that exits into it is patched to jump straight in. native code
+// keeps all its state in the vm, so a function compiled while one of its
+// loops is running carries on natively from the loop head on the next
+// trip, on stack replacement comes for free.
+//
+
+static void tier_compile(vm_t *vm, jit_t *jit, int func, int count, char *why)
+{
+  bin_t *bin = vm->bin;
+  
+  int start = bin->sym[func].pos;
+  int end = start;
+  while (end < bin->num_instr && jit->func_of[end] == func)
+    end++;
+  
+  jit_compile(jit, bin, start, end);
+  
+  mprotect(jit->code, jit->code_max, PROT_READ | PROT_WRITE);
+  for (int i = 0; i < jit->num_stub; i++) {
+    int target = jit->stub[i].target;
+    if (target >= start && target < end && jit->is_op[target])
+      jit_patch_stub(&jit->stub[i], jit->addr[target]);
+  }
+  mprotect(jit->code, jit->code_max, PROT_READ | PROT_EXEC);
+  
+  jit->num_calls[func] = -1;
+  jit->num_tier++;
+  
+  if (vm->stats)
+    fprintf(stderr, "tier: %s compiled after %i %s\n", hash_get(bin->sym[func].name), count, why);
+}
+
+// ip is the start of a function about to run in the interpreter
+static void tier_call(vm_t *vm, jit_t *jit, int ip)
+{
+  int func = jit->func_of[ip];
+  if (func < 0 || vm->bin->sym[func].pos != ip || jit->num_calls[func] < 0)
+    return;
+  
+  if (++jit->num_calls[func] >= vm->tier_calls)
+    tier_compile(vm, jit, func, jit->num_calls[func], "calls");
+}
+
+// ip is a backward jump about to run in the interpreter
+static void tier_trip(vm_t *vm, jit_t *jit, int ip)
+{
+  int func = jit->func_of[ip];
+  if (func < 0 || jit->num_calls[func] < 0)
+    return;
+  
+  if (++jit->num_trips[func] >= vm->tier_trips) {
+    tier_compile(vm, jit, func, jit->num_trips[func], "loop trips");
+    jit->num_osr++;
+  }
+}
+
+void vm_tier_load(vm_t *vm)
+{
+  bin_t *bin = vm->bin;
+  
+  jit_t *jit = make_jit(vm, bin->num_instr * 96 + 4096);
+  jit->tiered = 1;
+  jit->func_of = bin_func_map(bin);
+  jit->num_calls = calloc(bin->num_sym + 1, sizeof(int));
+  jit->num_trips = calloc(bin->num_sym + 1, sizeof(int));
+  
+  vm->jit = jit;
+  
+  // without symbols there is nothing to tier by
+  if (!bin->num_sym)
+    jit_compile(jit, bin, 0, bin->num_instr);
+}
+
+void vm_exec_tier(vm_t *vm)
+{
+  jit_t *jit = vm->jit;
+  instr_t *instr = vm->bin->instr;
+  
+  while (!vm->f_exit) {
+    int ip = vm->ip;
+    
+    if (jit->addr[ip] != jit->exit) {
+      jit->enter(vm, jit->addr[ip]);
+      
+      // native code stops either on the way into interpreted code or on an
+      // op it leaves to the interpreter
+      if (!vm->f_exit) {
+        tier_call(vm, jit, vm->ip);
+        if (jit->addr[vm->ip] != jit->exit)
+          vm_step(vm);
+      }
+      continue;
+    }
+    
+    if (instr[ip] == CALL)
+      tier_call(vm, jit, instr[ip + 1]);
+    else if (instr[ip] == JMP && instr[ip + 1] <= ip)
+      tier_trip(vm, jit, ip);
+    
+    vm_step(vm);
+  }
+  
+  if (vm->stats)
+    fprintf(stderr, "tier: %i of %i functions compiled, %i on stack\n", jit->num_tier, vm->bin->num_sym, jit->num_osr);
+}
+
+#else
+
+void vm_jit_load(vm_t *vm)
+{
+  vm->jit = NULL;
+}
+
+void vm_exec_jit(vm_t *vm)
+{
+  vm_exec_switch(vm);
+}
+
+void vm_trace_load(vm_t *vm)
+{
+  vm->jit = NULL;
+}
+
+void vm_exec_trace(vm_t *vm)
+{
+  vm_exec_switch(vm);
+}
+
+void vm_tier_load(vm_t *vm)
+{
+  vm->jit = NULL;
+}
+
+void vm_exec_tier(vm_t *vm)
+{
+  vm_exec_switch(vm);
+}
+
+#endif
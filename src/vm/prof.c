@@ -0,0 +1,442 @@
+#include "v_local.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+//
+// profiler
+//
+// a loop of its own around vm_step, so the engines pay nothing for it. it
+// counts every opcode, every pair of opcodes run back to back and, for
+// each function in the bin's symbols, its calls and the instructions run
+// inside it (self) and inside it or anything it called (total). a call
+// stack of its own is kept beside the vm's to know which function is
+// running. a jmp onto the enter at a function's symbol is a tail call, the
+// caller's frame is already gone so the callee takes its place. a tail
+// call to itself jumps past the enter and stays the one call it looks
+// like, and top level code without a frame can loop back to (top)'s
+// symbol, which is no call at all. profiling counts bytecode, so it always runs the switch loop
+// whatever the engine.
+//
+// the sampler instead lets the program run at full speed and, on every
+// tick of a cpu time timer, copies the live ip and return addresses into
+// a buffer. the stacks are only named and folded once the run is over.
+// a tick landing halfway through a call or ret sees the ip and the return
+// addresses out of step, so the odd sample is charged to the wrong frame.
+// frames are named by the ip and return addresses alone, so a tail call
+// is charged to the callee as soon as it lands with nothing to track.
+//
+
+#define PROF_TOP_PAIRS 20
+#define PROF_INTERVAL 1000
+#define PROF_MAX_SAMPLE MB(1)
+
+typedef struct func_s func_t;
+
+struct func_s {
+  hash_t name;
+  int pos;
+  long long calls;
+  long long self;
+  long long total;
+  int active;
+};
+
+struct prof_s {
+  long long num_exec;
+  long long num_call;
+  long long *op;
+  long long *pair;
+  func_t *func;
+  int num_func;
+  int *func_of;
+  int top;
+  int stack[MAX_CALL + 1];
+  long long start[MAX_CALL + 1];
+  int depth;
+  int *sample;
+  int num_sample;
+  int num_drop;
+  int sample_size;
+};
+
+static void prof_enter(prof_t *prof, int func)
+{
+  if (prof->depth > MAX_CALL)
+    error("prof: call stack overflow");
+  
+  prof->stack[prof->depth] = func;
+  prof->start[prof->depth] = prof->num_exec;
+  prof->depth++;
+  
+  prof->func[func].active++;
+}
+
+static void prof_leave(prof_t *prof)
+{
+  if (!prof->depth)
+    return;
+  
+  prof->depth--;
+  
+  // recursive calls are only counted once, by the outermost
+  func_t *func = &prof->func[prof->stack[prof->depth]];
+  if (--func->active == 0)
+    func->total += prof->num_exec - prof->start[prof->depth];
+}
+
+static prof_t *make_prof(bin_t *bin)
+{
+  prof_t *prof = calloc(1, sizeof(prof_t));
+  prof->op = calloc(num_instr_tbl, sizeof(long long));
+  prof->pair = calloc(num_instr_tbl * num_instr_tbl, sizeof(long long));
+  
+  prof->func_of = bin_func_map(bin);
+  
+  // a bin without symbols is all one function
+  prof->num_func = bin->num_sym ? bin->num_sym : 1;
+  prof->func = calloc(prof->num_func, sizeof(func_t));
+  prof->top = -1;
+  
+  if (bin->num_sym) {
+    for (int i = 0; i < bin->num_sym; i++) {
+      prof->func[i].name = bin->sym[i].name;
+      prof->func[i].pos = bin->sym[i].pos;
+      
+      if (bin->sym[i].name == hash_value("(top)"))
+        prof->top = i;
+    }
+  } else {
+    prof->func[0].name = hash_value("(top)");
+    
+    for (int ip = 0; ip <= bin->num_instr; ip++)
+      prof->func_of[ip] = 0;
+  }
+  
+  return prof;
+}
+
+// a vm restored from a snapshot starts deep in calls, rebuild the stack
+// from the return addresses
+static void prof_start(prof_t *prof, vm_t *vm)
+{
+  for (int i = 0; i < prof->num_func; i++)
+    prof->func[i].active = 0;
+  
+  prof->depth = 0;
+  
+  for (int i = 0; i < vm->cp; i++)
+    prof_enter(prof, prof->func_of[vm->call[i]]);
+  
+  prof_enter(prof, prof->func_of[vm->ip]);
+}
+
+static int prof_tail(prof_t *prof, bin_t *bin, int ip)
+{
+  int func = prof->func_of[ip];
+  
+  return bin->num_sym && func != prof->top && ip < bin->num_instr
+    && prof->func[func].pos == ip && bin->instr[ip] == ENTER;
+}
+
+void vm_exec_prof(vm_t *vm)
+{
+  if (!vm->prof)
+    vm->prof = make_prof(vm->bin);
+  
+  prof_t *prof = vm->prof;
+  instr_t *instr = vm->bin->instr;
+  int *func_of = prof->func_of;
+  int prev = -1;
+  
+  prof_start(prof, vm);
+  
+  while (!vm->f_exit) {
+    instr_t op = instr[vm->ip];
+    
+    prof->num_exec++;
+    prof->op[op]++;
+    if (prev >= 0)
+      prof->pair[prev * num_instr_tbl + op]++;
+    prev = op;
+    
+    prof->func[prof->stack[prof->depth - 1]].self++;
+    
+    vm_step(vm);
+    
+    if (op == CALL) {
+      prof->num_call++;
+      prof->func[func_of[vm->ip]].calls++;
+      prof_enter(prof, func_of[vm->ip]);
+    } else if (op == RET) {
+      prof_leave(prof);
+    } else if (op == JMP && prof_tail(prof, vm->bin, vm->ip)) {
+      prof->num_call++;
+      prof->func[func_of[vm->ip]].calls++;
+      prof_leave(prof);
+      prof_enter(prof, func_of[vm->ip]);
+    }
+  }
+  
+  while (prof->depth)
+    prof_leave(prof);
+}
+
+//
+// sampler
+//
+
+static vm_t *volatile sample_vm;
+
+// async signal safe, only plain loads and stores into a buffer made up
+// front. a sample is the depth followed by the return addresses and the ip
+static void prof_sample(int sig)
+{
+  vm_t *vm = sample_vm;
+  if (!vm)
+    return;
+  
+  prof_t *prof = vm->prof;
+  
+  int cp = vm->cp;
+  if (cp < 0 || cp > MAX_CALL)
+    return;
+  
+  if (prof->sample_size + cp + 2 > PROF_MAX_SAMPLE) {
+    prof->num_drop++;
+    return;
+  }
+  
+  int *sample = &prof->sample[prof->sample_size];
+  
+  sample[0] = cp + 1;
+  for (int i = 0; i < cp; i++)
+    sample[i + 1] = vm->call[i];
+  sample[cp + 1] = vm->ip;
+  
+  prof->sample_size += cp + 2;
+  prof->num_sample++;
+}
+
+static void prof_timer(int usec)
+{
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = usec;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// the ip has to be live in memory to be sampled, which only the switch
+// loop guarantees
+void vm_exec_sample(vm_t *vm)
+{
+  if (!vm->prof)
+    vm->prof = make_prof(vm->bin);
+  
+  prof_t *prof = vm->prof;
+  if (!prof->sample)
+    prof->sample = malloc(PROF_MAX_SAMPLE * sizeof(int));
+  
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = prof_sample;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, NULL);
+  
+  sample_vm = vm;
+  prof_timer(PROF_INTERVAL);
+  
+  vm_exec_switch(vm);
+  
+  prof_timer(0);
+  sample_vm = NULL;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+  return strcmp(*(char**) a, *(char**) b);
+}
+
+// one line per distinct stack, root first: "(top);main;print 12"
+void vm_prof_folded(vm_t *vm, FILE *out)
+{
+  prof_t *prof = vm->prof;
+  if (!prof || !prof->sample)
+    return;
+  
+  int num_instr = vm->bin->num_instr;
+  char **line = malloc((prof->num_sample + 1) * sizeof(char*));
+  
+  int pos = 0;
+  for (int i = 0; i < prof->num_sample; i++) {
+    int depth = prof->sample[pos++];
+    
+    size_t size = 1;
+    for (int j = 0; j < depth; j++) {
+      int ip = prof->sample[pos + j];
+      if (ip < 0 || ip > num_instr)
+        ip = 0;
+      size += strlen(hash_get(prof->func[prof->func_of[ip]].name)) + 1;
+    }
+    
+    char *str = line[i] = malloc(size);
+    str[0] = '\0';
+    
+    for (int j = 0; j < depth; j++) {
+      int ip = prof->sample[pos + j];
+      if (ip < 0 || ip > num_instr)
+        ip = 0;
+      if (j)
+        strcat(str, ";");
+      strcat(str, hash_get(prof->func[prof->func_of[ip]].name));
+    }
+    
+    pos += depth;
+  }
+  
+  qsort(line, prof->num_sample, sizeof(char*), cmp_str);
+  
+  for (int i = 0; i < prof->num_sample;) {
+    int j = i;
+    while (j < prof->num_sample && strcmp(line[i], line[j]) == 0)
+      j++;
+    
+    fprintf(out, "%s %i\n", line[i], j - i);
+    
+    while (i < j)
+      free(line[i++]);
+  }
+  
+  free(line);
+  
+  if (prof->num_drop)
+    fprintf(stderr, "prof: sample buffer full, %i samples dropped\n", prof->num_drop);
+}
+
+//
+// report
+//
+
+static long long *sort_keys;
+
+static int cmp_key(const void *a, const void *b)
+{
+  long long ka = sort_keys[*(int*) a];
+  long long kb = sort_keys[*(int*) b];
+  
+  if (ka != kb)
+    return ka < kb ? 1 : -1;
+  
+  return *(int*) a - *(int*) b;
+}
+
+// indices of keys, biggest first
+static int *sort_by(long long *keys, int num)
+{
+  int *order = malloc((num + 1) * sizeof(int));
+  for (int i = 0; i < num; i++)
+    order[i] = i;
+  
+  sort_keys = keys;
+  qsort(order, num, sizeof(int), cmp_key);
+  
+  return order;
+}
+
+static double percent(long long n, long long total)
+{
+  return total ? 100.0 * n / total : 0.0;
+}
+
+void vm_prof_report(vm_t *vm, FILE *out)
+{
+  prof_t *prof = vm->prof;
+  if (!prof)
+    return;
+  
+  int num_op = num_instr_tbl;
+  int num_pair = num_op * num_op;
+  
+  fprintf(out, "prof: %lli instructions, %lli calls\n", prof->num_exec, prof->num_call);
+  
+  fprintf(out, "\n%-10s %14s %7s\n", "opcode", "count", "%");
+  int *order = sort_by(prof->op, num_op);
+  for (int i = 0; i < num_op && prof->op[order[i]]; i++) {
+    long long n = prof->op[order[i]];
+    fprintf(out, "%-10s %14lli %6.2f%%\n", instr_tbl[order[i]], n, percent(n, prof->num_exec));
+  }
+  free(order);
+  
+  fprintf(out, "\n%-21s %14s %7s\n", "pair", "count", "%");
+  order = sort_by(prof->pair, num_pair);
+  for (int i = 0; i < PROF_TOP_PAIRS && i < num_pair && prof->pair[order[i]]; i++) {
+    long long n = prof->pair[order[i]];
+    char name[32];
+    snprintf(name, sizeof(name), "%s %s", instr_tbl[order[i] / num_op], instr_tbl[order[i] % num_op]);
+    fprintf(out, "%-21s %14lli %6.2f%%\n", name, n, percent(n, prof->num_exec));
+  }
+  free(order);
+  
+  long long *self = malloc((prof->num_func + 1) * sizeof(long long));
+  for (int i = 0; i < prof->num_func; i++)
+    self[i] = prof->func[i].self;
+  
+  fprintf(out, "\n%-20s %10s %14s %7s %14s %7s\n", "function", "calls", "self", "%", "total", "%");
+  order = sort_by(self, prof->num_func);
+  for (int i = 0; i < prof->num_func; i++) {
+    func_t *func = &prof->func[order[i]];
+    if (!func->self && !func->calls)
+      continue;
+    
+    fprintf(out, "%-20s %10lli %14lli %6.2f%% %14lli %6.2f%%\n", hash_get(func->name), func->calls,
+      func->self, percent(func->self, prof->num_exec), func->total, percent(func->total, prof->num_exec));
+  }
+  free(order);
+  free(self);
+}
+
+// every count, unsorted and unabridged, for tools to chew on
+void vm_prof_json(vm_t *vm, FILE *out)
+{
+  prof_t *prof = vm->prof;
+  if (!prof)
+    return;
+  
+  int num_op = num_instr_tbl;
+  char *sep = "";
+  
+  fprintf(out, "{\n  \"instructions\": %lli,\n  \"calls\": %lli,\n", prof->num_exec, prof->num_call);
+  
+  fprintf(out, "  \"opcodes\": {");
+  for (int i = 0; i < num_op; i++) {
+    if (prof->op[i]) {
+      fprintf(out, "%s\n    \"%s\": %lli", sep, instr_tbl[i], prof->op[i]);
+      sep = ",";
+    }
+  }
+  fprintf(out, "\n  },\n");
+  
+  sep = "";
+  fprintf(out, "  \"pairs\": [");
+  for (int i = 0; i < num_op * num_op; i++) {
+    if (prof->pair[i]) {
+      fprintf(out, "%s\n    { \"first\": \"%s\", \"second\": \"%s\", \"count\": %lli }",
+        sep, instr_tbl[i / num_op], instr_tbl[i % num_op], prof->pair[i]);
+      sep = ",";
+    }
+  }
+  fprintf(out, "\n  ],\n");
+  
+  sep = "";
+  fprintf(out, "  \"functions\": [");
+  for (int i = 0; i < prof->num_func; i++) {
+    func_t *func = &prof->func[i];
+    fprintf(out, "%s\n    { \"name\": \"%s\", \"pos\": %i, \"calls\": %lli, \"self\": %lli, \"total\": %lli }",
+      sep, hash_get(func->name), func->pos, func->calls, func->self, func->total);
+    sep = ",";
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
@@ -0,0 +1,1076 @@
+#include "v_local.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//
+// register engine
+//
+// the stack bytecode is translated at load into three-address instructions.
+// operands name one of five banks, packed as index * 8 + bank:
+//   M_REG:    eval stack slot, relative to the sp at the start of the block
+//   M_LOCAL:  i32 local, relative to bp
+//   M_CONST:  constant pool
+//   M_GLOBAL: i32 in guest memory at an absolute address
+//   M_SLOT:   frame slot of the current frame
+//
+// inside a basic block the stack depth is static, so pushes of constants and
+// locals are deferred and folded into the instruction that consumes them, and
+// a result stored straight to a local or global writes it in place. at every
+// block boundary the deferred entries are written to their slots and the
+// block base is moved up to the real sp, so the layout matches the stack vm
+// and calls, returns and the syscalls need no special treatment. return
+// addresses and vm->ip stay bytecode positions, mapped through ridx when
+// jumped to, so a syscall sees the same state under every engine.
+//
+
+#define M_REG 0
+#define M_LOCAL 1
+#define M_CONST 2
+#define M_GLOBAL 3
+#define M_SLOT 4
+
+#define OPR(I, M) ((I) * 8 + (M))
+#define OPR_BANK(O) ((O) & 7)
+#define OPR_INDEX(O) ((O) >> 3)
+
+typedef struct rop_s rop_t;
+typedef struct ent_s ent_t;
+typedef enum rinstr_e rinstr_t;
+typedef enum tent_e tent_t;
+
+enum rinstr_e {
+  R_MOV,
+  R_ADD,
+  R_SUB,
+  R_MUL,
+  R_DIV,
+  R_MOD,
+  R_SHL,
+  R_SHR,
+  R_AND,
+  R_OR,
+  R_XOR,
+  R_LD,
+  R_LD8,
+  R_ST,
+  R_ST8,
+  R_LDO,
+  R_STO,
+  R_LDX,
+  R_STX,
+  R_LEA,
+  R_LBP,
+  R_SX8_32,
+  R_SX32_8,
+  R_CMP,
+  R_SETE,
+  R_SETNE,
+  R_SETL,
+  R_SETG,
+  R_SETLE,
+  R_SETGE,
+  R_JE,
+  R_JNE,
+  R_JL,
+  R_JG,
+  R_JLE,
+  R_JGE,
+  R_CJE,
+  R_CJNE,
+  R_CJL,
+  R_CJG,
+  R_CJLE,
+  R_CJGE,
+  R_SEQ,
+  R_SNE,
+  R_SLT,
+  R_SGT,
+  R_SLE,
+  R_SGE,
+  R_JMP,
+  R_ENTER,
+  R_LEAVE,
+  R_CALL,
+  R_RET,
+  R_SP,
+  R_INT
+};
+
+// deferred stack entries, only ENT_REG lives in a slot
+enum tent_e {
+  ENT_REG,
+  ENT_CONST,
+  ENT_LOCAL,
+  ENT_GLOBAL,
+  ENT_LEA,
+  ENT_BP,
+  ENT_SLOT
+};
+
+struct rop_s {
+  rinstr_t op;
+  int d, a, b;
+};
+
+struct ent_s {
+  tent_t tent;
+  int i32;
+};
+
+struct reg_s {
+  rop_t *code;
+  int *ridx;
+  int num_code, max_code;
+  int *kpool;
+  int num_k, max_k;
+};
+
+// translator state, per thread so batch workers can load in parallel
+static __thread reg_t *t_reg;
+static __thread ent_t t_buf[MAX_STACK * 2];
+static __thread int t_depth;
+static __thread int t_low;
+static __thread int t_last_def;
+
+static void reg_run(vm_t *vm, int decode);
+
+static int emit(rinstr_t op, int d, int a, int b)
+{
+  reg_t *reg = t_reg;
+  
+  if (reg->num_code >= reg->max_code) {
+    reg->max_code += 1024;
+    reg->code = realloc(reg->code, reg->max_code * sizeof(rop_t));
+  }
+  
+  rop_t *rop = &reg->code[reg->num_code];
+  rop->op = op;
+  rop->d = d;
+  rop->a = a;
+  rop->b = b;
+  
+  t_last_def = -1;
+  
+  return reg->num_code++;
+}
+
+static int k_const(int i32)
+{
+  reg_t *reg = t_reg;
+  
+  for (int i = 0; i < reg->num_k; i++) {
+    if (reg->kpool[i] == i32)
+      return OPR(i, M_CONST);
+  }
+  
+  if (reg->num_k >= reg->max_k) {
+    reg->max_k += 256;
+    reg->kpool = realloc(reg->kpool, reg->max_k * sizeof(int));
+  }
+  
+  reg->kpool[reg->num_k] = i32;
+  
+  return OPR(reg->num_k++, M_CONST);
+}
+
+static ent_t *t_ent(int slot)
+{
+  return &t_buf[slot + MAX_STACK];
+}
+
+static void t_reset()
+{
+  for (int i = 0; i < MAX_STACK * 2; i++)
+    t_buf[i].tent = ENT_REG;
+  
+  t_depth = 0;
+  t_low = 0;
+  t_last_def = -1;
+}
+
+static int t_push(tent_t tent, int i32)
+{
+  if (t_depth >= MAX_STACK)
+    return 0;
+  
+  t_ent(t_depth)->tent = tent;
+  t_ent(t_depth)->i32 = i32;
+  t_depth++;
+  
+  return 1;
+}
+
+static int t_pop()
+{
+  if (t_depth <= -MAX_STACK)
+    return 0;
+  
+  t_depth--;
+  
+  if (t_depth < t_low)
+    t_low = t_depth;
+  
+  return 1;
+}
+
+// write a deferred entry to its slot
+static void t_materialize(int slot)
+{
+  ent_t *ent = t_ent(slot);
+  
+  switch (ent->tent) {
+  case ENT_CONST:
+    emit(R_MOV, OPR(slot, M_REG), k_const(ent->i32), 0);
+    break;
+  case ENT_LOCAL:
+    emit(R_MOV, OPR(slot, M_REG), OPR(ent->i32 / 4, M_LOCAL), 0);
+    break;
+  case ENT_GLOBAL:
+    emit(R_MOV, OPR(slot, M_REG), OPR(ent->i32 / 4, M_GLOBAL), 0);
+    break;
+  case ENT_SLOT:
+    emit(R_MOV, OPR(slot, M_REG), OPR(ent->i32, M_SLOT), 0);
+    break;
+  case ENT_LEA:
+    emit(R_LEA, OPR(slot, M_REG), ent->i32, 0);
+    break;
+  case ENT_BP:
+    emit(R_LBP, OPR(slot, M_REG), 0, 0);
+    break;
+  default:
+    return;
+  }
+  
+  ent->tent = ENT_REG;
+}
+
+static int t_operand(int slot)
+{
+  ent_t *ent = t_ent(slot);
+  
+  switch (ent->tent) {
+  case ENT_CONST:
+    return k_const(ent->i32);
+  case ENT_LOCAL:
+    return OPR(ent->i32 / 4, M_LOCAL);
+  case ENT_GLOBAL:
+    return OPR(ent->i32 / 4, M_GLOBAL);
+  case ENT_SLOT:
+    return OPR(ent->i32, M_SLOT);
+  case ENT_REG:
+    return OPR(slot, M_REG);
+  default:
+    t_materialize(slot);
+    return OPR(slot, M_REG);
+  }
+}
+
+// the entries still on the symbolic stack read memory late, so pin them
+// before anything writes to it. frame slots are not memory and only get
+// pinned for a store to the same slot, see t_reads. once the block has popped below its base the
+// live entries can sit in negative slots, so start from the lowest depth
+static void t_barrier(int all)
+{
+  for (int i = t_low; i < t_depth; i++) {
+    tent_t tent = t_ent(i)->tent;
+    if (all || tent == ENT_LOCAL || tent == ENT_GLOBAL)
+      t_materialize(i);
+  }
+}
+
+// end of block: settle every entry and move the base up to the real sp
+static int t_flush()
+{
+  int depth = t_depth;
+  
+  t_barrier(1);
+  
+  if (depth != 0)
+    emit(R_SP, depth, 0, 0);
+  
+  t_reset();
+  
+  return depth;
+}
+
+static int t_shift(int opr, int depth)
+{
+  if (OPR_BANK(opr) == M_REG)
+    return OPR(OPR_INDEX(opr) - depth, M_REG);
+  
+  return opr;
+}
+
+static int t_binop(rinstr_t op)
+{
+  int b = t_operand(t_depth - 1);
+  int a = t_operand(t_depth - 2);
+  
+  if (!t_pop() || !t_pop())
+    return 0;
+  
+  int slot = t_depth;
+  int pos = emit(op, OPR(slot, M_REG), a, b);
+  
+  if (!t_push(ENT_REG, 0))
+    return 0;
+  
+  t_last_def = pos;
+  
+  return 1;
+}
+
+static int t_unary(rinstr_t op)
+{
+  int slot = t_depth - 1;
+  int a = t_operand(slot);
+  
+  int pos = emit(op, OPR(slot, M_REG), a, 0);
+  t_ent(slot)->tent = ENT_REG;
+  
+  t_last_def = pos;
+  
+  return 1;
+}
+
+static int is_aligned(int i32)
+{
+  return (i32 & 3) == 0;
+}
+
+// whether a deferred entry reads what a store to dest overwrites
+static int t_reads(ent_t *ent, int dest)
+{
+  if (OPR_BANK(dest) == M_SLOT)
+    return ent->tent == ENT_SLOT && ent->i32 == OPR_INDEX(dest);
+  
+  return ent->tent == ENT_LOCAL || ent->tent == ENT_GLOBAL;
+}
+
+// pop the value on top of the stack into a memory or slot operand
+static int t_store(int dest)
+{
+  int slot = t_depth - 1;
+  int last_def = t_last_def;
+  int is_last = t_ent(slot)->tent == ENT_REG && last_def >= 0
+    && t_reg->code[last_def].d == OPR(slot, M_REG);
+  
+  int value = t_operand(slot);
+  
+  if (!t_pop())
+    return 0;
+  
+  int pending = 0;
+  for (int i = t_low; i < t_depth; i++) {
+    if (t_reads(t_ent(i), dest))
+      pending = 1;
+  }
+  
+  if (is_last && !pending) {
+    t_reg->code[last_def].d = dest;
+  } else {
+    for (int i = t_low; i < t_depth; i++) {
+      if (t_reads(t_ent(i), dest))
+        t_materialize(i);
+    }
+    emit(R_MOV, dest, value, 0);
+  }
+  
+  return 1;
+}
+
+// store through an address computed at run time, ofs goes in d for R_STO
+static int t_str(rinstr_t op, int ofs)
+{
+  int addr = t_operand(t_depth - 1);
+  int value = t_operand(t_depth - 2);
+  
+  if (!t_pop() || !t_pop())
+    return 0;
+  
+  t_barrier(0);
+  emit(op, ofs, addr, value);
+  
+  return 1;
+}
+
+// i32 load from the address on top plus ofs. an aligned constant or frame
+// address is read in place, like any other global or local
+static int t_load(int ofs)
+{
+  int slot = t_depth - 1;
+  
+  if (t_depth > 0) {
+    ent_t *ent = t_ent(slot);
+    int i32 = ent->i32 + ofs;
+    
+    if (ent->tent == ENT_CONST && i32 >= 0 && is_aligned(i32)) {
+      ent->tent = ENT_GLOBAL;
+      ent->i32 = i32;
+      return 1;
+    }
+    
+    if (ent->tent == ENT_LEA && is_aligned(i32)) {
+      ent->tent = ENT_LOCAL;
+      ent->i32 = i32;
+      return 1;
+    }
+  }
+  
+  if (ofs == 0)
+    return t_unary(R_LD);
+  
+  int a = t_operand(slot);
+  int pos = emit(R_LDO, OPR(slot, M_REG), a, ofs);
+  t_ent(slot)->tent = ENT_REG;
+  
+  t_last_def = pos;
+  
+  return 1;
+}
+
+// i32 store to the address on top plus ofs, see t_load
+static int t_store_at(int ofs)
+{
+  if (t_depth > 0) {
+    ent_t *ent = t_ent(t_depth - 1);
+    int i32 = ent->i32 + ofs;
+    
+    if (ent->tent == ENT_CONST && i32 >= 0 && is_aligned(i32))
+      return t_pop() && t_store(OPR(i32 / 4, M_GLOBAL));
+    
+    if (ent->tent == ENT_LEA && is_aligned(i32))
+      return t_pop() && t_store(OPR(i32 / 4, M_LOCAL));
+  }
+  
+  return t_str(ofs ? R_STO : R_ST, ofs);
+}
+
+// stores the value under base and index, which takes all three operands,
+// so the value goes in d
+static int t_stx()
+{
+  int index = t_operand(t_depth - 1);
+  int addr = t_operand(t_depth - 2);
+  int value = t_operand(t_depth - 3);
+  
+  if (!t_pop() || !t_pop() || !t_pop())
+    return 0;
+  
+  t_barrier(0);
+  emit(R_STX, value, addr, index);
+  
+  return 1;
+}
+
+static int t_cj(rinstr_t op, int target)
+{
+  int b = t_operand(t_depth - 1);
+  int a = t_operand(t_depth - 2);
+  
+  if (!t_pop() || !t_pop())
+    return 0;
+  
+  int depth = t_flush();
+  
+  emit(op, target, t_shift(a, depth), t_shift(b, depth));
+  
+  return 1;
+}
+
+static int t_instr(instr_t *instr, int ip)
+{
+  int i32 = instr[ip + 1];
+  int top = t_depth - 1;
+  
+  switch (instr[ip]) {
+  case PUSH:
+    return t_push(ENT_CONST, i32);
+  case LBP:
+    return t_push(ENT_BP, 0);
+  case LEAL:
+    return t_push(ENT_LEA, i32);
+  case LDL:
+    if (is_aligned(i32))
+      return t_push(ENT_LOCAL, i32);
+    return t_push(ENT_LEA, i32) && t_unary(R_LD);
+  case STL:
+    if (is_aligned(i32))
+      return t_store(OPR(i32 / 4, M_LOCAL));
+    return t_push(ENT_LEA, i32) && t_str(R_ST, 0);
+  case LDS:
+    return t_push(ENT_SLOT, i32);
+  case STS:
+    return t_store(OPR(i32, M_SLOT));
+  case ADD:
+    return t_binop(R_ADD);
+  case ADDI:
+    return t_push(ENT_CONST, i32) && t_binop(R_ADD);
+  case SUB:
+    return t_binop(R_SUB);
+  case MUL:
+    return t_binop(R_MUL);
+  case DIV:
+    return t_binop(R_DIV);
+  case MOD:
+    return t_binop(R_MOD);
+  case DIVI:
+    return t_push(ENT_CONST, i32) && t_binop(R_DIV);
+  case MODI:
+    return t_push(ENT_CONST, i32) && t_binop(R_MOD);
+  case SHL:
+    return t_binop(R_SHL);
+  case SHR:
+    return t_binop(R_SHR);
+  case AND:
+    return t_binop(R_AND);
+  case OR:
+    return t_binop(R_OR);
+  case XOR:
+    return t_binop(R_XOR);
+  case LDR:
+    return t_load(0);
+  case LDR8:
+    return t_unary(R_LD8);
+  case STR:
+    return t_store_at(0);
+  case STR8:
+    return t_str(R_ST8, 0);
+  case LDO:
+    return t_load(i32);
+  case STO:
+    return t_store_at(i32);
+  // only a scale of 4 gets an op of its own, any other is worked out in
+  // front of a plain load or store
+  case LDX:
+    if (i32 == 4)
+      return t_binop(R_LDX);
+    return t_push(ENT_CONST, i32) && t_binop(R_MUL) && t_binop(R_ADD) && t_load(0);
+  case STX:
+    if (i32 == 4)
+      return t_stx();
+    return t_push(ENT_CONST, i32) && t_binop(R_MUL) && t_binop(R_ADD) && t_store_at(0);
+  case SX8_32:
+    return t_unary(R_SX8_32);
+  case SX32_8:
+    return t_unary(R_SX32_8);
+  case CMP: {
+      int b = t_operand(t_depth - 1);
+      int a = t_operand(t_depth - 2);
+      
+      if (!t_pop() || !t_pop())
+        return 0;
+      
+      emit(R_CMP, 0, a, b);
+    }
+    return 1;
+  case SETE:
+    return t_push(ENT_REG, 0) && emit(R_SETE, OPR(top + 1, M_REG), 0, 0) >= 0;
+  case SETNE:
+    return t_push(ENT_REG, 0) && emit(R_SETNE, OPR(top + 1, M_REG), 0, 0) >= 0;
+  case SETL:
+    return t_push(ENT_REG, 0) && emit(R_SETL, OPR(top + 1, M_REG), 0, 0) >= 0;
+  case SETG:
+    return t_push(ENT_REG, 0) && emit(R_SETG, OPR(top + 1, M_REG), 0, 0) >= 0;
+  case SETLE:
+    return t_push(ENT_REG, 0) && emit(R_SETLE, OPR(top + 1, M_REG), 0, 0) >= 0;
+  case SETGE:
+    return t_push(ENT_REG, 0) && emit(R_SETGE, OPR(top + 1, M_REG), 0, 0) >= 0;
+  case JE:
+    t_flush();
+    emit(R_JE, i32, 0, 0);
+    return 1;
+  case JNE:
+    t_flush();
+    emit(R_JNE, i32, 0, 0);
+    return 1;
+  case JL:
+    t_flush();
+    emit(R_JL, i32, 0, 0);
+    return 1;
+  case JG:
+    t_flush();
+    emit(R_JG, i32, 0, 0);
+    return 1;
+  case JLE:
+    t_flush();
+    emit(R_JLE, i32, 0, 0);
+    return 1;
+  case JGE:
+    t_flush();
+    emit(R_JGE, i32, 0, 0);
+    return 1;
+  case CJE:
+    return t_cj(R_CJE, i32);
+  case CJNE:
+    return t_cj(R_CJNE, i32);
+  case CJL:
+    return t_cj(R_CJL, i32);
+  case CJG:
+    return t_cj(R_CJG, i32);
+  case CJLE:
+    return t_cj(R_CJLE, i32);
+  case CJGE:
+    return t_cj(R_CJGE, i32);
+  case SEQ:
+    return t_binop(R_SEQ);
+  case SNE:
+    return t_binop(R_SNE);
+  case SLT:
+    return t_binop(R_SLT);
+  case SGT:
+    return t_binop(R_SGT);
+  case SLE:
+    return t_binop(R_SLE);
+  case SGE:
+    return t_binop(R_SGE);
+  case JMP:
+    t_flush();
+    emit(R_JMP, i32, 0, 0);
+    return 1;
+  case ENTER:
+    t_flush();
+    emit(R_ENTER, ip, i32, 0);
+    return 1;
+  case LEAVE:
+    t_barrier(1);
+    emit(R_LEAVE, 0, 0, 0);
+    return 1;
+  case CALL:
+    t_flush();
+    emit(R_CALL, i32, 0, ip + 2);
+    return 1;
+  case RET:
+    t_flush();
+    emit(R_RET, 0, 0, 0);
+    return 1;
+  case INT:
+    t_flush();
+    emit(R_INT, i32, 0, ip + 2);
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int is_leader_after(instr_t instr)
+{
+  switch (instr) {
+  case CALL:
+  case RET:
+  case JMP:
+  case JE:
+  case JNE:
+  case JL:
+  case JG:
+  case JLE:
+  case JGE:
+  case CJE:
+  case CJNE:
+  case CJL:
+  case CJG:
+  case CJLE:
+  case CJGE:
+  case INT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static int is_target(rinstr_t op)
+{
+  return op == R_JMP || op == R_CALL || (op >= R_JE && op <= R_CJGE);
+}
+
+static reg_t *reg_translate(bin_t *bin)
+{
+  instr_t *instr = bin->instr;
+  int num_instr = bin->num_instr;
+  
+  char *is_leader = calloc(num_instr + 1, 1);
+  int *ridx = malloc((num_instr + 1) * sizeof(int));
+  
+  int ip = 0;
+  while (ip < num_instr) {
+    int len = instr_len(instr[ip]);
+    
+    if (ip + len > num_instr)
+      goto fail_early;
+    
+    if (len == 2 && is_leader_after(instr[ip]) && instr[ip] != INT) {
+      int target = instr[ip + 1];
+      if (target < 0 || target > num_instr)
+        goto fail_early;
+      is_leader[target] = 1;
+    }
+    
+    if (is_leader_after(instr[ip]))
+      is_leader[ip + len] = 1;
+    
+    ip += len;
+  }
+  
+  for (int i = 0; i < bin->num_sym; i++)
+    is_leader[bin->sym[i].pos] = 1;
+  
+  reg_t *reg = malloc(sizeof(reg_t));
+  reg->code = NULL;
+  reg->num_code = 0;
+  reg->max_code = 0;
+  reg->kpool = NULL;
+  reg->num_k = 0;
+  reg->max_k = 0;
+  
+  t_reg = reg;
+  t_reset();
+  
+  for (int i = 0; i <= num_instr; i++)
+    ridx[i] = -1;
+  
+  ip = 0;
+  while (ip < num_instr) {
+    if (is_leader[ip])
+      t_flush();
+    
+    ridx[ip] = reg->num_code;
+    
+    if (!t_instr(instr, ip))
+      goto fail;
+    
+    ip += instr_len(instr[ip]);
+  }
+  
+  t_flush();
+  ridx[num_instr] = reg->num_code;
+  emit(R_INT, SYS_EXIT, 0, num_instr);
+  
+  for (int i = 0; i < reg->num_code; i++) {
+    rop_t *rop = &reg->code[i];
+    
+    if (is_target(rop->op)) {
+      if (ridx[rop->d] < 0)
+        goto fail;
+      rop->d = ridx[rop->d];
+    }
+  }
+  
+  free(is_leader);
+  
+  reg->ridx = ridx;
+  
+  return reg;
+
+fail:
+  free(reg->code);
+  free(reg->kpool);
+  free(reg);
+fail_early:
+  free(is_leader);
+  free(ridx);
+  
+  return NULL;
+}
+
+void vm_reg_load(vm_t *vm)
+{
+  vm->reg = reg_translate(vm->bin);
+  
+  if (!vm->reg) {
+    vm->engine = ENGINE_SWITCH;
+    return;
+  }
+  
+  if (vm->stats) {
+    int num_op = 0;
+    for (int ip = 0; ip < vm->bin->num_instr; ip += instr_len(vm->bin->instr[ip]))
+      num_op++;
+    
+    fprintf(stderr, "reg: %i stack ops -> %i register ops, %i constants\n", num_op, vm->reg->num_code, vm->reg->num_k);
+  }
+  
+  reg_run(vm, 1);
+}
+
+void vm_exec_reg(vm_t *vm)
+{
+  reg_run(vm, 0);
+}
+
+#define V(O) base[OPR_BANK(O)][OPR_INDEX(O)]
+#define DISPATCH() goto *label_tbl[(++pc)->op]
+#define GOTO(I) do { pc = &code[I]; goto *label_tbl[pc->op]; } while (0)
+
+static void reg_run(vm_t *vm, int decode)
+{
+  static void *label_tbl[] = {
+    [R_MOV]     = &&op_mov,
+    [R_ADD]     = &&op_add,
+    [R_SUB]     = &&op_sub,
+    [R_MUL]     = &&op_mul,
+    [R_DIV]     = &&op_div,
+    [R_MOD]     = &&op_mod,
+    [R_SHL]     = &&op_shl,
+    [R_SHR]     = &&op_shr,
+    [R_AND]     = &&op_and,
+    [R_OR]      = &&op_or,
+    [R_XOR]     = &&op_xor,
+    [R_LD]      = &&op_ld,
+    [R_LD8]     = &&op_ld8,
+    [R_ST]      = &&op_st,
+    [R_ST8]     = &&op_st8,
+    [R_LDO]     = &&op_ldo,
+    [R_STO]     = &&op_sto,
+    [R_LDX]     = &&op_ldx,
+    [R_STX]     = &&op_stx,
+    [R_LEA]     = &&op_lea,
+    [R_LBP]     = &&op_lbp,
+    [R_SX8_32]  = &&op_sx8_32,
+    [R_SX32_8]  = &&op_sx32_8,
+    [R_CMP]     = &&op_cmp,
+    [R_SETE]    = &&op_sete,
+    [R_SETNE]   = &&op_setne,
+    [R_SETL]    = &&op_setl,
+    [R_SETG]    = &&op_setg,
+    [R_SETLE]   = &&op_setle,
+    [R_SETGE]   = &&op_setge,
+    [R_JE]      = &&op_je,
+    [R_JNE]     = &&op_jne,
+    [R_JL]      = &&op_jl,
+    [R_JG]      = &&op_jg,
+    [R_JLE]     = &&op_jle,
+    [R_JGE]     = &&op_jge,
+    [R_CJE]     = &&op_cje,
+    [R_CJNE]    = &&op_cjne,
+    [R_CJL]     = &&op_cjl,
+    [R_CJG]     = &&op_cjg,
+    [R_CJLE]    = &&op_cjle,
+    [R_CJGE]    = &&op_cjge,
+    [R_SEQ]     = &&op_seq,
+    [R_SNE]     = &&op_sne,
+    [R_SLT]     = &&op_slt,
+    [R_SGT]     = &&op_sgt,
+    [R_SLE]     = &&op_sle,
+    [R_SGE]     = &&op_sge,
+    [R_JMP]     = &&op_jmp,
+    [R_ENTER]   = &&op_enter,
+    [R_LEAVE]   = &&op_leave,
+    [R_CALL]    = &&op_call,
+    [R_RET]     = &&op_ret,
+    [R_SP]      = &&op_sp,
+    [R_INT]     = &&op_int
+  };
+  
+  if (decode || vm->f_exit)
+    return;
+  
+  rop_t *code = vm->reg->code;
+  int *ridx = vm->reg->ridx;
+  rop_t *pc;
+  int bp = vm->bp;
+  int *base[5];
+  
+  base[M_REG] = vm->s_i32 + vm->sp;
+  base[M_LOCAL] = vm->m_i32 + ALIGN_32(bp);
+  base[M_CONST] = vm->reg->kpool;
+  base[M_GLOBAL] = vm->m_i32;
+  base[M_SLOT] = vm->slot[vm->fp];
+  
+  GOTO(ridx[vm->ip]);
+
+op_mov:
+  V(pc->d) = V(pc->a);
+  DISPATCH();
+op_add:
+  V(pc->d) = V(pc->a) + V(pc->b);
+  DISPATCH();
+op_sub:
+  V(pc->d) = V(pc->a) - V(pc->b);
+  DISPATCH();
+op_mul:
+  V(pc->d) = V(pc->a) * V(pc->b);
+  DISPATCH();
+op_div:
+  V(pc->d) = V(pc->a) / V(pc->b);
+  DISPATCH();
+op_mod:
+  V(pc->d) = V(pc->a) % V(pc->b);
+  DISPATCH();
+op_shl:
+  V(pc->d) = (unsigned) V(pc->a) << (V(pc->b) & 31);
+  DISPATCH();
+op_shr:
+  V(pc->d) = V(pc->a) >> (V(pc->b) & 31);
+  DISPATCH();
+op_and:
+  V(pc->d) = V(pc->a) & V(pc->b);
+  DISPATCH();
+op_or:
+  V(pc->d) = V(pc->a) | V(pc->b);
+  DISPATCH();
+op_xor:
+  V(pc->d) = V(pc->a) ^ V(pc->b);
+  DISPATCH();
+op_ld:
+  V(pc->d) = vm->m_i32[ALIGN_32(V(pc->a))];
+  DISPATCH();
+op_ld8:
+  V(pc->d) = vm->m_i8[ADDR(V(pc->a))];
+  DISPATCH();
+op_st:
+  vm->m_i32[ALIGN_32(V(pc->a))] = V(pc->b);
+  DISPATCH();
+op_st8:
+  vm->m_i8[ADDR(V(pc->a))] = V(pc->b);
+  DISPATCH();
+op_ldo:
+  V(pc->d) = vm->m_i32[ALIGN_32(V(pc->a) + pc->b)];
+  DISPATCH();
+op_sto:
+  vm->m_i32[ALIGN_32(V(pc->a) + pc->d)] = V(pc->b);
+  DISPATCH();
+op_ldx:
+  V(pc->d) = vm->m_i32[ALIGN_32(V(pc->a) + V(pc->b) * 4)];
+  DISPATCH();
+op_stx:
+  vm->m_i32[ALIGN_32(V(pc->a) + V(pc->b) * 4)] = V(pc->d);
+  DISPATCH();
+op_lea:
+  V(pc->d) = bp + pc->a;
+  DISPATCH();
+op_lbp:
+  V(pc->d) = bp;
+  DISPATCH();
+op_sx8_32:
+  V(pc->d) = (signed char) V(pc->a);
+  DISPATCH();
+op_sx32_8:
+  V(pc->d) = ((V(pc->a) & 0x80000000) >> 24) | (V(pc->a) & 0x7f);
+  DISPATCH();
+op_cmp: {
+    int tmp = V(pc->a) - V(pc->b);
+    vm->f_gtr = tmp > 0;
+    vm->f_lss = tmp < 0;
+    vm->f_equ = tmp == 0;
+  }
+  DISPATCH();
+op_sete:
+  V(pc->d) = vm->f_equ;
+  DISPATCH();
+op_setne:
+  V(pc->d) = !vm->f_equ;
+  DISPATCH();
+op_setl:
+  V(pc->d) = vm->f_lss;
+  DISPATCH();
+op_setg:
+  V(pc->d) = vm->f_gtr;
+  DISPATCH();
+op_setle:
+  V(pc->d) = vm->f_equ || vm->f_lss;
+  DISPATCH();
+op_setge:
+  V(pc->d) = vm->f_equ || vm->f_gtr;
+  DISPATCH();
+op_je:
+  if (vm->f_equ)
+    GOTO(pc->d);
+  DISPATCH();
+op_jne:
+  if (!vm->f_equ)
+    GOTO(pc->d);
+  DISPATCH();
+op_jl:
+  if (vm->f_lss)
+    GOTO(pc->d);
+  DISPATCH();
+op_jg:
+  if (vm->f_gtr)
+    GOTO(pc->d);
+  DISPATCH();
+op_jle:
+  if (vm->f_equ || vm->f_lss)
+    GOTO(pc->d);
+  DISPATCH();
+op_jge:
+  if (vm->f_equ || vm->f_gtr)
+    GOTO(pc->d);
+  DISPATCH();
+op_cje:
+  if (V(pc->a) - V(pc->b) == 0)
+    GOTO(pc->d);
+  DISPATCH();
+op_cjne:
+  if (V(pc->a) - V(pc->b) != 0)
+    GOTO(pc->d);
+  DISPATCH();
+op_cjl:
+  if (V(pc->a) - V(pc->b) < 0)
+    GOTO(pc->d);
+  DISPATCH();
+op_cjg:
+  if (V(pc->a) - V(pc->b) > 0)
+    GOTO(pc->d);
+  DISPATCH();
+op_cjle:
+  if (V(pc->a) - V(pc->b) <= 0)
+    GOTO(pc->d);
+  DISPATCH();
+op_cjge:
+  if (V(pc->a) - V(pc->b) >= 0)
+    GOTO(pc->d);
+  DISPATCH();
+op_seq:
+  V(pc->d) = V(pc->a) - V(pc->b) == 0;
+  DISPATCH();
+op_sne:
+  V(pc->d) = V(pc->a) - V(pc->b) != 0;
+  DISPATCH();
+op_slt:
+  V(pc->d) = V(pc->a) - V(pc->b) < 0;
+  DISPATCH();
+op_sgt:
+  V(pc->d) = V(pc->a) - V(pc->b) > 0;
+  DISPATCH();
+op_sle:
+  V(pc->d) = V(pc->a) - V(pc->b) <= 0;
+  DISPATCH();
+op_sge:
+  V(pc->d) = V(pc->a) - V(pc->b) >= 0;
+  DISPATCH();
+op_jmp:
+  GOTO(pc->d);
+op_enter:
+  vm_check_frame(vm);
+  vm_check_stack(vm, pc->d, base[M_REG] - vm->s_i32);
+  vm_check_bp(vm, bp, pc->a);
+  vm->frame[vm->fp++] = bp;
+  bp -= pc->a;
+  base[M_LOCAL] = vm->m_i32 + ALIGN_32(bp);
+  base[M_SLOT] = vm->slot[vm->fp];
+  DISPATCH();
+op_leave:
+  bp = vm->frame[--vm->fp];
+  base[M_LOCAL] = vm->m_i32 + ALIGN_32(bp);
+  base[M_SLOT] = vm->slot[vm->fp];
+  DISPATCH();
+op_call:
+  vm_check_call(vm);
+  vm->call[vm->cp++] = pc->b;
+  GOTO(pc->d);
+op_ret:
+  GOTO(ridx[vm->call[--vm->cp]]);
+op_sp:
+  base[M_REG] += pc->d;
+  DISPATCH();
+op_int:
+  vm->sp = base[M_REG] - vm->s_i32;
+  vm->bp = bp;
+  vm->ip = pc->b;
+  vm_int(vm, pc->d);
+  if (vm->f_exit)
+    return;
+  base[M_REG] = vm->s_i32 + vm->sp;
+  DISPATCH();
+}
@@ -0,0 +1,183 @@
+#include "v_local.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// snapshots
+//
+// a snapshot is a few pages of header holding the registers, the stacks,
+// the frame slots and the heap's host side state, followed by the guest
+// memory at a page aligned offset. pages of zeros are left as holes.
+// restoring maps the memory straight from the file copy on write, so it
+// costs the same no matter how big the memory is.
+//
+
+#define SNAP_MAGIC 0x70616e73
+#define SNAP_VERSION 2
+#define SNAP_PAGE KB(4)
+#define SNAP_HEAD (3 * SNAP_PAGE)
+
+typedef struct snap_s snap_t;
+
+struct snap_s {
+  unsigned magic;
+  unsigned version;
+  unsigned bin_hash;
+  unsigned mem_size;
+  int ip, sp, bp, cp, fp;
+  int f_gtr, f_lss, f_equ;
+  int stack[MAX_STACK];
+  int call[MAX_CALL];
+  int frame[MAX_FRAME];
+  int slot[MAX_FRAME + 1][MAX_SLOT];
+  int heap_size;
+};
+
+static int is_zero(char *page)
+{
+  for (int i = 0; i < SNAP_PAGE; i += sizeof(long)) {
+    if (*(long*) &page[i])
+      return 0;
+  }
+  
+  return 1;
+}
+
+static void snap_write(int fd, void *buf, int size, off_t ofs, char *path)
+{
+  while (size > 0) {
+    ssize_t n = pwrite(fd, buf, size, ofs);
+    if (n <= 0)
+      error("snap: could not write %s", path);
+    
+    buf = (char*) buf + n;
+    size -= n;
+    ofs += n;
+  }
+}
+
+void vm_snapshot(vm_t *vm, char *path)
+{
+  int heap_size;
+  void *heap = heap_state(vm, &heap_size);
+  
+  if (sizeof(snap_t) + heap_size > SNAP_HEAD)
+    error("snap: header does not fit in its pages");
+  
+  // written next to the target and renamed over it, so a reader never
+  // sees half a snapshot
+  char *tmp = malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+  
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    error("snap: could not open %s", tmp);
+  
+  char *page = calloc(1, SNAP_HEAD);
+  snap_t *snap = (snap_t*) page;
+  
+  snap->magic = SNAP_MAGIC;
+  snap->version = SNAP_VERSION;
+  snap->bin_hash = bin_hash(vm->bin);
+  snap->mem_size = vm->mem_size;
+  snap->ip = vm->ip;
+  snap->sp = vm->sp;
+  snap->bp = vm->bp;
+  snap->cp = vm->cp;
+  snap->fp = vm->fp;
+  snap->f_gtr = vm->f_gtr;
+  snap->f_lss = vm->f_lss;
+  snap->f_equ = vm->f_equ;
+  memcpy(snap->stack, vm->s_i32, sizeof(snap->stack));
+  memcpy(snap->call, vm->call, sizeof(snap->call));
+  memcpy(snap->frame, vm->frame, sizeof(snap->frame));
+  memcpy(snap->slot, vm->slot, sizeof(snap->slot));
+  snap->heap_size = heap_size;
+  memcpy(page + sizeof(snap_t), heap, heap_size);
+  
+  snap_write(fd, page, SNAP_HEAD, 0, tmp);
+  
+  for (unsigned ofs = 0; ofs < vm->mem_size; ofs += SNAP_PAGE) {
+    if (!is_zero(vm->m_i8 + ofs))
+      snap_write(fd, vm->m_i8 + ofs, SNAP_PAGE, SNAP_HEAD + (off_t) ofs, tmp);
+  }
+  
+  if (ftruncate(fd, SNAP_HEAD + (off_t) vm->mem_size) < 0)
+    error("snap: could not write %s", tmp);
+  
+  close(fd);
+  
+  if (rename(tmp, path) < 0)
+    error("snap: could not rename %s to %s", tmp, path);
+  
+  free(page);
+  free(tmp);
+}
+
+void vm_restore(vm_t *vm, char *path)
+{
+  int heap_size;
+  void *heap = heap_state(vm, &heap_size);
+  
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    error("snap: could not open %s", path);
+  
+  char *page = malloc(SNAP_HEAD);
+  snap_t *snap = (snap_t*) page;
+  
+  if (pread(fd, page, SNAP_HEAD, 0) != SNAP_HEAD)
+    error("snap: %s is not a snapshot", path);
+  
+  if (snap->magic != SNAP_MAGIC || snap->version != SNAP_VERSION)
+    error("snap: %s is not a snapshot", path);
+  
+  if (snap->bin_hash != bin_hash(vm->bin))
+    error("snap: %s was taken from a different program", path);
+  
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < SNAP_HEAD + (off_t) snap->mem_size)
+    error("snap: %s is truncated", path);
+  
+  if (snap->heap_size != heap_size || !snap->mem_size || snap->mem_size > MEM_MAX
+  || snap->ip < 0 || snap->ip > vm->bin->num_instr || snap->sp < 0 || snap->sp > MAX_STACK || snap->cp < 0 || snap->cp > MAX_CALL
+  || snap->fp < 0 || snap->fp > MAX_FRAME)
+    error("snap: %s is corrupt", path);
+  
+  // anything the old memory had past the snapshot's goes back to the
+  // reservation
+  if (vm->mem_size > snap->mem_size) {
+    mmap(vm->m_i8 + snap->mem_size, vm->mem_size - snap->mem_size, PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  }
+  
+  if (mmap(vm->m_i8, snap->mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, SNAP_HEAD) == MAP_FAILED)
+    error("snap: could not map %s", path);
+  
+  close(fd);
+  
+  vm->mem_size = snap->mem_size;
+  vm->mem_mapped = 1;
+  vm->ip = snap->ip;
+  vm->sp = snap->sp;
+  vm->bp = snap->bp;
+  vm->cp = snap->cp;
+  vm->fp = snap->fp;
+  vm->f_gtr = snap->f_gtr;
+  vm->f_lss = snap->f_lss;
+  vm->f_equ = snap->f_equ;
+  vm->f_exit = 0;
+  memcpy(vm->s_i32, snap->stack, sizeof(snap->stack));
+  memcpy(vm->call, snap->call, sizeof(snap->call));
+  memcpy(vm->frame, snap->frame, sizeof(snap->frame));
+  memcpy(vm->slot, snap->slot, sizeof(snap->slot));
+  memcpy(heap, page + sizeof(snap_t), heap_size);
+  vm->stack_end = heap_end(vm);
+  
+  free(page);
+}
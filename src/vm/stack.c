@@ -0,0 +1,336 @@
+#include "v_local.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//
+// eval stack bounds
+//
+// every push and pop in a function happens at a fixed depth from where sp
+// was when the function was entered, so how deep it goes and how far below
+// its entry it reads are known at load. enter checks sp against them, and
+// a program that would run off either end of the eval stack stops with an
+// error in every engine instead of writing past vm->stack. a call adds what
+// its callee leaves behind, which is found the same way, over and over
+// until nothing changes so that recursion settles. the callee's own enter
+// checks everything it does below the call.
+//
+// code that does not come out at the same depth every way round, a loop
+// that leaves a value behind each trip, is taken at its worst: it counts as
+// too deep once it could go past MAX_STACK.
+//
+
+#define DEPTH_MAX (MAX_STACK + 1)
+
+typedef struct walk_s walk_t;
+
+struct walk_s {
+  bin_t *bin;
+  char *is_entry;
+  int *net_min, *net_max;
+  int *stamp, *d_min, *d_max;
+  int num_stamp;
+  int *work;
+  int num_work, max_work;
+  int low, high;
+  int ret_min, ret_max;
+};
+
+// operands an op reads off the stack, and how many it leaves in their place
+static void stack_effect(instr_t *instr, int ip, int *pops, int *pushes)
+{
+  *pops = 0;
+  *pushes = 0;
+  
+  switch (instr[ip]) {
+  case PUSH:
+  case LBP:
+  case LDL:
+  case LEAL:
+  case LDS:
+  case SETE:
+  case SETNE:
+  case SETL:
+  case SETG:
+  case SETLE:
+  case SETGE:
+    *pushes = 1;
+    break;
+  case ADD:
+  case SUB:
+  case MUL:
+  case DIV:
+  case MOD:
+  case SHL:
+  case SHR:
+  case AND:
+  case OR:
+  case XOR:
+  case SEQ:
+  case SNE:
+  case SLT:
+  case SGT:
+  case SLE:
+  case SGE:
+  case LDX:
+    *pops = 2;
+    *pushes = 1;
+    break;
+  case LDR:
+  case LDR8:
+  case SX8_32:
+  case SX32_8:
+  case ADDI:
+  case DIVI:
+  case MODI:
+  case LDO:
+    *pops = 1;
+    *pushes = 1;
+    break;
+  case STR:
+  case STR8:
+  case CMP:
+  case CJE:
+  case CJNE:
+  case CJL:
+  case CJG:
+  case CJLE:
+  case CJGE:
+  case STO:
+    *pops = 2;
+    break;
+  case STL:
+  case STS:
+    *pops = 1;
+    break;
+  case STX:
+    *pops = 3;
+    break;
+  case INT:
+    switch (instr[ip + 1]) {
+    case SYS_PRINT:
+    case SYS_WRITE:
+    case SYS_FREE:
+      *pops = 1;
+      break;
+    case SYS_ALLOC:
+    case SYS_ARENA_ALLOC:
+      *pops = 1;
+      *pushes = 1;
+      break;
+    case SYS_REALLOC:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case SYS_INPUT:
+      *pushes = 1;
+      break;
+    default:
+      break;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static void walk_push(walk_t *walk, int ip, int depth)
+{
+  if (ip < 0 || ip >= walk->bin->num_instr)
+    return;
+  
+  if (walk->num_work + 2 > walk->max_work) {
+    walk->max_work = walk->max_work * 2 + 64;
+    walk->work = realloc(walk->work, walk->max_work * sizeof(int));
+  }
+  
+  walk->work[walk->num_work++] = ip;
+  walk->work[walk->num_work++] = depth;
+}
+
+static void walk_ret(walk_t *walk, int min, int max)
+{
+  if (min < walk->ret_min)
+    walk->ret_min = min;
+  if (max > walk->ret_max)
+    walk->ret_max = max;
+}
+
+// follows the function at entry for every depth each ip can be reached at
+static void walk_func(walk_t *walk, int entry)
+{
+  instr_t *instr = walk->bin->instr;
+  
+  int stamp = ++walk->num_stamp;
+  
+  walk->low = 0;
+  walk->high = 0;
+  walk->ret_min = DEPTH_MAX;
+  walk->ret_max = -DEPTH_MAX;
+  walk->num_work = 0;
+  
+  walk_push(walk, entry, 0);
+  
+  while (walk->num_work > 0) {
+    int depth = walk->work[--walk->num_work];
+    int ip = walk->work[--walk->num_work];
+    
+    if (walk->stamp[ip] != stamp) {
+      walk->stamp[ip] = stamp;
+      walk->d_min[ip] = depth;
+      walk->d_max[ip] = depth;
+    } else if (depth < walk->d_min[ip]) {
+      walk->d_min[ip] = depth;
+    } else if (depth > walk->d_max[ip]) {
+      walk->d_max[ip] = depth;
+    } else {
+      continue;
+    }
+    
+    int pops, pushes;
+    stack_effect(instr, ip, &pops, &pushes);
+    
+    int low = depth - pops;
+    int after = low + pushes;
+    
+    if (low < walk->low)
+      walk->low = low;
+    if (after > walk->high)
+      walk->high = after;
+    
+    // gone off one end already, going round again only goes further
+    if (low < -MAX_STACK || after > MAX_STACK)
+      continue;
+    
+    int next = ip + instr_len(instr[ip]);
+    int i32 = ip + 1 < walk->bin->num_instr ? instr[ip + 1] : 0;
+    
+    switch (instr[ip]) {
+    case RET:
+      walk_ret(walk, after, after);
+      break;
+    case JMP:
+      // a tail call, the callee's enter checks it and what it leaves is
+      // what this function leaves
+      if (i32 >= 0 && i32 < walk->bin->num_instr && walk->is_entry[i32] && i32 != entry) {
+        if (walk->net_min[i32] <= walk->net_max[i32])
+          walk_ret(walk, after + walk->net_min[i32], after + walk->net_max[i32]);
+        break;
+      }
+      walk_push(walk, i32, after);
+      break;
+    case JE:
+    case JNE:
+    case JL:
+    case JG:
+    case JLE:
+    case JGE:
+    case CJE:
+    case CJNE:
+    case CJL:
+    case CJG:
+    case CJLE:
+    case CJGE:
+      walk_push(walk, i32, after);
+      walk_push(walk, next, after);
+      break;
+    case CALL:
+      // nothing after the call until the callee is known to come back
+      if (i32 >= 0 && i32 < walk->bin->num_instr && walk->net_min[i32] <= walk->net_max[i32]) {
+        walk_push(walk, next, after + walk->net_min[i32]);
+        walk_push(walk, next, after + walk->net_max[i32]);
+      }
+      break;
+    case INT:
+      if (i32 != SYS_EXIT)
+        walk_push(walk, next, after);
+      break;
+    default:
+      walk_push(walk, next, after);
+      break;
+    }
+  }
+  
+  if (walk->low < -DEPTH_MAX)
+    walk->low = -DEPTH_MAX;
+  if (walk->high > DEPTH_MAX)
+    walk->high = DEPTH_MAX;
+}
+
+void vm_stack_load(vm_t *vm)
+{
+  bin_t *bin = vm->bin;
+  int num_instr = bin->num_instr;
+  
+  walk_t walk;
+  memset(&walk, 0, sizeof(walk));
+  walk.bin = bin;
+  walk.is_entry = calloc(num_instr + 1, 1);
+  walk.net_min = malloc((num_instr + 1) * sizeof(int));
+  walk.net_max = malloc((num_instr + 1) * sizeof(int));
+  walk.stamp = calloc(num_instr + 1, sizeof(int));
+  walk.d_min = malloc((num_instr + 1) * sizeof(int));
+  walk.d_max = malloc((num_instr + 1) * sizeof(int));
+  
+  free(vm->s_min);
+  free(vm->s_max);
+  vm->s_min = calloc(num_instr + 1, sizeof(int));
+  vm->s_max = malloc((num_instr + 1) * sizeof(int));
+  
+  for (int ip = 0; ip <= num_instr; ip++) {
+    walk.net_min[ip] = DEPTH_MAX;
+    walk.net_max[ip] = -DEPTH_MAX;
+    vm->s_max[ip] = MAX_STACK;
+  }
+  
+  // top level code, every called address and every symbol start a walk
+  walk.is_entry[0] = 1;
+  for (int ip = 0; ip < num_instr; ip += instr_len(bin->instr[ip])) {
+    if (bin->instr[ip] == CALL && ip + 1 < num_instr) {
+      int target = bin->instr[ip + 1];
+      if (target >= 0 && target < num_instr)
+        walk.is_entry[target] = 1;
+    }
+  }
+  for (int i = 0; i < bin->num_sym; i++) {
+    if (bin->sym[i].pos >= 0 && bin->sym[i].pos < num_instr)
+      walk.is_entry[bin->sym[i].pos] = 1;
+  }
+  
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    
+    for (int ip = 0; ip < num_instr; ip++) {
+      if (!walk.is_entry[ip])
+        continue;
+      
+      walk_func(&walk, ip);
+      
+      vm->s_min[ip] = -walk.low;
+      vm->s_max[ip] = MAX_STACK - walk.high;
+      
+      if (walk.ret_min < walk.net_min[ip] || walk.ret_max > walk.net_max[ip]) {
+        if (walk.ret_min < walk.net_min[ip])
+          walk.net_min[ip] = walk.ret_min < -DEPTH_MAX ? -DEPTH_MAX : walk.ret_min;
+        if (walk.ret_max > walk.net_max[ip])
+          walk.net_max[ip] = walk.ret_max > DEPTH_MAX ? DEPTH_MAX : walk.ret_max;
+        changed = 1;
+      }
+    }
+  }
+  
+  free(walk.is_entry);
+  free(walk.net_min);
+  free(walk.net_max);
+  free(walk.stamp);
+  free(walk.d_min);
+  free(walk.d_max);
+  free(walk.work);
+  
+  // top level code starts on an empty stack, nothing enters it
+  if (num_instr > 0 && vm->s_min[0] > 0)
+    error("vm: eval stack underflow in top level code");
+  if (num_instr > 0 && vm->s_max[0] < 0)
+    error("vm: eval stack overflow in top level code, more than %i entries", MAX_STACK);
+}
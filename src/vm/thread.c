@@ -0,0 +1,311 @@
+#include "v_local.h"
+
+#include <stdlib.h>
+
+#define DISPATCH() goto *code[vm->ip++].handler
+#define OPERAND() code[vm->ip++].i32
+
+static void thread_run(vm_t *vm, int decode);
+
+void vm_thread_load(vm_t *vm)
+{
+  thread_run(vm, 1);
+}
+
+void vm_exec_thread(vm_t *vm)
+{
+  thread_run(vm, 0);
+}
+
+static void thread_decode(vm_t *vm, void **label_tbl, int num_label, void *unknown)
+{
+  bin_t *bin = vm->bin;
+  
+  free(vm->code);
+  vm->code = malloc(bin->num_instr * sizeof(cell_t));
+  
+  int i = 0;
+  while (i < bin->num_instr) {
+    instr_t instr = bin->instr[i];
+    
+    if (instr >= 0 && instr < num_label)
+      vm->code[i].handler = label_tbl[instr];
+    else
+      vm->code[i].handler = unknown;
+    
+    if (instr_len(instr) == 2 && i + 1 < bin->num_instr) {
+      vm->code[i + 1].i32 = bin->instr[i + 1];
+      i += 2;
+    } else {
+      i += 1;
+    }
+  }
+}
+
+static void thread_run(vm_t *vm, int decode)
+{
+  static void *label_tbl[] = {
+    [PUSH]    = &&op_push,
+    [ADD]     = &&op_add,
+    [SUB]     = &&op_sub,
+    [MUL]     = &&op_mul,
+    [DIV]     = &&op_div,
+    [MOD]     = &&op_mod,
+    [LDR]     = &&op_ldr,
+    [LDR8]    = &&op_ldr8,
+    [STR]     = &&op_str,
+    [STR8]    = &&op_str8,
+    [LBP]     = &&op_lbp,
+    [ENTER]   = &&op_enter,
+    [LEAVE]   = &&op_leave,
+    [CALL]    = &&op_call,
+    [RET]     = &&op_ret,
+    [JMP]     = &&op_jmp,
+    [CMP]     = &&op_cmp,
+    [JE]      = &&op_je,
+    [JNE]     = &&op_jne,
+    [JL]      = &&op_jl,
+    [JG]      = &&op_jg,
+    [JLE]     = &&op_jle,
+    [JGE]     = &&op_jge,
+    [SETE]    = &&op_sete,
+    [SETNE]   = &&op_setne,
+    [SETL]    = &&op_setl,
+    [SETG]    = &&op_setg,
+    [SETLE]   = &&op_setle,
+    [SETGE]   = &&op_setge,
+    [SX8_32]  = &&op_sx8_32,
+    [SX32_8]  = &&op_sx32_8,
+    [INT]     = &&op_int,
+    [LDL]     = &&op_ldl,
+    [STL]     = &&op_stl,
+    [LEAL]    = &&op_leal,
+    [ADDI]    = &&op_addi,
+    [CJE]     = &&op_cje,
+    [CJNE]    = &&op_cjne,
+    [CJL]     = &&op_cjl,
+    [CJG]     = &&op_cjg,
+    [CJLE]    = &&op_cjle,
+    [CJGE]    = &&op_cjge,
+    [SEQ]     = &&op_seq,
+    [SNE]     = &&op_sne,
+    [SLT]     = &&op_slt,
+    [SGT]     = &&op_sgt,
+    [SLE]     = &&op_sle,
+    [SGE]     = &&op_sge,
+    [LDS]     = &&op_lds,
+    [STS]     = &&op_sts,
+    [LDO]     = &&op_ldo,
+    [STO]     = &&op_sto,
+    [LDX]     = &&op_ldx,
+    [STX]     = &&op_stx,
+    [SHL]     = &&op_shl,
+    [SHR]     = &&op_shr,
+    [AND]     = &&op_and,
+    [OR]      = &&op_or,
+    [XOR]     = &&op_xor,
+    [DIVI]    = &&op_divi,
+    [MODI]    = &&op_modi
+  };
+  
+  if (decode) {
+    thread_decode(vm, label_tbl, sizeof(label_tbl) / sizeof(void *), &&op_unknown);
+    return;
+  }
+  
+  if (vm->f_exit)
+    return;
+  
+  cell_t *code = vm->code;
+  
+  DISPATCH();
+
+op_push:
+  vm_push(vm, OPERAND());
+  DISPATCH();
+op_enter:
+  vm_enter(vm, OPERAND());
+  DISPATCH();
+op_add:
+  vm_add(vm);
+  DISPATCH();
+op_sub:
+  vm_sub(vm);
+  DISPATCH();
+op_mul:
+  vm_mul(vm);
+  DISPATCH();
+op_div:
+  vm_div(vm);
+  DISPATCH();
+op_mod:
+  vm_mod(vm);
+  DISPATCH();
+op_ldr:
+  vm_ldr(vm);
+  DISPATCH();
+op_ldr8:
+  vm_ldr8(vm);
+  DISPATCH();
+op_str:
+  vm_str(vm);
+  DISPATCH();
+op_str8:
+  vm_str8(vm);
+  DISPATCH();
+op_lbp:
+  vm_lbp(vm);
+  DISPATCH();
+op_call:
+  vm_call(vm, OPERAND());
+  DISPATCH();
+op_leave:
+  vm_leave(vm);
+  DISPATCH();
+op_ret:
+  vm_ret(vm);
+  DISPATCH();
+op_jmp:
+  vm_jmp(vm, OPERAND());
+  DISPATCH();
+op_cmp:
+  vm_cmp(vm);
+  DISPATCH();
+op_je:
+  vm_je(vm, OPERAND());
+  DISPATCH();
+op_jne:
+  vm_jne(vm, OPERAND());
+  DISPATCH();
+op_jl:
+  vm_jl(vm, OPERAND());
+  DISPATCH();
+op_jg:
+  vm_jg(vm, OPERAND());
+  DISPATCH();
+op_jle:
+  vm_jle(vm, OPERAND());
+  DISPATCH();
+op_jge:
+  vm_jge(vm, OPERAND());
+  DISPATCH();
+op_sete:
+  vm_sete(vm);
+  DISPATCH();
+op_setne:
+  vm_setne(vm);
+  DISPATCH();
+op_setl:
+  vm_setl(vm);
+  DISPATCH();
+op_setg:
+  vm_setg(vm);
+  DISPATCH();
+op_setle:
+  vm_setle(vm);
+  DISPATCH();
+op_setge:
+  vm_setge(vm);
+  DISPATCH();
+op_sx8_32:
+  vm_sx8_32(vm);
+  DISPATCH();
+op_sx32_8:
+  vm_sx32_8(vm);
+  DISPATCH();
+op_ldl:
+  vm_ldl(vm, OPERAND());
+  DISPATCH();
+op_stl:
+  vm_stl(vm, OPERAND());
+  DISPATCH();
+op_leal:
+  vm_leal(vm, OPERAND());
+  DISPATCH();
+op_addi:
+  vm_addi(vm, OPERAND());
+  DISPATCH();
+op_cje:
+  vm_cje(vm, OPERAND());
+  DISPATCH();
+op_cjne:
+  vm_cjne(vm, OPERAND());
+  DISPATCH();
+op_cjl:
+  vm_cjl(vm, OPERAND());
+  DISPATCH();
+op_cjg:
+  vm_cjg(vm, OPERAND());
+  DISPATCH();
+op_cjle:
+  vm_cjle(vm, OPERAND());
+  DISPATCH();
+op_cjge:
+  vm_cjge(vm, OPERAND());
+  DISPATCH();
+op_seq:
+  vm_seq(vm);
+  DISPATCH();
+op_sne:
+  vm_sne(vm);
+  DISPATCH();
+op_slt:
+  vm_slt(vm);
+  DISPATCH();
+op_sgt:
+  vm_sgt(vm);
+  DISPATCH();
+op_sle:
+  vm_sle(vm);
+  DISPATCH();
+op_sge:
+  vm_sge(vm);
+  DISPATCH();
+op_lds:
+  vm_lds(vm, OPERAND());
+  DISPATCH();
+op_sts:
+  vm_sts(vm, OPERAND());
+  DISPATCH();
+op_ldo:
+  vm_ldo(vm, OPERAND());
+  DISPATCH();
+op_sto:
+  vm_sto(vm, OPERAND());
+  DISPATCH();
+op_ldx:
+  vm_ldx(vm, OPERAND());
+  DISPATCH();
+op_stx:
+  vm_stx(vm, OPERAND());
+  DISPATCH();
+op_shl:
+  vm_shl(vm);
+  DISPATCH();
+op_shr:
+  vm_shr(vm);
+  DISPATCH();
+op_and:
+  vm_and(vm);
+  DISPATCH();
+op_or:
+  vm_or(vm);
+  DISPATCH();
+op_xor:
+  vm_xor(vm);
+  DISPATCH();
+op_divi:
+  vm_divi(vm, OPERAND());
+  DISPATCH();
+op_modi:
+  vm_modi(vm, OPERAND());
+  DISPATCH();
+op_int:
+  vm_int(vm, OPERAND());
+  if (vm->f_exit)
+    return;
+  DISPATCH();
+op_unknown:
+  error("unknown op");
+  return;
+}
@@ -0,0 +1,301 @@
+#include "v_local.h"
+
+#include <string.h>
+
+//
+// top of stack caching engine
+//
+// same switch loop as vm.c, but ip, sp and bp live in locals and the top of
+// the eval stack is held in a local instead of vm->s_i32. the rest of the
+// stack sits in a local buffer with one slot of padding below it, so a push
+// onto an empty stack can spill the (dead) cached value without a branch.
+// the vm is only brought up to date around syscalls, which is also the only
+// way out of the loop.
+//
+
+#define FETCH() (*pc++)
+#define PUSH_TOS(V) do { *s++ = tos; tos = (V); } while (0)
+#define POP_TOS() (tos = *--s)
+#define CJ(OP) do { \
+    int diff = s[-1] - tos; \
+    s -= 2; \
+    tos = *s; \
+    pc = diff OP 0 ? code + *pc : pc + 1; \
+  } while (0)
+
+// write the cached state back to the vm
+static void tos_save(vm_t *vm, instr_t *pc, int bp, int *stack, int *s, int tos)
+{
+  int depth = s - stack + 1;
+  
+  if (depth > 0) {
+    memcpy(vm->s_i32, stack, (depth - 1) * sizeof(int));
+    vm->s_i32[depth - 1] = tos;
+  }
+  
+  vm->sp = depth;
+  vm->ip = pc - vm->bin->instr;
+  vm->bp = bp;
+}
+
+// reload the cache from the vm, returns the new top of stack
+static int tos_load(vm_t *vm, int *stack, int **s)
+{
+  int depth = vm->sp;
+  
+  *s = stack + depth - 1;
+  
+  if (depth <= 0)
+    return 0;
+  
+  memcpy(stack, vm->s_i32, (depth - 1) * sizeof(int));
+  
+  return vm->s_i32[depth - 1];
+}
+
+void vm_exec_tos(vm_t *vm)
+{
+  int buf[MAX_STACK + 1];
+  int *stack = buf + 1;
+  int *s;
+  
+  int tos = tos_load(vm, stack, &s);
+  instr_t *code = vm->bin->instr;
+  instr_t *pc = code + vm->ip;
+  int bp = vm->bp;
+  
+  int *m_i32 = vm->m_i32;
+  char *m_i8 = vm->m_i8;
+  
+  int i32, tmp;
+  
+  if (vm->f_exit)
+    return;
+  
+  for (;;) {
+    switch (FETCH()) {
+    case PUSH:
+      PUSH_TOS(FETCH());
+      break;
+    case ADD:
+      tos = *--s + tos;
+      break;
+    case SUB:
+      tos = *--s - tos;
+      break;
+    case MUL:
+      tos = *--s * tos;
+      break;
+    case DIV:
+      tos = *--s / tos;
+      break;
+    case MOD:
+      tos = *--s % tos;
+      break;
+    case LDR:
+      tos = m_i32[ALIGN_32(tos)];
+      break;
+    case LDR8:
+      tos = m_i8[ADDR(tos)];
+      break;
+    case STR:
+      m_i32[ALIGN_32(tos)] = s[-1];
+      s -= 2;
+      tos = *s;
+      break;
+    case STR8:
+      m_i8[ADDR(tos)] = s[-1];
+      s -= 2;
+      tos = *s;
+      break;
+    case LBP:
+      PUSH_TOS(bp);
+      break;
+    case ENTER:
+      vm_check_frame(vm);
+      vm_check_stack(vm, pc - code - 1, s - stack + 1);
+      vm_check_bp(vm, bp, *pc);
+      vm->frame[vm->fp++] = bp;
+      bp -= FETCH();
+      break;
+    case LEAVE:
+      bp = vm->frame[--vm->fp];
+      break;
+    case CALL:
+      i32 = FETCH();
+      vm_check_call(vm);
+      vm->call[vm->cp++] = pc - code;
+      pc = code + i32;
+      break;
+    case RET:
+      pc = code + vm->call[--vm->cp];
+      break;
+    case JMP:
+      pc = code + *pc;
+      break;
+    case CMP:
+      tmp = s[-1] - tos;
+      s -= 2;
+      tos = *s;
+      vm->f_gtr = tmp > 0;
+      vm->f_lss = tmp < 0;
+      vm->f_equ = tmp == 0;
+      break;
+    case JE:
+      pc = vm->f_equ ? code + *pc : pc + 1;
+      break;
+    case JNE:
+      pc = !vm->f_equ ? code + *pc : pc + 1;
+      break;
+    case JL:
+      pc = vm->f_lss ? code + *pc : pc + 1;
+      break;
+    case JG:
+      pc = vm->f_gtr ? code + *pc : pc + 1;
+      break;
+    case JLE:
+      pc = vm->f_equ || vm->f_lss ? code + *pc : pc + 1;
+      break;
+    case JGE:
+      pc = vm->f_equ || vm->f_gtr ? code + *pc : pc + 1;
+      break;
+    case SETE:
+      PUSH_TOS(vm->f_equ);
+      break;
+    case SETNE:
+      PUSH_TOS(!vm->f_equ);
+      break;
+    case SETL:
+      PUSH_TOS(vm->f_lss);
+      break;
+    case SETG:
+      PUSH_TOS(vm->f_gtr);
+      break;
+    case SETLE:
+      PUSH_TOS(vm->f_equ || vm->f_lss);
+      break;
+    case SETGE:
+      PUSH_TOS(vm->f_equ || vm->f_gtr);
+      break;
+    case SX8_32:
+      tos = (signed char) tos;
+      break;
+    case SX32_8:
+      tos = ((tos & 0x80000000) >> 24) | (tos & 0x7f);
+      break;
+    case INT:
+      i32 = FETCH();
+      tos_save(vm, pc, bp, stack, s, tos);
+      vm_int(vm, i32);
+      if (vm->f_exit)
+        return;
+      tos = tos_load(vm, stack, &s);
+      break;
+    case LDL:
+      PUSH_TOS(m_i32[ALIGN_32(bp + FETCH())]);
+      break;
+    case STL:
+      m_i32[ALIGN_32(bp + FETCH())] = tos;
+      POP_TOS();
+      break;
+    case LEAL:
+      PUSH_TOS(bp + FETCH());
+      break;
+    case ADDI:
+      tos += FETCH();
+      break;
+    case CJE:
+      CJ(==);
+      break;
+    case CJNE:
+      CJ(!=);
+      break;
+    case CJL:
+      CJ(<);
+      break;
+    case CJG:
+      CJ(>);
+      break;
+    case CJLE:
+      CJ(<=);
+      break;
+    case CJGE:
+      CJ(>=);
+      break;
+    case SEQ:
+      tmp = *--s - tos;
+      tos = tmp == 0;
+      break;
+    case SNE:
+      tmp = *--s - tos;
+      tos = tmp != 0;
+      break;
+    case SLT:
+      tmp = *--s - tos;
+      tos = tmp < 0;
+      break;
+    case SGT:
+      tmp = *--s - tos;
+      tos = tmp > 0;
+      break;
+    case SLE:
+      tmp = *--s - tos;
+      tos = tmp <= 0;
+      break;
+    case SGE:
+      tmp = *--s - tos;
+      tos = tmp >= 0;
+      break;
+    case LDS:
+      PUSH_TOS(vm->slot[vm->fp][FETCH()]);
+      break;
+    case STS:
+      vm->slot[vm->fp][FETCH()] = tos;
+      POP_TOS();
+      break;
+    case LDO:
+      tos = m_i32[ALIGN_32(tos + FETCH())];
+      break;
+    case STO:
+      m_i32[ALIGN_32(tos + FETCH())] = s[-1];
+      s -= 2;
+      tos = *s;
+      break;
+    case LDX:
+      tmp = *--s;
+      tos = m_i32[ALIGN_32(tmp + tos * FETCH())];
+      break;
+    case STX:
+      m_i32[ALIGN_32(s[-1] + tos * FETCH())] = s[-2];
+      s -= 3;
+      tos = *s;
+      break;
+    case SHL:
+      tos = (unsigned) *--s << (tos & 31);
+      break;
+    case SHR:
+      tos = *--s >> (tos & 31);
+      break;
+    case AND:
+      tos = *--s & tos;
+      break;
+    case OR:
+      tos = *--s | tos;
+      break;
+    case XOR:
+      tos = *--s ^ tos;
+      break;
+    case DIVI:
+      i32 = FETCH();
+      tos /= i32;
+      break;
+    case MODI:
+      i32 = FETCH();
+      tos %= i32;
+      break;
+    default:
+      error("unknown op");
+      break;
+    }
+  }
+}
@@ -0,0 +1,475 @@
+#ifndef V_LOCAL_H
+#define V_LOCAL_H
+
+#include "vm.h"
+#include "../common/error.h"
+#include <stdio.h>
+
+// guest addresses are unsigned 32-bit offsets into the memory reservation
+#define ADDR(X) ((unsigned) (X))
+#define ALIGN_32(X) (ADDR(X) / 4)
+
+// an error in the guest rather than in 9c. the message goes in vm->error,
+// in the same form error() prints, and vm_fail leaves for vm_exec, which
+// stops the process or, in batch mode, just the job
+#define vm_error_msg(vm, ...) { \
+  int len = snprintf((vm)->error, sizeof((vm)->error), "%s:%i:%s: ", __FILE__, __LINE__, __func__); \
+  snprintf((vm)->error + len, sizeof((vm)->error) - len, __VA_ARGS__); \
+}
+
+#define vm_error(vm, ...) { vm_error_msg(vm, __VA_ARGS__); vm_fail(vm); }
+
+void vm_fail(vm_t *vm) __attribute__((noreturn));
+
+static inline instr_t fetch(vm_t *vm)
+{
+  return vm->bin->instr[vm->ip++];
+}
+
+static inline int pop(vm_t *vm)
+{
+  return vm->s_i32[--vm->sp];
+}
+
+static inline void vm_push(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp++] = i32;
+}
+
+static inline void vm_add(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] += vm->s_i32[vm->sp - 1];
+  --vm->sp;
+}
+
+static inline void vm_sub(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] -= vm->s_i32[vm->sp - 1];
+  --vm->sp;
+}
+
+static inline void vm_mul(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] *= vm->s_i32[vm->sp - 1];
+  --vm->sp;
+}
+
+static inline void vm_div(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] /= vm->s_i32[vm->sp - 1];
+  --vm->sp;
+}
+
+static inline void vm_ldr(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 1] = vm->m_i32[ALIGN_32(vm->s_i32[vm->sp - 1])];
+}
+
+static inline void vm_ldr8(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 1] = vm->m_i8[ADDR(vm->s_i32[vm->sp - 1])];
+}
+
+static inline void vm_str(vm_t *vm)
+{
+  vm->m_i32[ALIGN_32(vm->s_i32[vm->sp - 1])] = vm->s_i32[vm->sp - 2];
+  vm->sp -= 2;
+}
+
+static inline void vm_str8(vm_t *vm)
+{
+  vm->m_i8[ADDR(vm->s_i32[vm->sp - 1])] = vm->s_i32[vm->sp - 2];
+  vm->sp -= 2;
+}
+
+static inline void vm_lbp(vm_t *vm)
+{
+  vm->s_i32[vm->sp++] = vm->bp;
+}
+
+// a guest that goes too deep stops with an error instead of pushing past
+// the end of the frame or call stack, every engine checks before it pushes
+static inline void vm_check_frame(vm_t *vm)
+{
+  if (vm->fp >= MAX_FRAME)
+    vm_error(vm, "vm: frame stack overflow, more than %i frames", MAX_FRAME);
+}
+
+static inline void vm_check_call(vm_t *vm)
+{
+  if (vm->cp >= MAX_CALL)
+    vm_error(vm, "vm: call stack overflow, more than %i calls", MAX_CALL);
+}
+
+// frames grow down from the top of memory to stack_end, the end of the
+// heap, and stop there rather than run over live blocks
+static inline void vm_check_bp(vm_t *vm, int bp, int size)
+{
+  if ((unsigned) size > ADDR(bp) - vm->stack_end)
+    vm_error(vm, "vm: stack overflow, a frame of %i bytes runs into the heap", size);
+}
+
+// sp on the way into the function whose enter is at ip, see stack.c
+static inline void vm_check_stack(vm_t *vm, int ip, int sp)
+{
+  if (sp < vm->s_min[ip])
+    vm_error(vm, "vm: eval stack underflow");
+  if (sp > vm->s_max[ip])
+    vm_error(vm, "vm: eval stack overflow, more than %i entries", MAX_STACK);
+}
+
+static inline void vm_enter(vm_t *vm, int i32)
+{
+  vm_check_frame(vm);
+  vm_check_stack(vm, vm->ip - 2, vm->sp);
+  vm_check_bp(vm, vm->bp, i32);
+  vm->frame[vm->fp++] = vm->bp;
+  vm->bp -= i32;
+}
+
+static inline void vm_leave(vm_t *vm)
+{
+  vm->bp = vm->frame[--vm->fp];
+}
+
+static inline void vm_call(vm_t *vm, int i32)
+{
+  vm_check_call(vm);
+  vm->call[vm->cp++] = vm->ip;
+  vm->ip = i32;
+}
+
+static inline void vm_ret(vm_t *vm)
+{
+  vm->ip = vm->call[--vm->cp];
+}
+
+static inline void vm_jmp(vm_t *vm, int i32)
+{
+  vm->ip = i32;
+}
+
+static inline void vm_cmp(vm_t *vm)
+{
+  int tmp = vm->s_i32[vm->sp - 2] - vm->s_i32[vm->sp - 1];
+  vm->sp -= 2;
+  
+  vm->f_gtr = tmp > 0;
+  vm->f_lss = tmp < 0;
+  vm->f_equ = tmp == 0;
+}
+
+static inline void vm_je(vm_t *vm, int i32)
+{
+  if (vm->f_equ)
+    vm->ip = i32;
+}
+
+static inline void vm_jne(vm_t *vm, int i32)
+{
+  if (!vm->f_equ)
+    vm->ip = i32;
+}
+
+static inline void vm_jl(vm_t *vm, int i32)
+{
+  if (vm->f_lss)
+    vm->ip = i32;
+}
+
+static inline void vm_jg(vm_t *vm, int i32)
+{
+  if (vm->f_gtr)
+    vm->ip = i32;
+}
+
+static inline void vm_jle(vm_t *vm, int i32)
+{
+  if (vm->f_equ || vm->f_lss)
+    vm->ip = i32;
+}
+
+static inline void vm_jge(vm_t *vm, int i32)
+{
+  if (vm->f_equ || vm->f_gtr)
+    vm->ip = i32;
+}
+
+static inline void vm_sete(vm_t *vm)
+{
+  vm_push(vm, vm->f_equ);
+}
+
+static inline void vm_setne(vm_t *vm)
+{
+  vm_push(vm, !vm->f_equ);
+}
+
+static inline void vm_setl(vm_t *vm)
+{
+  vm_push(vm, vm->f_lss);
+}
+
+static inline void vm_setg(vm_t *vm)
+{
+  vm_push(vm, vm->f_gtr);
+}
+
+static inline void vm_setle(vm_t *vm)
+{
+  vm_push(vm, vm->f_equ || vm->f_lss);
+}
+
+static inline void vm_setge(vm_t *vm)
+{
+  vm_push(vm, vm->f_equ || vm->f_gtr);
+}
+
+static inline void vm_sx8_32(vm_t *vm)
+{
+  int is_sign = (vm->s_i32[vm->sp - 1] & 0x80);
+  vm->s_i32[vm->sp - 1] = (is_sign << 24) | (is_sign ? (vm->s_i32[vm->sp - 1] | ~0x7f) : (vm->s_i32[vm->sp - 1] & 0x7f));
+}
+
+static inline void vm_sx32_8(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 1] = ((vm->s_i32[vm->sp - 1] & 0x80000000) >> 24) | (vm->s_i32[vm->sp - 1] & 0x7f);
+}
+
+static inline void vm_mod(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] %= vm->s_i32[vm->sp - 1];
+  --vm->sp;
+}
+
+// shift counts are taken mod 32, as on x86, and shl works on the bits so a
+// shift into the sign bit is defined
+static inline void vm_shl(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] = (unsigned) vm->s_i32[vm->sp - 2] << (vm->s_i32[vm->sp - 1] & 31);
+  --vm->sp;
+}
+
+static inline void vm_shr(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] >>= vm->s_i32[vm->sp - 1] & 31;
+  --vm->sp;
+}
+
+static inline void vm_and(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] &= vm->s_i32[vm->sp - 1];
+  --vm->sp;
+}
+
+static inline void vm_or(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] |= vm->s_i32[vm->sp - 1];
+  --vm->sp;
+}
+
+static inline void vm_xor(vm_t *vm)
+{
+  vm->s_i32[vm->sp - 2] ^= vm->s_i32[vm->sp - 1];
+  --vm->sp;
+}
+
+static inline void vm_ldl(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp++] = vm->m_i32[ALIGN_32(vm->bp + i32)];
+}
+
+static inline void vm_stl(vm_t *vm, int i32)
+{
+  vm->m_i32[ALIGN_32(vm->bp + i32)] = vm->s_i32[--vm->sp];
+}
+
+static inline void vm_leal(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp++] = vm->bp + i32;
+}
+
+static inline void vm_addi(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp - 1] += i32;
+}
+
+static inline void vm_divi(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp - 1] /= i32;
+}
+
+static inline void vm_modi(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp - 1] %= i32;
+}
+
+// pops both operands of a compare and branch or compare and set and returns
+// lhs - rhs, the flags are left untouched
+static inline int vm_cj(vm_t *vm)
+{
+  vm->sp -= 2;
+  return vm->s_i32[vm->sp] - vm->s_i32[vm->sp + 1];
+}
+
+static inline void vm_cje(vm_t *vm, int i32)
+{
+  if (vm_cj(vm) == 0)
+    vm->ip = i32;
+}
+
+static inline void vm_cjne(vm_t *vm, int i32)
+{
+  if (vm_cj(vm) != 0)
+    vm->ip = i32;
+}
+
+static inline void vm_cjl(vm_t *vm, int i32)
+{
+  if (vm_cj(vm) < 0)
+    vm->ip = i32;
+}
+
+static inline void vm_cjg(vm_t *vm, int i32)
+{
+  if (vm_cj(vm) > 0)
+    vm->ip = i32;
+}
+
+static inline void vm_cjle(vm_t *vm, int i32)
+{
+  if (vm_cj(vm) <= 0)
+    vm->ip = i32;
+}
+
+static inline void vm_cjge(vm_t *vm, int i32)
+{
+  if (vm_cj(vm) >= 0)
+    vm->ip = i32;
+}
+
+static inline void vm_seq(vm_t *vm)
+{
+  vm_push(vm, vm_cj(vm) == 0);
+}
+
+static inline void vm_sne(vm_t *vm)
+{
+  vm_push(vm, vm_cj(vm) != 0);
+}
+
+static inline void vm_slt(vm_t *vm)
+{
+  vm_push(vm, vm_cj(vm) < 0);
+}
+
+static inline void vm_sgt(vm_t *vm)
+{
+  vm_push(vm, vm_cj(vm) > 0);
+}
+
+static inline void vm_sle(vm_t *vm)
+{
+  vm_push(vm, vm_cj(vm) <= 0);
+}
+
+static inline void vm_sge(vm_t *vm)
+{
+  vm_push(vm, vm_cj(vm) >= 0);
+}
+
+// locals that never have their address taken live in the slots of the
+// frame fp is in instead of guest memory
+static inline void vm_lds(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp++] = vm->slot[vm->fp][i32];
+}
+
+static inline void vm_sts(vm_t *vm, int i32)
+{
+  vm->slot[vm->fp][i32] = vm->s_i32[--vm->sp];
+}
+
+// struct members and array elements are read and written straight off a
+// base address, at base + i32 or base + index * i32
+static inline void vm_ldo(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp - 1] = vm->m_i32[ALIGN_32(vm->s_i32[vm->sp - 1] + i32)];
+}
+
+static inline void vm_sto(vm_t *vm, int i32)
+{
+  vm->m_i32[ALIGN_32(vm->s_i32[vm->sp - 1] + i32)] = vm->s_i32[vm->sp - 2];
+  vm->sp -= 2;
+}
+
+static inline void vm_ldx(vm_t *vm, int i32)
+{
+  vm->s_i32[vm->sp - 2] = vm->m_i32[ALIGN_32(vm->s_i32[vm->sp - 2] + vm->s_i32[vm->sp - 1] * i32)];
+  vm->sp--;
+}
+
+static inline void vm_stx(vm_t *vm, int i32)
+{
+  vm->m_i32[ALIGN_32(vm->s_i32[vm->sp - 2] + vm->s_i32[vm->sp - 1] * i32)] = vm->s_i32[vm->sp - 3];
+  vm->sp -= 3;
+}
+
+//
+// vm.c
+//
+void vm_int(vm_t *vm, int code);
+void vm_step(vm_t *vm);
+void vm_exec_switch(vm_t *vm);
+
+//
+// stack.c
+//
+void vm_stack_load(vm_t *vm);
+
+//
+// thread.c
+//
+void vm_thread_load(vm_t *vm);
+void vm_exec_thread(vm_t *vm);
+
+//
+// jit.c
+//
+void vm_jit_load(vm_t *vm);
+void vm_exec_jit(vm_t *vm);
+void vm_trace_load(vm_t *vm);
+void vm_exec_trace(vm_t *vm);
+void vm_tier_load(vm_t *vm);
+void vm_exec_tier(vm_t *vm);
+
+//
+// reg.c
+//
+void vm_reg_load(vm_t *vm);
+void vm_exec_reg(vm_t *vm);
+
+//
+// tos.c
+//
+void vm_exec_tos(vm_t *vm);
+
+//
+// prof.c
+//
+void vm_exec_prof(vm_t *vm);
+void vm_exec_sample(vm_t *vm);
+
+//
+// heap.c
+//
+void heap_init(vm_t *vm);
+int heap_alloc(vm_t *vm, unsigned size);
+void heap_free(vm_t *vm, unsigned ptr);
+int heap_realloc(vm_t *vm, unsigned ptr, unsigned size);
+int heap_arena_alloc(vm_t *vm, unsigned size);
+void heap_arena_reset(vm_t *vm);
+void *heap_state(vm_t *vm, int *size);
+unsigned heap_end(vm_t *vm);
+
+#endif
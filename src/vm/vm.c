@@ -1,234 +1,201 @@
-#include "vm.h"
+#include "v_local.h"
 
-#include "../common/error.h"
-#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-
-#define ALIGN_32(X) (X / 4)
-
-vm_t *make_vm()
-{
-  vm_t *vm = malloc(sizeof(vm_t));
-  vm->ip = 0;
-  vm->sp = 0;
-  vm->bp = MAX_MEM * sizeof(int);
-  vm->cp = 0;
-  vm->fp = 0;
-  vm->f_gtr = 0;
-  vm->f_lss = 0;
-  vm->f_equ = 0;
-  vm->f_exit = 0;
-  vm->s_i32 = vm->stack;
-  vm->m_i8 = (char*) vm->mem;
-  vm->m_i32 = vm->mem;
-  return vm;
-}
-
-instr_t fetch(vm_t *vm)
-{
-  return vm->bin->instr[vm->ip++];
-}
-
-int pop(vm_t *vm)
-{
-  return vm->s_i32[--vm->sp];
-}
-
-static inline void vm_push(vm_t *vm, int i32)
-{
-  vm->s_i32[vm->sp++] = i32;
-}
-
-static inline void vm_add(vm_t *vm)
-{
-  vm->s_i32[vm->sp - 2] += vm->s_i32[vm->sp - 1];
-  --vm->sp;
-}
-
-static inline void vm_sub(vm_t *vm)
-{
-  vm->s_i32[vm->sp - 2] -= vm->s_i32[vm->sp - 1];
-  --vm->sp;
-}
-
-static inline void vm_mul(vm_t *vm)
-{
-  vm->s_i32[vm->sp - 2] *= vm->s_i32[vm->sp - 1];
-  --vm->sp;
-}
-
-static inline void vm_div(vm_t *vm)
-{
-  vm->s_i32[vm->sp - 2] /= vm->s_i32[vm->sp - 1];
-  --vm->sp;
-}
-
-static inline void vm_ldr(vm_t *vm)
-{
-  vm->s_i32[vm->sp - 1] = vm->m_i32[ALIGN_32(vm->s_i32[vm->sp - 1])];
-}
-
-static inline void vm_ldr8(vm_t *vm)
-{
-  vm->s_i32[vm->sp - 1] = vm->m_i8[vm->s_i32[vm->sp - 1]];
-}
-
-static inline void vm_str(vm_t *vm)
-{
-  vm->m_i32[ALIGN_32(vm->s_i32[vm->sp - 1])] = vm->s_i32[vm->sp - 2];
-  vm->sp -= 2;
-}
-
-static inline void vm_str8(vm_t *vm)
-{
-  vm->m_i8[vm->s_i32[vm->sp - 1]] = vm->s_i32[vm->sp - 2];
-  vm->sp -= 2;
-}
-
-static inline void vm_lbp(vm_t *vm)
-{
-  vm->s_i32[vm->sp++] = vm->bp;
-}
-
-static inline void vm_enter(vm_t *vm, int i32)
-{
-  vm->frame[vm->fp++] = vm->bp;
-  vm->bp -= i32;
-}
-
-static inline void vm_leave(vm_t *vm)
-{
-  vm->bp = vm->frame[--vm->fp];
-}
-
-static inline void vm_call(vm_t *vm, int i32)
-{
-  vm->call[vm->cp++] = vm->ip;
-  vm->ip = i32;
-}
-
-static inline void vm_ret(vm_t *vm)
-{
-  vm->ip = vm->call[--vm->cp];
-}
-
-static inline void vm_jmp(vm_t *vm, int i32)
-{
-  vm->ip = i32;
-}
-
-static inline void vm_cmp(vm_t *vm)
-{
-  int tmp = vm->s_i32[vm->sp - 2] - vm->s_i32[vm->sp - 1];
-  vm->sp -= 2;
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// every 32-bit guest address lands inside the reservation, anything past
+// mem_size is PROT_NONE and faults instead of touching host memory
+#define MEM_RESERVE (1ul << 32)
+
+static __thread vm_t *vm_active;
+static __thread sigjmp_buf vm_fault_jmp;
+static __thread unsigned vm_fault_addr;
+static __thread int vm_fault_sig;
+
+// a guest access out of range goes back to vm_exec, which reports it once
+// the guest's output is out. so does a guest division by zero or of
+// INT_MIN by -1, which every engine leaves to the host's idiv to trap
+static void vm_fault(int sig, siginfo_t *info, void *ctx)
+{
+  vm_t *vm = vm_active;
+  char *addr = info->si_addr;
   
-  vm->f_gtr = tmp > 0;
-  vm->f_lss = tmp < 0;
-  vm->f_equ = tmp == 0;
-}
-
-static inline void vm_je(vm_t *vm, int i32)
-{
-  if (vm->f_equ)
-    vm->ip = i32;
-}
-
-static inline void vm_jne(vm_t *vm, int i32)
-{
-  if (!vm->f_equ)
-    vm->ip = i32;
-}
-
-static inline void vm_jl(vm_t *vm, int i32)
-{
-  if (vm->f_lss)
-    vm->ip = i32;
-}
-
-static inline void vm_jg(vm_t *vm, int i32)
-{
-  if (vm->f_gtr)
-    vm->ip = i32;
+  if (vm && sig == SIGFPE) {
+    vm_fault_sig = sig;
+    siglongjmp(vm_fault_jmp, 1);
+  }
+  
+  if (vm && addr >= vm->m_i8 && addr < vm->m_i8 + MEM_RESERVE) {
+    vm_fault_sig = sig;
+    vm_fault_addr = addr - vm->m_i8;
+    siglongjmp(vm_fault_jmp, 1);
+  }
+  
+  signal(sig, SIG_DFL);
 }
 
-static inline void vm_jle(vm_t *vm, int i32)
+void vm_fail(vm_t *vm)
 {
-  if (vm->f_equ || vm->f_lss)
-    vm->ip = i32;
+  siglongjmp(vm_fault_jmp, 1);
 }
 
-static inline void vm_jge(vm_t *vm, int i32)
+static void vm_fault_install()
 {
-  if (vm->f_equ || vm->f_gtr)
-    vm->ip = i32;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = vm_fault;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &sa, NULL);
+  sigaction(SIGBUS, &sa, NULL);
+  sigaction(SIGFPE, &sa, NULL);
 }
 
-static inline void vm_sete(vm_t *vm)
+static void vm_fault_init()
 {
-  vm_push(vm, vm->f_equ);
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  
+  pthread_once(&once, vm_fault_install);
 }
 
-static inline void vm_setne(vm_t *vm)
+// commit the first size bytes, pages are only backed once touched
+static void vm_commit(vm_t *vm, unsigned size)
 {
-  vm_push(vm, !vm->f_equ);
-}
+  // memory restored from a snapshot is a file mapping, put the anonymous
+  // reservation back before reusing it
+  if (vm->mem_mapped) {
+    mmap(vm->m_i8, vm->mem_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    vm->mem_size = 0;
+    vm->mem_mapped = 0;
+  }
+  
+  if (vm->mem_size == size) {
+    madvise(vm->m_i8, size, MADV_DONTNEED);
+    return;
+  }
+  
+  if (vm->mem_size) {
+    madvise(vm->m_i8, vm->mem_size, MADV_DONTNEED);
+    mprotect(vm->m_i8, vm->mem_size, PROT_NONE);
+  }
+  
+  if (mprotect(vm->m_i8, size, PROT_READ | PROT_WRITE) < 0)
+    error("vm: could not commit %u bytes of memory", size);
 
-static inline void vm_setl(vm_t *vm)
-{
-  vm_push(vm, vm->f_lss);
+#ifdef MADV_HUGEPAGE
+  if (vm->mem_huge)
+    madvise(vm->m_i8, size, MADV_HUGEPAGE);
+#endif
+  
+  vm->mem_size = size;
 }
 
-static inline void vm_setg(vm_t *vm)
+vm_t *make_vm()
 {
-  vm_push(vm, vm->f_gtr);
+  vm_fault_init();
+  
+  vm_t *vm = malloc(sizeof(vm_t));
+  vm->bin = NULL;
+  vm->ip = 0;
+  vm->sp = 0;
+  vm->bp = 0;
+  vm->cp = 0;
+  vm->fp = 0;
+  vm->f_gtr = 0;
+  vm->f_lss = 0;
+  vm->f_equ = 0;
+  vm->f_exit = 0;
+  vm->engine = ENGINE_SWITCH;
+  vm->code = NULL;
+  vm->jit = NULL;
+  vm->reg = NULL;
+  vm->heap = NULL;
+  vm->prof = NULL;
+  vm->stats = 0;
+  vm->tier_calls = TIER_CALLS;
+  vm->tier_trips = TIER_TRIPS;
+  vm->profile = 0;
+  vm->sample = 0;
+  vm->s_i32 = vm->stack;
+  vm->s_min = NULL;
+  vm->s_max = NULL;
+  vm->mem_size = 0;
+  vm->stack_end = 0;
+  vm->mem_huge = 0;
+  vm->mem_mapped = 0;
+  vm->out = stdout;
+  vm->input = NULL;
+  vm->snap_name = NULL;
+  vm->batch = 0;
+  vm->error[0] = '\0';
+  
+  vm->m_i8 = mmap(NULL, MEM_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (vm->m_i8 == MAP_FAILED)
+    error("vm: could not reserve guest memory");
+  
+  vm->m_i32 = (int*) vm->m_i8;
+  
+  return vm;
 }
 
-static inline void vm_setle(vm_t *vm)
+static inline void vm_exit(vm_t *vm)
 {
-  vm_push(vm, vm->f_equ || vm->f_lss);
+  vm->f_exit = 1;
 }
 
-static inline void vm_setge(vm_t *vm)
+static inline void vm_print(vm_t *vm)
 {
-  vm_push(vm, vm->f_equ || vm->f_gtr);
+  fprintf(vm->out, "%i\n", vm->s_i32[vm->sp - 1]);
+  vm->sp -= 1;
 }
 
-static inline void vm_sx8_32(vm_t *vm)
+static inline void vm_write(vm_t *vm)
 {
-  int is_sign = (vm->s_i32[vm->sp - 1] & 0x80);
-  vm->s_i32[vm->sp - 1] = (is_sign << 24) | (is_sign ? (vm->s_i32[vm->sp - 1] | ~0x7f) : (vm->s_i32[vm->sp - 1] & 0x7f));
+  fputs(&vm->m_i8[ADDR(vm->s_i32[vm->sp - 1])], vm->out);
+  vm->sp -= 1;
 }
 
-static inline void vm_sx32_8(vm_t *vm)
+static inline void vm_alloc(vm_t *vm)
 {
-  vm->s_i32[vm->sp - 1] = ((vm->s_i32[vm->sp - 1] & 0x80000000) >> 24) | (vm->s_i32[vm->sp - 1] & 0x7f);
+  vm->s_i32[vm->sp - 1] = heap_alloc(vm, vm->s_i32[vm->sp - 1]);
 }
 
-static inline void vm_mod(vm_t *vm)
+static inline void vm_free(vm_t *vm)
 {
-  vm->s_i32[vm->sp - 2] %= vm->s_i32[vm->sp - 1];
-  --vm->sp;
+  heap_free(vm, vm->s_i32[vm->sp - 1]);
+  vm->sp -= 1;
 }
 
-static inline void vm_exit(vm_t *vm)
+static inline void vm_realloc(vm_t *vm)
 {
-  vm->f_exit = 1;
+  vm->s_i32[vm->sp - 2] = heap_realloc(vm, vm->s_i32[vm->sp - 2], vm->s_i32[vm->sp - 1]);
+  vm->sp -= 1;
 }
 
-static inline void vm_print(vm_t *vm)
+static inline void vm_arena_alloc(vm_t *vm)
 {
-  printf("%i\n", vm->s_i32[vm->sp - 1]);
-  vm->sp -= 1;
+  vm->s_i32[vm->sp - 1] = heap_arena_alloc(vm, vm->s_i32[vm->sp - 1]);
 }
 
-static inline void vm_write(vm_t *vm)
+// copy the job's input onto the heap, 0 without one
+static inline void vm_input(vm_t *vm)
 {
-  fputs(&vm->m_i8[vm->s_i32[vm->sp - 1]], stdout);
-  vm->sp -= 1;
+  int addr = 0;
+  
+  if (vm->input) {
+    int len = strlen(vm->input);
+    addr = heap_alloc(vm, len + 1);
+    if (addr)
+      memcpy(&vm->m_i8[addr], vm->input, len + 1);
+  }
+  
+  vm->s_i32[vm->sp++] = addr;
 }
 
-static inline void vm_int(vm_t *vm, int code)
+void vm_int(vm_t *vm, int code)
 {
   switch (code) {
   case SYS_EXIT:
@@ -240,123 +207,371 @@ static inline void vm_int(vm_t *vm, int code)
   case SYS_WRITE:
     vm_write(vm);
     break;
+  case SYS_ALLOC:
+    vm_alloc(vm);
+    break;
+  case SYS_FREE:
+    vm_free(vm);
+    break;
+  case SYS_REALLOC:
+    vm_realloc(vm);
+    break;
+  case SYS_ARENA_ALLOC:
+    vm_arena_alloc(vm);
+    break;
+  case SYS_ARENA_RESET:
+    heap_arena_reset(vm);
+    break;
+  case SYS_INPUT:
+    vm_input(vm);
+    break;
+  case SYS_CHECKPOINT:
+    if (vm->snap_name)
+      vm_snapshot(vm, vm->snap_name);
+    break;
   }
 }
 
+// a bin read from disk has its data laid out as whole guest pages, map
+// them copy on write so runs of the same file share them until written
+static void vm_load_data(vm_t *vm, bin_t *bin)
+{
+  if (bin->data_fd < 0 || !bin->data_size) {
+    memcpy(vm->m_i8 + bin->bss_size, bin->data, bin->data_size);
+    return;
+  }
+  
+  unsigned lead = bin->bss_size & 4095;
+  unsigned start = bin->bss_size - lead;
+  unsigned size = (lead + bin->data_size + 4095) & ~4095u;
+  
+  if (mmap(vm->m_i8 + start, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+    bin->data_fd, bin->data_ofs - lead) == MAP_FAILED)
+    error("vm: could not map program data");
+  
+  vm->mem_mapped = 1;
+}
+
 void vm_load(vm_t *vm, bin_t *bin)
 {
+  int reload = vm->bin != bin;
+  
   vm->bin = bin;
   vm->ip = 0;
-  vm->bp = MAX_MEM * sizeof(int);
   vm->sp = 0;
+  vm->cp = 0;
+  vm->fp = 0;
   vm->f_exit = 0;
   
-  memcpy(vm->m_i8 + bin->bss_size, bin->data, bin->data_size);
+  unsigned mem_size = bin->mem_size ? bin->mem_size : MEM_DEFAULT;
+  if (mem_size > MEM_MAX)
+    mem_size = MEM_MAX;
+  mem_size = (mem_size + 4095) & ~4095u;
+  
+  if ((unsigned) bin->bss_size + bin->data_size > mem_size)
+    error("vm: program data does not fit in %u bytes of memory", mem_size);
+  
+  vm_commit(vm, mem_size);
+  vm->bp = mem_size;
+  
+  vm_load_data(vm, bin);
+  
+  heap_init(vm);
+  
+  // the decoded code only depends on the bin, a vm loaded again with the
+  // same one keeps it
+  if (!reload)
+    return;
+  
+  vm_stack_load(vm);
+  
+  switch (vm->engine) {
+  case ENGINE_THREAD:
+    vm_thread_load(vm);
+    break;
+  case ENGINE_JIT:
+    vm_jit_load(vm);
+    break;
+  case ENGINE_REG:
+    vm_reg_load(vm);
+    break;
+  case ENGINE_TRACE:
+    vm_trace_load(vm);
+    break;
+  case ENGINE_TIER:
+    vm_tier_load(vm);
+    break;
+  default:
+    break;
+  }
 }
 
-void vm_exec(vm_t *vm)
+// returns 0 if the guest stopped on an error, which only comes back in
+// batch mode, anywhere else it ends the process once the output is out
+int vm_exec(vm_t *vm)
 {
-  while (!vm->f_exit) {
-    switch (fetch(vm)) {
-    case PUSH:
-      vm_push(vm, fetch(vm));
-      break;
-    case ENTER:
-      vm_enter(vm, fetch(vm));
-      break;
-    case ADD:
-      vm_add(vm);
-      break;
-    case SUB:
-      vm_sub(vm);
-      break;
-    case MUL:
-      vm_mul(vm);
-      break;
-    case DIV:
-      vm_div(vm);
-      break;
-    case MOD:
-      vm_mod(vm);
-      break;
-    case LDR:
-      vm_ldr(vm);
-      break;
-    case LDR8:
-      vm_ldr8(vm);
-      break;
-    case STR:
-      vm_str(vm);
-      break;
-    case STR8:
-      vm_str8(vm);
-      break;
-    case LBP:
-      vm_lbp(vm);
-      break;
-    case CALL:
-      vm_call(vm, fetch(vm));
-      break;
-    case LEAVE:
-      vm_leave(vm);
-      break;
-    case RET:
-      vm_ret(vm);
-      break;
-    case JMP:
-      vm_jmp(vm, fetch(vm));
-      break;
-    case CMP:
-      vm_cmp(vm);
-      break;
-    case JE:
-      vm_je(vm, fetch(vm));
-      break;
-    case JNE:
-      vm_jne(vm, fetch(vm));
-      break;
-    case JL:
-      vm_jl(vm, fetch(vm));
-      break;
-    case JG:
-      vm_jg(vm, fetch(vm));
-      break;
-    case JLE:
-      vm_jle(vm, fetch(vm));
-      break;
-    case JGE:
-      vm_jge(vm, fetch(vm));
-      break;
-    case SETE:
-      vm_sete(vm);
-      break;
-    case SETNE:
-      vm_setne(vm);
-      break;
-    case SETL:
-      vm_setl(vm);
-      break;
-    case SETG:
-      vm_setg(vm);
-      break;
-    case SETLE:
-      vm_setle(vm);
-      break;
-    case SETGE:
-      vm_setge(vm);
-      break;
-    case SX8_32:
-      vm_sx8_32(vm);
-      break;
-    case SX32_8:
-      vm_sx32_8(vm);
-      break;
-    case INT:
-      vm_int(vm, fetch(vm));
-      break;
-    default:
-      error("unknown op");
-      break;
+  vm_active = vm;
+  vm->error[0] = '\0';
+  
+  if (sigsetjmp(vm_fault_jmp, 1)) {
+    vm_active = NULL;
+    
+    if (!vm->error[0]) {
+      if (vm_fault_sig == SIGFPE) {
+        vm_error_msg(vm, "vm: division by zero or overflow");
+      } else {
+        vm_error_msg(vm, "vm: memory access out of range at 0x%08x, memory size is 0x%08x", vm_fault_addr, vm->mem_size);
+      }
     }
+    
+    fflush(vm->out);
+    
+    if (vm->batch)
+      return 0;
+    
+    fprintf(stderr, "%s\n", vm->error);
+    exit(-1);
+  }
+  
+  if (vm->profile) {
+    vm_exec_prof(vm);
+    return 1;
+  }
+  
+  if (vm->sample) {
+    vm_exec_sample(vm);
+    return 1;
   }
+  
+  switch (vm->engine) {
+  case ENGINE_SWITCH:
+    vm_exec_switch(vm);
+    break;
+  case ENGINE_THREAD:
+    vm_exec_thread(vm);
+    break;
+  case ENGINE_JIT:
+    vm_exec_jit(vm);
+    break;
+  case ENGINE_REG:
+    vm_exec_reg(vm);
+    break;
+  case ENGINE_TOS:
+    vm_exec_tos(vm);
+    break;
+  case ENGINE_TRACE:
+    vm_exec_trace(vm);
+    break;
+  case ENGINE_TIER:
+    vm_exec_tier(vm);
+    break;
+  default:
+    error("unknown engine");
+    break;
+  }
+  
+  return 1;
+}
+
+static inline void vm_dispatch(vm_t *vm)
+{
+  switch (fetch(vm)) {
+  case PUSH:
+    vm_push(vm, fetch(vm));
+    break;
+  case ENTER:
+    vm_enter(vm, fetch(vm));
+    break;
+  case ADD:
+    vm_add(vm);
+    break;
+  case SUB:
+    vm_sub(vm);
+    break;
+  case MUL:
+    vm_mul(vm);
+    break;
+  case DIV:
+    vm_div(vm);
+    break;
+  case MOD:
+    vm_mod(vm);
+    break;
+  case LDR:
+    vm_ldr(vm);
+    break;
+  case LDR8:
+    vm_ldr8(vm);
+    break;
+  case STR:
+    vm_str(vm);
+    break;
+  case STR8:
+    vm_str8(vm);
+    break;
+  case LBP:
+    vm_lbp(vm);
+    break;
+  case CALL:
+    vm_call(vm, fetch(vm));
+    break;
+  case LEAVE:
+    vm_leave(vm);
+    break;
+  case RET:
+    vm_ret(vm);
+    break;
+  case JMP:
+    vm_jmp(vm, fetch(vm));
+    break;
+  case CMP:
+    vm_cmp(vm);
+    break;
+  case JE:
+    vm_je(vm, fetch(vm));
+    break;
+  case JNE:
+    vm_jne(vm, fetch(vm));
+    break;
+  case JL:
+    vm_jl(vm, fetch(vm));
+    break;
+  case JG:
+    vm_jg(vm, fetch(vm));
+    break;
+  case JLE:
+    vm_jle(vm, fetch(vm));
+    break;
+  case JGE:
+    vm_jge(vm, fetch(vm));
+    break;
+  case SETE:
+    vm_sete(vm);
+    break;
+  case SETNE:
+    vm_setne(vm);
+    break;
+  case SETL:
+    vm_setl(vm);
+    break;
+  case SETG:
+    vm_setg(vm);
+    break;
+  case SETLE:
+    vm_setle(vm);
+    break;
+  case SETGE:
+    vm_setge(vm);
+    break;
+  case SX8_32:
+    vm_sx8_32(vm);
+    break;
+  case SX32_8:
+    vm_sx32_8(vm);
+    break;
+  case INT:
+    vm_int(vm, fetch(vm));
+    break;
+  case LDL:
+    vm_ldl(vm, fetch(vm));
+    break;
+  case STL:
+    vm_stl(vm, fetch(vm));
+    break;
+  case LEAL:
+    vm_leal(vm, fetch(vm));
+    break;
+  case ADDI:
+    vm_addi(vm, fetch(vm));
+    break;
+  case CJE:
+    vm_cje(vm, fetch(vm));
+    break;
+  case CJNE:
+    vm_cjne(vm, fetch(vm));
+    break;
+  case CJL:
+    vm_cjl(vm, fetch(vm));
+    break;
+  case CJG:
+    vm_cjg(vm, fetch(vm));
+    break;
+  case CJLE:
+    vm_cjle(vm, fetch(vm));
+    break;
+  case CJGE:
+    vm_cjge(vm, fetch(vm));
+    break;
+  case SEQ:
+    vm_seq(vm);
+    break;
+  case SNE:
+    vm_sne(vm);
+    break;
+  case SLT:
+    vm_slt(vm);
+    break;
+  case SGT:
+    vm_sgt(vm);
+    break;
+  case SLE:
+    vm_sle(vm);
+    break;
+  case SGE:
+    vm_sge(vm);
+    break;
+  case LDS:
+    vm_lds(vm, fetch(vm));
+    break;
+  case STS:
+    vm_sts(vm, fetch(vm));
+    break;
+  case LDO:
+    vm_ldo(vm, fetch(vm));
+    break;
+  case STO:
+    vm_sto(vm, fetch(vm));
+    break;
+  case LDX:
+    vm_ldx(vm, fetch(vm));
+    break;
+  case STX:
+    vm_stx(vm, fetch(vm));
+    break;
+  case SHL:
+    vm_shl(vm);
+    break;
+  case SHR:
+    vm_shr(vm);
+    break;
+  case AND:
+    vm_and(vm);
+    break;
+  case OR:
+    vm_or(vm);
+    break;
+  case XOR:
+    vm_xor(vm);
+    break;
+  case DIVI:
+    vm_divi(vm, fetch(vm));
+    break;
+  case MODI:
+    vm_modi(vm, fetch(vm));
+    break;
+  default:
+    error("unknown op");
+    break;
+  }
+}
+
+void vm_step(vm_t *vm)
+{
+  vm_dispatch(vm);
+}
+
+void vm_exec_switch(vm_t *vm)
+{
+  while (!vm->f_exit)
+    vm_dispatch(vm);
 }
@@ -2,12 +2,19 @@
 #define VM_H
 
 #define KB(B) (B * 1024)
+#define MB(B) (KB(B) * 1024)
 
 #define MAX_STACK 128
 #define MAX_CALL 64
-#define MAX_MEM 64
 #define MAX_CALL 64
 #define MAX_FRAME 64
+#define MAX_SLOT 32
+
+#define MEM_DEFAULT MB(1)
+#define MEM_MAX 0xfffff000u
+
+#define TIER_CALLS 100
+#define TIER_TRIPS 1000
 
 #include "bin.h"
 #include "instr.h"
@@ -15,29 +22,100 @@
 
 typedef struct vm_s vm_t;
 typedef struct call_s call_t;
+typedef union cell_u cell_t;
+typedef struct jit_s jit_t;
+typedef struct reg_s reg_t;
+typedef struct heap_s heap_t;
+typedef struct batch_s batch_t;
+typedef struct prof_s prof_t;
 typedef enum int_code_e int_code_t;
+typedef enum engine_e engine_t;
 
 enum int_code_e {
   SYS_EXIT,
   SYS_PRINT,
-  SYS_WRITE
+  SYS_WRITE,
+  SYS_ALLOC,
+  SYS_FREE,
+  SYS_REALLOC,
+  SYS_ARENA_ALLOC,
+  SYS_ARENA_RESET,
+  SYS_INPUT,
+  SYS_CHECKPOINT
+};
+
+enum engine_e {
+  ENGINE_SWITCH,
+  ENGINE_THREAD,
+  ENGINE_JIT,
+  ENGINE_REG,
+  ENGINE_TOS,
+  ENGINE_TRACE,
+  ENGINE_TIER
+};
+
+union cell_u {
+  void *handler;
+  int i32;
 };
 
 struct vm_s {
   bin_t *bin;
+  engine_t engine;
+  cell_t *code;
+  jit_t *jit;
+  reg_t *reg;
+  heap_t *heap;
+  prof_t *prof;
+  int stats;
+  int tier_calls;
+  int tier_trips;
+  int profile;
+  int sample;
   int ip, sp, bp, cp, fp;
   int f_gtr, f_lss, f_equ, f_exit;
-  int mem[MAX_MEM];
   int stack[MAX_STACK];
   int call[MAX_CALL];
   int frame[MAX_FRAME];
+  int slot[MAX_FRAME + 1][MAX_SLOT];
   int *s_i32;
+  int *s_min, *s_max;
   char *m_i8;
   int *m_i32;
+  unsigned mem_size;
+  unsigned stack_end;
+  int mem_huge;
+  int mem_mapped;
+  FILE *out;
+  char *input;
+  char *snap_name;
+  int batch;
+  char error[256];
+};
+
+// many inputs over one bin, see batch.c
+struct batch_s {
+  bin_t *bin;
+  engine_t engine;
+  int stats;
+  int tier_calls;
+  int tier_trips;
+  int mem_huge;
+  char **input;
+  int num_input;
+  int num_thread;
+  char *restore_name;
 };
 
 vm_t *make_vm();
 void vm_load(vm_t *vm, bin_t *bin);
-void vm_exec(vm_t *vm);
+int vm_exec(vm_t *vm);
+void vm_heap_stats(vm_t *vm, FILE *out);
+void vm_prof_report(vm_t *vm, FILE *out);
+void vm_prof_json(vm_t *vm, FILE *out);
+void vm_prof_folded(vm_t *vm, FILE *out);
+int vm_batch(batch_t *batch, FILE *out);
+void vm_snapshot(vm_t *vm, char *path);
+void vm_restore(vm_t *vm, char *path);
 
 #endif